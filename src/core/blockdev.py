@@ -0,0 +1,406 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+Read-only virtual block devices.
+Images nested in each other (a filesystem in a partition of a sparse super.img, a partition of payload.bin)
+are read through pread(offset, size) layers instead of writing every layer out as an intermediate file.
+Usage:
+    dev = open_image('super.img')            # raw or sparse
+    system = lp_partitions(dev)['system_a']  # or payload_partitions(open_image('payload.bin'))['system']
+    fs = open_filesystem(system)             # ext4.Volume or erofs.Volume
+    data = fs.root.get_inode('system', 'build.prop').open_read().read()
+"""
+import argparse
+import bz2
+import contextlib
+import lzma
+import os
+import struct
+import sys
+import threading
+from bisect import bisect_right
+from collections import OrderedDict
+from io import RawIOBase, UnsupportedOperation
+
+import zstandard
+
+from . import erofs, ext4, update_metadata_pb2
+from .lpunpack import LP_SECTOR_SIZE, LP_TARGET_TYPE_LINEAR, LP_TARGET_TYPE_ZERO, read_metadata
+from .payload_extract import BadPayload, init_payload_info
+from .sparse_img import SparseImage
+
+SPARSE_MAGIC = b'\x3a\xff\x26\xed'
+EXT4_MAGIC_OFFSET = 0x438
+
+
+class BlockDevice:
+    """
+    Base of the devices, subclasses implement pread and set size.
+    pread must be safe to call from several threads at once.
+    """
+    size = 0
+
+    def pread(self, offset: int, size: int) -> bytes:
+        raise NotImplementedError
+
+    def open(self) -> 'DeviceReader':
+        return DeviceReader(self)
+
+    def close(self):
+        ...
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_val, exc_tb):
+        self.close()
+
+    def _clamp(self, offset: int, size: int) -> int:
+        return max(min(size, self.size - offset), 0)
+
+
+class RawDevice(BlockDevice):
+    """
+    [offset, offset + size) of a plain file.
+    """
+
+    def __init__(self, file, offset: int = 0, size: int = None):
+        self._own = isinstance(file, (str, os.PathLike))
+        self.file = open(file, 'rb') if self._own else file
+        self.offset = offset
+        self.size = (os.fstat(self.file.fileno()).st_size - offset) if size is None else size
+        self._lock = threading.Lock()
+
+    def pread(self, offset: int, size: int) -> bytes:
+        size = self._clamp(offset, size)
+        if not size:
+            return b''
+        if hasattr(os, 'pread'):
+            return os.pread(self.file.fileno(), size, self.offset + offset)
+        # No pread on Windows, share the handle under a lock.
+        with self._lock:
+            self.file.seek(self.offset + offset)
+            return self.file.read(size)
+
+    def close(self):
+        if self._own:
+            self.file.close()
+
+
+class ExtentDevice(BlockDevice):
+    """
+    A device made of extents of a parent device.
+    :param extents: (start, length, parent offset), parent offset None reads as zeros
+    """
+
+    def __init__(self, parent: BlockDevice, extents: list):
+        self.parent = parent
+        self.extents = sorted(extents, key=lambda x: x[0])
+        self.starts = [i[0] for i in self.extents]
+        self.size = self.extents[-1][0] + self.extents[-1][1] if self.extents else 0
+
+    def pread(self, offset: int, size: int) -> bytes:
+        size = self._clamp(offset, size)
+        out = []
+        end = offset + size
+        index = max(bisect_right(self.starts, offset) - 1, 0)
+        while offset < end:
+            if index >= len(self.extents) or offset < self.extents[index][0]:
+                # Hole between extents.
+                stop = self.extents[index][0] if index < len(self.extents) else end
+                out.append(bytes(min(stop, end) - offset))
+                offset = min(stop, end)
+                continue
+            start, length, parent_offset = self.extents[index]
+            n = min(end, start + length) - offset
+            if n > 0:
+                out.append(bytes(n) if parent_offset is None else
+                           self.parent.pread(parent_offset + offset - start, n))
+                offset += n
+            index += 1
+        return b''.join(out)
+
+
+class SparseDevice(BlockDevice):
+    """
+    The expanded content of an Android sparse image, mapped through SparseImage.offset_map.
+    Don't care chunks read as zeros.
+    """
+
+    def __init__(self, path: str):
+        image = SparseImage(path, build_map=True)
+        image.simg_f.close()
+        self.blocksize = image.blocksize
+        self.size = image.total_blocks * image.blocksize
+        self.offset_map = image.offset_map
+        self.offset_index = image.offset_index
+        self.raw = RawDevice(path)
+
+    def pread(self, offset: int, size: int) -> bytes:
+        size = self._clamp(offset, size)
+        bs = self.blocksize
+        out = []
+        end = offset + size
+        while offset < end:
+            block = offset // bs
+            idx = bisect_right(self.offset_index, block) - 1
+            if idx >= 0:
+                chunk_start, chunk_len, filepos, fill_data = self.offset_map[idx]
+                chunk_end = (chunk_start + chunk_len) * bs
+            if idx < 0 or offset >= chunk_end:
+                # Don't care, up to the next chunk.
+                stop = self.offset_index[idx + 1] * bs if idx + 1 < len(self.offset_index) else self.size
+                n = min(stop, end) - offset
+                out.append(bytes(n))
+            else:
+                n = min(chunk_end, end) - offset
+                inner = offset - chunk_start * bs
+                if filepos is not None:
+                    out.append(self.raw.pread(filepos + inner, n))
+                else:
+                    # Fill patterns are 4 bytes, rotate to where the read starts.
+                    pattern = fill_data[inner % 4:] + fill_data[:inner % 4]
+                    out.append((pattern * (n // 4 + 1))[:n])
+            offset += n
+        return b''.join(out)
+
+    def close(self):
+        self.raw.close()
+
+
+class PayloadDevice(BlockDevice):
+    """
+    A partition of a full payload.bin, operations are decoded when a read touches them.
+    REPLACE data is read straight from the payload, compressed operations are decoded and kept in a small cache.
+    """
+
+    def __init__(self, parent: BlockDevice, partition: update_metadata_pb2.PartitionUpdate, block_size: int,
+                 data_offset: int, cache_size: int = 8):
+        self.parent = parent
+        self.partition = partition
+        self.name = partition.partition_name
+        self.size = partition.new_partition_info.size
+        self.data_offset = data_offset
+        self.cache_size = cache_size
+        self._cache = OrderedDict()
+        self._lock = threading.Lock()
+        index = []
+        for op_index, op in enumerate(partition.operations):
+            out_offset = 0
+            for ext in op.dst_extents:
+                length = ext.num_blocks * block_size
+                index.append((ext.start_block * block_size, length, op_index, out_offset))
+                out_offset += length
+        index.sort(key=lambda x: x[0])
+        self.index = index
+        self.starts = [i[0] for i in index]
+
+    def _decode(self, op_index: int) -> bytes:
+        with self._lock:
+            if op_index in self._cache:
+                self._cache.move_to_end(op_index)
+                return self._cache[op_index]
+        op = self.partition.operations[op_index]
+        data = self.parent.pread(self.data_offset + op.data_offset, op.data_length)
+        match op.type:
+            case update_metadata_pb2.InstallOperation.REPLACE_BZ:
+                data = bz2.decompress(data)
+            case update_metadata_pb2.InstallOperation.REPLACE_XZ:
+                data = lzma.decompress(data)
+            case update_metadata_pb2.InstallOperation.REPLACE_ZSTD:
+                data = zstandard.ZstdDecompressor().decompressobj().decompress(data)
+        with self._lock:
+            self._cache[op_index] = data
+            while len(self._cache) > self.cache_size:
+                self._cache.popitem(last=False)
+        return data
+
+    def pread(self, offset: int, size: int) -> bytes:
+        size = self._clamp(offset, size)
+        out = []
+        end = offset + size
+        index = max(bisect_right(self.starts, offset) - 1, 0)
+        while offset < end:
+            if index >= len(self.index) or offset < self.index[index][0]:
+                stop = self.index[index][0] if index < len(self.index) else end
+                out.append(bytes(min(stop, end) - offset))
+                offset = min(stop, end)
+                continue
+            start, length, op_index, out_offset = self.index[index]
+            n = min(end, start + length) - offset
+            if n > 0:
+                op = self.partition.operations[op_index]
+                inner = out_offset + offset - start
+                match op.type:
+                    case update_metadata_pb2.InstallOperation.ZERO | update_metadata_pb2.InstallOperation.DISCARD:
+                        out.append(bytes(n))
+                    case update_metadata_pb2.InstallOperation.REPLACE:
+                        out.append(self.parent.pread(self.data_offset + op.data_offset + inner, n))
+                    case (update_metadata_pb2.InstallOperation.REPLACE_BZ |
+                          update_metadata_pb2.InstallOperation.REPLACE_XZ |
+                          update_metadata_pb2.InstallOperation.REPLACE_ZSTD):
+                        out.append(self._decode(op_index)[inner:inner + n])
+                    case _:
+                        raise BadPayload(f"unsupported operation {op.type} in {self.name}, is it a delta payload?")
+                offset += n
+            index += 1
+        return b''.join(out)
+
+
+class DeviceReader(RawIOBase):
+    """
+    File object over a device, for code that reads through seek/read.
+    pread is passed through so ext4.Volume skips the file position.
+    """
+
+    def __init__(self, device: BlockDevice):
+        super().__init__()
+        self.device = device
+        self.pos = 0
+
+    seekable = lambda self: True
+    readable = lambda self: True
+    writable = lambda self: False
+
+    def pread(self, offset: int, size: int) -> bytes:
+        return self.device.pread(offset, size)
+
+    def readinto(self, buffer) -> int:
+        data = self.device.pread(self.pos, len(buffer))
+        buffer[:len(data)] = data
+        self.pos += len(data)
+        return len(data)
+
+    def seek(self, offset: int, whence: int = os.SEEK_SET) -> int:
+        if whence == os.SEEK_CUR:
+            offset += self.pos
+        elif whence == os.SEEK_END:
+            offset += self.device.size
+        elif whence != os.SEEK_SET:
+            raise UnsupportedOperation(f"unsupported seek whence! {whence}")
+        if offset < 0:
+            raise ValueError(f"invalid position to seek: {offset}")
+        self.pos = offset
+        return offset
+
+    def tell(self) -> int:
+        return self.pos
+
+
+def open_image(path: str) -> BlockDevice:
+    """
+    Open an image file, sparse images are expanded on the fly
+    :param path: image path
+    :return:
+    """
+    with open(path, 'rb') as f:
+        magic = f.read(4)
+    return SparseDevice(path) if magic == SPARSE_MAGIC else RawDevice(path)
+
+
+def lp_partitions(device: BlockDevice) -> dict[str, ExtentDevice]:
+    """
+    Return the logical partitions of a super image as devices
+    :param device: the super image
+    :return: {name: device}
+    """
+    metadata = read_metadata(device.open())
+    partitions = {}
+    for partition in metadata.partitions:
+        extents = []
+        pos = 0
+        for i in range(partition.first_extent_index, partition.first_extent_index + partition.num_extents):
+            extent = metadata.extents[i]
+            length = extent.num_sectors * LP_SECTOR_SIZE
+            if extent.target_type == LP_TARGET_TYPE_LINEAR:
+                if extent.target_source != 0:
+                    raise ValueError(f"{partition.name} lives on block device {extent.target_source}, "
+                                     f"only the super device can be read")
+                extents.append((pos, length, extent.target_data * LP_SECTOR_SIZE))
+            elif extent.target_type == LP_TARGET_TYPE_ZERO:
+                extents.append((pos, length, None))
+            else:
+                raise ValueError(f"Unsupported target type in extent: {extent.target_type}")
+            pos += length
+        partitions[partition.name] = ExtentDevice(device, extents)
+    return partitions
+
+
+def payload_partitions(device: BlockDevice) -> dict[str, PayloadDevice]:
+    """
+    Return the partitions of a full payload.bin as devices
+    :param device: payload.bin
+    :return: {name: device}
+    """
+    reader = device.open()
+    manifest = init_payload_info(reader)
+    data_offset = reader.tell()
+    return {i.partition_name: PayloadDevice(device, i, manifest.block_size, data_offset) for i in
+            manifest.partitions}
+
+
+def open_filesystem(device: BlockDevice) -> ext4.Volume | erofs.Volume:
+    """
+    Open the ext4 or erofs filesystem on a device
+    """
+    if device.pread(EXT4_MAGIC_OFFSET, 2) == b'\x53\xef':
+        return ext4.Volume(device.open())
+    if device.pread(erofs.EROFS_SUPER_OFFSET, 4) == struct.pack('<I', erofs.EROFS_MAGIC):
+        return erofs.Volume(device)
+    raise ValueError("Neither ext4 nor erofs")
+
+
+def open_path(image: str, *partitions: str) -> BlockDevice:
+    """
+    Open a device through nested partitions, e.g. open_path('super.img', 'system_a')
+    :param image: image file, raw or sparse, super or payload
+    :param partitions: partition names, one per nesting level
+    :return:
+    """
+    device = open_image(image)
+    for name in partitions:
+        if device.pread(0, 4) == b"CrAU":
+            parts = payload_partitions(device)
+        else:
+            parts = lp_partitions(device)
+        if name not in parts:
+            raise FileNotFoundError(f"{name} not found, available: {' '.join(parts)}")
+        device = parts[name]
+    return device
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Read a file from a filesystem nested in images")
+    parser.add_argument('image', help="raw/sparse image, super.img or payload.bin")
+    parser.add_argument('path', help="path of the file in the filesystem, e.g. system/build.prop")
+    parser.add_argument('-p', '--partition', action='append', default=[],
+                        help="partition of super.img or payload.bin, may be repeated for nested images")
+    parser.add_argument('-o', '--output', help="output file, stdout by default")
+    args = parser.parse_args()
+    out = open(args.output, 'wb') if args.output else sys.stdout.buffer
+    # Image readers talk on stdout, keep it for the data.
+    try:
+        with contextlib.redirect_stdout(sys.stderr):
+            device = open_path(args.image, *args.partition)
+            inode = open_filesystem(device).root.get_inode(*[i for i in args.path.split('/') if i])
+            reader = inode.open_read()
+            while data := reader.read(4 * 1024 * 1024):
+                out.write(data)
+    finally:
+        if args.output:
+            out.close()
+
+
+if __name__ == '__main__':
+    main()
@@ -26,6 +26,7 @@ from heapq import heappop, heappush, heapify
 from multiprocessing import cpu_count
 from re import sub
 
+from . import jobs
 from .rangelib import RangeSet  # Assuming rangelib is in the same package directory
 
 __all__ = ["EmptyImage", "DataImage", "BlockImageDiff"]
@@ -276,6 +277,9 @@ class BlockImageDiff:
         self._max_stashed_size = 0
         self.touched_src_ranges = RangeSet()
         self.touched_src_sha1 = None # Will be hex string
+        # new.dat goes here instead of prefix.new.dat when set, e.g. the stdin of a compressor
+        self.new_data_file = None
+        self._hash_cache = {} # (id(image), ranges string) -> sha1 hex, filled by PrefetchHashes
 
         assert version in (1, 2, 3, 4), "Unsupported version"
         assert tgt.blocksize == 4096, "Target blocksize must be 4096"
@@ -365,15 +369,40 @@ class BlockImageDiff:
 
         self.AssertSequenceGood()
         self.ComputePatches(prefix)
+        self.PrefetchHashes()
         self.WriteTransfers(prefix)
 
     def HashBlocks(self, image_source: Image, ranges: RangeSet) -> str:
         """Hashes data from specified ranges of an image source."""
+        digest = self._hash_cache.get((id(image_source), ranges.to_string_raw()))
+        if digest is not None:
+            return digest
+        if hasattr(image_source, "RangeSha1"):
+            return image_source.RangeSha1(ranges)
         ctx = hashlib.sha1()
         for chunk in image_source.ReadRangeSet(ranges):
             ctx.update(chunk)
         return ctx.hexdigest()
 
+    def PrefetchHashes(self):
+        """
+        Hashes the ranges WriteTransfers needs on the cpu pool of jobs.
+        Images read ranges without a shared file position, so the reads and hashes run in parallel.
+        """
+        if self.version < 3:
+            return
+        wanted = {}
+        for xf in self.transfers:
+            if xf.style == "move" and xf.src_ranges != xf.tgt_ranges:
+                wanted[(id(self.tgt), xf.tgt_ranges.to_string_raw())] = (self.tgt, xf.tgt_ranges)
+            elif xf.style in ("bsdiff", "imgdiff"):
+                wanted[(id(self.src), xf.src_ranges.to_string_raw())] = (self.src, xf.src_ranges)
+                wanted[(id(self.tgt), xf.tgt_ranges.to_string_raw())] = (self.tgt, xf.tgt_ranges)
+        if not wanted:
+            return
+        digests = jobs.parallel(lambda item: self.HashBlocks(*item), wanted.values(), workers=self.threads)
+        self._hash_cache.update(zip(wanted.keys(), digests))
+
     def WriteTransfers(self, prefix: str):
         """Writes the transfer list file."""
         out_lines = []
@@ -711,12 +740,13 @@ class BlockImageDiff:
 
         # Transfers that need patch computation
         diff_tasks = [] 
-        # Data for "new" transfers
+        # Data for "new" transfers, zero copy views when the target supports positional reads
         new_data_chunks = []
+        read_new = getattr(self.tgt, "PReadRangeSet", self.tgt.ReadRangeSet)
 
         for xf in self.transfers:
             if xf.style == "new":
-                for piece in self.tgt.ReadRangeSet(xf.tgt_ranges):
+                for piece in read_new(xf.tgt_ranges):
                     new_data_chunks.append(piece)
             elif xf.style == "diff": # Original style before checking for identical data
                 # Read data now to avoid issues with data changing if src/tgt are complex objects
@@ -745,10 +775,14 @@ class BlockImageDiff:
             # "zero" and "move" (if already set) styles don't need patch computation here
 
         # Write .new.dat file
-        new_dat_path = prefix + ".new.dat"
-        with open(new_dat_path, "wb") as f_new:
+        if self.new_data_file is not None:
             for chunk in new_data_chunks:
-                f_new.write(chunk)
+                self.new_data_file.write(chunk)
+        else:
+            new_dat_path = prefix + ".new.dat"
+            with open(new_dat_path, "wb") as f_new:
+                for chunk in new_data_chunks:
+                    f_new.write(chunk)
 
         # Compute patches if there are tasks
         # Store patches indexed by a unique ID from the transfer if needed, or process in order
@@ -15,7 +15,7 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 import os
-from re import escape, search
+from re import compile as re_compile, escape
 from typing import Any, Generator, Union, Optional
 from .utils import JsonEdit
 
@@ -51,15 +51,17 @@ def scan_dir(folder) -> Generator[Union[str, Any], Optional[Any], None]:  # 读
 str_to_selinux = lambda string: escape(string).replace('\\-', '-') if not string.endswith('(/.*)?') else string
 
 
-def context_patch(fs_file, dir_path, fix_permission: dict) -> tuple:  # 接收两个字典对比
+def context_patch(fs_file, dir_path, fix_permission: dict, paths=None) -> tuple:  # 接收两个字典对比
     new_fs = {}
+    # 规则只在需要时编译一次, 倒序查找, 最后一个匹配的规则生效
+    rules = None
     # 定义已修补过的 避免重复修补
     r_new_fs = {}
     add_new = 0
     print(f"ContextPatcher: the Original File Has {len(fs_file.keys()):d} entries")
     # 定义默认SeLinux标签
     permission_d = 'u:object_r:system_file:s0'
-    for i in scan_dir(os.path.abspath(dir_path)):
+    for i in scan_dir(os.path.abspath(dir_path)) if paths is None else paths:
         # 把不可打印字符替换为*
         if not i.isprintable():
             i = ''.join([c if c.isprintable() or not c.strip(' ') else '*' for c in i])
@@ -75,9 +77,9 @@ def context_patch(fs_file, dir_path, fix_permission: dict) -> tuple:  # 接收
             # 确认i不为空
             if i:
                 # 搜索已定义的权限
-                for f in fix_permission.keys():
-                    if search(f, i):
-                        permission = fix_permission.get(f)
+                if rules is None:
+                    rules = [(re_compile(f), p) for f, p in reversed(fix_permission.items())]
+                permission = next((p for f, p in rules if f.search(i)), None)
                 #upper
                 if not permission:
                     permission = permission_d
@@ -0,0 +1,299 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+Conversion between the formats of a partition: raw, sparse, dat (new.dat + transfer.list), br and xz.
+plan() lists the stages from a source to a target format and run() connects them in memory:
+    decode: brotli (a brotli process), xz, new.dat, raw or sparse image
+    apply: the new.dat data is placed at the blocks of the transfer list
+    encode: raw image, sparse image, new.dat or brotli (a brotli process)
+so a conversion reads its input once and writes its output once, convert() runs the items at the same time.
+Usage:
+    convert('MIO/rom/', ['system.new.dat.br', 'vendor.new.dat.br'], 'br', 'sparse')
+"""
+import lzma
+import os
+import subprocess
+from contextlib import contextmanager
+
+from . import jobs, progress, trace, utils
+from .sparse_img import SparseWriter
+
+CHUNK = 4 << 20
+BLOCK = 4096
+SOURCES = ('raw', 'sparse', 'dat', 'br', 'xz')
+TARGETS = ('raw', 'sparse', 'dat', 'br')
+# Suffix of the files of every format after the partition name
+SUFFIXES = {'raw': '.img', 'sparse': '.img', 'dat': '.new.dat', 'br': '.new.dat.br', 'xz': '.new.dat.xz'}
+
+
+def plan(source: str, target: str) -> list[str]:
+    """
+    Stages of a conversion
+    :param source: one of SOURCES
+    :param target: one of TARGETS
+    :return: e.g. ['brotli decode', 'apply transfer list', 'sparse encode'], empty if there is nothing to do
+    """
+    if source not in SOURCES or target not in TARGETS:
+        raise ValueError(f'Cannot convert {source} to {target}')
+    if source == target:
+        return []
+    decode = {'raw': 'read raw', 'sparse': 'read sparse', 'dat': 'read new.dat', 'br': 'brotli decode',
+              'xz': 'xz decode'}[source]
+    encode = {'raw': 'raw write', 'sparse': 'sparse encode', 'dat': 'new.dat write', 'br': 'brotli encode'}[target]
+    if source in ('dat', 'br', 'xz'):
+        if target in ('raw', 'sparse'):
+            return [decode, 'apply transfer list', encode]
+        return [decode, encode]
+    if target in ('dat', 'br'):
+        return [decode, 'block image diff', encode]
+    return [decode, encode]
+
+
+@contextmanager
+def _process(cmd: list, **kwargs):
+    """
+    A tool of bin connected with pipes, it must exit with 0
+    """
+    cmd = [f'{utils.tool_bin}{cmd[0]}', *cmd[1:]]
+    flags = subprocess.CREATE_NO_WINDOW if os.name != 'posix' else 0
+    with trace.span(os.path.basename(cmd[0]), 'exec', cmd=' '.join(cmd)):
+        proc = subprocess.Popen(cmd, creationflags=flags, **kwargs)
+        utils.states.open_pids.append(proc.pid)
+        try:
+            yield proc
+        except BaseException:
+            proc.kill()
+            raise
+        finally:
+            for pipe in proc.stdin, proc.stdout:
+                if pipe:
+                    pipe.close()
+            proc.wait()
+            utils.states.open_pids.remove(proc.pid)
+        if proc.returncode:
+            raise RuntimeError(f'{os.path.basename(cmd[0])} exited with {proc.returncode}')
+
+
+@contextmanager
+def _decoded(path: str, source: str):
+    """
+    The new.dat data of a dat, br or xz file as a readable file
+    """
+    if source == 'br':
+        with _process(['brotli', '-dc', path], stdout=subprocess.PIPE) as proc:
+            yield proc.stdout
+    elif source == 'xz':
+        with lzma.open(path, 'rb') as f:
+            yield f
+    else:
+        with open(path, 'rb') as f:
+            yield f
+
+
+@contextmanager
+def _brotli_encoder(output: str, quality: int = 0):
+    """
+    A writable file whose data is compressed to output
+    """
+    with _process(['brotli', '-f', '-q', str(quality), '-w', '24', '-o', output], stdin=subprocess.PIPE) as proc:
+        yield proc.stdin
+
+
+def read_transfer_list(path: str) -> tuple[int, list[tuple[int, int]]]:
+    """
+    :return: version and the block ranges of the new commands in the order of new.dat
+    """
+    with open(path, 'r', encoding='utf-8') as f:
+        lines = f.read().splitlines()
+    version = int(lines[0])
+    ranges = []
+    # Total blocks, then stash entries and stashed blocks since version 2
+    for line in lines[2 if version < 2 else 4:]:
+        cmd, _, args = line.partition(' ')
+        if cmd != 'new':
+            continue
+        values = [int(i) for i in args.split(',')]
+        if len(values) != values[0] + 1:
+            raise ValueError(f'Bad range set: {args}')
+        ranges.extend(zip(values[1::2], values[2::2]))
+    return version, ranges
+
+
+class RawSink:
+    """
+    Blocks written at their position, the rest of the image is left as holes
+    """
+
+    def __init__(self, path: str, total_blocks: int):
+        self.file = open(path, 'wb')
+        self.file.truncate(total_blocks * BLOCK)
+
+    def write(self, block: int, data: bytes):
+        self.file.seek(block * BLOCK)
+        self.file.write(data)
+
+    def close(self):
+        self.file.close()
+
+
+class SparseSink:
+    """
+    Blocks written in ascending order as sparse chunks, the blocks between them become zero fill chunks
+    """
+
+    def __init__(self, path: str, total_blocks: int):
+        self.file = open(path, 'wb')
+        self.writer = SparseWriter(self.file, BLOCK, total_blocks)
+
+    def write(self, block: int, data: bytes):
+        self.writer.AppendFill(b'\0' * 4, block - self.writer.blocks)
+        self.writer.AppendData(data)
+
+    def close(self):
+        self.writer.AppendFill(b'\0' * 4, self.writer.total_blocks - self.writer.blocks)
+        self.writer.Close()
+        self.file.close()
+
+
+def _apply(stream, ranges: list, sink, tracker: progress.Progress):
+    for start, end in ranges:
+        block = start
+        while block < end:
+            jobs.check_cancelled()
+            data = stream.read(min(end - block, CHUNK // BLOCK) * BLOCK)
+            if len(data) % BLOCK:
+                data += bytes(BLOCK - len(data) % BLOCK)
+            if not data:
+                raise ValueError('new.dat is shorter than the transfer list')
+            sink.write(block, data)
+            tracker.update(len(data))
+            block += len(data) // BLOCK
+
+
+def _copy(stream, out, tracker: progress.Progress):
+    while data := stream.read(CHUNK):
+        jobs.check_cancelled()
+        out.write(data)
+        tracker.update(len(data))
+
+
+def _encode_sparse(raw: str, output: str, tracker: progress.Progress):
+    size = os.path.getsize(raw)
+    with open(raw, 'rb') as f, open(output, 'wb') as out:
+        writer = SparseWriter(out, BLOCK, -(-size // BLOCK))
+        while data := f.read(CHUNK):
+            jobs.check_cancelled()
+            if len(data) % BLOCK:
+                data += bytes(BLOCK - len(data) % BLOCK)
+            writer.AppendData(data)
+            tracker.update(len(data))
+        writer.Close()
+
+
+def _remove(*paths: str):
+    for path in paths:
+        if os.path.exists(path):
+            os.remove(path)
+
+
+def run(work: str, file: str, source: str, target: str):
+    """
+    Convert one file of work, the source files are removed when the output is complete
+    :param work: folder of the file
+    :param file: e.g. system.new.dat.br or system.img
+    :param source:
+    :param target:
+    :return:
+    """
+    stages = plan(source, target)
+    if not stages:
+        return
+    name = os.path.basename(file).split('.')[0]
+    path = os.path.join(work, file)
+    transfer_list = os.path.join(work, f'{name}.transfer.list')
+    output = os.path.join(work, name + SUFFIXES[target])
+    print(f"[{source}->{target}]{file}: {' | '.join(stages)}")
+    size = os.path.getsize(path)
+    with progress.Progress(f'{source}->{target} {name}', size) as tracker, \
+            trace.span(f'convert {name} {source}->{target}', bytes=size):
+        if source in ('dat', 'br', 'xz') and target in ('raw', 'sparse'):
+            _, ranges = read_transfer_list(transfer_list)
+            total = max((end for _, end in ranges), default=0)
+            tracker.bytes_total = sum(end - start for start, end in ranges) * BLOCK
+            in_order = all(a[1] <= b[0] for a, b in zip(ranges, ranges[1:]))
+            # Sparse chunks are written front to back, other transfer lists are applied to a raw image first
+            direct = target == 'raw' or in_order
+            temp = output if direct else output + '.raw'
+            with jobs.partial(temp), _decoded(path, source) as stream:
+                sink = SparseSink(temp, total) if target == 'sparse' and direct else RawSink(temp, total)
+                try:
+                    _apply(stream, ranges, sink, tracker)
+                finally:
+                    sink.close()
+            if not direct:
+                with jobs.partial(output):
+                    _encode_sparse(temp, output, progress.Progress(f'sparse {name}', total * BLOCK))
+                _remove(temp)
+            patch = os.path.join(work, f'{name}.patch.dat')
+            _remove(path, transfer_list, *([patch] if os.path.exists(patch) and not os.path.getsize(patch) else []))
+        elif source in ('br', 'xz') and target == 'dat':
+            with jobs.partial(output), _decoded(path, source) as stream, open(output, 'wb') as out:
+                _copy(stream, out, tracker)
+            _remove(path)
+        elif source in ('dat', 'xz') and target == 'br':
+            with jobs.partial(output), _decoded(path, source) as stream, _brotli_encoder(output) as out:
+                _copy(stream, out, tracker)
+            _remove(path)
+        elif source == 'raw' and target == 'sparse':
+            with jobs.partial(output + '.sparse'):
+                _encode_sparse(path, output + '.sparse', tracker)
+            os.replace(output + '.sparse', path)
+        elif source == 'sparse' and target == 'raw':
+            utils.simg2img(path)
+            tracker.update(size)
+        else:
+            # raw or sparse to dat or br, the image is diffed against an empty source in place
+            if target == 'br':
+                with jobs.partial(output), _brotli_encoder(output) as out:
+                    utils.img2sdat(path, work, 4, name, out)
+            else:
+                with jobs.partial(output):
+                    utils.img2sdat(path, work, 4, name)
+            tracker.update(size)
+            _remove(path)
+    print(f'Done: {output}')
+
+
+def convert(work: str, files: list, source: str, target: str, workers: int = None) -> int:
+    """
+    Convert files of work at the same time
+    :return: the number of files that failed
+    """
+    if not files or source == target:
+        return 0
+
+    def job(file):
+        try:
+            run(work, file, source, target)
+            return True
+        except jobs.JobCancelled:
+            raise
+        except Exception as e:
+            print(f'Convert {file} failed: {e}')
+            utils.logging.exception('convert')
+            return False
+
+    # Decoding and encoding run on the cpu pool as part of the calling job, a cancel stops them and removes
+    # their partial outputs
+    return jobs.parallel(job, files, workers=workers).count(False)
@@ -0,0 +1,247 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+Multi connection, resumable HTTP downloader.
+The file is split into segments fetched in parallel into a preallocated file,
+the progress of each segment is kept in <file>.mkcdl so an interrupted download resumes.
+"""
+import hashlib
+import json
+import logging
+import os
+import threading
+import time
+
+import requests
+
+CHUNK_SIZE = 1024 * 1024
+MIN_SEGMENT = 4 * 1024 * 1024
+STATE_SUFFIX = '.mkcdl'
+
+
+class Segment:
+    def __init__(self, start: int, end: int, done: int = 0):
+        self.start = start
+        self.end = end
+        self.done = done
+
+    @property
+    def finished(self) -> bool:
+        return self.start + self.done >= self.end
+
+
+class Downloader:
+    """
+    Usage:
+        d = Downloader(url, path, connections=4, hash_=('sha256', '...'))
+        for done, total, speed, elapsed in d.run():
+            ...
+    """
+
+    def __init__(self, url: str, path: str, connections: int = 4, hash_: tuple[str, str] = None,
+                 size: int = 0, timeout: int = 10, retries: int = 5):
+        self.url = url
+        # Redirects may lead to a signed url that changes every time, the state is kept for the url asked for
+        self.origin = url
+        self.path = path
+        self.state_file = path + STATE_SUFFIX
+        self.connections = max(connections, 1)
+        self.hash_ = hash_
+        self.size = size
+        self.timeout = timeout
+        self.retries = retries
+        self.ranges = False
+        self.validator = ''
+        self.segments: list[Segment] = []
+        self.lock = threading.Lock()
+        self.stop = threading.Event()
+        self.errors = []
+
+    def probe(self):
+        """
+        Find out the length of the file and whether the server answers range requests.
+        """
+        with requests.Session() as session:
+            try:
+                resp = session.head(self.url, timeout=self.timeout, allow_redirects=True)
+                resp.raise_for_status()
+                self.url = resp.url
+                self.size = int(resp.headers.get("Content-Length", 0)) or self.size
+                self.ranges = resp.headers.get("Accept-Ranges", "none") == "bytes"
+                self.validator = resp.headers.get("ETag") or resp.headers.get("Last-Modified") or ''
+            except requests.exceptions.RequestException as e:
+                logging.error(f"Error making HEAD request to {self.url}: {e}")
+            if not self.ranges or not self.size:
+                # HEAD may be unsupported or incomplete, a one byte range answers both questions.
+                try:
+                    with session.get(self.url, headers={"Range": "bytes=0-0"}, stream=True,
+                                     timeout=self.timeout) as resp:
+                        if resp.status_code == 206:
+                            self.ranges = True
+                            self.size = int(resp.headers.get("Content-Range", "*/0").rsplit('/', 1)[1]) or self.size
+                except (requests.exceptions.RequestException, ValueError):
+                    logging.exception('probe')
+        self.ranges = self.ranges and self.size > 0
+
+    def _load_state(self) -> bool:
+        if not os.path.exists(self.state_file) or not os.path.exists(self.path):
+            return False
+        try:
+            with open(self.state_file, 'r', encoding='utf-8') as f:
+                state = json.load(f)
+        except (ValueError, OSError):
+            return False
+        if state.get('url') != self.origin or state.get('size') != self.size or \
+                state.get('validator') != self.validator or os.path.getsize(self.path) != self.size:
+            return False
+        self.segments = [Segment(*i) for i in state['segments']]
+        return True
+
+    def _save_state(self):
+        with self.lock:
+            state = {'url': self.origin, 'size': self.size, 'validator': self.validator,
+                     'segments': [[i.start, i.end, i.done] for i in self.segments]}
+        with open(self.state_file + '.tmp', 'w', encoding='utf-8') as f:
+            json.dump(state, f)
+        os.replace(self.state_file + '.tmp', self.state_file)
+
+    def _plan(self):
+        if self.ranges and self._load_state():
+            logging.info(f"Resuming {self.path}")
+            return
+        if self.ranges:
+            count = max(min(self.connections, self.size // MIN_SEGMENT), 1)
+            step = -(-self.size // count)
+            self.segments = [Segment(i, min(i + step, self.size)) for i in range(0, self.size, step)]
+            with open(self.path, 'wb') as f:
+                f.truncate(self.size)
+            self._save_state()
+        else:
+            # The length may be unknown, the segment is closed when the stream ends.
+            self.segments = [Segment(0, self.size or float('inf'))]
+            open(self.path, 'wb').close()
+            # Left by a download that had ranges, it cannot be resumed without them
+            if os.path.exists(self.state_file):
+                os.remove(self.state_file)
+
+    def _fetch(self, segment: Segment):
+        """
+        Download a segment, on errors the request is repeated from where it stopped.
+        """
+        with requests.Session() as session, open(self.path, 'r+b', buffering=0) as f:
+            for attempt in range(self.retries):
+                if segment.finished or self.stop.is_set():
+                    return
+                headers = {}
+                if self.ranges:
+                    headers["Range"] = f"bytes={segment.start + segment.done}-{segment.end - 1}"
+                elif segment.done:
+                    # Without ranges there is no way to continue, start over.
+                    with self.lock:
+                        segment.done = 0
+                    f.truncate(0)
+                try:
+                    with session.get(self.url, headers=headers, stream=True, timeout=self.timeout) as resp:
+                        resp.raise_for_status()
+                        if self.ranges and resp.status_code != 206:
+                            raise IOError("Remote ignored the range request!")
+                        f.seek(segment.start + segment.done)
+                        for data in resp.iter_content(chunk_size=CHUNK_SIZE):
+                            if self.stop.is_set():
+                                return
+                            if self.ranges:
+                                data = data[:segment.end - segment.start - segment.done]
+                            f.write(data)
+                            with self.lock:
+                                segment.done += len(data)
+                    if not self.ranges:
+                        if self.size and segment.done < self.size:
+                            raise IOError(f"Stream ended at {segment.done}/{self.size}")
+                        with self.lock:
+                            segment.end = segment.done
+                        return
+                except (requests.exceptions.RequestException, IOError) as e:
+                    logging.warning(f"Segment {segment.start}: {e}, retry {attempt + 1}/{self.retries}")
+                    time.sleep(min(2 ** attempt, 10))
+            if not segment.finished:
+                raise IOError(f"Failed to download {self.url} at {segment.start + segment.done}")
+
+    def _worker(self, segment: Segment):
+        try:
+            self._fetch(segment)
+        except (Exception, BaseException) as e:
+            logging.exception('Downloader')
+            self.errors.append(e)
+
+    @property
+    def done(self) -> int:
+        with self.lock:
+            return sum(i.done for i in self.segments)
+
+    def _contiguous(self) -> int:
+        """
+        End of the downloaded prefix of the file.
+        """
+        with self.lock:
+            for i in self.segments:
+                if not i.finished:
+                    return i.start + i.done
+            return self.segments[-1].end if self.segments else 0
+
+    def run(self):
+        """
+        Download the file, yield (bytes done, total bytes, speed KB/s, elapsed seconds) while running.
+        Raise IOError on failure and ValueError if the hash does not match.
+        """
+        start_time = last_time = time.time()
+        self.probe()
+        self._plan()
+        hasher = hashlib.new(self.hash_[0]) if self.hash_ else None
+        hashed = 0
+        threads = [threading.Thread(target=self._worker, args=(i,), daemon=True) for i in self.segments if
+                   not i.finished]
+        for t in threads:
+            t.start()
+        last_done = self.done
+        with open(self.path, 'rb', buffering=0) as reader:
+            while True:
+                alive = any(t.is_alive() for t in threads)
+                if hasher:
+                    # Hash the downloaded prefix while the rest is still coming, the data is still in page cache.
+                    end = self._contiguous()
+                    reader.seek(hashed)
+                    while hashed < end:
+                        data = reader.read(min(CHUNK_SIZE * 4, end - hashed))
+                        hasher.update(data)
+                        hashed += len(data)
+                if not alive:
+                    break
+                time.sleep(0.5)
+                if self.ranges:
+                    self._save_state()
+                now = time.time()
+                done = self.done
+                speed = (done - last_done) / 1024 / max(now - last_time, 0.001)
+                last_done, last_time = done, now
+                yield done, self.size, speed, now - start_time
+        if self.errors or self.stop.is_set():
+            if self.ranges:
+                self._save_state()
+            raise IOError(f"Download of {self.url} did not finish: {self.errors[0] if self.errors else 'stopped'}")
+        if os.path.exists(self.state_file):
+            os.remove(self.state_file)
+        done = self.done
+        yield done, self.size or done, done / 1024 / max(time.time() - start_time, 0.001), time.time() - start_time
+        if hasher and hasher.hexdigest().lower() != self.hash_[1].lower():
+            raise ValueError(f"{self.hash_[0]} mismatch: expected {self.hash_[1]}, got {hasher.hexdigest()}")
@@ -0,0 +1,625 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+Read-only EROFS reader.
+Supports plain, inline and chunk based files and compressed files (lz4, lzma, deflate, zstd)
+with full or compact indexes, big pclusters, ztailpacking and fragments.
+The image is read through pread(offset, size), so any block device of blockdev works as a source.
+"""
+import lzma
+import os
+import stat
+import struct
+import threading
+import zlib
+from bisect import bisect_right
+from io import RawIOBase, UnsupportedOperation
+
+import zstandard
+
+EROFS_MAGIC = 0xE0F5E1E2
+EROFS_SUPER_OFFSET = 1024
+EROFS_NULL_ADDR = 0xFFFFFFFF
+
+FEATURE_INCOMPAT_ZERO_PADDING = 0x1
+FEATURE_INCOMPAT_COMPR_CFGS = 0x2
+FEATURE_INCOMPAT_CHUNKED_FILE = 0x4
+FEATURE_INCOMPAT_ZTAILPACKING = 0x10
+FEATURE_INCOMPAT_FRAGMENTS = 0x20
+
+LAYOUT_FLAT_PLAIN = 0
+LAYOUT_COMPRESSED_FULL = 1
+LAYOUT_FLAT_INLINE = 2
+LAYOUT_COMPRESSED_COMPACT = 3
+LAYOUT_CHUNK_BASED = 4
+
+CHUNK_FORMAT_BLKBITS_MASK = 0x1F
+CHUNK_FORMAT_INDEXES = 0x20
+
+Z_ADVISE_COMPACTED_2B = 0x1
+Z_ADVISE_BIG_PCLUSTER_1 = 0x2
+Z_ADVISE_BIG_PCLUSTER_2 = 0x4
+Z_ADVISE_INLINE_PCLUSTER = 0x8
+Z_ADVISE_INTERLACED_PCLUSTER = 0x10
+Z_ADVISE_FRAGMENT_PCLUSTER = 0x20
+Z_FRAGMENT_INODE_BIT = 7
+
+LCLUSTER_TYPE_PLAIN = 0
+LCLUSTER_TYPE_HEAD1 = 1
+LCLUSTER_TYPE_NONHEAD = 2
+LCLUSTER_TYPE_HEAD2 = 3
+LI_D0_CBLKCNT = 1 << 11
+LI_PARTIAL_REF = 1 << 15
+
+COMPRESSION_LZ4 = 0
+COMPRESSION_LZMA = 1
+COMPRESSION_DEFLATE = 2
+COMPRESSION_ZSTD = 3
+
+FT_UNKNOWN = 0
+FT_REG_FILE = 1
+FT_DIR = 2
+FT_CHRDEV = 3
+FT_BLKDEV = 4
+FT_FIFO = 5
+FT_SOCK = 6
+FT_SYMLINK = 7
+
+_super = struct.Struct('<IIIBBHQQIIII16s16sIHHHBBIQ')
+_inode_compact = struct.Struct('<HHHHIIIIHHI')
+_inode_extended = struct.Struct('<HHHHQIIIIQII')
+_dirent = struct.Struct('<QHBx')
+_map_header = struct.Struct('<HHHBB')
+_full_index = struct.Struct('<HHI')
+_chunk_index = struct.Struct('<HHI')
+
+
+class ErofsError(Exception):
+    ...
+
+
+def lz4_decompress(src, size: int) -> bytes:
+    """
+    Decode a LZ4 block until size bytes are produced or the input ends
+    :param src: compressed block
+    :param size: wanted output size
+    :return:
+    """
+    dst = bytearray()
+    i, n = 0, len(src)
+    while i < n:
+        token = src[i]
+        i += 1
+        length = token >> 4
+        if length == 15:
+            while True:
+                b = src[i]
+                i += 1
+                length += b
+                if b != 255:
+                    break
+        dst += src[i:i + length]
+        i += length
+        if i >= n or len(dst) >= size:
+            break
+        distance = src[i] | src[i + 1] << 8
+        i += 2
+        if not distance or distance > len(dst):
+            raise ErofsError(f"Bad LZ4 match distance {distance} at {i}")
+        length = token & 15
+        if length == 15:
+            while True:
+                b = src[i]
+                i += 1
+                length += b
+                if b != 255:
+                    break
+        length += 4
+        start = len(dst) - distance
+        if distance >= length:
+            dst += dst[start:start + length]
+        else:
+            # Overlapping match, the last distance bytes repeat.
+            dst += (dst[start:] * (length // distance + 1))[:length]
+    return bytes(dst[:size])
+
+
+def _decompress(algorithm: int, data: bytes, size: int) -> bytes:
+    if algorithm == COMPRESSION_LZ4:
+        return lz4_decompress(data, size)
+    if algorithm == COMPRESSION_LZMA:
+        # MicroLZMA: the first byte of the range coder (always 0) carries the inverted properties.
+        props = ~data[0] & 0xFF
+        lc, lp, pb = props % 9, props // 9 % 5, props // 45
+        decoder = lzma.LZMADecompressor(lzma.FORMAT_RAW, filters=[
+            {'id': lzma.FILTER_LZMA1, 'lc': lc, 'lp': lp, 'pb': pb, 'dict_size': 1 << 23}])
+        return decoder.decompress(b'\0' + bytes(data[1:]), size)
+    if algorithm == COMPRESSION_DEFLATE:
+        return zlib.decompressobj(-15).decompress(data, size)
+    if algorithm == COMPRESSION_ZSTD:
+        return zstandard.ZstdDecompressor().decompressobj().decompress(data)[:size]
+    raise ErofsError(f"Unsupported compression algorithm {algorithm}")
+
+
+class _Source:
+    """
+    pread over a path or a file object, used when the source has no pread of its own.
+    """
+
+    def __init__(self, file):
+        self.file = open(file, 'rb') if isinstance(file, (str, os.PathLike)) else file
+        self.lock = threading.Lock()
+
+    def pread(self, offset: int, size: int) -> bytes:
+        if hasattr(os, 'pread'):
+            return os.pread(self.file.fileno(), size, offset)
+        with self.lock:
+            self.file.seek(offset)
+            return self.file.read(size)
+
+
+class Volume:
+    def __init__(self, source):
+        """
+        :param source: anything with pread(offset, size), a path or an opened file
+        """
+        self.source = source if hasattr(source, 'pread') else _Source(source)
+        raw = self.pread(EROFS_SUPER_OFFSET, _super.size)
+        if len(raw) != _super.size:
+            raise ErofsError("Image is too small")
+        (self.magic, self.checksum, self.feature_compat, self.blkszbits, self.sb_extslots, self.root_nid,
+         self.inos, self.build_time, self.build_time_nsec, self.blocks, self.meta_blkaddr, self.xattr_blkaddr,
+         self.uuid_raw, volume_name, self.feature_incompat, self.available_compr_algs, self.extra_devices,
+         self.devt_slotoff, self.dirblkbits, self.xattr_prefix_count, self.xattr_prefix_start,
+         self.packed_nid) = _super.unpack(raw)
+        if self.magic != EROFS_MAGIC:
+            raise ErofsError(f"Invalid magic value in superblock: 0x{self.magic:08X} (expected 0x{EROFS_MAGIC:08X})")
+        self.volume_name = volume_name.rstrip(b'\0').decode(errors='replace')
+        self.block_size = 1 << self.blkszbits
+        self._packed = None
+
+    def pread(self, offset: int, size: int) -> bytes:
+        return self.source.pread(offset, size)
+
+    def has_feature(self, feature: int) -> bool:
+        return bool(self.feature_incompat & feature)
+
+    @property
+    def uuid(self):
+        uuid = self.uuid_raw
+        uuid = [uuid[:4], uuid[4: 6], uuid[6: 8], uuid[8: 10], uuid[10:]]
+        return "-".join("".join(f"{c:02X}" for c in part) for part in uuid)
+
+    def iloc(self, nid: int) -> int:
+        return (self.meta_blkaddr << self.blkszbits) + (nid << 5)
+
+    def get_inode(self, nid: int, file_type: int = FT_UNKNOWN) -> 'Inode':
+        return Inode(self, nid, file_type)
+
+    @property
+    def root(self) -> 'Inode':
+        return self.get_inode(self.root_nid, FT_DIR)
+
+    @property
+    def packed_inode(self) -> 'Inode':
+        if self._packed is None:
+            if not self.has_feature(FEATURE_INCOMPAT_FRAGMENTS):
+                raise ErofsError("Image has no packed inode")
+            self._packed = self.get_inode(self.packed_nid)
+        return self._packed
+
+
+class Inode:
+    def __init__(self, volume: Volume, nid: int, file_type: int = FT_UNKNOWN):
+        self.volume = volume
+        self.nid = nid
+        self.file_type = file_type
+        self.offset = volume.iloc(nid)
+        raw = volume.pread(self.offset, _inode_extended.size)
+        i_format = struct.unpack_from('<H', raw)[0]
+        self.extended = i_format & 1
+        self.datalayout = (i_format >> 1) & 7
+        if self.extended:
+            (_, xattr_icount, self.mode, _, self.size, self.i_u, self.ino, self.uid, self.gid, self.mtime,
+             self.mtime_nsec, self.nlink) = _inode_extended.unpack_from(raw)
+            self.inode_isize = 64
+        else:
+            (_, xattr_icount, self.mode, self.nlink, self.size, _, self.i_u, self.ino, self.uid, self.gid,
+             _) = _inode_compact.unpack_from(raw)
+            self.mtime, self.mtime_nsec = volume.build_time, volume.build_time_nsec
+            self.inode_isize = 32
+        self.xattr_isize = 12 + 4 * (xattr_icount - 1) if xattr_icount else 0
+        self.data_offset = self.offset + self.inode_isize + self.xattr_isize
+        if self.file_type == FT_UNKNOWN:
+            self.file_type = _mode_to_type(self.mode)
+        self._extents = None
+        self._cache = (None, b'')
+        self._lock = threading.Lock()
+
+    def __len__(self):
+        return self.size
+
+    def __repr__(self):
+        return f"{type(self).__name__:s}(nid = {self.nid!r:s}, offset = 0x{self.offset:X}, volume_uuid = {self.volume.uuid!r:s})"
+
+    @property
+    def is_dir(self):
+        return self.file_type == FT_DIR
+
+    @property
+    def is_file(self):
+        return self.file_type == FT_REG_FILE
+
+    @property
+    def is_symlink(self):
+        return self.file_type == FT_SYMLINK
+
+    @property
+    def compressed(self) -> bool:
+        return self.datalayout in (LAYOUT_COMPRESSED_FULL, LAYOUT_COMPRESSED_COMPACT)
+
+    def open_dir(self):
+        """
+        Yield (name, nid, file_type) of the directory entries, "." and ".." included
+        """
+        if not self.is_dir:
+            raise ErofsError(f"Inode ({self.nid:d}) is not a directory.")
+        bs = self.volume.block_size
+        for pos in range(0, self.size, bs):
+            block = self.read(pos, min(bs, self.size - pos))
+            count = _dirent.unpack_from(block)[1] // _dirent.size
+            entries = [_dirent.unpack_from(block, i * _dirent.size) for i in range(count)]
+            for i, (nid, nameoff, file_type) in enumerate(entries):
+                end = entries[i + 1][1] if i + 1 < count else len(block)
+                name = block[nameoff:end]
+                if i + 1 == count:
+                    name = name.split(b'\0', 1)[0]
+                yield name.decode("utf8", errors='surrogateescape'), nid, file_type
+
+    def get_inode(self, *relative_path) -> 'Inode':
+        if not self.is_dir:
+            raise ErofsError(f"Inode {self.nid:d} is not a directory.")
+        current_inode = self
+        for i, part in enumerate(relative_path):
+            if not current_inode.is_dir:
+                raise ErofsError(f"{'/'.join(relative_path[:i])!r:s} (Inode {current_inode.nid:d}) is not a directory.")
+            file_name, nid, file_type = next(
+                filter(lambda entry: entry[0] == part, current_inode.open_dir()), (None, None, None))
+            if nid is None:
+                raise FileNotFoundError(
+                    f"{part!r:s} not found in {'/'.join(relative_path[:i])!r:s} (Inode {current_inode.nid:d}).")
+            current_inode = current_inode.volume.get_inode(nid, file_type)
+        return current_inode
+
+    def readlink(self) -> str:
+        return self.read().decode("utf8", errors='surrogateescape')
+
+    def open_read(self) -> 'InodeReader':
+        return InodeReader(self)
+
+    def read(self, offset: int = 0, size: int = -1) -> bytes:
+        """
+        Read size bytes at offset of the file content, -1 reads to the end
+        """
+        size = self.size - offset if size < 0 else min(size, self.size - offset)
+        if size <= 0:
+            return b''
+        if self.compressed:
+            return self._read_compressed(offset, size)
+        out = []
+        while size > 0:
+            data = self._read_flat(offset, size)
+            out.append(data)
+            offset += len(data)
+            size -= len(data)
+        return b''.join(out)
+
+    def _read_flat(self, offset: int, size: int) -> bytes:
+        """
+        Read from the mapping that contains offset, may return fewer bytes than asked.
+        """
+        volume = self.volume
+        bs = volume.block_size
+        if self.datalayout == LAYOUT_FLAT_PLAIN:
+            return volume.pread((self.i_u << volume.blkszbits) + offset, size)
+        if self.datalayout == LAYOUT_FLAT_INLINE:
+            last_block = (self.size - 1) // bs
+            if offset < last_block * bs:
+                size = min(size, last_block * bs - offset)
+                return volume.pread((self.i_u << volume.blkszbits) + offset, size)
+            return volume.pread(self.data_offset + offset % bs, size)
+        if self.datalayout == LAYOUT_CHUNK_BASED:
+            chunk_format = self.i_u & 0xFFFF
+            chunkbits = volume.blkszbits + (chunk_format & CHUNK_FORMAT_BLKBITS_MASK)
+            chunk_nr = offset >> chunkbits
+            in_chunk = offset & ((1 << chunkbits) - 1)
+            size = min(size, (1 << chunkbits) - in_chunk)
+            if chunk_format & CHUNK_FORMAT_INDEXES:
+                pos = _align(self.data_offset, _chunk_index.size) + chunk_nr * _chunk_index.size
+                _, device_id, blkaddr = _chunk_index.unpack(volume.pread(pos, _chunk_index.size))
+                if device_id:
+                    raise ErofsError(f"Inode {self.nid} has chunks on extra device {device_id}")
+            else:
+                pos = _align(self.data_offset, 4) + chunk_nr * 4
+                blkaddr = struct.unpack('<I', volume.pread(pos, 4))[0]
+            if blkaddr == EROFS_NULL_ADDR:
+                return bytes(size)
+            return volume.pread((blkaddr << volume.blkszbits) + in_chunk, size)
+        raise ErofsError(f"Unknown data layout {self.datalayout} of inode {self.nid}")
+
+    # Compressed files
+
+    def _load_map(self):
+        volume = self.volume
+        pos = _align(self.data_offset, 8)
+        reserved1, idata_size, self.z_advise, algorithm, clusterbits = _map_header.unpack(
+            volume.pread(pos, _map_header.size))
+        self.z_fragmentoff = reserved1 | idata_size << 16
+        self.z_idata_size = idata_size
+        self.z_algorithm = (algorithm & 0xF, algorithm >> 4)
+        self.z_whole_fragment = bool(clusterbits >> Z_FRAGMENT_INODE_BIT)
+        self.lclusterbits = volume.blkszbits + (clusterbits & 7)
+        self.total_idx = -(-self.size >> self.lclusterbits)
+        self.z_ebase = pos + _map_header.size
+
+    def _index_pos(self, lcn: int) -> tuple[int, int]:
+        """
+        Return the position of compact index lcn and the shift of its size (1: 2 bytes, 2: 4 bytes).
+        """
+        ebase = self.z_ebase
+        initial = (32 - ebase % 32) // 4
+        if initial == 32 // 4:
+            initial = 0
+        if self.z_advise & Z_ADVISE_COMPACTED_2B and initial < self.total_idx:
+            compacted_2b = (self.total_idx - initial) // 16 * 16
+        else:
+            compacted_2b = 0
+        pos = ebase
+        if lcn < initial:
+            return pos + lcn * 4, 2
+        pos += initial * 4
+        lcn -= initial
+        if lcn < compacted_2b:
+            return pos + lcn * 2, 1
+        pos += compacted_2b * 2
+        lcn -= compacted_2b
+        return pos + lcn * 4, 2
+
+    def _load_lcluster(self, lcn: int) -> tuple[int, int, int, int, int]:
+        """
+        Decode logical cluster lcn.
+        :return: (type, clusterofs, pblk, delta0, compressed blocks)
+        """
+        if self.datalayout == LAYOUT_COMPRESSED_FULL:
+            pos = self.z_ebase + 8 + lcn * _full_index.size
+            advise, clusterofs, u = _full_index.unpack(self.volume.pread(pos, _full_index.size))
+            type_ = advise & 3
+            if type_ != LCLUSTER_TYPE_NONHEAD:
+                return type_, clusterofs, u, 0, 0
+            delta0 = u & 0xFFFF
+            if delta0 & LI_D0_CBLKCNT:
+                return type_, 1 << self.lclusterbits, 0, 1, delta0 & ~LI_D0_CBLKCNT
+            return type_, 1 << self.lclusterbits, 0, delta0, 0
+        pos, shift = self._index_pos(lcn)
+        if shift == 2 and self.lclusterbits <= 14:
+            vcnt = 2
+        elif shift == 1 and self.lclusterbits <= 12:
+            vcnt = 16
+        else:
+            raise ErofsError(f"Unsupported compact index of inode {self.nid}")
+        pack_size = vcnt << shift
+        start = pos - pos % pack_size
+        pack = self.volume.pread(start, pack_size)
+        i = (pos - start) >> shift
+        lobits = max(self.lclusterbits, LI_D0_CBLKCNT.bit_length())
+        encodebits = (pack_size - 4) * 8 // vcnt
+
+        def decode(index):
+            bit = encodebits * index
+            v = int.from_bytes(pack[bit // 8:bit // 8 + 4], 'little') >> (bit & 7)
+            return v & ((1 << lobits) - 1), (v >> lobits) & 3
+
+        lo, type_ = decode(i)
+        if type_ == LCLUSTER_TYPE_NONHEAD:
+            clusterofs = 1 << self.lclusterbits
+            if lo & LI_D0_CBLKCNT:
+                return type_, clusterofs, 0, 1, lo & ~LI_D0_CBLKCNT
+            if i + 1 != vcnt:
+                return type_, clusterofs, 0, lo, 0
+            # The last lcluster of a pack stores delta[1], delta[0] comes from the previous one.
+            lo, prev_type = decode(i - 1)
+            if prev_type != LCLUSTER_TYPE_NONHEAD:
+                lo = 0
+            elif lo & LI_D0_CBLKCNT:
+                lo = 1
+            return type_, clusterofs, 0, lo + 1, 0
+        clusterofs = lo
+        # Heads store no block address, count the pclusters before it in this pack.
+        if not self.z_advise & Z_ADVISE_BIG_PCLUSTER_1:
+            nblk = 1
+            while i > 0:
+                i -= 1
+                lo, t = decode(i)
+                if t == LCLUSTER_TYPE_NONHEAD:
+                    i -= lo
+                if i >= 0:
+                    nblk += 1
+        else:
+            nblk = 0
+            while i > 0:
+                i -= 1
+                lo, t = decode(i)
+                if t == LCLUSTER_TYPE_NONHEAD:
+                    if lo & LI_D0_CBLKCNT:
+                        i -= 1
+                        nblk += lo & ~LI_D0_CBLKCNT
+                        continue
+                    if lo <= 1:
+                        raise ErofsError(f"Bogus big pcluster delta in inode {self.nid}")
+                    i -= lo - 2
+                    continue
+                nblk += 1
+        return type_, clusterofs, struct.unpack_from('<I', pack, pack_size - 4)[0] + nblk, 0, 0
+
+    def _compressed_blocks(self, lcn: int, type_: int) -> int:
+        advise = self.z_advise
+        if ((type_ == LCLUSTER_TYPE_HEAD1 and not advise & Z_ADVISE_BIG_PCLUSTER_1) or
+                (type_ in (LCLUSTER_TYPE_PLAIN, LCLUSTER_TYPE_HEAD2) and not advise & Z_ADVISE_BIG_PCLUSTER_2) or
+                (lcn + 1) << self.lclusterbits >= self.size):
+            return 1
+        next_type, _, _, delta0, blocks = self._load_lcluster(lcn + 1)
+        if next_type == LCLUSTER_TYPE_NONHEAD and delta0 != 1:
+            raise ErofsError(f"Bogus CBLKCNT at lcn {lcn + 1} of inode {self.nid}")
+        return blocks if next_type == LCLUSTER_TYPE_NONHEAD and blocks else 1
+
+    def _end_of_indexes(self) -> int:
+        if self.datalayout == LAYOUT_COMPRESSED_FULL:
+            return self.z_ebase + 8 + self.total_idx * _full_index.size
+        pos, shift = self._index_pos(self.total_idx - 1)
+        pack_size = (2 if shift == 2 else 16) << shift
+        return pos - pos % pack_size + pack_size
+
+    @property
+    def extents(self) -> list:
+        """
+        Decompressed extents (start, length, kind, algorithm, physical offset, physical size) of a compressed file,
+        kind is 'block', 'inline' or 'fragment'.
+        """
+        if self._extents is not None:
+            return self._extents
+        self._load_map()
+        if self.z_whole_fragment:
+            self._extents = [(0, self.size, 'fragment', None, self.z_fragmentoff, self.size)]
+            return self._extents
+        heads = []
+        for lcn in range(self.total_idx):
+            type_, clusterofs, pblk, _, _ = self._load_lcluster(lcn)
+            if type_ != LCLUSTER_TYPE_NONHEAD and (lcn << self.lclusterbits) | clusterofs < self.size:
+                heads.append(((lcn << self.lclusterbits) | clusterofs, lcn, type_, pblk))
+        extents = []
+        for i, (la, lcn, type_, pblk) in enumerate(heads):
+            end = heads[i + 1][0] if i + 1 < len(heads) else self.size
+            if type_ == LCLUSTER_TYPE_PLAIN:
+                algorithm = 'interlaced' if self.z_advise & Z_ADVISE_INTERLACED_PCLUSTER else 'shifted'
+            else:
+                algorithm = self.z_algorithm[0 if type_ == LCLUSTER_TYPE_HEAD1 else 1]
+            if i + 1 == len(heads) and self.z_advise & Z_ADVISE_INLINE_PCLUSTER:
+                extents.append((la, end - la, 'inline', algorithm, self._end_of_indexes(), self.z_idata_size))
+            elif i + 1 == len(heads) and self.z_advise & Z_ADVISE_FRAGMENT_PCLUSTER:
+                offset = self.z_fragmentoff
+                if self.datalayout == LAYOUT_COMPRESSED_FULL:
+                    offset |= pblk << 32
+                extents.append((la, end - la, 'fragment', None, offset, end - la))
+            else:
+                blocks = self._compressed_blocks(lcn, type_)
+                extents.append((la, end - la, 'block', algorithm, pblk << self.volume.blkszbits,
+                                blocks << self.volume.blkszbits))
+        self._extents = extents
+        return extents
+
+    def decode_extent(self, index: int) -> bytes:
+        """
+        Return the decompressed data of extent index, the last decoded extent is cached.
+        """
+        with self._lock:
+            if self._cache[0] == index:
+                return self._cache[1]
+        la, length, kind, algorithm, offset, size = self.extents[index]
+        volume = self.volume
+        if kind == 'fragment':
+            data = volume.packed_inode.read(offset, length)
+        else:
+            raw = volume.pread(offset, size)
+            if algorithm == 'shifted':
+                data = raw[:length]
+            elif algorithm == 'interlaced':
+                head = volume.block_size - la % volume.block_size
+                data = (raw[len(raw) - head:] + raw[:len(raw) - head])[:length] if head < len(raw) else raw[:length]
+            else:
+                if volume.has_feature(FEATURE_INCOMPAT_ZERO_PADDING):
+                    # Compressed data is aligned to the end of the pcluster.
+                    first = raw[:volume.block_size]
+                    raw = memoryview(raw)[len(first) - len(first.lstrip(b'\0')):]
+                data = _decompress(algorithm, raw, length)
+        if len(data) != length:
+            raise ErofsError(f"Extent at {la} of inode {self.nid} decoded to {len(data)}/{length} bytes")
+        with self._lock:
+            self._cache = (index, data)
+        return data
+
+    def _read_compressed(self, offset: int, size: int) -> bytes:
+        extents = self.extents
+        starts = [i[0] for i in extents]
+        index = bisect_right(starts, offset) - 1
+        out = []
+        end = offset + size
+        while offset < end and index < len(extents):
+            la, length = extents[index][:2]
+            data = self.decode_extent(index)
+            out.append(data[offset - la:min(end, la + length) - la])
+            offset = la + length
+            index += 1
+        return b''.join(out)
+
+
+class InodeReader(RawIOBase):
+    """
+    Seekable file object of an inode.
+    """
+
+    def __init__(self, inode: Inode):
+        super().__init__()
+        self.inode = inode
+        self.pos = 0
+
+    seekable = lambda self: True
+    readable = lambda self: True
+    writable = lambda self: False
+
+    def readinto(self, buffer) -> int:
+        data = self.inode.read(self.pos, len(buffer))
+        buffer[:len(data)] = data
+        self.pos += len(data)
+        return len(data)
+
+    def seek(self, offset: int, whence: int = os.SEEK_SET) -> int:
+        if whence == os.SEEK_CUR:
+            offset += self.pos
+        elif whence == os.SEEK_END:
+            offset += self.inode.size
+        elif whence != os.SEEK_SET:
+            raise UnsupportedOperation(f"unsupported seek whence! {whence}")
+        if offset < 0:
+            raise ValueError(f"invalid position to seek: {offset}")
+        self.pos = offset
+        return offset
+
+    def tell(self) -> int:
+        return self.pos
+
+
+def _align(value: int, unit: int) -> int:
+    return -(-value // unit) * unit
+
+
+def _mode_to_type(mode: int) -> int:
+    return {
+        stat.S_IFREG: FT_REG_FILE,
+        stat.S_IFDIR: FT_DIR,
+        stat.S_IFCHR: FT_CHRDEV,
+        stat.S_IFBLK: FT_BLKDEV,
+        stat.S_IFIFO: FT_FIFO,
+        stat.S_IFSOCK: FT_SOCK,
+        stat.S_IFLNK: FT_SYMLINK,
+    }.get(stat.S_IFMT(mode), FT_UNKNOWN)
@@ -2,8 +2,10 @@
 import ctypes
 from functools import cmp_to_key
 import io
+import os
 from math import log as log_math
-import queue
+import struct
+from collections import namedtuple
 
 
 def wcs_cmp(str_a, str_b):
@@ -427,13 +429,89 @@ class InodeType:
     CHECKSUM = 0xDE  # Checksum entry; not really a file type, but a type of directory entry
 
 
+# ----------------------------- BATCH DECODERS ------------------------------
+# Precompiled decoders for the hot metadata paths, a whole inode table block, directory block or
+# extent node is decoded in one call and the *_lo/*_hi pairs are merged at decode time,
+# the ctypes structures above stay for the rarely used metadata.
+
+_dir_entry = struct.Struct("<IHBB")
+_extent_header = struct.Struct("<HHHHI")
+_extent = struct.Struct("<IHHI")
+_extent_idx = struct.Struct("<IIHH")
+# ee_len above this marks an uninitialized (preallocated, reads as zeros) extent
+EXT_INIT_MAX_LEN = 1 << 15
+# i_mode .. i_file_acl_lo, i_size_hi, i_obso_faddr, osd2 (blocks_hi, file_acl_hi, uid_hi, gid_hi)
+_inode_base = struct.Struct("<HHIIIIIHHIII60sIIIIHHHH4x")
+_inode_extra = struct.Struct("<H")
+
+InodeRecord = namedtuple("InodeRecord", ["i_mode", "i_uid", "i_size", "i_atime", "i_ctime", "i_mtime", "i_dtime",
+                                         "i_gid", "i_links_count", "i_blocks", "i_flags", "i_block", "i_generation",
+                                         "i_file_acl", "i_extra_isize"])
+
+
+def decode_inode(raw, offset=0, inode_size=ext4_inode.EXT2_GOOD_OLD_INODE_SIZE):
+    (mode, uid_lo, size_lo, atime, ctime, mtime, dtime, gid_lo, links, blocks_lo, flags, _, i_block, generation,
+     file_acl_lo, size_hi, _, blocks_hi, file_acl_hi, uid_hi, gid_hi) = _inode_base.unpack_from(raw, offset)
+    extra_isize = _inode_extra.unpack_from(raw, offset + 0x80)[0] \
+        if inode_size > ext4_inode.EXT2_GOOD_OLD_INODE_SIZE else 0
+    return InodeRecord(mode, uid_hi << 16 | uid_lo, size_hi << 32 | size_lo, atime, ctime, mtime, dtime,
+                       gid_hi << 16 | gid_lo, links, blocks_hi << 32 | blocks_lo, flags, i_block, generation,
+                       file_acl_hi << 32 | file_acl_lo, extra_isize)
+
+
+def decode_inode_table(raw, inode_size):
+    """
+    Decode every inode of a raw inode table block
+    :param raw: inode table data, a multiple of inode_size
+    :param inode_size: s_inode_size of the volume
+    :return: list of InodeRecord
+    """
+    return [decode_inode(raw, offset, inode_size) for offset in range(0, len(raw) - inode_size + 1, inode_size)]
+
+
+def decode_dir_block(raw):
+    """
+    Decode the linear directory entries of raw directory data, checksum entries are left out
+    :param raw: directory data
+    :return: list of (raw name, inode, file_type)
+    """
+    entries = []
+    offset = 0
+    end = len(raw) - _dir_entry.size
+    while offset <= end:
+        inode, rec_len, name_len, file_type = _dir_entry.unpack_from(raw, offset)
+        if file_type != InodeType.CHECKSUM:
+            entries.append((raw[offset + 8: offset + 8 + name_len], inode, file_type))
+        if rec_len < _dir_entry.size:
+            break
+        offset += rec_len
+    return entries
+
+
+def decode_extent_node(raw):
+    """
+    Decode an extent tree node, the header and all of its entries
+    :param raw: node data, i_block of the inode or a tree block
+    :return: (magic, depth, entries), entries are (ee_block, length, ee_start, uninit) for leaves
+             and (ei_block, ei_leaf) for index nodes
+    """
+    magic, count, _, depth, _ = _extent_header.unpack_from(raw)
+    body = raw[_extent_header.size: _extent_header.size + count * _extent.size]
+    if depth:
+        return magic, depth, [(block, hi << 32 | lo) for block, lo, hi, _ in _extent_idx.iter_unpack(body)]
+    return magic, depth, [(block, length - EXT_INIT_MAX_LEN, hi << 32 | lo, True) if length > EXT_INIT_MAX_LEN else
+                          (block, length, hi << 32 | lo, False) for block, length, hi, lo in _extent.iter_unpack(body)]
+
+
 # ----------------------------- HIGH LEVEL ------------------------------
 
 class MappingEntry:
-    def __init__(self, file_block_idx, disk_block_idx, block_count=1):
+    def __init__(self, file_block_idx, disk_block_idx, block_count=1, uninit=False):
         self.file_block_idx = file_block_idx
         self.disk_block_idx = disk_block_idx
         self.block_count = block_count
+        # Allocated but never written, reads as zeros
+        self.uninit = uninit
 
     def __iter__(self):
         yield self.file_block_idx
@@ -444,7 +522,7 @@ class MappingEntry:
         return f"{type(self).__name__:s}({self.file_block_idx!r:s}, {self.disk_block_idx!r:s}, {self.block_count!r:s})"
 
     def copy(self):
-        return MappingEntry(self.file_block_idx, self.disk_block_idx, self.block_count)
+        return MappingEntry(self.file_block_idx, self.disk_block_idx, self.block_count, self.uninit)
 
     def create_mapping(*entries):
         file_block_idx = 0
@@ -465,7 +543,8 @@ class MappingEntry:
         while idx < len(entries):
             while idx + 1 < len(entries) \
                     and entries[idx].file_block_idx + entries[idx].block_count == entries[idx + 1].file_block_idx \
-                    and entries[idx].disk_block_idx + entries[idx].block_count == entries[idx + 1].disk_block_idx:
+                    and entries[idx].disk_block_idx + entries[idx].block_count == entries[idx + 1].disk_block_idx \
+                    and entries[idx].uninit == entries[idx + 1].uninit:
                 tmp = entries.pop(idx + 1)
                 entries[idx].block_count += tmp.block_count
 
@@ -481,6 +560,10 @@ class Volume:
         self.offset = offset
         self.platform64 = True  # Initial value needed for Volume.read_struct
         self.stream = stream
+        # Block devices and their readers offer positional reads which need no shared file position.
+        self.pread = getattr(stream, 'pread', None)
+        # Decoded inode table blocks, keyed by their offset
+        self._inode_tables = {}
 
         # Superblock
         self.superblock = self.read_struct(ext4_superblock, 0x400)
@@ -550,7 +633,28 @@ class Volume:
         inode_table_entry_idx = (inode_idx - 1) % self.superblock.s_inodes_per_group
         return group_idx, inode_table_entry_idx
 
+    def read_inode(self, offset):
+        """
+        Return the InodeRecord at offset, the whole inode table block around it is decoded and kept
+        :param offset: offset of the inode
+        :return:
+        """
+        inode_size = self.superblock.s_inode_size
+        table_offset = offset - offset % self.block_size
+        records = self._inode_tables.get(table_offset)
+        if records is None:
+            if len(self._inode_tables) >= 256:
+                self._inode_tables.clear()
+            records = self._inode_tables[table_offset] = decode_inode_table(
+                self.read(table_offset, self.block_size), inode_size)
+        index = (offset - table_offset) // inode_size
+        if index >= len(records) or (offset - table_offset) % inode_size:
+            return decode_inode(self.read(offset, inode_size), 0, inode_size)
+        return records[index]
+
     def read(self, offset, byte_len):
+        if self.pread:
+            return self.pread(self.offset + offset, byte_len)
         if self.offset + offset != self.stream.tell():
             self.stream.seek(self.offset + offset, io.SEEK_SET)
 
@@ -582,7 +686,7 @@ class Inode:
         self.volume = volume
 
         self.file_type = file_type
-        self.inode = volume.read_struct(ext4_inode, offset)
+        self.inode = volume.read_inode(offset)
 
     def __len__(self):
         return self.inode.i_size
@@ -772,51 +876,48 @@ class Inode:
             ...
 
         # Read raw directory content
-        raw_data = self.open_read().read()
-        offset = 0
-
-        while offset < len(raw_data):
-            dirent = ext4_dir_entry_2._from_buffer_copy(raw_data, offset, platform64=self.volume.platform64)
-
-            if dirent.file_type != InodeType.CHECKSUM:
-                yield decode_name(dirent.name), dirent.inode, dirent.file_type
-
-            offset += dirent.rec_len
+        for name, inode_idx, file_type in decode_dir_block(self.open_read().read()):
+            yield decode_name(name), inode_idx, file_type
 
     def open_read(self):
         if (self.inode.i_flags & ext4_inode.EXT4_EXTENTS_FL) != 0:
             # Obtain mapping from extents
             mapping = []  # List of MappingEntry instances
 
-            nodes = queue.Queue()
-            nodes.put_nowait(self.offset + ext4_inode.i_block.offset)
+            nodes = [self.inode.i_block]
 
-            while nodes.qsize() != 0:
-                header_offset = nodes.get_nowait()
-                header = self.volume.read_struct(ext4_extent_header, header_offset)
+            while nodes:
+                magic, depth, entries = decode_extent_node(nodes.pop())
 
-                if not self.volume.ignore_magic and header.eh_magic != 0xF30A:
+                if not self.volume.ignore_magic and magic != 0xF30A:
                     raise MagicError(
                         f"Invalid magic value in extent header at offset 0x{self.inode_idx:X} of"
-                        f" inode {self.inode_idx:d}: 0x{header.eh_magic:04X} (expected 0xF30A)")
+                        f" inode {self.inode_idx:d}: 0x{magic:04X} (expected 0xF30A)")
 
-                if header.eh_depth != 0:
-                    indices = self.volume.read_struct(ext4_extent_idx * header.eh_entries,
-                                                      header_offset + ctypes.sizeof(ext4_extent_header))
-                    for idx in indices:
-                        nodes.put_nowait(idx.ei_leaf * self.volume.block_size)
+                if depth != 0:
+                    block_size = self.volume.block_size
+                    for _, leaf in entries:
+                        nodes.append(self.volume.read(leaf * block_size, block_size))
                 else:
-                    extents = self.volume.read_struct(ext4_extent * header.eh_entries,
-                                                      header_offset + ctypes.sizeof(ext4_extent_header))
-                    for extent in extents:
-                        mapping.append(MappingEntry(extent.ee_block, extent.ee_start, extent.ee_len))
+                    mapping.extend(MappingEntry(block, start, length, uninit) for block, length, start, uninit in entries)
 
             MappingEntry.optimize(mapping)
             return BlockReader(self.volume, len(self), mapping)
         else:
             # Inode uses inline data
-            i_block = self.volume.read(self.offset + ext4_inode.i_block.offset, ext4_inode.i_block.size)
-            return io.BytesIO(i_block[:self.inode.i_size])
+            return io.BytesIO(self.inode.i_block[:self.inode.i_size])
+
+    def extract_to(self, out):
+        """
+        Write the content of the inode to out, holes stay holes
+        :param out: file opened for binary writing
+        :return:
+        """
+        reader = self.open_read()
+        if isinstance(reader, BlockReader):
+            reader.copy_to(out)
+        else:
+            out.write(reader.read())
 
     @property
     def size_readable(self):
@@ -894,15 +995,71 @@ class BlockReader:
     def get_block_mapping(self, file_block_idx):
         disk_block_idx = None
 
-        # Find disk block
+        # Find disk block, uninitialized extents are holes too
         for entry in self.block_map:
             if entry.file_block_idx <= file_block_idx < entry.file_block_idx + entry.block_count:
-                block_diff = file_block_idx - entry.file_block_idx
-                disk_block_idx = entry.disk_block_idx + block_diff
+                if not entry.uninit:
+                    block_diff = file_block_idx - entry.file_block_idx
+                    disk_block_idx = entry.disk_block_idx + block_diff
                 break
 
         return disk_block_idx
 
+    def data_extents(self):
+        """
+        The byte ranges of the file which hold data, holes and uninitialized extents are left out
+        :return: list of (file offset, length, volume offset)
+        """
+        block_size = self.volume.block_size
+        extents = []
+        for entry in self.block_map:
+            start = entry.file_block_idx * block_size
+            length = min(entry.block_count * block_size, self.byte_size - start)
+            if entry.uninit or length <= 0:
+                continue
+            extents.append((start, length, entry.disk_block_idx * block_size))
+        return extents
+
+    def copy_to(self, out, chunk_size=16 * 1024 * 1024):
+        """
+        Write the file to out keeping its holes, only data extents are copied and the rest is left
+        to seek/truncate. The data goes through copy_file_range when both sides are plain files.
+        :param out: file opened for binary writing
+        :param chunk_size: size of each read when copying through memory
+        :return:
+        """
+        out.flush()
+        src_fd = dst_fd = None
+        if hasattr(os, "copy_file_range") and not self.volume.pread:
+            try:
+                src_fd = self.volume.stream.fileno()
+                dst_fd = out.fileno()
+            except (AttributeError, OSError):
+                src_fd = None
+        for file_offset, length, disk_offset in self.data_extents():
+            done = 0
+            if src_fd is not None:
+                try:
+                    while done < length:
+                        copied = os.copy_file_range(src_fd, dst_fd, length - done,
+                                                    self.volume.offset + disk_offset + done, file_offset + done)
+                        if not copied:
+                            break
+                        done += copied
+                except OSError:
+                    # Cross device or not supported by the filesystem, copy through memory from here on.
+                    src_fd = None
+            if done < length:
+                out.seek(file_offset + done)
+            while done < length:
+                data = self.volume.read(disk_offset + done, min(chunk_size, length - done))
+                if not data:
+                    raise EndOfStreamError(f"The volume's underlying stream ended at {disk_offset + done:d}.")
+                out.write(data)
+                done += len(data)
+        out.seek(self.byte_size)
+        out.truncate(self.byte_size)
+
     def read(self, byte_len=-1):
         # Parse args
         if byte_len < -1:
@@ -919,7 +1076,7 @@ class BlockReader:
         end_block_idx = (self.cursor + byte_len - 1) // self.volume.block_size
         end_of_stream_check = byte_len
 
-        blocks = [self.read_block(i) for i in range(start_block_idx, end_block_idx - start_block_idx + 1)]
+        blocks = [self.read_block(i) for i in range(start_block_idx, end_block_idx + 1)]
 
         start_offset = self.cursor % self.volume.block_size
         if start_offset != 0:
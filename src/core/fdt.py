@@ -0,0 +1,814 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+Flattened device tree (dtb, dtbo) decompiler and compiler, so overlays are converted without a dtc process each.
+dtb_to_dts() writes the dts text of `dtc -@ -I dtb -O dts` and dts_to_dtb() the dtb of `dtc -@ -I dts -O dtb`:
+labels, phandle and path references, /plugin/ fragments, __symbols__, __fixups__ and __local_fixups__
+are generated the same way dtc 1.6 does. Syntax it does not handle (/include/, /incbin/, cpp) raises FdtError,
+callers fall back to dtc for that file.
+"""
+import logging
+import re
+import struct
+
+from . import jobs
+
+FDT_MAGIC = 0xD00DFEED
+FDT_BEGIN_NODE = 1
+FDT_END_NODE = 2
+FDT_PROP = 3
+FDT_NOP = 4
+FDT_END = 9
+FDT_VERSION = 17
+FDT_LAST_COMP_VERSION = 16
+HEADER_SIZE = 40
+
+# Marker kinds of references in property values
+REF_PHANDLE = 0
+REF_PATH = 1
+
+_PRINTABLE = frozenset(range(0x20, 0x7f))
+_STRING_CHARS = _PRINTABLE | frozenset(b'\0\a\b\t\n\v\f\r')
+_ESCAPES = {7: '\\a', 8: '\\b', 9: '\\t', 10: '\\n', 11: '\\v', 12: '\\f', 13: '\\r', 0x5c: '\\\\', 0x22: '\\"',
+            0: '\\0'}
+_CHAR_ESCAPES = {'a': 7, 'b': 8, 't': 9, 'n': 10, 'v': 11, 'f': 12, 'r': 13}
+_MASK64 = (1 << 64) - 1
+
+
+class FdtError(ValueError):
+    pass
+
+
+class Prop:
+    __slots__ = ('name', 'value', 'markers', 'deleted')
+
+    def __init__(self, name: str, value: bytes = b'', markers: list = None, deleted: bool = False):
+        self.name = name
+        self.value = bytearray(value)
+        # [offset, kind, ref] of the references in value
+        self.markers = markers or []
+        self.deleted = deleted
+
+
+class Node:
+    __slots__ = ('name', 'props', 'children', 'labels', 'parent', 'phandle', 'deleted', 'path')
+
+    def __init__(self, name: str = '', deleted: bool = False):
+        self.name = name
+        self.props: list[Prop] = []
+        self.children: list[Node] = []
+        self.labels: list[str] = []
+        self.parent = None
+        self.phandle = 0
+        self.deleted = deleted
+        self.path = ''
+
+    def prop(self, name: str) -> Prop | None:
+        return next((i for i in self.props if i.name == name and not i.deleted), None)
+
+    def child(self, name: str) -> 'Node | None':
+        return next((i for i in self.children if i.name == name and not i.deleted), None)
+
+    def add_child(self, child: 'Node') -> 'Node':
+        child.parent = self
+        self.children.append(child)
+        return child
+
+    def add_label(self, label: str):
+        # dtc keeps the labels in a list it prepends to
+        if label not in self.labels:
+            self.labels.insert(0, label)
+
+    def append_to_prop(self, name: str, data: bytes):
+        if prop := self.prop(name):
+            prop.value += data
+        else:
+            self.props.append(Prop(name, data))
+
+    def walk(self):
+        """
+        The node and its subnodes, depth first
+        """
+        yield self
+        for i in self.children:
+            if not i.deleted:
+                yield from i.walk()
+
+
+class Tree:
+    def __init__(self, root: Node = None, reserve: list = None, boot_cpuid: int = 0, plugin: bool = False):
+        self.root = root or Node()
+        self.reserve: list[tuple[int, int]] = reserve or []
+        self.boot_cpuid = boot_cpuid
+        self.plugin = plugin
+
+
+# ---- dtb ----
+
+def _cstring(data: bytes, offset: int) -> str:
+    end = data.find(b'\0', offset)
+    if end < 0:
+        raise FdtError('Unterminated string in dtb')
+    return data[offset:end].decode('utf-8', 'surrogateescape')
+
+
+def parse_dtb(data: bytes) -> Tree:
+    """
+    Read a flattened device tree blob
+    """
+    if len(data) < 28 or struct.unpack_from('>I', data)[0] != FDT_MAGIC:
+        raise FdtError('Not a dtb')
+    _, total, off_struct, off_strings, off_reserve, version = struct.unpack_from('>6I', data)
+    if version < 16:
+        raise FdtError(f'Unsupported dtb version {version}')
+    boot_cpuid, size_strings = struct.unpack_from('>2I', data, 28)
+    strings = data[off_strings:off_strings + size_strings]
+    reserve = []
+    offset = off_reserve
+    while True:
+        address, size = struct.unpack_from('>2Q', data, offset)
+        offset += 16
+        if not address and not size:
+            break
+        reserve.append((address, size))
+    tree = Tree(reserve=reserve, boot_cpuid=boot_cpuid)
+    stack = []
+    offset = off_struct
+    while True:
+        token, = struct.unpack_from('>I', data, offset)
+        offset += 4
+        if token == FDT_BEGIN_NODE:
+            end = data.find(b'\0', offset)
+            node = Node(data[offset:end].decode('utf-8', 'surrogateescape'))
+            offset = (end + 4) & ~3
+            if stack:
+                stack[-1].add_child(node)
+            else:
+                tree.root = node
+            stack.append(node)
+        elif token == FDT_END_NODE:
+            if not stack:
+                raise FdtError('Unbalanced FDT_END_NODE')
+            stack.pop()
+        elif token == FDT_PROP:
+            length, name_offset = struct.unpack_from('>2I', data, offset)
+            offset += 8
+            if not stack:
+                raise FdtError('Property outside a node')
+            stack[-1].props.append(Prop(_cstring(strings, name_offset), data[offset:offset + length]))
+            offset = (offset + length + 3) & ~3
+        elif token == FDT_NOP:
+            continue
+        elif token == FDT_END:
+            break
+        else:
+            raise FdtError(f'Bad token {token:#x} at {offset - 4:#x}')
+        if offset > len(data):
+            raise FdtError('Truncated dtb')
+    return tree
+
+
+def _string_offset(table: bytearray, name: bytes) -> int:
+    # Like dtc, a name that is the tail of one already stored reuses it
+    if (index := table.find(name + b'\0')) >= 0:
+        return index
+    index = len(table)
+    table += name + b'\0'
+    return index
+
+
+def to_dtb(tree: Tree) -> bytes:
+    """
+    Write the tree as a version 17 blob, laid out the way dtc does without padding options
+    """
+    body = bytearray()
+    strings = bytearray()
+    pack = struct.pack
+
+    def write(node: Node):
+        name = node.name.encode('utf-8', 'surrogateescape') + b'\0'
+        body.extend(pack('>I', FDT_BEGIN_NODE))
+        body.extend(name + b'\0' * (-len(name) % 4))
+        for prop in node.props:
+            if prop.deleted:
+                continue
+            value = bytes(prop.value)
+            body.extend(pack('>3I', FDT_PROP, len(value),
+                             _string_offset(strings, prop.name.encode('utf-8', 'surrogateescape'))))
+            body.extend(value + b'\0' * (-len(value) % 4))
+        for child in node.children:
+            if not child.deleted:
+                write(child)
+        body.extend(pack('>I', FDT_END_NODE))
+
+    write(tree.root)
+    body.extend(pack('>I', FDT_END))
+    reserve = b''.join(pack('>2Q', *i) for i in tree.reserve) + pack('>2Q', 0, 0)
+    off_reserve = HEADER_SIZE
+    off_struct = off_reserve + len(reserve)
+    off_strings = off_struct + len(body)
+    total = off_strings + len(strings)
+    header = pack('>10I', FDT_MAGIC, total, off_struct, off_strings, off_reserve, FDT_VERSION, FDT_LAST_COMP_VERSION,
+                  tree.boot_cpuid, len(strings), len(body))
+    return header + reserve + bytes(body) + bytes(strings)
+
+
+# ---- dts output ----
+
+def _format_value(value: bytes) -> str:
+    """
+    The value as dtc guesses its type from a dtb: strings, cells or bytes
+    """
+    length = len(value)
+    nul = value.count(0)
+    if value[-1] == 0 and nul <= length - nul and all(i in _STRING_CHARS for i in value):
+        out = []
+        for i in value[:-1]:
+            if i in _ESCAPES:
+                out.append(_ESCAPES[i])
+            elif i in _PRINTABLE:
+                out.append(chr(i))
+            else:
+                out.append(f'\\x{i:02x}')
+        return '"' + ''.join(out) + '"'
+    if length % 4 == 0:
+        return '<' + ' '.join(f'0x{i:02x}' for i in struct.unpack(f'>{length // 4}I', value)) + '>'
+    return '[' + ' '.join(f'{i:02x}' for i in value) + ']'
+
+
+def to_dts(tree: Tree) -> str:
+    """
+    The source text of the tree, the same text `dtc -I dtb -O dts` writes
+    """
+    out = ['/dts-v1/;\n\n']
+    for address, size in tree.reserve:
+        out.append(f'/memreserve/\t0x{address:016x} 0x{size:016x};\n')
+
+    def write(node: Node, level: int):
+        indent = '\t' * level
+        labels = ''.join(f'{i}: ' for i in node.labels)
+        out.append(f'{indent}{labels}{node.name or "/"} {{\n')
+        for prop in node.props:
+            if prop.deleted:
+                continue
+            if prop.value:
+                out.append(f'{indent}\t{prop.name} = {_format_value(bytes(prop.value))};\n')
+            else:
+                out.append(f'{indent}\t{prop.name};\n')
+        for child in node.children:
+            if not child.deleted:
+                out.append('\n')
+                write(child, level + 1)
+        out.append(f'{indent}}};\n')
+
+    write(tree.root, 0)
+    return ''.join(out)
+
+
+def dtb_to_dts(data: bytes) -> str:
+    """
+    dtb to dts text, the output of `dtc -@ -I dtb -O dts`
+    """
+    try:
+        return to_dts(parse_dtb(data))
+    except struct.error as e:
+        raise FdtError(f'Truncated dtb: {e}')
+
+
+# ---- dts input ----
+
+_NAME = re.compile(r'[a-zA-Z0-9,._+*#?@-]+')
+_LABEL = re.compile(r'([a-zA-Z_][a-zA-Z0-9_]*):(?![:])')
+_REF = re.compile(r'&(?:([a-zA-Z_][a-zA-Z0-9_]*)|\{([a-zA-Z0-9,._+*#?@/-]*)\})')
+_INTEGER = re.compile(r'(0[xX][0-9a-fA-F]+|[0-9]+)(?:[uU]?[lL]{0,2}|[lL]{1,2}[uU])(?![a-zA-Z0-9_])')
+_SPACE = re.compile(r'(?:\s+|//[^\n]*|/\*.*?\*/)+', re.S)
+_HEX_BYTE = re.compile(r'[0-9a-fA-F]{2}')
+_DIRECTIVE = re.compile(r'/[a-z-]+/')
+# Binary operators of cell expressions by precedence, lowest first
+_BINARY = [('||',), ('&&',), ('|',), ('^',), ('&',), ('==', '!='), ('<=', '>=', '<', '>'), ('<<', '>>'), ('+', '-'),
+           ('*', '/', '%')]
+
+
+class _Parser:
+    def __init__(self, text: str):
+        self.text = text
+        self.pos = 0
+
+    def error(self, message: str):
+        line = self.text.count('\n', 0, self.pos) + 1
+        raise FdtError(f'dts line {line}: {message}')
+
+    def skip(self):
+        if m := _SPACE.match(self.text, self.pos):
+            self.pos = m.end()
+
+    def peek(self, token: str) -> bool:
+        self.skip()
+        return self.text.startswith(token, self.pos)
+
+    def accept(self, token: str) -> bool:
+        if self.peek(token):
+            self.pos += len(token)
+            return True
+        return False
+
+    def expect(self, token: str):
+        if not self.accept(token):
+            self.error(f'expected "{token}"')
+
+    def match(self, pattern: re.Pattern):
+        self.skip()
+        if m := pattern.match(self.text, self.pos):
+            self.pos = m.end()
+        return m
+
+    def labels(self) -> list[str]:
+        found = []
+        while m := self.match(_LABEL):
+            found.append(m.group(1))
+        return found
+
+    def ref(self) -> str | None:
+        if m := self.match(_REF):
+            return m.group(1) if m.group(1) is not None else m.group(2)
+        return None
+
+    def directive(self) -> str | None:
+        self.skip()
+        m = _DIRECTIVE.match(self.text, self.pos)
+        return m.group() if m else None
+
+    # Integers
+
+    def char_literal(self) -> int:
+        end = self.pos + 1
+        while end < len(self.text) and self.text[end] != "'":
+            end += 2 if self.text[end] == '\\' else 1
+        value = _unescape(self.text[self.pos + 1:end])
+        self.pos = end + 1
+        if len(value) != 1:
+            self.error('bad character literal')
+        return value[0]
+
+    def primary(self) -> int:
+        self.skip()
+        if self.accept('('):
+            value = self.expression()
+            self.expect(')')
+            return value
+        if self.text.startswith("'", self.pos):
+            return self.char_literal()
+        if m := self.match(_INTEGER):
+            digits = m.group(1)
+            try:
+                value = int(digits, 16 if digits[:2] in ('0x', '0X') else 8 if digits[0] == '0' else 10)
+            except ValueError:
+                self.error(f'bad integer {digits}')
+            if value > _MASK64:
+                self.error('integer literal too large')
+            return value
+        self.error('expected an integer')
+
+    def unary(self) -> int:
+        for op, func in (('-', lambda x: -x), ('~', lambda x: ~x), ('!', lambda x: int(not x))):
+            if self.peek(op):
+                self.pos += 1
+                return func(self.unary()) & _MASK64
+        return self.primary()
+
+    def binary(self, level: int = 0) -> int:
+        if level == len(_BINARY):
+            return self.unary()
+        value = self.binary(level + 1)
+        while True:
+            self.skip()
+            op = next((i for i in _BINARY[level] if self.text.startswith(i, self.pos) and
+                       not (i in ('|', '&') and self.text.startswith(i * 2, self.pos)) and
+                       not (i in ('<', '>') and self.text.startswith(i * 2, self.pos))), None)
+            if op is None:
+                return value
+            self.pos += len(op)
+            right = self.binary(level + 1)
+            if op in ('/', '%') and not right:
+                self.error('division by zero')
+            value = {
+                '||': lambda a, b: int(bool(a or b)), '&&': lambda a, b: int(bool(a and b)),
+                '|': lambda a, b: a | b, '^': lambda a, b: a ^ b, '&': lambda a, b: a & b,
+                '==': lambda a, b: int(a == b), '!=': lambda a, b: int(a != b),
+                '<': lambda a, b: int(a < b), '>': lambda a, b: int(a > b),
+                '<=': lambda a, b: int(a <= b), '>=': lambda a, b: int(a >= b),
+                '<<': lambda a, b: a << (b & 63), '>>': lambda a, b: a >> (b & 63),
+                '+': lambda a, b: a + b, '-': lambda a, b: a - b,
+                '*': lambda a, b: a * b, '/': lambda a, b: a // b, '%': lambda a, b: a % b,
+            }[op](value, right) & _MASK64
+
+    def expression(self) -> int:
+        value = self.binary()
+        if self.accept('?'):
+            true = self.expression()
+            self.expect(':')
+            false = self.expression()
+            return true if value else false
+        return value
+
+    # Values
+
+    def cells(self, prop: Prop, bits: int):
+        mask = (1 << bits) - 1
+        fmt = {8: '>B', 16: '>H', 32: '>I', 64: '>Q'}[bits]
+        while True:
+            self.labels()
+            if self.accept('>'):
+                return
+            if (ref := self.ref()) is not None:
+                if bits != 32:
+                    self.error('references are only allowed in 32-bit cells')
+                prop.markers.append([len(prop.value), REF_PHANDLE, ref])
+                prop.value += b'\xff\xff\xff\xff'
+                continue
+            value = self.primary()
+            if value > mask and (value | mask) != _MASK64:
+                self.error(f'value out of range for {bits}-bit cell')
+            prop.value += struct.pack(fmt, value & mask)
+
+    def prop_value(self, prop: Prop):
+        while True:
+            self.labels()
+            self.skip()
+            if self.text.startswith('"', self.pos):
+                prop.value += self.string() + b'\0'
+            elif self.accept('<'):
+                self.cells(prop, 32)
+            elif self.accept('/bits/'):
+                bits = self.primary()
+                if bits not in (8, 16, 32, 64):
+                    self.error(f'bad /bits/ size {bits}')
+                self.expect('<')
+                self.cells(prop, bits)
+            elif self.accept('['):
+                while not self.accept(']'):
+                    self.labels()
+                    if not (m := self.match(_HEX_BYTE)):
+                        self.error('bad byte string')
+                    prop.value.append(int(m.group(), 16))
+            elif (ref := self.ref()) is not None:
+                prop.markers.append([len(prop.value), REF_PATH, ref])
+            else:
+                self.error(f'unsupported property value {self.text[self.pos:self.pos + 16]!r}')
+            self.labels()
+            if not self.accept(','):
+                return
+
+    def string(self) -> bytes:
+        end = self.pos + 1
+        while end < len(self.text) and self.text[end] != '"':
+            end += 2 if self.text[end] == '\\' else 1
+        if end >= len(self.text):
+            self.error('unterminated string')
+        value = _unescape(self.text[self.pos + 1:end])
+        self.pos = end + 1
+        return value
+
+    # Nodes
+
+    def node_body(self, node: Node) -> Node:
+        self.expect('{')
+        while not self.accept('}'):
+            if node.children and (self.peek('/delete-property/') or not self.peek('/') and self._is_prop()):
+                self.error('properties must precede subnodes')
+            if self.accept('/delete-property/'):
+                name = self.name()
+                self.expect(';')
+                node.props.append(Prop(name, deleted=True))
+                continue
+            if self.accept('/delete-node/'):
+                name = self.name()
+                self.expect(';')
+                node.children.append(Node(name, deleted=True))
+                node.children[-1].parent = node
+                continue
+            if (directive := self.directive()) is not None:
+                self.error(f'unsupported {directive}')
+            labels = self.labels()
+            name = self.name()
+            if self.peek('{'):
+                if any(i.name == name and not i.deleted for i in node.children):
+                    self.error(f'duplicate node name {name}')
+                child = node.add_child(self.node_body(Node(name)))
+                for i in reversed(labels):
+                    child.add_label(i)
+            else:
+                if any(i.name == name and not i.deleted for i in node.props):
+                    self.error(f'duplicate property name {name}')
+                prop = Prop(name)
+                if self.accept('='):
+                    self.prop_value(prop)
+                node.props.append(prop)
+            self.expect(';')
+        return node
+
+    def _is_prop(self) -> bool:
+        pos = self.pos
+        self.labels()
+        self.match(_NAME)
+        prop = not self.peek('{')
+        self.pos = pos
+        return prop
+
+    def name(self) -> str:
+        if not (m := self.match(_NAME)):
+            self.error('expected a name')
+        return m.group()
+
+    def parse(self) -> Tree:
+        tree = Tree()
+        tree.root = None
+        fragments = 0
+        if not self.accept('/dts-v1/'):
+            self.error('missing /dts-v1/')
+        self.expect(';')
+        while self.accept('/dts-v1/'):
+            self.expect(';')
+        if self.accept('/plugin/'):
+            self.expect(';')
+            tree.plugin = True
+        while True:
+            self.labels()
+            if not self.accept('/memreserve/'):
+                break
+            address, size = self.primary(), self.primary()
+            self.expect(';')
+            tree.reserve.append((address, size))
+        while True:
+            self.skip()
+            if self.pos >= len(self.text):
+                break
+            labels = self.labels()
+            if (directive := self.directive()) not in (None, '/delete-node/'):
+                self.error(f'unsupported {directive}')
+            if self.accept('/delete-node/'):
+                if (ref := self.ref()) is None:
+                    self.error('expected a reference')
+                self.expect(';')
+                if tree.root and (target := get_node_by_ref(tree.root, ref)):
+                    _delete_node(target)
+                else:
+                    self.error(f'label or path {ref} not found')
+                continue
+            if self.accept('/'):
+                new = self.node_body(Node())
+                self.expect(';')
+                for i in reversed(labels):
+                    new.add_label(i)
+                if tree.root is None:
+                    tree.root = new
+                else:
+                    merge_nodes(tree.root, new)
+                continue
+            if (ref := self.ref()) is not None:
+                new = self.node_body(Node())
+                self.expect(';')
+                if tree.root is None:
+                    tree.root = Node()
+                if tree.plugin and not labels:
+                    _add_orphan(tree.root, new, ref, fragments)
+                    fragments += 1
+                elif target := get_node_by_ref(tree.root, ref):
+                    for i in reversed(labels):
+                        new.add_label(i)
+                    merge_nodes(target, new)
+                else:
+                    self.error(f'label or path {ref} not found')
+                continue
+            self.error(f'unexpected {self.text[self.pos:self.pos + 16]!r}')
+        if tree.root is None:
+            self.error('no root node')
+        return tree
+
+
+def _unescape(text: str) -> bytes:
+    out = bytearray()
+    data = text.encode('utf-8', 'surrogateescape')
+    i = 0
+    while i < len(data):
+        c = data[i]
+        i += 1
+        if c != 0x5c or i >= len(data):
+            out.append(c)
+            continue
+        c = chr(data[i])
+        i += 1
+        if c in _CHAR_ESCAPES:
+            out.append(_CHAR_ESCAPES[c])
+        elif c in '01234567':
+            j = i
+            while j < len(data) and j < i + 2 and chr(data[j]) in '01234567':
+                j += 1
+            out.append(int(data[i - 1:j], 8) & 0xff)
+            i = j
+        elif c == 'x' and i < len(data) and chr(data[i]) in '0123456789abcdefABCDEF':
+            j = i + 1 if i + 1 < len(data) and chr(data[i + 1]) in '0123456789abcdefABCDEF' else i
+            out.append(int(data[i:j + 1], 16))
+            i = j + 1
+        else:
+            out.append(ord(c))
+    return bytes(out)
+
+
+# ---- tree operations, the same as dtc's livetree ----
+
+def merge_nodes(old: Node, new: Node):
+    for i in reversed(new.labels):
+        old.add_label(i)
+    for prop in new.props:
+        if prop.deleted:
+            for i in old.props:
+                if i.name == prop.name:
+                    i.deleted = True
+            continue
+        if same := next((i for i in old.props if i.name == prop.name), None):
+            same.value, same.markers, same.deleted = prop.value, prop.markers, False
+        else:
+            old.props.append(prop)
+    for child in new.children:
+        if child.deleted:
+            if same := old.child(child.name):
+                _delete_node(same)
+            continue
+        if same := next((i for i in old.children if i.name == child.name), None):
+            same.deleted = False
+            merge_nodes(same, child)
+        else:
+            old.add_child(child)
+
+
+def _delete_node(node: Node):
+    node.deleted = True
+    node.labels.clear()
+    for i in node.props:
+        i.deleted = True
+    for i in node.children:
+        _delete_node(i)
+
+
+def _add_orphan(root: Node, new: Node, ref: str, index: int):
+    if ref.startswith('/'):
+        target = Prop('target-path', ref.encode() + b'\0')
+    else:
+        target = Prop('target', b'\xff\xff\xff\xff', [[0, REF_PHANDLE, ref]])
+    new.name = '__overlay__'
+    fragment = Node(f'fragment@{index}')
+    fragment.props.append(target)
+    fragment.add_child(new)
+    root.add_child(fragment)
+
+
+def _fill_paths(node: Node, prefix: str = ''):
+    node.path = prefix.rstrip('/') + '/' + node.name
+    for i in node.children:
+        _fill_paths(i, node.path)
+
+
+def get_node_by_path(root: Node, path: str) -> Node | None:
+    node = root
+    for part in path.strip('/').split('/') if path.strip('/') else []:
+        if (node := node.child(part)) is None:
+            return None
+    return None if node.deleted else node
+
+
+def get_node_by_ref(root: Node, ref: str) -> Node | None:
+    if ref.startswith('/'):
+        return get_node_by_path(root, ref)
+    return next((i for i in root.walk() if ref in i.labels), None)
+
+
+def _node_phandle(root: Node, node: Node, counter: list) -> int:
+    if node.phandle not in (0, 0xffffffff):
+        return node.phandle
+    used = {i.phandle for i in root.walk()}
+    while counter[0] in used:
+        counter[0] += 1
+    node.phandle = counter[0]
+    if not node.prop('phandle'):
+        node.props.append(Prop('phandle', struct.pack('>I', node.phandle)))
+    return node.phandle
+
+
+def _markers(root: Node, kind: int):
+    for node in root.walk():
+        for prop in node.props:
+            if prop.deleted:
+                continue
+            for marker in prop.markers:
+                if marker[1] == kind:
+                    yield node, prop, marker
+
+
+def resolve(tree: Tree, symbols: bool = True):
+    """
+    Fill in references and generate __symbols__, __fixups__ and __local_fixups__, the way `dtc -@` does
+    """
+    root = tree.root
+    _fill_paths(root)
+    for node in root.walk():
+        for name in ('linux,phandle', 'phandle'):
+            if (prop := node.prop(name)) and len(prop.value) == 4 and not prop.markers:
+                node.phandle = struct.unpack('>I', prop.value)[0]
+    counter = [1]
+    for node, prop, marker in list(_markers(root, REF_PHANDLE)):
+        if (target := get_node_by_ref(root, marker[2])) is None:
+            if not tree.plugin:
+                raise FdtError(f'Reference to non-existent node or label "{marker[2]}"')
+            continue
+        prop.value[marker[0]:marker[0] + 4] = struct.pack('>I', _node_phandle(root, target, counter))
+    for node, prop, marker in list(_markers(root, REF_PATH)):
+        if (target := get_node_by_ref(root, marker[2])) is None:
+            raise FdtError(f'Reference to non-existent node or label "{marker[2]}"')
+        path = target.path.encode() + b'\0'
+        offset = marker[0]
+        prop.value[offset:offset] = path
+        for i in prop.markers[prop.markers.index(marker) + 1:]:
+            i[0] += len(path)
+        # The marker is done, later passes must not see it as a path again
+        marker[1] = None
+    if symbols and any(i.labels for i in root.walk()):
+        table = root.child('__symbols__') or root.add_child(Node('__symbols__'))
+        for node in list(root.walk()):
+            if not node.labels:
+                continue
+            for label in node.labels:
+                if not table.prop(label):
+                    table.props.append(Prop(label, node.path.encode() + b'\0'))
+            _node_phandle(root, node, counter)
+    if not tree.plugin:
+        return
+    unresolved = [(n, p, m) for n, p, m in _markers(root, REF_PHANDLE) if get_node_by_ref(root, m[2]) is None]
+    if unresolved:
+        table = root.child('__fixups__') or root.add_child(Node('__fixups__'))
+        for node, prop, marker in unresolved:
+            table.append_to_prop(marker[2], f'{node.path}:{prop.name}:{marker[0]}'.encode() + b'\0')
+    local = [(n, p, m) for n, p, m in _markers(root, REF_PHANDLE) if get_node_by_ref(root, m[2]) is not None]
+    if local:
+        table = root.child('__local_fixups__') or root.add_child(Node('__local_fixups__'))
+        for node, prop, marker in local:
+            parts = []
+            walk = node
+            while walk.parent is not None:
+                parts.append(walk.name)
+                walk = walk.parent
+            target = table
+            for part in reversed(parts):
+                target = target.child(part) or target.add_child(Node(part))
+            target.append_to_prop(prop.name, struct.pack('>I', marker[0]))
+
+
+def parse_dts(text: str) -> Tree:
+    return _Parser(text).parse()
+
+
+def dts_to_dtb(text: str) -> bytes:
+    """
+    dts text to dtb, the output of `dtc -@ -I dts -O dtb`
+    """
+    tree = parse_dts(text)
+    resolve(tree)
+    return to_dtb(tree)
+
+
+def _map(func, items: list, workers: int = None) -> list:
+    def run(item):
+        try:
+            return func(item)
+        except FdtError as e:
+            logging.warning(f'{func.__name__}: {e}')
+            return None
+
+    return jobs.parallel(run, items, workers=workers)
+
+
+def decompile_all(blobs: list, workers: int = None) -> list:
+    """
+    Decompile many overlays at the same time
+    :return: the dts texts, None where the blob could not be decompiled
+    """
+    return _map(dtb_to_dts, blobs, workers)
+
+
+def compile_all(texts: list, workers: int = None) -> list:
+    """
+    Compile many overlays at the same time
+    :return: the dtbs, None where the source needs dtc
+    """
+    return _map(dts_to_dtb, texts, workers)
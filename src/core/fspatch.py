@@ -18,7 +18,6 @@
 Patch Fs_Config To Add Missing File Config
 """
 import os
-from collections import deque
 
 
 def scanfs(file: str) -> dict:
@@ -82,18 +81,19 @@ def islink(file) -> str:
     return ''
 
 
-def fs_patch(fs_file, dir_path) -> tuple:  # 接收两个字典对比
+def fs_patch(fs_file, dir_path, paths=None) -> tuple:  # 接收两个字典对比
     """
     Patch fs_file, Add Missing File Config
     :param fs_file:
     :param dir_path:
+    :param paths: entries of dir_path in the form of scan_dir, scanned here if None
     :return:
     """
     new_fs = {}
     new_add = 0
-    r_fs = deque()
+    r_fs = set()
     print(f"FsPatcher: The original file has {len(fs_file.keys()):d} entries")
-    for i in scan_dir(os.path.abspath(dir_path)):
+    for i in scan_dir(os.path.abspath(dir_path)) if paths is None else paths:
         if not i.isprintable():
             tmp = ''
             for c in i:
@@ -147,7 +147,7 @@ def fs_patch(fs_file, dir_path) -> tuple:  # 接收两个字典对比
             else:
                 config = ['0', '0', '0644']
             print(f'Add [{i}{config}]')
-            r_fs.append(i)
+            r_fs.add(i)
             new_add += 1
             new_fs[i] = config
     return new_fs, new_add
@@ -16,9 +16,10 @@ import logging
 import os
 import re
 import struct
+from contextlib import nullcontext
 from .posix import symlink
 from timeit import default_timer as dti
-from . import ext4
+from . import ext4, jobs, progress, trace
 from .utils import simg2img
 
 
@@ -32,6 +33,7 @@ class Extractor:
         self.fs_config = []
         self.space = []
         self.error_times = 0
+        self.tracker = None
 
     @staticmethod
     def __out_name(file_path, out=1):
@@ -100,6 +102,8 @@ class Extractor:
         for entry_name, entry_inode_idx, entry_type in root_inode.open_dir():
             if entry_name in ['.', '..'] or entry_name.endswith(' (2)'):
                 continue
+            jobs.check_cancelled()
+            self.tracker.update(items=1)
             if self.error_times >= 200:
                 print("Some thing wrong,Stop!")
                 break
@@ -162,7 +166,7 @@ class Extractor:
                     os.makedirs(file_target_dirname, exist_ok=True)
                 try:
                     with open(file_target, 'wb') as out:
-                        out.write(entry_inode.open_read().read())
+                        entry_inode.extract_to(out)
                 except Exception and BaseException as e:
                     logging.exception('Ext4Extractor')
                     print(f'[E] Cannot Write to {file_target}, Reason: {e}')
@@ -191,7 +195,12 @@ class Extractor:
         self.__write(os.path.getsize(self.OUTPUT_IMAGE_FILE), self.CONFIG_DIR + os.sep + self.FileName + '_size.txt')
         with open(self.OUTPUT_IMAGE_FILE, 'rb') as file:
             dir_r = self.FileName
-            self.scan_dir(ext4.Volume(file).root)
+            volume = ext4.Volume(file)
+            sb = volume.superblock
+            with progress.Progress(f'ext4 {self.FileName}', items_total=sb.s_inodes_count - sb.s_free_inodes_count) \
+                    as self.tracker, trace.span(f'ext4 {self.FileName}', 'io') as s:
+                self.scan_dir(volume.root)
+                s.set(files=self.tracker.items_done)
             self.fs_config.insert(0, '/ 0 2000 0755' if dir_r == 'vendor' else '/ 0 0 0755')
             self.fs_config.insert(1, f'{dir_r} 0 2000 0755' if dir_r == 'vendor' else '/lost+found 0 0 0700')
             self.fs_config.insert(2 if dir_r == 'system' else 1, f'{dir_r} 0 0 0755')
@@ -294,5 +303,7 @@ class Extractor:
             self.fix_size()
             print(f"Extracting {os.path.basename(target)} --> {os.path.basename(self.EXTRACT_DIR)}")
             start = dti()
-            self.__ext4extractor()
+            # A cancelled extraction leaves no half filled folder, a folder that was there before is kept
+            with jobs.partial(self.EXTRACT_DIR) if not os.path.exists(self.EXTRACT_DIR) else nullcontext():
+                self.__ext4extractor()
             print(f"Done! [{dti() - start}]")
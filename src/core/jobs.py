@@ -0,0 +1,481 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+Background jobs.
+Work runs in bounded pools instead of a new thread per task:
+    cpu: parsing and compression, one worker per core by default
+    io: unpacking, packing and scanning, a few workers so the disk is not thrashed
+    thread: a dedicated thread, for dialogs and loops that live as long as the app
+Queued jobs start by priority, interactive jobs (refreshes) go before bulk ones (pack, unpack) and one worker
+of each pool is kept free of bulk jobs. parallel() spreads the items of a job over a pool, e.g. the images of
+a conversion over the cpu pool. Every job is kept in a registry and can be cancelled, long loops call
+check_cancelled() and partial() removes the half written output of a cancelled job.
+share() publishes the registry to a folder, so the command line of another process can list and cancel the jobs.
+"""
+import atexit
+import contextlib
+import functools
+import heapq
+import itertools
+import json
+import logging
+import os
+import shutil
+import threading
+import time
+from enum import IntEnum
+
+from . import trace
+
+HISTORY = 200
+# Shared registries are written at least this often, older ones belong to processes that are gone
+HEARTBEAT = 5
+# Interactive jobs may start on extra threads when their pool is busy.
+OVERFLOW = 2
+
+
+class Priority(IntEnum):
+    INTERACTIVE = 0
+    NORMAL = 1
+    BULK = 2
+
+
+class JobCancelled(BaseException):
+    """
+    Raised in a job that was cancelled, a BaseException so `except Exception` blocks let it through
+    """
+
+
+class Job:
+    def __init__(self, func, args: tuple, pool: str, priority: Priority, name: str, daemon: bool = True,
+                 traced: bool = False):
+        self.id = next(_ids)
+        self.func = func
+        self.args = args
+        self.pool = pool
+        self.priority = Priority(priority)
+        self.name = name
+        self.daemon = daemon
+        self.traced = traced
+        self.state = 'queued'
+        self.error = None
+        self.submitted = time.time()
+        self.started = None
+        self.finished = None
+        self.partials = []
+        self._cancel = threading.Event()
+        self._done = threading.Event()
+
+    @property
+    def cancelled(self) -> bool:
+        return self._cancel.is_set()
+
+    def cancel(self):
+        self._cancel.set()
+
+    def wait(self, timeout: float = None) -> bool:
+        return self._done.wait(timeout)
+
+    def info(self) -> dict:
+        end = self.finished or time.time()
+        return {'id': self.id, 'name': self.name, 'pool': self.pool, 'priority': self.priority.name.lower(),
+                'state': self.state, 'error': self.error, 'traced': self.traced,
+                'elapsed': round(end - self.started, 3) if self.started else 0}
+
+    def run(self):
+        self.state = 'running'
+        self.started = time.time()
+        _local.job = self
+        trace.trace_thread(self)
+        try:
+            # Cancelled while queued
+            check_cancelled()
+            with trace.span(self.name, 'job', pool=self.pool, priority=self.priority.name.lower(),
+                            queued_ms=round((self.started - self.submitted) * 1000, 3)):
+                self.func(*self.args)
+            self.state = 'done'
+        except JobCancelled:
+            self.state = 'cancelled'
+            for path in reversed(self.partials):
+                _remove(path)
+            print(f"Cancelled: {self.name}")
+        except (Exception, BaseException) as e:
+            self.state = 'failed'
+            self.error = str(e)
+            logging.exception(f'job {self.name}')
+        finally:
+            _local.job = None
+            trace.trace_thread(False)
+            self.partials.clear()
+            self.finished = time.time()
+            self._done.set()
+            _registry.finish(self)
+
+
+class Pool:
+    def __init__(self, name: str, limit: int):
+        self.name = name
+        self.limit = max(1, limit)
+        self.queue = []
+        self.workers = 0
+        self.idle = 0
+        self.busy = 0
+        self.overflow = 0
+        self.cond = threading.Condition()
+
+    def set_limit(self, limit: int):
+        with self.cond:
+            self.limit = max(1, limit)
+            self._grow()
+            self.cond.notify_all()
+
+    def _grow(self):
+        # idle only counts workers that are waiting, one that was just started is not yet
+        while len(self.queue) > self.idle and self.workers < self.limit:
+            self.workers += 1
+            threading.Thread(target=self._worker, name=f'{self.name}-{self.workers}', daemon=True).start()
+
+    def submit(self, job: Job):
+        with self.cond:
+            if job.priority == Priority.INTERACTIVE and not self.idle and self.workers >= self.limit and \
+                    self.overflow < OVERFLOW:
+                self.overflow += 1
+                threading.Thread(target=self._overflow, args=(job,), daemon=True).start()
+                return
+            heapq.heappush(self.queue, (job.priority, job.id, job))
+            self._grow()
+            self.cond.notify_all()
+
+    def _overflow(self, job: Job):
+        try:
+            job.run()
+        finally:
+            with self.cond:
+                self.overflow -= 1
+
+    def _runnable(self) -> bool:
+        if not self.queue:
+            return False
+        # Keep a worker for interactive and normal jobs
+        return self.queue[0][0] != Priority.BULK or self.limit == 1 or self.busy < self.limit - 1
+
+    def _worker(self):
+        while True:
+            with self.cond:
+                while not self._runnable() or self.workers > self.limit:
+                    if self.workers > self.limit:
+                        self.workers -= 1
+                        return
+                    self.idle += 1
+                    self.cond.wait()
+                    self.idle -= 1
+                _, _, job = heapq.heappop(self.queue)
+                self.busy += 1
+            try:
+                job.run()
+            finally:
+                with self.cond:
+                    self.busy -= 1
+                    self.cond.notify_all()
+
+
+class Registry:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.active = {}
+        self.history = []
+
+    def add(self, job: Job):
+        with self.lock:
+            self.active[job.id] = job
+
+    def finish(self, job: Job):
+        with self.lock:
+            self.active.pop(job.id, None)
+            self.history.append(job)
+            del self.history[:-HISTORY]
+
+    def get(self, job_id: int) -> Job | None:
+        with self.lock:
+            return self.active.get(job_id) or next((i for i in self.history if i.id == job_id), None)
+
+    def list(self, finished: bool = False) -> list[Job]:
+        with self.lock:
+            return (self.history if finished else []) + list(self.active.values())
+
+
+_ids = itertools.count(1)
+_local = threading.local()
+_registry = Registry()
+pools = {
+    'cpu': Pool('cpu', os.cpu_count() or 2),
+    'io': Pool('io', 4),
+}
+
+
+def _remove(path: str):
+    try:
+        if os.path.isdir(path) and not os.path.islink(path):
+            shutil.rmtree(path)
+        elif os.path.lexists(path):
+            os.remove(path)
+    except OSError:
+        logging.exception(f'Remove {path}')
+
+
+def submit(func, *args, pool: str = 'io', priority: Priority = Priority.NORMAL, name: str = None,
+           daemon: bool = True, traced: bool = False) -> Job:
+    """
+    Run func(*args) in the background
+    :param func:
+    :param args:
+    :param pool: cpu, io or thread
+    :param priority:
+    :param name: shown in the job list, the name of func by default
+    :param daemon: only for the thread pool
+    :param traced: record the trace spans of this job even if tracing is off
+    :return: the job
+    """
+    job = Job(func, args, pool, priority, name or getattr(func, '__qualname__', repr(func)), daemon, traced)
+    _registry.add(job)
+    if pool == 'thread':
+        threading.Thread(target=job.run, daemon=daemon, name=job.name).start()
+    else:
+        pools[pool].submit(job)
+    return job
+
+
+def set_limits(cpu: int = None, io: int = None):
+    """
+    Change the size of the pools, 0 or None keeps the current size
+    """
+    for name, limit in ('cpu', cpu), ('io', io):
+        if limit:
+            pools[name].set_limit(limit)
+
+
+def list_jobs(finished: bool = False) -> list[dict]:
+    return [i.info() for i in _registry.list(finished)]
+
+
+def cancel(job_id: int) -> bool:
+    if (job := _registry.get(job_id)) is None or job.finished:
+        return False
+    job.cancel()
+    return True
+
+
+def set_traced(job_id: int, on: bool) -> bool:
+    """
+    Switch the tracing of a queued or running job, a running job records its spans from the next one on
+    """
+    if (job := _registry.get(job_id)) is None or job.finished:
+        return False
+    job.traced = on
+    return True
+
+
+def share(folder: str, interval: float = 1.0):
+    """
+    Publish the jobs of this process to folder/PID.json, the ids written to folder/PID.cancel are cancelled
+    """
+    state = os.path.join(folder, f'{os.getpid()}.json')
+    requests = os.path.join(folder, f'{os.getpid()}.cancel')
+
+    def loop():
+        last = None
+        written = 0
+        while True:
+            try:
+                if os.path.exists(requests):
+                    taken = f'{requests}.taken'
+                    os.replace(requests, taken)
+                    with open(taken, 'r', encoding='utf-8') as f:
+                        ids = [int(i) for i in f.read().split() if i.isdigit()]
+                    os.remove(taken)
+                    for i in ids:
+                        cancel(i)
+                data = json.dumps(list_jobs(finished=True))
+                if data != last or time.time() - written > HEARTBEAT:
+                    os.makedirs(folder, exist_ok=True)
+                    with open(f'{state}.tmp', 'w', encoding='utf-8') as f:
+                        f.write(data)
+                    os.replace(f'{state}.tmp', state)
+                    last = data
+                    written = time.time()
+            except (OSError, ValueError):
+                logging.exception('Share jobs')
+            time.sleep(interval)
+
+    threading.Thread(target=loop, name='jobs-share', daemon=True).start()
+    atexit.register(_remove, state)
+
+
+def shared_jobs(folder: str) -> dict[int, list[dict]]:
+    """
+    Jobs of the other processes that share them
+    :return: {pid: jobs}
+    """
+    result = {}
+    if not os.path.isdir(folder):
+        return result
+    for name in os.listdir(folder):
+        pid, ext = os.path.splitext(name)
+        if ext != '.json' or not pid.isdigit() or int(pid) == os.getpid():
+            continue
+        path = os.path.join(folder, name)
+        try:
+            if time.time() - os.path.getmtime(path) > HEARTBEAT * 3:
+                continue
+            with open(path, 'r', encoding='utf-8') as f:
+                result[int(pid)] = json.load(f)
+        except (OSError, ValueError):
+            continue
+    return result
+
+
+def request_cancel(folder: str, pid: int, job_id: int) -> bool:
+    """
+    Ask another process to cancel one of its jobs
+    :return: whether the job is queued or running there
+    """
+    if not any(i['id'] == job_id and i['state'] in ('queued', 'running')
+               for i in shared_jobs(folder).get(pid, [])):
+        return False
+    with open(os.path.join(folder, f'{pid}.cancel'), 'a', encoding='utf-8') as f:
+        f.write(f'{job_id}\n')
+    return True
+
+
+def current() -> Job | None:
+    """
+    The job running in this thread
+    """
+    return getattr(_local, 'job', None)
+
+
+@contextlib.contextmanager
+def bound(job: Job | None):
+    """
+    Run the block as part of job in this thread, so cancelling and partial outputs of the job also work in
+    the threads of an executor it uses
+    """
+    previous = getattr(_local, 'job', None)
+    _local.job = job
+    trace.trace_thread(job or False)
+    try:
+        yield
+    finally:
+        _local.job = previous
+        trace.trace_thread(previous or False)
+
+
+def carry(func):
+    """
+    func bound to the job of the calling thread, for work handed to other threads
+    """
+    job = current()
+
+    @functools.wraps(func)
+    def wrapper(*args, **kwargs):
+        with bound(job):
+            return func(*args, **kwargs)
+
+    return wrapper
+
+
+def parallel(func, items, pool: str = 'cpu', workers: int = None) -> list:
+    """
+    func(item) for every item on the workers of pool, as part of the job of the calling thread.
+    The calling thread takes items too and never waits for a worker that has not started, so a parallel
+    inside a job of the same pool cannot wait forever.
+    :param func:
+    :param items:
+    :param pool: cpu or io
+    :param workers: at most this many items at the same time, the limit of the pool by default
+    :return: the results in the order of items, the first error is raised once the running items are done
+    """
+    items = list(items)
+    parent = current()
+    func = carry(func)
+    results = [None] * len(items)
+    errors = []
+    cond = threading.Condition()
+    taken = done = 0
+
+    def drain():
+        nonlocal taken, done
+        while True:
+            with cond:
+                if taken >= len(items) or errors:
+                    return
+                index = taken
+                taken += 1
+            try:
+                results[index] = func(items[index])
+            except (Exception, BaseException) as e:
+                errors.append(e)
+            finally:
+                with cond:
+                    done += 1
+                    cond.notify_all()
+
+    helpers = min(workers or pools[pool].limit, len(items)) - 1
+    for _ in range(max(helpers, 0)):
+        submit(drain, pool=pool, priority=parent.priority if parent else Priority.NORMAL,
+               name=f'{parent.name if parent else getattr(func, "__qualname__", "parallel")} (worker)')
+    drain()
+    with cond:
+        cond.wait_for(lambda: done == taken)
+    if errors:
+        raise errors[0]
+    return results
+
+
+def cancel_requested() -> bool:
+    """
+    Whether the job of this thread was cancelled, for loops that have to stop at a safe point
+    """
+    job = getattr(_local, 'job', None)
+    return job is not None and job._cancel.is_set()
+
+
+def check_cancelled():
+    """
+    Raise JobCancelled if the job of this thread was cancelled, cheap enough for inner loops
+    """
+    job = getattr(_local, 'job', None)
+    if job is not None and job._cancel.is_set():
+        raise JobCancelled
+
+
+@contextlib.contextmanager
+def partial(path: str):
+    """
+    Mark path as being written, it is removed if the job is cancelled before the block ends
+    """
+    job = current()
+    if job is None:
+        yield
+        return
+    job.partials.append(path)
+    cancelled = False
+    try:
+        yield
+    except JobCancelled:
+        cancelled = True
+        raise
+    finally:
+        if not cancelled:
+            job.partials.remove(path)
@@ -0,0 +1,385 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+Edit the logical partitions of an existing super image in place.
+A partition is written into its own extents when the new image fits, otherwise it grows into free space
+and all metadata slots are rewritten with fresh checksums. Only the partition data and the metadata are written,
+the other partitions are not touched.
+Usage:
+    with SuperImage('super.img') as s:
+        s.replace('system_a', 'system.img')
+"""
+import argparse
+import os
+import struct
+from hashlib import sha256
+
+from . import blockdev
+from .lpunpack import (LP_METADATA_HEADER_MAGIC, LP_SECTOR_SIZE, LP_TARGET_TYPE_LINEAR, LpMetadataExtent,
+                       LpMetadataPartition, LpUnpackError, read_metadata)
+from .sparse_img import SparseWriter
+
+COPY_CHUNK = 16 * 1024 * 1024
+
+
+class LpEditError(Exception):
+    ...
+
+
+class SuperImage:
+    def __init__(self, path: str):
+        self.path = path
+        self.device = blockdev.open_image(path)
+        self.sparse = isinstance(self.device, blockdev.SparseDevice)
+        try:
+            self.metadata = read_metadata(self.device.open())
+        except LpUnpackError as e:
+            raise LpEditError(e.message)
+        self.geometry = self.metadata.geometry
+        self.block_device = self.metadata.block_devices[0]
+        self.header_raw, tables = self._read_raw()
+        header = self.metadata.header
+        self.groups_raw = tables[header.groups.offset:
+                                 header.groups.offset + header.groups.num_entries * header.groups.entry_size]
+        self.block_devices_raw = tables[header.block_devices.offset:
+                                        header.block_devices.offset +
+                                        header.block_devices.num_entries * header.block_devices.entry_size]
+        # name: [[num_sectors, target_type, target_data, target_source]]
+        self.extents = {}
+        for p in self.metadata.partitions:
+            self.extents[p.name] = [
+                [e.num_sectors, e.target_type, e.target_data, e.target_source] for e in
+                self.metadata.extents[p.first_extent_index:p.first_extent_index + p.num_extents]]
+        # (offset, length, read(offset, size)), applied by commit()
+        self.patches = []
+        self._sources = []
+        self.dirty = False
+
+    def _read_raw(self) -> tuple[bytes, bytes]:
+        """
+        The raw header and tables of slot 0, the backup is used when the primary copy is broken
+        """
+        for offset in self.metadata.get_offsets(0):
+            head = self.device.pread(offset, 12)
+            magic, _, _, header_size = struct.unpack('<I2HI', head)
+            if magic != LP_METADATA_HEADER_MAGIC:
+                continue
+            header_raw = self.device.pread(offset, header_size)
+            tables = self.device.pread(offset + header_size, self.metadata.header.tables_size)
+            if sha256(tables).digest() != self.metadata.header.tables_checksum:
+                continue
+            return header_raw, tables
+        raise LpEditError("No valid copy of the metadata found!")
+
+    @property
+    def partitions(self) -> list:
+        return [i.name for i in self.metadata.partitions]
+
+    def _require(self, name: str):
+        if name not in self.extents:
+            raise LpEditError(f"{name} not found, available: {' '.join(self.partitions)}")
+
+    def partition_size(self, name: str) -> int:
+        self._require(name)
+        return sum(i[0] for i in self.extents[name]) * LP_SECTOR_SIZE
+
+    @property
+    def _sector_count(self) -> int:
+        return self.block_device.block_device_size // LP_SECTOR_SIZE
+
+    def free_regions(self) -> list[tuple[int, int]]:
+        """
+        The unused sectors of the super device
+        :return: [(first sector, sector count)]
+        """
+        used = sorted((e[2], e[2] + e[0]) for extents in self.extents.values() for e in extents if
+                      e[1] == LP_TARGET_TYPE_LINEAR)
+        regions = []
+        pos = self.block_device.first_logical_sector
+        for start, end in used:
+            if start > pos:
+                regions.append((pos, start - pos))
+            pos = max(pos, end)
+        if pos < self._sector_count:
+            regions.append((pos, self._sector_count - pos))
+        return regions
+
+    def _align(self, sector: int) -> int:
+        alignment = (self.block_device.alignment or self.geometry.logical_block_size) // LP_SECTOR_SIZE
+        offset = self.block_device.alignment_offset // LP_SECTOR_SIZE
+        if not alignment:
+            return sector
+        return -(-(sector - offset) // alignment) * alignment + offset
+
+    def _group_of(self, name: str):
+        partition = next(i for i in self.metadata.partitions if i.name == name)
+        return partition.group_index
+
+    def resize(self, name: str, size: int):
+        """
+        Shrink or grow a partition, growing takes the first free sectors, the last extent is extended
+        when the free space follows it.
+        :param name: partition name
+        :param size: new size in bytes, rounded up to the logical block size
+        :return:
+        """
+        self._require(name)
+        block = self.geometry.logical_block_size
+        sectors = -(-size // block) * block // LP_SECTOR_SIZE
+        # Zero extents cannot hold data, the partition is rebuilt from its linear extents.
+        old = self.extents[name]
+        extents = [list(i) for i in old if i[1] == LP_TARGET_TYPE_LINEAR]
+        current = sum(i[0] for i in extents)
+        if current == sectors and len(extents) == len(old):
+            return
+        if current > sectors:
+            while current > sectors:
+                cut = min(current - sectors, extents[-1][0])
+                extents[-1][0] -= cut
+                current -= cut
+                if not extents[-1][0]:
+                    extents.pop()
+        else:
+            self.extents[name] = extents
+            for start, count in self.free_regions():
+                if current >= sectors:
+                    break
+                aligned = start if extents and extents[-1][2] + extents[-1][0] == start else self._align(start)
+                count -= aligned - start
+                if count <= 0:
+                    continue
+                take = min(count, sectors - current)
+                if extents and extents[-1][2] + extents[-1][0] == aligned:
+                    extents[-1][0] += take
+                else:
+                    extents.append([take, LP_TARGET_TYPE_LINEAR, aligned, 0])
+                current += take
+            if current < sectors:
+                self.extents[name] = old
+                raise LpEditError(f"Not enough free space in super for {name}: "
+                                  f"{(sectors - current) * LP_SECTOR_SIZE} bytes missing")
+        self.extents[name] = extents
+        try:
+            self._check_group(self._group_of(name))
+        except LpEditError:
+            self.extents[name] = old
+            raise
+        self.dirty = True
+
+    def _check_group(self, group_index: int):
+        maximum_size = struct.unpack_from('<36sIQ', self.groups_raw, group_index * self.metadata.header.groups.entry_size)[2]
+        if not maximum_size:
+            return
+        used = sum(self.partition_size(i.name) for i in self.metadata.partitions if i.group_index == group_index)
+        if used > maximum_size:
+            raise LpEditError(f"Group {group_index} would use {used} bytes, its maximum is {maximum_size}")
+
+    def _map(self, name: str) -> list[tuple[int, int, int]]:
+        """
+        :return: [(partition offset, super offset, length)] in bytes
+        """
+        result = []
+        pos = 0
+        for num_sectors, target_type, target_data, _ in self.extents[name]:
+            length = num_sectors * LP_SECTOR_SIZE
+            if target_type == LP_TARGET_TYPE_LINEAR:
+                result.append((pos, target_data * LP_SECTOR_SIZE, length))
+            pos += length
+        return result
+
+    def replace(self, name: str, image: str):
+        """
+        Put image into partition name, the partition is resized to the image
+        :param name: partition name
+        :param image: raw or sparse image
+        :return:
+        """
+        self._require(name)
+        source = blockdev.open_image(image)
+        self._sources.append(source)
+        self.resize(name, source.size)
+        for part_offset, super_offset, length in self._map(name):
+            self.patches.append((super_offset, length,
+                                 lambda offset, size, base=part_offset: source.pread(base + offset, size).ljust(size,
+                                                                                                               b'\0')))
+
+    def serialize(self) -> bytes:
+        """
+        The metadata of one slot, header and tables
+        """
+        header = self.metadata.header
+        partitions = bytearray()
+        extents = bytearray()
+        index = 0
+        for p in self.metadata.partitions:
+            own = self.extents[p.name]
+            partitions += struct.pack(LpMetadataPartition._fmt, p.name.encode(), p.attributes, index, len(own),
+                                      p.group_index).ljust(header.partitions.entry_size, b'\0')
+            for e in own:
+                extents += struct.pack(LpMetadataExtent._fmt, *e).ljust(header.extents.entry_size, b'\0')
+            index += len(own)
+        tables = bytes(partitions + extents) + self.groups_raw + self.block_devices_raw
+        head = bytearray(self.header_raw)
+        struct.pack_into('<I32s', head, 44, len(tables), sha256(tables).digest())
+        offset = 0
+        for pos, table, entry_size in ((80, partitions, header.partitions.entry_size),
+                                       (92, extents, header.extents.entry_size),
+                                       (104, self.groups_raw, header.groups.entry_size),
+                                       (116, self.block_devices_raw, header.block_devices.entry_size)):
+            struct.pack_into('<3I', head, pos, offset, len(table) // entry_size, entry_size)
+            offset += len(table)
+        head[12:44] = bytes(32)
+        head[12:44] = sha256(head).digest()
+        blob = bytes(head) + tables
+        if len(blob) > self.geometry.metadata_max_size:
+            raise LpEditError(f"Metadata of {len(blob)} bytes exceeds the maximum of {self.geometry.metadata_max_size}")
+        return blob
+
+    def _metadata_patches(self) -> list:
+        blob = self.serialize()
+        read = lambda offset, size: blob[offset:offset + size]
+        return [(offset, len(blob), read) for slot in range(self.geometry.metadata_slot_count) for offset in
+                self.metadata.get_offsets(slot)]
+
+    def commit(self):
+        """
+        Write the pending partition data and, when extents changed, every copy of the metadata
+        """
+        patches = self.patches + (self._metadata_patches() if self.dirty else [])
+        if self.sparse:
+            self._commit_sparse(patches)
+        else:
+            with open(self.path, 'r+b') as f:
+                for offset, length, read in patches:
+                    done = 0
+                    while done < length:
+                        data = read(done, min(COPY_CHUNK, length - done))
+                        f.seek(offset + done)
+                        f.write(data)
+                        done += len(data)
+        self.patches = []
+        self.dirty = False
+
+    def _commit_sparse(self, patches: list):
+        """
+        A sparse image cannot be patched where it lies, the chunks are copied into a new file
+        and the patched blocks are written as new chunks.
+        """
+        bs = self.device.blocksize
+        patches = sorted(patches)
+
+        def overlay(offset: int, size: int) -> bytes:
+            data = bytearray(self.device.pread(offset, size).ljust(size, b'\0'))
+            for p_offset, p_length, read in patches:
+                start, end = max(offset, p_offset), min(offset + size, p_offset + p_length)
+                if start < end:
+                    data[start - offset:end - offset] = read(start - p_offset, end - start)
+            return bytes(data)
+
+        # Patched block ranges, merged
+        ranges = []
+        for offset, length, _ in patches:
+            start, end = offset // bs, -(-(offset + length) // bs)
+            if ranges and start <= ranges[-1][1]:
+                ranges[-1][1] = max(ranges[-1][1], end)
+            else:
+                ranges.append([start, end])
+
+        tmp = self.path + '.tmp'
+        total_blocks = self.device.size // bs
+        with open(tmp, 'wb') as out:
+            writer = SparseWriter(out, bs, total_blocks)
+
+            def copy(start: int, end: int):
+                """Original content of blocks [start, end)"""
+                for chunk_start, chunk_len, filepos, fill_data in self.device.offset_map:
+                    s, e = max(start, chunk_start), min(end, chunk_start + chunk_len)
+                    if s >= e:
+                        continue
+                    writer.AppendDontCare(s - writer.blocks)
+                    if filepos is None:
+                        writer.AppendFill(fill_data, e - s)
+                    else:
+                        for i in range(s, e, COPY_CHUNK // bs):
+                            n = min(COPY_CHUNK // bs, e - i)
+                            writer.AppendRaw(self.device.raw.pread(filepos + (i - chunk_start) * bs, n * bs))
+                writer.AppendDontCare(end - writer.blocks)
+
+            pos = 0
+            for start, end in ranges:
+                copy(pos, start)
+                for i in range(start, end, COPY_CHUNK // bs):
+                    n = min(COPY_CHUNK // bs, end - i)
+                    data = overlay(i * bs, n * bs)
+                    if data.count(0) == len(data):
+                        writer.AppendFill(b'\0' * 4, n)
+                    else:
+                        writer.AppendRaw(data)
+                pos = end
+            copy(pos, total_blocks)
+            writer.Close()
+        self.device.close()
+        os.replace(tmp, self.path)
+        self.device = blockdev.open_image(self.path)
+
+    def close(self):
+        for i in self._sources:
+            i.close()
+        self.device.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_val, exc_tb):
+        if exc_type is None and (self.patches or self.dirty):
+            self.commit()
+        self.close()
+
+
+def replace_partitions(super_image: str, images: dict):
+    """
+    Replace partitions of super_image
+    :param super_image: raw or sparse super image
+    :param images: {partition name: image path}
+    :return:
+    """
+    with SuperImage(super_image) as s:
+        # Every name is checked before the first change
+        for name in images:
+            s._require(name)
+        for name, image in images.items():
+            before = s.partition_size(name)
+            s.replace(name, image)
+            print(f"{name}: {before} -> {s.partition_size(name)} bytes")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Replace logical partitions of a super image in place")
+    parser.add_argument('super', help="raw or sparse super image")
+    parser.add_argument('-p', '--partition', action='append', default=[], metavar='NAME=IMAGE',
+                        help="partition to replace, may be repeated")
+    args = parser.parse_args()
+    images = {}
+    for i in args.partition:
+        name, image = i.split('=', 1)
+        images[name] = image
+    if images:
+        replace_partitions(args.super, images)
+    with SuperImage(args.super) as s:
+        for name in s.partitions:
+            print(f"{name:<20} {s.partition_size(name):>12} {s.extents[name]}")
+
+
+if __name__ == '__main__':
+    main()
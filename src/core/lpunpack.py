@@ -12,9 +12,14 @@ from string import Template
 from timeit import default_timer as dti
 from typing import IO, Dict, List, TypeVar, cast, BinaryIO, Tuple
 
+from . import progress, trace
+from .sparse_img import SparseWriter
+
 SPARSE_HEADER_MAGIC = 0xED26FF3A
 SPARSE_HEADER_SIZE = 28
 SPARSE_CHUNK_HEADER_SIZE = 12
+# Bytes read at once when a partition is copied out of super
+COPY_CHUNK = 4 << 20
 
 LP_PARTITION_RESERVED_BYTES = 4096
 LP_METADATA_GEOMETRY_MAGIC = 0x616c4467
@@ -605,7 +610,8 @@ class LpUnpackError(Exception):
 class UnpackJob:
     name: str
     geometry: LpMetadataGeometry
-    parts: List[Tuple[int, int]] = field(default_factory=list)
+    # (offset, size), offset is None for a zero extent
+    parts: List[Tuple[int | None, int]] = field(default_factory=list)
     total_size: int = field(default=0)
 
 
@@ -634,12 +640,15 @@ class SparseImage:
         unsparse_file_dir = os.path.dirname(self._fd.name)
         unsparse_file = os.path.join(unsparse_file_dir,
                                      f"{os.path.splitext(os.path.basename(self._fd.name))[0]}.unsparse.img")
-        with open(str(unsparse_file), 'wb') as out:
+        with open(str(unsparse_file), 'wb') as out, \
+                progress.Progress(f'unsparse {os.path.basename(self._fd.name)}',
+                                  self.header.total_blks * self.header.blk_sz, chunks) as tracker:
             sector_base = 82528
             output_len = 0
             while chunks > 0:
                 chunk_header = SparseChunkHeader(self._fd.read(SPARSE_CHUNK_HEADER_SIZE))
                 sector_size = (chunk_header.chunk_sz * self.header.blk_sz) >> 9
+                tracker.update(sector_size << 9, 1)
                 chunk_data_size = chunk_header.total_sz - self.header.chunk_hdr_sz
                 if chunk_header.chunk_type == 0xCAC1:
                     data = self._read_data(chunk_data_size)
@@ -681,8 +690,12 @@ class LpUnpack:
         self._show_info_format = kwargs.get('SHOW_INFO_FORMAT', FormatType.TEXT)
         self._config = kwargs.get('CONFIG', None)
         self._slot_num = None
-        self._fd: BinaryIO = open(kwargs.get('SUPER_IMAGE'), 'rb')
+        super_image = kwargs.get('SUPER_IMAGE')
+        # An opened file (or a blockdev reader) may be passed instead of a path.
+        self._fd: BinaryIO = super_image if hasattr(super_image, 'read') else open(super_image, 'rb')
         self._out_dir = kwargs.get('OUTPUT_DIR', None)
+        # Write the partitions as android sparse images
+        self._sparse = kwargs.get('SPARSE', False)
 
     def _check_out_dir_exists(self):
         if self._out_dir is None:
@@ -696,10 +709,19 @@ class LpUnpack:
         start = dti()
         print(f'Extracting partition [{unpack_job.name}]')
         out_file = os.path.join(self._out_dir, f'{unpack_job.name}.img')
-        with open(str(out_file), 'wb') as out:
+        block_size = unpack_job.geometry.logical_block_size
+        with open(str(out_file), 'wb') as out, \
+                progress.Progress(f'super {unpack_job.name}', unpack_job.total_size) as tracker, \
+                trace.span(f'super {unpack_job.name}', bytes=unpack_job.total_size):
+            writer = None
+            # Empty partitions stay empty files, the tool removes them by size
+            if self._sparse and unpack_job.total_size and not unpack_job.total_size % block_size:
+                writer = SparseWriter(out, block_size, unpack_job.total_size // block_size)
             for part in unpack_job.parts:
                 offset, size = part
-                self._write_extent_to_file(out, offset, size, unpack_job.geometry.logical_block_size)
+                self._write_extent_to_file(out, offset, size, block_size, tracker, writer)
+            if writer:
+                writer.Close()
 
         print(f'Done:[{dti() - start}]')
 
@@ -711,10 +733,13 @@ class LpUnpack:
                 index = partition.first_extent_index + extent_number
                 extent = metadata.extents[index]
 
-                if extent.target_type != LP_TARGET_TYPE_LINEAR:
+                if extent.target_type == LP_TARGET_TYPE_ZERO:
+                    offset = None
+                elif extent.target_type == LP_TARGET_TYPE_LINEAR:
+                    offset = extent.target_data * LP_SECTOR_SIZE
+                else:
                     raise LpUnpackError(f'Unsupported target type in extent: {extent.target_type}')
 
-                offset = extent.target_data * LP_SECTOR_SIZE
                 size = extent.num_sectors * LP_SECTOR_SIZE
                 unpack_job.parts.append((offset, size))
                 unpack_job.total_size += size
@@ -728,13 +753,6 @@ class LpUnpack:
             count -= 1
         return result
 
-    def _read_chunk(self, block_size):
-        while True:
-            data = self._fd.read(block_size)
-            if not data:
-                break
-            yield data
-
     def _read_metadata_header(self, metadata: Metadata):
         offsets = metadata.get_offsets()
         for index, offset in enumerate(offsets):
@@ -811,15 +829,41 @@ class LpUnpack:
         else:
             return LpMetadataGeometry(self._fd.read(LP_METADATA_GEOMETRY_SIZE))
 
-    def _write_extent_to_file(self, fd: IO, offset: int, size: int, block_size: int):
+    def _write_extent_to_file(self, fd: IO, offset: int | None, size: int, block_size: int,
+                              tracker: progress.Progress = None, writer: SparseWriter = None):
+        """
+        Copy an extent to the partition image in large reads
+        :param fd: the partition image
+        :param offset: offset in super, None for a zero extent
+        :param size:
+        :param block_size:
+        :param tracker:
+        :param writer: write sparse chunks instead of raw data, zero blocks become fill chunks
+        :return:
+        """
+        if offset is None:
+            if writer:
+                writer.AppendFill(b'\0' * 4, size // block_size)
+            else:
+                # Left as a hole
+                fd.seek(size, io.SEEK_CUR)
+                fd.truncate()
+            if tracker:
+                tracker.update(size)
+            return
+        chunk = COPY_CHUNK - COPY_CHUNK % block_size
         self._fd.seek(offset)
-        for block in self._read_chunk(block_size):
-            if size == 0:
+        while size > 0:
+            data = self._fd.read(min(size, chunk))
+            if not data:
                 break
-
-            fd.write(block)
-
-            size -= block_size
+            if writer:
+                writer.AppendData(data)
+            else:
+                fd.write(data)
+            if tracker:
+                tracker.update(len(data))
+            size -= len(data)
 
     def get_parts(self):
         try:
@@ -918,8 +962,8 @@ class LpUnpack:
             sys.exit(1)
 
 
-def unpack(file: str, out: str, parts: list = None):
-    namespace = argparse.Namespace(SUPER_IMAGE=file, OUTPUT_DIR=out, SHOW_INFO=False, NAME=parts)
+def unpack(file: str, out: str, parts: list = None, sparse: bool = False):
+    namespace = argparse.Namespace(SUPER_IMAGE=file, OUTPUT_DIR=out, SHOW_INFO=False, NAME=parts, SPARSE=sparse)
     if not os.path.exists(namespace.SUPER_IMAGE):
         raise FileNotFoundError(f"{namespace.SUPER_IMAGE} Cannot Find")
     else:
@@ -938,3 +982,13 @@ def get_parts(file_):
         raise FileNotFoundError(f"{namespace.SUPER_IMAGE} Cannot Find")
     else:
         return LpUnpack(**vars(namespace)).get_parts()
+
+
+def read_metadata(fd: BinaryIO) -> Metadata:
+    """
+    Read the LP metadata of an opened, non sparse super image
+    :param fd: file object of the super image
+    :return:
+    """
+    fd.seek(0)
+    return LpUnpack(SUPER_IMAGE=fd, SHOW_INFO=False)._read_metadata()
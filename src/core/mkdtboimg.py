@@ -18,6 +18,7 @@ from __future__ import print_function
 """Tool for packing multiple DTB/DTBO files into a single image"""
 
 import argparse
+import io
 import os
 import struct
 import zlib
@@ -358,8 +359,13 @@ class Dtbo:
             from internal list is returned. If not, 'None' is returned.
         """
 
+        if not hasattr(dt_entry.dt_file, 'name'):
+            # DT images in memory are never shared
+            return None
         dt_entry_path = os.path.realpath(dt_entry.dt_file.name)
         for entry in self.__dt_entries:
+            if not hasattr(entry.dt_file, 'name'):
+                continue
             entry_path = os.path.realpath(entry.dt_file.name)
             if entry_path == dt_entry_path:
                 return entry
@@ -696,3 +702,39 @@ def dump_dtbo(file, out):
 def create_dtbo(out, list, page_size):
     with open(out, 'wb') as f:
         create_dtbo_image(f, list, page_size)
+
+
+def read_dtbo(file):
+    """Read the DT images of a DTBO file into memory.
+
+    Args:
+        file: Path of the DTBO image.
+
+    Returns:
+        A list with the DT image of every entry.
+    """
+    blobs = []
+    with open(file, 'rb') as f:
+        dtbo = Dtbo(f)
+        for idx in range(len(dtbo.dt_entries)):
+            buf = io.BytesIO()
+            dtbo.extract_dt_file(idx, buf, False)
+            blobs.append(buf.getvalue())
+    print(str(dtbo) + '\n')
+    return blobs
+
+
+def create_dtbo_from_blobs(out, blobs, page_size):
+    """Create a DTBO image from DT images in memory.
+
+    Args:
+        out: Path of the DTBO image to write.
+        blobs: DT images in the order of the entries.
+        page_size: Page size of the image.
+    """
+    assert blobs, 'List of dt_images to add to DTBO not provided'
+    dt_entries = [DtEntry(version=0, dt_file=io.BytesIO(blob), dt_size=len(blob), dt_offset=0, id='0', rev='0',
+                          custom0='0', custom1='0', custom2='0', custom3='0') for blob in blobs]
+    with open(out, 'wb') as f:
+        dtbo = Dtbo(f, 'dtb', page_size, 0)
+        dtbo.commit(dtbo.add_dt_entries(dt_entries))
@@ -0,0 +1,259 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+Line indexed, memory mapped text files.
+Used by the editor to view and edit files too large to be loaded into a Text widget at once.
+"""
+import mmap
+import os
+import re
+import shutil
+import tempfile
+import threading
+from array import array
+from bisect import bisect_right
+
+# Files bigger than this are opened through MappedText by the editor.
+LARGE_FILE_SIZE = 4 * 1024 * 1024
+INDEX_STEP = 4 * 1024 * 1024
+COPY_SIZE = 8 * 1024 * 1024
+
+
+class MappedText:
+    """
+    A read-only mmap of a text file plus an overlay of edited line ranges.
+    Line offsets are indexed in a background thread, lines become available while indexing.
+    Edits are stored as {start_line: (end_line, text)} against the original line numbers.
+    """
+
+    def __init__(self, path: str, encoding: str = 'utf-8'):
+        self.path = path
+        self.encoding = encoding
+        self.edits: dict[int, tuple[int, str]] = {}
+        self.offsets = array('Q', [0])
+        self.indexed = threading.Event()
+        self.lock = threading.Lock()
+        self._stop = False
+        self._f = None
+        self.mm = None
+        self.size = 0
+        self._open()
+
+    def _open(self):
+        self._f = open(self.path, 'rb')
+        self.size = os.fstat(self._f.fileno()).st_size
+        # mmap cannot map an empty file.
+        self.mm = mmap.mmap(self._f.fileno(), 0, access=mmap.ACCESS_READ) if self.size else b''
+        self.offsets = array('Q', [0])
+        self.indexed.clear()
+        self._stop = False
+        threading.Thread(target=self._index, daemon=True).start()
+
+    def _index(self):
+        mm, size = self.mm, self.size
+        pos = 0
+        while pos < size and not self._stop:
+            end = min(pos + INDEX_STEP, size)
+            found = array('Q')
+            nl = mm.find(b'\n', pos, end)
+            while nl != -1:
+                found.append(nl + 1)
+                nl = mm.find(b'\n', nl + 1, end)
+            with self.lock:
+                self.offsets.extend(found)
+            pos = end
+        with self.lock:
+            # The last line has no newline, close it with the file end.
+            if self.offsets[-1] != size or size == 0:
+                self.offsets.append(size)
+        self.indexed.set()
+
+    def close(self):
+        self._stop = True
+        self.indexed.wait()
+        if isinstance(self.mm, mmap.mmap):
+            self.mm.close()
+        if self._f:
+            self._f.close()
+
+    @property
+    def line_count(self) -> int:
+        """
+        Number of original lines indexed so far.
+        """
+        with self.lock:
+            return len(self.offsets) - 1
+
+    def line_of(self, offset: int) -> int:
+        with self.lock:
+            return max(bisect_right(self.offsets, offset) - 1, 0)
+
+    def _span(self, start: int, end: int) -> tuple[int, int]:
+        with self.lock:
+            last = len(self.offsets) - 1
+            start, end = min(start, last), min(end, last)
+            return self.offsets[start], self.offsets[end]
+
+    def _decode(self, data: bytes) -> str:
+        return data.decode(self.encoding, errors='replace')
+
+    def expand(self, start: int, end: int) -> tuple[int, int]:
+        """
+        Grow [start, end) until no edited range crosses its borders.
+        """
+        changed = True
+        while changed:
+            changed = False
+            for e_start, (e_end, _) in self.edits.items():
+                if e_start < end and e_end > start and (e_start < start or e_end > end):
+                    start, end = min(start, e_start), max(end, e_end)
+                    changed = True
+        return start, end
+
+    def text(self, start: int, end: int) -> str:
+        """
+        Return lines [start, end) with edits applied, the range must be expanded first.
+        """
+        out = []
+        line = start
+        for e_start in sorted(i for i in self.edits if start <= i < end):
+            if line < e_start:
+                b, e = self._span(line, e_start)
+                out.append(self._decode(self.mm[b:e]))
+            e_end, text = self.edits[e_start]
+            out.append(text)
+            line = e_end
+        if line < end:
+            b, e = self._span(line, end)
+            out.append(self._decode(self.mm[b:e]))
+        return ''.join(out)
+
+    def replace(self, start: int, end: int, text: str):
+        """
+        Replace lines [start, end) with text, the range must be expanded first.
+        """
+        if text == self.text(start, end):
+            return
+        for e_start in [i for i in self.edits if start <= i < end]:
+            del self.edits[e_start]
+        self.edits[start] = (end, text)
+
+    @property
+    def modified(self) -> bool:
+        return bool(self.edits)
+
+    def offset_of(self, line: int) -> int:
+        return self._span(line, line)[0]
+
+    def _scan(self, needle: bytes, expr, pos: int, stop: int) -> int:
+        if expr is None:
+            return self.mm.find(needle, pos, stop)
+        while pos < stop:
+            end = min(pos + COPY_SIZE, stop)
+            # Extend the window to a line end so a match is never split between windows.
+            if end < stop:
+                nl = self.mm.find(b'\n', end, stop)
+                end = stop if nl == -1 else nl + 1
+            if m := expr.search(self.mm, pos, end):
+                return m.start()
+            pos = end
+        return -1
+
+    def find(self, pattern: str, offset: int = 0, regex: bool = False, ignore_case: bool = False) -> int:
+        """
+        Stream over the mapping from offset and return the line number of the first match, or -1.
+        Edited ranges are searched in their edited text instead of the mapping.
+        """
+        self.indexed.wait()
+        needle = pattern.encode(self.encoding)
+        expr = str_expr = None
+        if regex or ignore_case:
+            flags = re.MULTILINE | (re.IGNORECASE if ignore_case else 0)
+            expr = re.compile(needle if regex else re.escape(needle), flags)
+            str_expr = re.compile(pattern if regex else re.escape(pattern), flags)
+        segments = []
+        prev = 0
+        # The editor may add edits while the search runs, work on a copy
+        for start, (end, text) in sorted(dict(self.edits).items()):
+            segments.append((prev, start, None))
+            segments.append((start, end, text))
+            prev = end
+        segments.append((prev, self.line_count, None))
+        for start, end, text in segments:
+            b, e = self._span(start, end)
+            if e <= offset:
+                continue
+            if text is not None:
+                # Search the edited text from the line of offset, the lines before it were passed already
+                pos = 0
+                for _ in range(self.line_of(offset) - start if b < offset else 0):
+                    if (pos := text.find('\n', pos) + 1) == 0:
+                        pos = len(text)
+                        break
+                if str_expr:
+                    hit = m.start() if (m := str_expr.search(text, pos)) else -1
+                else:
+                    hit = text.find(pattern, pos)
+                if hit != -1:
+                    return min(start + text.count('\n', 0, hit), max(end - 1, start))
+                continue
+            if (hit := self._scan(needle, expr, max(b, offset), e)) != -1:
+                return self.line_of(hit)
+        return -1
+
+    def save(self):
+        """
+        Write edits back.
+        If every edit keeps its byte length only the edited regions are written,
+        otherwise the file is rewritten through a temp file by streaming the unchanged spans.
+        """
+        if not self.edits:
+            return
+        self.indexed.wait()
+        regions = []
+        for start, (end, text) in sorted(self.edits.items()):
+            b, e = self._span(start, end)
+            regions.append((b, e, text.encode(self.encoding)))
+        if all(e - b == len(data) for b, e, data in regions):
+            with open(self.path, 'r+b') as f:
+                for b, _, data in regions:
+                    f.seek(b)
+                    f.write(data)
+            self.edits.clear()
+            return
+        fd, tmp = tempfile.mkstemp(prefix='.mio_', dir=os.path.dirname(os.path.abspath(self.path)))
+        try:
+            with os.fdopen(fd, 'wb') as out:
+                pos = 0
+                for b, e, data in regions:
+                    while pos < b:
+                        n = min(COPY_SIZE, b - pos)
+                        out.write(self.mm[pos:pos + n])
+                        pos += n
+                    out.write(data)
+                    pos = e
+                while pos < self.size:
+                    n = min(COPY_SIZE, self.size - pos)
+                    out.write(self.mm[pos:pos + n])
+                    pos += n
+            # mkstemp creates the file as 0600, keep the mode of the file it replaces
+            shutil.copymode(self.path, tmp)
+            self.close()
+            os.replace(tmp, self.path)
+        except (Exception, BaseException):
+            if os.path.exists(tmp):
+                os.remove(tmp)
+            raise
+        self.edits.clear()
+        self._open()
@@ -9,6 +9,7 @@ import struct
 import threading
 import time
 import zipfile
+from collections import deque
 from concurrent.futures import Future, ThreadPoolExecutor
 from io import (
     SEEK_CUR,
@@ -21,7 +22,9 @@ from typing import IO, List
 
 import requests
 
-from . import update_metadata_pb2
+from . import jobs, progress, trace, update_metadata_pb2
+from .remote_zip import open_remote_payload, plan_ranges
+from .sparse_img import SparseWriter
 
 
 class BadPayload(Exception):
@@ -30,6 +33,8 @@ class BadPayload(Exception):
 
 
 PAYLOAD_MAGIC = b"CrAU"
+# Bytes read at once when a raw image is converted to sparse
+COPY_CHUNK = 4 << 20
 
 
 class PayloadHdr(object):
@@ -119,6 +124,20 @@ def init_payload_info(reader: IO[bytes]) -> update_metadata_pb2.DeltaArchiveMani
     return manifest
 
 
+def _decompress_operation(operation: update_metadata_pb2.InstallOperation, data: bytes) -> bytes:
+    match operation.type:
+        case update_metadata_pb2.InstallOperation.REPLACE:
+            return data
+        case update_metadata_pb2.InstallOperation.REPLACE_BZ:
+            return bz2.decompress(data)
+        case update_metadata_pb2.InstallOperation.REPLACE_XZ:
+            return lzma.decompress(data)
+        case update_metadata_pb2.InstallOperation.REPLACE_ZSTD:
+            return zstandard.decompress(data)
+        case _:
+            raise BadPayload("unexpected data type")
+
+
 def _extract_operation_to_file(
     operation: update_metadata_pb2.InstallOperation,
     writer: OrderedFileWriter,  # multi thread use
@@ -127,43 +146,13 @@ def _extract_operation_to_file(
     data: bytes,
 ):
     match operation.type:
-        case update_metadata_pb2.InstallOperation.REPLACE:
-            # if writer:
-            writer.write(out_offset, data)
-            # else:
-            #    out_file.seek(out_offset, SEEK_SET)
-            #    out_file.write(data)
-        case update_metadata_pb2.InstallOperation.ZERO:
-            for ext in operation.dst_extents:
-                out_seek = ext.start_block * block_size
-                num_blocks = ext.num_blocks
-                # if writer:
-                writer.write(out_seek, b"\0" * num_blocks)
-                # else:
-                #    out_file.seek(out_seek, SEEK_SET)
-                #    out_file.seek(num_blocks, SEEK_CUR)
-        case (
-            update_metadata_pb2.InstallOperation.REPLACE_BZ
-            | update_metadata_pb2.InstallOperation.REPLACE_XZ
-            | update_metadata_pb2.InstallOperation.REPLACE_ZSTD
-        ):
-            if operation.type == update_metadata_pb2.InstallOperation.REPLACE_BZ:
-                decompressed_data = bz2.decompress(data)
-            elif operation.type == update_metadata_pb2.InstallOperation.REPLACE_XZ:
-                decompressed_data = lzma.decompress(data)
-            elif operation.type == update_metadata_pb2.InstallOperation.REPLACE_ZSTD:
-                decompressed_data = zstandard.decompress(data)
-
-            # if writer:
+        case update_metadata_pb2.InstallOperation.ZERO | update_metadata_pb2.InstallOperation.DISCARD:
+            # The image is truncated to its full size before extraction, the blocks are already zero holes
+            pass
+        case _:
+            decompressed_data = _decompress_operation(operation, data)
             writer.write(out_offset, decompressed_data)
-
             del decompressed_data
-            # else:
-            #    out_file.seek(out_offset, SEEK_SET)
-            #    out_file.write(decompressed_data)
-
-        case _:
-            raise BadPayload("unexpected data type")
     del data
 
 
@@ -178,6 +167,8 @@ def _extract_partition_from_payload(
     with (
         open(out_path, "wb") as out_file,
         OrderedFileWriter(out_file, executor._max_workers) as writer,
+        progress.Progress(f"payload {partition.partition_name}", total_size, len(partition.operations)) as tracker,
+        trace.span(f"payload {partition.partition_name}", bytes=total_size),
     ):
         out_file.truncate(total_size)  # pre set memory
 
@@ -188,6 +179,9 @@ def _extract_partition_from_payload(
 
 
         for operation in sorted(partition.operations, key=lambda o: o.data_offset):
+            if jobs.cancel_requested():
+                # The submitted operations still finish while the writer runs, the job stops below
+                break
             data_len = operation.data_length
             data_offset = operation.data_offset
 
@@ -196,6 +190,7 @@ def _extract_partition_from_payload(
             data = reader.read(data_len)
 
             curr_data_offset = data_offset + data_len
+            tracker.update(sum(e.num_blocks for e in operation.dst_extents) * block_size, 1)
             if writer:
                 futures.append(
                     executor.submit(
@@ -214,7 +209,113 @@ def _extract_partition_from_payload(
             future.result()
         futures.clear()
 
-        print(f"Extract partition: {partition.partition_name:<16} size: {total_size:<10} ... Done!")
+        if not jobs.cancel_requested():
+            print(f"Extract partition: {partition.partition_name:<16} size: {total_size:<10} ... Done!")
+    jobs.check_cancelled()
+
+
+def _in_block_order(operations: List[update_metadata_pb2.InstallOperation]) -> bool:
+    """
+    Whether the operations write their blocks front to back without overlapping and their data is in the same
+    order, true for full payloads
+    """
+    end = data_end = 0
+    for operation in operations:
+        if operation.data_length:
+            if operation.data_offset < data_end:
+                return False
+            data_end = operation.data_offset + operation.data_length
+        for ext in operation.dst_extents:
+            if ext.start_block < end:
+                return False
+            end = ext.start_block + ext.num_blocks
+    return True
+
+
+def _sparse_from_raw(path: str, block_size: int):
+    """
+    Convert a raw image to an android sparse image in place
+    """
+    size = os.path.getsize(path)
+    with open(path, "rb") as raw, open(path + ".sparse", "wb") as out:
+        writer = SparseWriter(out, block_size, -(-size // block_size))
+        while data := raw.read(COPY_CHUNK - COPY_CHUNK % block_size):
+            if len(data) % block_size:
+                data += bytes(block_size - len(data) % block_size)
+            writer.AppendData(data)
+        writer.Close()
+    os.replace(path + ".sparse", path)
+
+
+def _extract_partition_sparse(
+    reader: IO[bytes],
+    block_size: int,
+    partition: update_metadata_pb2.PartitionUpdate,
+    out_path: str,
+    total_size: int,
+    executor: ThreadPoolExecutor,
+):
+    """
+    Write the partition as an android sparse image, without a raw image in between.
+    The data is decompressed in parallel and written in order: ZERO operations and zero blocks in the data become
+    fill chunks, DISCARD operations and blocks no operation writes become don't care chunks.
+    """
+    operations = sorted(partition.operations, key=lambda o: o.dst_extents[0].start_block if o.dst_extents else 0)
+    if not _in_block_order(operations) or total_size % block_size:
+        _extract_partition_from_payload(reader, block_size, partition, out_path, total_size, executor)
+        if not jobs.cancel_requested():
+            _sparse_from_raw(out_path, block_size)
+        return
+    with (
+        open(out_path, "wb") as out_file,
+        progress.Progress(f"payload {partition.partition_name}", total_size, len(operations)) as tracker,
+        trace.span(f"payload {partition.partition_name}", bytes=total_size),
+    ):
+        writer = SparseWriter(out_file, block_size, total_size // block_size)
+
+        def write(operation: update_metadata_pb2.InstallOperation, future: Future | None):
+            data = future.result() if future else None
+            view = memoryview(data) if data is not None else None
+            pos = 0
+            for ext in operation.dst_extents:
+                writer.AppendDontCare(ext.start_block - writer.blocks)
+                size = ext.num_blocks * block_size
+                if operation.type == update_metadata_pb2.InstallOperation.ZERO:
+                    writer.AppendFill(b"\0" * 4, ext.num_blocks)
+                elif operation.type == update_metadata_pb2.InstallOperation.DISCARD:
+                    writer.AppendDontCare(ext.num_blocks)
+                else:
+                    part = data if pos == 0 and len(data) == size else view[pos:pos + size]
+                    if len(part) < size:
+                        part = bytes(part) + bytes(size - len(part))
+                    writer.AppendData(part)
+                    pos += size
+            tracker.update(sum(e.num_blocks for e in operation.dst_extents) * block_size, 1)
+
+        curr_data_offset = 0
+        # Decompressed operations waiting to be written, bounded so memory does not grow with the partition
+        pending = deque()
+        for operation in operations:
+            if jobs.cancel_requested():
+                break
+            future = None
+            if operation.type not in (update_metadata_pb2.InstallOperation.ZERO,
+                                      update_metadata_pb2.InstallOperation.DISCARD):
+                reader.seek(operation.data_offset - curr_data_offset, SEEK_CUR)
+                data = reader.read(operation.data_length)
+                curr_data_offset = operation.data_offset + operation.data_length
+                future = executor.submit(_decompress_operation, operation, data)
+                del data
+            pending.append((operation, future))
+            while len(pending) > executor._max_workers * 2:
+                write(*pending.popleft())
+        while pending and not jobs.cancel_requested():
+            write(*pending.popleft())
+
+        if not jobs.cancel_requested():
+            writer.Close()
+            print(f"Extract partition: {partition.partition_name:<16} size: {total_size:<10} ... Done!")
+    jobs.check_cancelled()
 
 
 def extract_partitions_from_payload(
@@ -222,7 +323,11 @@ def extract_partitions_from_payload(
     partitions_name: List[str] = [],
     out_dir: str = "out",
     max_workers: int = 32,
+    sparse: bool = False,
 ):
+    """
+    :param sparse: write android sparse images, zero and unwritten blocks take no space
+    """
     reader.seek(0, SEEK_SET)
 
     os.makedirs(out_dir, exist_ok=True)
@@ -249,19 +354,82 @@ def extract_partitions_from_payload(
             ) * block_size
             # total_length = len(p.operations)
             print(f"Extracting {p.partition_name} ...")
-            _extract_partition_from_payload(
-                reader,
-                block_size,
-                p,
-                os.path.join(out_dir, p.partition_name + ".img"),
-                total_length,
-                executor,
-            )
+            out_path = os.path.join(out_dir, p.partition_name + ".img")
+            with jobs.partial(out_path):
+                (_extract_partition_sparse if sparse else _extract_partition_from_payload)(
+                    reader,
+                    block_size,
+                    p,
+                    out_path,
+                    total_length,
+                    executor,
+                )
 
             # if progress:
             #    progress.stop_task(task_id)
 
 
+def extract_partitions_from_url(
+    url: str,
+    partitions_name: List[str] = [],
+    out_dir: str = "out",
+    connections: int = 8,
+):
+    """
+    Extract partitions from a payload.bin on a HTTP server, bare or stored in an OTA zip.
+    Only the manifest and the data blobs of the selected partitions are downloaded,
+    adjacent blobs are fetched together by several connections.
+    """
+    os.makedirs(out_dir, exist_ok=True)
+    reader = open_remote_payload(url)
+    manifest = init_payload_info(reader)
+    baseoff = reader.tell()
+    if len(partitions_name) == 0:
+        all_parts = manifest.partitions
+    else:
+        all_parts = [p for p in manifest.partitions if p.partition_name in partitions_name]
+    block_size = manifest.block_size
+
+    out_files = []
+    spans = []
+    try:
+        for p in all_parts:
+            total_length = (
+                p.operations[-1].dst_extents[-1].start_block
+                + p.operations[-1].dst_extents[-1].num_blocks
+            ) * block_size
+            out_file = open(os.path.join(out_dir, p.partition_name + ".img"), "wb")
+            out_file.truncate(total_length)
+            writer = OrderedFileWriter(out_file, connections)
+            out_files.append((p, out_file, writer))
+            for operation in p.operations:
+                spans.append((baseoff + operation.data_offset, operation.data_length, (writer, operation)))
+        print(f"Extracting {', '.join(p.partition_name for p in all_parts)} ...")
+
+        def fetch(request):
+            start, end, items = request
+            data = memoryview(reader.pread(start, end - start))
+            for offset, length, (writer_, operation_) in items:
+                _extract_operation_to_file(
+                    operation_,
+                    writer_,
+                    operation_.dst_extents[0].start_block * block_size,
+                    block_size,
+                    data[offset - start:offset - start + length],
+                )
+
+        with ThreadPoolExecutor(max_workers=connections) as executor:
+            for _ in executor.map(fetch, plan_ranges([i for i in spans if i[1]])):
+                ...
+    finally:
+        for p, out_file, writer in out_files:
+            writer.close()
+            out_file.close()
+    for p, out_file, _ in out_files:
+        print(f"Extract partition: {p.partition_name:<16} size: {os.path.getsize(out_file.name):<10} ... Done!")
+    print(f"Downloaded {reader.source.fetched} of {reader.source.size} bytes.")
+
+
 class SeekableMmap(mmap.mmap):
     def seekable(self) -> bool:  # stub
         return True
@@ -439,6 +607,13 @@ if __name__ == "__main__":
         dest="extract_partitions",
         default=None,
     )
+    parser.add_argument(
+        "-S",
+        "--sparse",
+        action="store_true",
+        dest="sparse",
+        help="write android sparse images (bin and zip only)",
+    )
 
     args = parser.parse_args()
 
@@ -461,6 +636,7 @@ if __name__ == "__main__":
                                     ),
                                     args.out,
                                     args.workers,
+                                    args.sparse,
                                 )
         case "bin":
             with open(args.input, "rb") as f:
@@ -473,23 +649,19 @@ if __name__ == "__main__":
                     ),
                     args.out,
                     args.workers,
+                    args.sparse,
                 )
         case "url":
-            with UrlFileReader(args.input) as r:
-                with zipfile.ZipFile(r, "r") as zip:
-                    for file in zip.filelist:
-                        if file.filename.endswith("payload.bin"):
-                            with zip.open(file, "r") as zf:
-                                extract_partitions_from_payload(
-                                    zf,
-                                    (
-                                        args.extract_partitions.split(",")
-                                        if args.extract_partitions
-                                        else []
-                                    ),
-                                    args.out,
-                                    args.workers,
-                                )
+            extract_partitions_from_url(
+                args.input,
+                (
+                    args.extract_partitions.split(",")
+                    if args.extract_partitions
+                    else []
+                ),
+                args.out,
+                args.workers,
+            )
         case _:
             raise Exception("type not support")
     tooks = time.time() - now
@@ -0,0 +1,115 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+Prepare fs_config and file_contexts of the partitions before packing.
+Every partition tree is walked once, the entries feed both fspatch and contextpatch,
+the files are written deduplicated and the context rules are merged in memory and saved once.
+All partitions are handled at the same time.
+"""
+import logging
+import os
+from concurrent.futures import ThreadPoolExecutor
+
+from . import contextpatch, fspatch, jobs
+from .utils import JsonEdit
+
+
+def walk_tree(folder: str) -> list[str]:
+    """
+    Entries of folder relative to it, in the order of os.walk
+    :param folder:
+    :return: ['bin', 'bin/sh', ...]
+    """
+    entries = []
+    for root, dirs, files in os.walk(folder, topdown=True):
+        rel = os.path.relpath(root, folder).replace('\\', '/')
+        prefix = '' if rel == '.' else rel + '/'
+        entries.extend(prefix + i for i in dirs)
+        entries.extend(prefix + i for i in files)
+    return entries
+
+
+def dedup_file(file: str):
+    """
+    Remove repeated lines, the first one is kept
+    """
+    with open(file, 'r', encoding='utf-8', newline='\n') as f:
+        data = f.readlines()
+    unique = list(dict.fromkeys(data))
+    if len(unique) != len(data):
+        with open(file, 'w', encoding='utf-8', newline='\n') as f:
+            f.writelines(unique)
+
+
+def normalize_partition(work: str, name: str, rules: dict | None) -> dict:
+    """
+    Patch and deduplicate the configs of one partition
+    :param work: project path
+    :param name: partition name
+    :param rules: context rules, None to leave file_contexts unpatched
+    :return: the new context rules found in file_contexts
+    """
+    folder = os.path.abspath(os.path.join(work, name))
+    fs_config = os.path.join(work, 'config', f'{name}_fs_config')
+    contexts_file = os.path.join(work, 'config', f'{name}_file_contexts')
+    entries = walk_tree(folder)
+    fs_paths = [name, *(f'{name}/{i}' for i in entries), '/', '/lost+found']
+    new_fs, new_add = fspatch.fs_patch(fspatch.scanfs(fs_config), folder, fs_paths)
+    with open(fs_config, 'w', encoding='utf-8', newline='\n') as f:
+        f.writelines([f"{i} {' '.join(new_fs[i])}\n" for i in sorted(new_fs.keys())])
+    print(f'FsPatcher: Added {new_add} entries')
+    if not os.path.exists(contexts_file):
+        return {}
+    if rules is None:
+        dedup_file(contexts_file)
+        return {}
+    context_paths = [*(f'/{name}/{i}' for i in entries), '/', '/lost+found', f'/{name}/lost+found', f'/{name}',
+                     f'/{name}/', fr'/{name}(/.*)?']
+    new_contexts, add_new = contextpatch.context_patch(contextpatch.scan_context(contexts_file), folder, rules,
+                                                       context_paths)
+    with open(contexts_file, 'w', encoding='utf-8', newline='\n') as f:
+        f.writelines([f"{i} {new_contexts[i]}\n" for i in sorted(new_contexts.keys())])
+    print(f'ContextPatcher: Add {add_new:d} entries')
+    return {k.replace(r'\@', '@'): v for k, v in new_contexts.items()}
+
+
+def normalize(work: str, names: list, rule_file: str = None, workers: int = None):
+    """
+    Patch the configs of all partitions before they are packed
+    :param work: project path
+    :param names: partitions that have a fs_config
+    :param rule_file: context rules json, file_contexts is only deduplicated if None
+    :param workers: partitions handled at the same time
+    :return:
+    :raise RuntimeError: a partition could not be patched, its image would be broken
+    """
+    rules = JsonEdit(rule_file).read() if rule_file else None
+
+    def run(name):
+        try:
+            return normalize_partition(work, name, rules)
+        except Exception as e:
+            logging.exception(f'prepack {name}')
+            raise RuntimeError(f'{name}: {e}') from e
+
+    with ThreadPoolExecutor(max_workers=workers or min(len(names), os.cpu_count() or 1) or 1) as executor:
+        results = list(executor.map(jobs.carry(run), names))
+    if rules is None:
+        return
+    # Rules already known win, the first partition wins over the later ones, same as patching one by one.
+    merged = dict(rules)
+    for new_rules in results:
+        merged = new_rules | merged
+    if merged != rules:
+        JsonEdit(rule_file).write(merged)
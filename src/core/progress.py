@@ -0,0 +1,203 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+Progress events of long operations.
+Extractors and packers count bytes and items on a Progress, sinks get an Event at most every INTERVAL seconds
+per operation plus one when it starts and ends, so counting in inner loops costs next to nothing.
+Usage:
+    with Progress('payload system', bytes_total=size) as p:
+        for chunk in chunks:
+            ...
+            p.update(len(chunk))
+    subscribe(JsonlSink('progress.jsonl'))
+"""
+import json
+import logging
+import threading
+import time
+from typing import NamedTuple
+
+from . import jobs
+
+INTERVAL = 0.25
+
+
+class Event(NamedTuple):
+    job: str
+    phase: str
+    bytes_done: int
+    bytes_total: int
+    items_done: int
+    items_total: int
+    started: float
+    time: float
+    done: bool
+
+    @property
+    def fraction(self) -> float | None:
+        if self.bytes_total:
+            return min(1.0, self.bytes_done / self.bytes_total)
+        if self.items_total:
+            return min(1.0, self.items_done / self.items_total)
+        return 1.0 if self.done else None
+
+    @property
+    def rate(self) -> float:
+        """
+        bytes per second
+        """
+        elapsed = self.time - self.started
+        return self.bytes_done / elapsed if elapsed > 0 else 0.0
+
+    @property
+    def eta(self) -> float | None:
+        fraction = self.fraction
+        if not fraction or self.done:
+            return None
+        return (self.time - self.started) * (1 - fraction) / fraction
+
+    def to_dict(self) -> dict:
+        return self._asdict() | {'fraction': self.fraction, 'rate': round(self.rate), 'eta': self.eta}
+
+
+_sinks = []
+_active: dict[int, Event] = {}
+_lock = threading.Lock()
+
+
+def subscribe(sink):
+    """
+    :param sink: called with every Event, from the thread doing the work
+    """
+    with _lock:
+        if sink not in _sinks:
+            _sinks.append(sink)
+
+
+def unsubscribe(sink):
+    with _lock:
+        if sink in _sinks:
+            _sinks.remove(sink)
+
+
+def active() -> list[Event]:
+    """
+    The last event of every running operation
+    """
+    with _lock:
+        return list(_active.values())
+
+
+def _emit(key: int, event: Event):
+    with _lock:
+        if event.done:
+            _active.pop(key, None)
+        else:
+            _active[key] = event
+        sinks = list(_sinks)
+    for sink in sinks:
+        try:
+            sink(event)
+        except Exception:
+            logging.exception('progress sink')
+            unsubscribe(sink)
+
+
+class Progress:
+    def __init__(self, phase: str, bytes_total: int = 0, items_total: int = 0):
+        job = jobs.current()
+        self.job = f'{job.id}:{job.name}' if job else threading.current_thread().name
+        self.phase = phase
+        self.bytes_total = bytes_total
+        self.items_total = items_total
+        self.bytes_done = 0
+        self.items_done = 0
+        self.started = time.time()
+        self.last = 0.0
+        self.finished = False
+        self._lock = threading.Lock()
+
+    def _event(self, now: float, done: bool = False) -> Event:
+        return Event(self.job, self.phase, self.bytes_done, self.bytes_total, self.items_done, self.items_total,
+                     self.started, now, done)
+
+    def update(self, bytes_: int = 0, items: int = 0):
+        """
+        Count work done, safe to call from several threads
+        """
+        with self._lock:
+            self.bytes_done += bytes_
+            self.items_done += items
+            now = time.time()
+            if now - self.last < INTERVAL:
+                return
+            self.last = now
+            event = self._event(now)
+        _emit(id(self), event)
+
+    def finish(self):
+        with self._lock:
+            if self.finished:
+                return
+            self.finished = True
+            event = self._event(time.time(), True)
+        _emit(id(self), event)
+
+    def __enter__(self):
+        with self._lock:
+            self.last = time.time()
+            event = self._event(self.last)
+        _emit(id(self), event)
+        return self
+
+    def __exit__(self, exc_type, exc_val, exc_tb):
+        self.finish()
+
+
+def format_event(event: Event) -> str:
+    """
+    One line for humans: system.img 45.2% 12.3 MiB/s ETA 0:12
+    """
+    text = event.phase
+    if (fraction := event.fraction) is not None:
+        text += f' {fraction * 100:.1f}%'
+    elif event.items_done:
+        text += f' {event.items_done}'
+    if event.bytes_done:
+        text += f' {event.rate / 1048576:.1f} MiB/s'
+    if (eta := event.eta) is not None:
+        text += f' ETA {int(eta) // 60}:{int(eta) % 60:02d}'
+    return text + (' Done' if event.done else '')
+
+
+class JsonlSink:
+    """
+    Append every event to a file as one json line, for scripts watching a batch run
+    """
+
+    def __init__(self, path: str):
+        self.path = path
+        self.lock = threading.Lock()
+        self.file = open(path, 'a', encoding='utf-8', newline='\n')
+
+    def __call__(self, event: Event):
+        line = json.dumps(event.to_dict(), ensure_ascii=False) + '\n'
+        with self.lock:
+            self.file.write(line)
+            self.file.flush()
+
+    def close(self):
+        unsubscribe(self)
+        with self.lock:
+            self.file.close()
@@ -12,8 +12,8 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
-from heapq import merge
-from itertools import cycle
+from bisect import bisect_left, bisect_right
+from itertools import accumulate
 from typing import (List, Tuple, Union, Iterator, Optional, TypeVar,
                     Type)
 
@@ -23,6 +23,10 @@ __all__ = ["RangeSet"]
 # allowing for correct type inference with subclasses.
 _RS = TypeVar('_RS', bound='RangeSet')
 
+# Up to this many boundaries of the smaller set are spliced into the larger
+# one, more are merged in a single pass.
+_SPLICE_LIMIT = 64
+
 
 class RangeSet:
     """Represents a set of non-overlapping integer ranges.
@@ -35,6 +39,11 @@ class RangeSet:
     pair of integers represents a half-open interval `[start, end)`.
     For example, the tuple `(10, 20, 30, 35)` represents the integer ranges
     [10, 19] and [30, 34].
+
+    Set operations binary search the boundaries of the larger set and copy the
+    runs between hits by slicing, so their Python work grows with the number
+    of ranges in the smaller set. Block maps of whole images are combined with
+    the few ranges of a single file most of the time.
     """
 
     def __init__(
@@ -77,8 +86,7 @@ class RangeSet:
 
     def __iter__(self) -> Iterator[Tuple[int, int]]:
         """Iterates over the [start, end) tuples of the ranges."""
-        for i in range(0, len(self.data), 2):
-            yield self.data[i], self.data[i + 1]
+        return zip(self.data[0::2], self.data[1::2])
 
     def __eq__(self, other: object) -> bool:
         if not isinstance(other, RangeSet):
@@ -202,102 +210,130 @@ class RangeSet:
             return "0,"
         return str(len(self.data)) + "," + ",".join(map(str, self.data))
 
-    def _set_op(self, other: 'RangeSet',
-                start_z: int, end_z: int) -> 'RangeSet':
-        """Generic sweep-line algorithm for set operations."""
-        out_data = []
-        z = 0
-        # Create iterators of (point, delta) tuples for the sweep-line.
-        # Delta is +1 for a start point and -1 for an end point.
-        self_events = zip(self.data, cycle((+1, -1)))
-        other_events = zip(other.data, cycle((+1, -1)))
-
-        for point, delta in merge(self_events, other_events):
-            z_before = z
-            z += delta
-            if z_before == start_z and z > start_z:
-                out_data.append(point)
-            elif z_before == end_z and z < end_z:
-                out_data.append(point)
-        return self.__class__(data=tuple(out_data))
+    @classmethod
+    def _from_data(cls: Type[_RS], data: Tuple[int, ...]) -> _RS:
+        """Wraps boundaries that are already sorted and merged, skipping the
+        normalization done by the constructor."""
+        obj = cls.__new__(cls)
+        obj.data = data
+        obj.monotonic = False
+        return obj
+
+    def _splice(self: _RS, other: _RS, union: bool) -> _RS:
+        """Adds (union) or removes (subtract) the few ranges of `other`.
+
+        Each range of `other` replaces the boundaries it covers by slicing,
+        which costs a memmove of the boundary list per range instead of
+        Python work per boundary.
+        """
+        data = list(self.data)
+        o = other.data
+        for k in range(len(o) - 2, -1, -2):
+            s, e = o[k], o[k + 1]
+            if union:
+                # Starts and ends touching [s, e) are merged into it.
+                i = bisect_left(data, s)
+                j = bisect_right(data, e)
+                data[i:j] = ([s] if i % 2 == 0 else []) + ([e] if j % 2 == 0 else [])
+            else:
+                i = bisect_left(data, s)
+                j = bisect_right(data, e)
+                data[i:j] = ([s] if i % 2 else []) + ([e] if j % 2 else [])
+        return self._from_data(tuple(data))
+
+    @staticmethod
+    def _clip(ranges: Tuple[int, ...], small: Tuple[int, ...],
+              inside: bool) -> List[int]:
+        """Clips the ranges of `small` by the boundaries of `ranges`.
+
+        With `inside` the parts of `small` covered by `ranges` are returned,
+        otherwise the parts not covered. The boundaries of `ranges` that fall
+        within a range of `small` are copied by slicing, so the Python work
+        is per range of `small`, not per boundary of `ranges`.
+        """
+        out = []
+        first = 1 if inside else 0
+        for k in range(0, len(small), 2):
+            s, e = small[k], small[k + 1]
+            i = bisect_right(ranges, s)
+            j = bisect_left(ranges, e)
+            if i % 2 == first:
+                out.append(s)
+            out.extend(ranges[i:j])
+            if j % 2 == first:
+                out.append(e)
+        return out
+
+    @staticmethod
+    def _merge(a: Tuple[int, ...], b: Tuple[int, ...]) -> List[int]:
+        """Union of two boundary tuples of similar size in one linear pass."""
+        out = []
+        i = j = 0
+        la, lb = len(a), len(b)
+        while i < la or j < lb:
+            if j >= lb or (i < la and a[i] <= b[j]):
+                s, e = a[i], a[i + 1]
+                i += 2
+            else:
+                s, e = b[j], b[j + 1]
+                j += 2
+            if out and s <= out[-1]:
+                if e > out[-1]:
+                    out[-1] = e
+            else:
+                out.append(s)
+                out.append(e)
+        return out
 
     def union(self: _RS, other: _RS) -> _RS:
         """Returns the union of this set and another.
 
-        A new range in the union starts when the number of active ranges goes
-        from 0 to 1, and ends when it goes from 1 to 0.
+        The ranges of the smaller set are spliced into the larger one when it
+        has only a few, otherwise both are merged in one pass.
         """
-        out_data = []
-        z = 0
-        self_events = zip(self.data, cycle((+1, -1)))
-        other_events = zip(other.data, cycle((+1, -1)))
-
-        for point, delta in merge(self_events, other_events):
-            if z == 0 and delta == +1:  # A new range begins
-                out_data.append(point)
-            elif z == 1 and delta == -1:  # A combined range ends
-                out_data.append(point)
-            z += delta
-        return self.__class__(data=tuple(out_data))
+        if not other.data:
+            return self._from_data(self.data)
+        if not self.data:
+            return self._from_data(other.data)
+        big, small = (self, other) if len(self.data) >= len(other.data) else (other, self)
+        if len(small.data) <= _SPLICE_LIMIT:
+            return self._from_data(big._splice(small, True).data)
+        return self._from_data(tuple(self._merge(self.data, other.data)))
 
     def intersect(self: _RS, other: _RS) -> _RS:
         """Returns the intersection of this set and another.
 
-        A new range in the intersection starts when the number of active ranges
-        goes from 1 to 2, and ends when it goes from 2 to 1.
+        Every range of the smaller set is clipped by the larger one.
         """
-        out_data = []
-        z = 0
-        self_events = zip(self.data, cycle((+1, -1)))
-        other_events = zip(other.data, cycle((+1, -1)))
-
-        for point, delta in merge(self_events, other_events):
-            if z == 1 and delta == +1:  # Overlap begins
-                out_data.append(point)
-            elif z == 2 and delta == -1:  # Overlap ends
-                out_data.append(point)
-            z += delta
-        return self.__class__(data=tuple(out_data))
+        big, small = (self, other) if len(self.data) >= len(other.data) else (other, self)
+        return self._from_data(tuple(self._clip(big.data, small.data, True)))
 
     def subtract(self: _RS, other: _RS) -> _RS:
         """Returns the set of integers in `self` but not in `other`.
 
-        This is implemented by inverting the effect of `other`'s ranges on
-        the sweep-line counter. A range starts when `self` starts while not
-        inside `other`, and ends when `self` ends.
+        A few ranges of `other` are cut out of `self` directly, otherwise
+        every range of `self` is clipped by `other`.
         """
-        out_data = []
-        z = 0
-        # Invert the delta for `other`: a start point decreases z, an end
-        # point increases it. This effectively subtracts `other`'s regions.
-        self_events = zip(self.data, cycle((+1, -1)))
-        other_events = zip(other.data, cycle((-1, +1)))
-
-        for point, delta in merge(self_events, other_events):
-            if z == 0 and delta == +1:  # Start of a self-range, outside other
-                out_data.append(point)
-            elif z == 1 and delta == -1:  # End of a self-range
-                out_data.append(point)
-            z += delta
-        return self.__class__(data=tuple(out_data))
+        if not self.data or not other.data:
+            return self._from_data(self.data)
+        if len(other.data) <= _SPLICE_LIMIT and len(other.data) < len(self.data):
+            return self._splice(other, False)
+        return self._from_data(tuple(self._clip(other.data, self.data, False)))
 
     def overlaps(self, other: 'RangeSet') -> bool:
         """Returns True if the sets have any integers in common."""
-        z = 0
-        self_events = zip(self.data, cycle((+1, -1)))
-        other_events = zip(other.data, cycle((+1, -1)))
-
-        for _, delta in merge(self_events, other_events):
-            z += delta
-            # If z reaches 2, it means a point is covered by ranges from
-            # both sets, so an overlap exists.
-            if z == 2:
+        big, small = (self.data, other.data) if len(self.data) >= len(other.data) else (other.data, self.data)
+        for k in range(0, len(small), 2):
+            i = bisect_right(big, small[k])
+            # The start is inside a range of big, or the next range of big
+            # starts before this one ends.
+            if i % 2 or (i < len(big) and big[i] < small[k + 1]):
                 return True
         return False
 
     def size(self) -> int:
         """Returns the total number of integers in all ranges."""
-        return sum(e - s for s, e in self)
+        return sum(self.data[1::2]) - sum(self.data[0::2])
 
     def map_within(self: _RS, other: _RS) -> _RS:
         """Maps ranges from `other` into the contiguous space of `self`.
@@ -327,32 +363,22 @@ class RangeSet:
         Raises:
             ValueError: If `other` is not a subset of `self`.
         """
-        if not self.intersect(other) == other:
-            raise ValueError("'other' must be a subset of 'self'")
-
+        data = self.data
+        # offsets[k] is the number of integers in the ranges of self before range k.
+        offsets = [0, *accumulate(e - s for s, e in self)]
         out_data = []
-        self_offset = 0
-        self_active_start = 0
-
-        # Event types for the sweep-line:
-        # -5: self range starts
-        # +5: self range ends
-        # -1: other range starts
-        # +1: other range ends
-        self_events = zip(self.data, cycle((-5, +5)))
-        other_events = zip(other.data, cycle((-1, +1)))
-
-        for point, event in merge(self_events, other_events):
-            if event == -5:  # self range starts
-                self_active_start = point
-            elif event == +5:  # self range ends
-                self_offset += (point - self_active_start)
-            else:  # an 'other' event
-                # Map the point from `other` into the 0-based contiguous space of `self`.
-                mapped_point = self_offset + (point - self_active_start)
-                out_data.append(mapped_point)
-
-        return self.__class__(data=tuple(out_data))
+        o = other.data
+        for k in range(0, len(o), 2):
+            s, e = o[k], o[k + 1]
+            i = bisect_right(data, s)
+            # Ranges of self never touch, so a subset range lies within one of them.
+            if i % 2 == 0 or e > data[i]:
+                raise ValueError("'other' must be a subset of 'self'")
+            base = offsets[i // 2] - data[i - 1]
+            out_data.append(base + s)
+            out_data.append(base + e)
+        # The mapped ranges are sorted, adjacent ones still have to be merged.
+        return self._from_data(tuple(self._remove_pairs(out_data)))
 
     def extend(self: _RS, n: int) -> _RS:
         """Returns a new set with each range extended by `n` on both sides.
@@ -369,19 +395,17 @@ class RangeSet:
         if n < 0:
             raise ValueError("Cannot extend by a negative value.")
         if n == 0 or not self.data:
-            return self.__class__(data=self.data)
+            return self._from_data(self.data)
 
-        # Create a string representation of all the extended ranges.
-        # This is an efficient way to leverage the robust parsing and merging
-        # logic in the constructor.
-        extended_ranges = []
+        out_data = []
         for s, e in self:
-            s_ext = max(0, s - n)
-            e_ext = e + n
-            # to_string expects inclusive end, so e_ext-1
-            extended_ranges.append(f"{s_ext}-{e_ext-1}")
-
-        return self.parse(" ".join(extended_ranges))
+            s = max(0, s - n)
+            if out_data and s <= out_data[-1]:
+                out_data[-1] = e + n
+            else:
+                out_data.append(s)
+                out_data.append(e + n)
+        return self._from_data(tuple(out_data))
 
     def first(self: _RS, n: int) -> _RS:
         """Returns a new set containing the first `n` integers from this set.
@@ -398,22 +422,14 @@ class RangeSet:
         if n < 0:
             raise ValueError("Number of integers 'n' cannot be negative.")
         if n == 0:
-            return self.__class__(data=())
-        if self.size() <= n:
-            return self.__class__(data=self.data)
+            return self._from_data(())
 
-        out_data = []
         count = 0
-        for s, e in self:
-            size = e - s
+        data = self.data
+        for k in range(0, len(data), 2):
+            size = data[k + 1] - data[k]
             if count + size >= n:
-                # This range contains the nth integer. Take a partial slice and stop.
-                needed = n - count
-                out_data.extend((s, s + needed))
-                break
-            else:
-                # Take the whole range and continue.
-                out_data.extend((s, e))
-                count += size
-
-        return self.__class__(data=tuple(out_data))
+                # This range contains the nth integer, take a slice of it and stop.
+                return self._from_data(data[:k + 1] + (data[k] + n - count,))
+            count += size
+        return self._from_data(data)
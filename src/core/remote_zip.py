@@ -0,0 +1,246 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+Read files stored inside a remote zip through HTTP range requests,
+only the central directory and the requested bytes are downloaded.
+"""
+import os
+import struct
+import threading
+import zipfile
+from io import RawIOBase, UnsupportedOperation
+
+import requests
+
+UA = "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/136.0.0.0 Safari/537.36"
+# EOCD + max comment + zip64 locator + zip64 EOCD, what zipfile looks at before the central directory.
+TAIL_SIZE = 22 + 65535 + 20 + 56
+
+
+class HttpRange:
+    """
+    Positional reads of a remote file, every thread gets its own connection.
+    """
+
+    def __init__(self, url: str, timeout: int = 60, retries: int = 3):
+        self.timeout = timeout
+        self.retries = retries
+        self._local = threading.local()
+        self._lock = threading.Lock()
+        self.fetched = 0
+        resp = self.session.head(url, headers={"User-Agent": UA}, allow_redirects=True, timeout=timeout)
+        try:
+            if resp.status_code != 200:
+                raise ValueError(f"HTTP request failed with status {resp.status_code}")
+            self.url = resp.url
+            self.size = int(resp.headers.get("Content-Length", 0))
+            ranges = resp.headers.get("Accept-Ranges", "none") == "bytes"
+        finally:
+            resp.close()
+        if not ranges or not self.size:
+            # Some servers only answer ranges on GET, ask for the first byte to find out.
+            with self.session.get(self.url, headers={"User-Agent": UA, "Range": "bytes=0-0"}, stream=True,
+                                  timeout=timeout) as resp:
+                if resp.status_code != 206:
+                    raise UnsupportedOperation("Remote does not support range requests!")
+                self.size = int(resp.headers.get("Content-Range", "*/0").rsplit('/', 1)[1])
+        if not self.size:
+            raise ValueError("Could not determine content length")
+
+    @property
+    def session(self) -> requests.Session:
+        if not hasattr(self._local, 'session'):
+            self._local.session = requests.Session()
+        return self._local.session
+
+    def pread(self, offset: int, size: int) -> bytes:
+        """
+        Read size bytes at offset, the request is retried on connection errors
+        :param offset: offset in the remote file
+        :param size: bytes to read
+        :return:
+        """
+        size = min(size, self.size - offset)
+        if size <= 0:
+            return b''
+        headers = {"User-Agent": UA, "Range": f"bytes={offset}-{offset + size - 1}"}
+        for attempt in range(self.retries):
+            try:
+                resp = self.session.get(self.url, headers=headers, timeout=self.timeout)
+                if resp.status_code != 206:
+                    raise UnsupportedOperation(f"Remote did not return partial content! ({resp.status_code})")
+                data = resp.content
+                if len(data) != size:
+                    raise IOError(f"Short read at {offset}: {len(data)}/{size}")
+                with self._lock:
+                    self.fetched += size
+                return data
+            except (requests.ConnectionError, requests.Timeout, IOError):
+                if attempt == self.retries - 1:
+                    raise
+        return b''
+
+
+class RemoteFile(RawIOBase):
+    """
+    Seekable view of [offset, offset + size) of a HttpRange.
+    Small reads are served from a readahead block so parsers reading a few bytes at a time stay cheap.
+    """
+
+    def __init__(self, source: HttpRange, offset: int = 0, size: int = None, readahead: int = 1024 * 1024):
+        super().__init__()
+        self.source = source
+        self.offset = offset
+        self.size = source.size - offset if size is None else size
+        self.readahead = readahead
+        self.pos = 0
+        self._cache_start = 0
+        self._cache = b''
+
+    seekable = lambda self: True
+    readable = lambda self: True
+    writable = lambda self: False
+
+    def prime(self, start: int, size: int):
+        """
+        Fill the readahead block with [start, start + size)
+        """
+        start = max(start, 0)
+        self._cache = self.pread(start, size)
+        self._cache_start = start
+
+    def pread(self, pos: int, size: int) -> bytes:
+        size = min(size, self.size - pos)
+        if size <= 0:
+            return b''
+        return self.source.pread(self.offset + pos, size)
+
+    def readinto(self, buffer) -> int:
+        size = min(len(buffer), self.size - self.pos)
+        if size <= 0:
+            return 0
+        start = self.pos - self._cache_start
+        if not (0 <= start and start + size <= len(self._cache)):
+            if size >= self.readahead:
+                data = self.pread(self.pos, size)
+                buffer[:size] = data
+                self.pos += size
+                return size
+            self.prime(self.pos, self.readahead)
+            start = 0
+        buffer[:size] = self._cache[start:start + size]
+        self.pos += size
+        return size
+
+    def seek(self, offset: int, whence: int = os.SEEK_SET) -> int:
+        if whence == os.SEEK_SET:
+            new_pos = offset
+        elif whence == os.SEEK_CUR:
+            new_pos = self.pos + offset
+        elif whence == os.SEEK_END:
+            new_pos = self.size + offset
+        else:
+            raise UnsupportedOperation(f"unsupported seek whence! {whence}")
+        if new_pos < 0:
+            raise ValueError(f"invalid position to seek: {new_pos}")
+        self.pos = new_pos
+        return new_pos
+
+    def tell(self) -> int:
+        return self.pos
+
+
+class RemoteZip:
+    """
+    A zip on a HTTP server, only the tail and the central directory are fetched on open.
+    """
+
+    def __init__(self, url: str = None, source: HttpRange = None):
+        self.source = source or HttpRange(url)
+        index = RemoteFile(self.source, readahead=64 * 1024)
+        index.prime(self.source.size - TAIL_SIZE, TAIL_SIZE)
+        self.zip = zipfile.ZipFile(index)
+
+    def namelist(self) -> list:
+        return self.zip.namelist()
+
+    def find(self, suffix: str) -> zipfile.ZipInfo | None:
+        for info in self.zip.infolist():
+            if info.filename.endswith(suffix):
+                return info
+        return None
+
+    def open_stored(self, name: str | zipfile.ZipInfo) -> RemoteFile:
+        """
+        Return a seekable RemoteFile of a stored (uncompressed) entry
+        :param name: entry name or ZipInfo
+        :return:
+        """
+        info = name if isinstance(name, zipfile.ZipInfo) else self.zip.getinfo(name)
+        if info.compress_type != zipfile.ZIP_STORED:
+            raise UnsupportedOperation(f"{info.filename} is compressed, it cannot be read by ranges!")
+        header = self.source.pread(info.header_offset, zipfile.sizeFileHeader)
+        fields = struct.unpack(zipfile.structFileHeader, header)
+        if fields[zipfile._FH_SIGNATURE] != zipfile.stringFileHeader:
+            raise zipfile.BadZipFile(f"Bad local file header of {info.filename}")
+        data_offset = (info.header_offset + zipfile.sizeFileHeader + fields[zipfile._FH_FILENAME_LENGTH] +
+                       fields[zipfile._FH_EXTRA_FIELD_LENGTH])
+        return RemoteFile(self.source, data_offset, info.file_size)
+
+    def close(self):
+        self.zip.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_val, exc_tb):
+        self.close()
+
+
+def open_remote_payload(url: str) -> RemoteFile:
+    """
+    Return a RemoteFile of the payload.bin at url, either a bare payload.bin or one stored in an OTA zip
+    :param url: url of payload.bin or an OTA zip
+    :return:
+    """
+    source = HttpRange(url)
+    if source.pread(0, 4) == b"CrAU":
+        return RemoteFile(source)
+    remote = RemoteZip(source=source)
+    if (info := remote.find("payload.bin")) is None:
+        raise FileNotFoundError("payload.bin not found in the remote zip!")
+    return remote.open_stored(info)
+
+
+def plan_ranges(spans: list, max_gap: int = 256 * 1024, max_size: int = 32 * 1024 * 1024) -> list:
+    """
+    Coalesce (offset, length, item) spans into (start, end, [spans]) requests.
+    Spans closer than max_gap are merged as long as a request stays under max_size,
+    the gap bytes are downloaded and thrown away, which is cheaper than another round trip.
+    :param spans: (offset, length, item)
+    :param max_gap: biggest hole merged into a request
+    :param max_size: biggest request
+    :return:
+    """
+    ranges = []
+    for span in sorted(spans, key=lambda x: x[0]):
+        offset, length, _ = span
+        if ranges:
+            start, end, items = ranges[-1]
+            if offset - end <= max_gap and offset + length - start <= max_size:
+                ranges[-1] = (start, max(end, offset + length), items)
+                items.append(span)
+                continue
+        ranges.append((offset, offset + length, [span]))
+    return ranges
@@ -0,0 +1,290 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+Quick ROM scan.
+The build.prop files of every partition are read in place through blockdev, nothing is unpacked,
+so the fingerprint, Android version and partition layout of a firmware are known within seconds.
+Usage:
+    report = scan('firmware_dir')  # a directory of images, super.img, payload.bin or an OTA zip
+    print(report['summary'])
+"""
+import argparse
+import contextlib
+import json
+import logging
+import os
+import struct
+import sys
+import zipfile
+from concurrent.futures import ThreadPoolExecutor
+
+from . import blockdev, erofs, ext4
+from .lpunpack import LP_METADATA_GEOMETRY_MAGIC, LP_PARTITION_RESERVED_BYTES
+
+# Checked in every partition, relative to its root.
+PROP_PATHS = (
+    'build.prop',
+    'default.prop',
+    'prop.default',
+    'etc/build.prop',
+    'system/build.prop',
+    'system/etc/prop.default',
+    'vendor/build.prop',
+    'vendor/default.prop',
+    'vendor/odm/etc/build.prop',
+    'odm/etc/build.prop',
+    'product/etc/build.prop',
+    'system_ext/etc/build.prop',
+)
+# Load order of init, properties of a later partition win.
+PARTITION_ORDER = ('system', 'system_ext', 'vendor', 'odm', 'vendor_dlkm', 'odm_dlkm', 'product')
+# summary key: properties checked in order
+SUMMARY_KEYS = {
+    'fingerprint': ('ro.build.fingerprint', 'ro.system.build.fingerprint', 'ro.vendor.build.fingerprint'),
+    'android_version': ('ro.build.version.release', 'ro.system.build.version.release',
+                        'ro.vendor.build.version.release'),
+    'sdk': ('ro.build.version.sdk', 'ro.system.build.version.sdk', 'ro.vendor.build.version.sdk'),
+    'security_patch': ('ro.build.version.security_patch', 'ro.vendor.build.security_patch'),
+    'build_id': ('ro.build.id', 'ro.system.build.id'),
+    'incremental': ('ro.build.version.incremental', 'ro.system.build.version.incremental'),
+    'build_type': ('ro.build.type', 'ro.system.build.type'),
+    'device': ('ro.product.device', 'ro.product.vendor.device', 'ro.product.system.device', 'ro.build.product'),
+    'model': ('ro.product.model', 'ro.product.vendor.model', 'ro.product.system.model'),
+    'brand': ('ro.product.brand', 'ro.product.vendor.brand', 'ro.product.system.brand'),
+    'manufacturer': ('ro.product.manufacturer', 'ro.product.vendor.manufacturer', 'ro.product.system.manufacturer'),
+}
+MAX_LINKS = 8
+
+
+def parse_prop(data: bytes) -> dict:
+    """
+    Parse the content of a build.prop
+    :param data: raw content
+    :return: {key: value}, the last assignment of a key wins
+    """
+    props = {}
+    for line in data.decode('utf-8', errors='replace').splitlines():
+        line = line.strip()
+        if not line or line.startswith('#') or '=' not in line:
+            continue
+        key, value = line.split('=', 1)
+        props[key.strip()] = value.strip()
+    return props
+
+
+def _readlink(inode) -> str:
+    if isinstance(inode, erofs.Inode):
+        return inode.readlink()
+    return inode.open_read().read().decode('utf-8', errors='surrogateescape')
+
+
+def lookup(fs: ext4.Volume | erofs.Volume, path: str):
+    """
+    Resolve path in a filesystem, symlinks are followed, absolute targets start at the root of the filesystem
+    :param fs: the filesystem
+    :param path: path relative to the root
+    :return: the inode of a regular file or None
+    """
+    parts = [i for i in path.split('/') if i]
+    resolved = []
+    links = 0
+    while parts:
+        part = parts.pop(0)
+        if part == '.':
+            continue
+        if part == '..':
+            if resolved:
+                resolved.pop()
+            continue
+        try:
+            inode = fs.root.get_inode(*resolved, part)
+        except (FileNotFoundError, ext4.Ext4Error, erofs.ErofsError):
+            return None
+        if inode.is_symlink:
+            links += 1
+            if links > MAX_LINKS:
+                return None
+            target = _readlink(inode)
+            if target.startswith('/'):
+                resolved = []
+            parts = [i for i in target.split('/') if i] + parts
+            continue
+        resolved.append(part)
+    if not resolved:
+        return None
+    inode = fs.root.get_inode(*resolved)
+    return inode if inode.is_file else None
+
+
+def scan_filesystem(device: blockdev.BlockDevice) -> dict:
+    """
+    Read the known property files of the filesystem on device
+    :param device: partition device
+    :return: {path: {key: value}}
+    """
+    fs = blockdev.open_filesystem(device)
+    files = {}
+    seen = set()
+    for path in PROP_PATHS:
+        inode = lookup(fs, path)
+        if inode is None:
+            continue
+        # system/build.prop and build.prop may be the same file through a link
+        key = getattr(inode, 'inode_idx', None), getattr(inode, 'nid', None)
+        if key in seen:
+            continue
+        seen.add(key)
+        files['/' + path] = parse_prop(inode.open_read().read())
+    return files
+
+
+def _is_super(device: blockdev.BlockDevice) -> bool:
+    return device.pread(LP_PARTITION_RESERVED_BYTES, 4) == struct.pack('<I', LP_METADATA_GEOMETRY_MAGIC)
+
+
+def _stored_payload(path: str) -> blockdev.BlockDevice | None:
+    """
+    Return payload.bin of an OTA zip as a device, it is stored uncompressed so it can be read in place
+    """
+    with zipfile.ZipFile(path) as z:
+        info = next((i for i in z.infolist() if i.filename.endswith('payload.bin')), None)
+        if info is None or info.compress_type != zipfile.ZIP_STORED:
+            return None
+    with open(path, 'rb') as f:
+        f.seek(info.header_offset)
+        header = struct.unpack(zipfile.structFileHeader, f.read(zipfile.sizeFileHeader))
+    offset = (info.header_offset + zipfile.sizeFileHeader + header[zipfile._FH_FILENAME_LENGTH] +
+              header[zipfile._FH_EXTRA_FIELD_LENGTH])
+    return blockdev.RawDevice(path, offset, info.file_size)
+
+
+def collect_partitions(path: str) -> tuple[dict, dict]:
+    """
+    Find the partitions of a firmware
+    :param path: directory of images, an image, super.img, payload.bin or an OTA zip
+    :return: ({name: device}, layout)
+    """
+    partitions = {}
+    layout = {'super': False, 'payload': False}
+    if os.path.isdir(path):
+        images = [os.path.join(path, i) for i in sorted(os.listdir(path)) if
+                  i.endswith('.img') or i == 'payload.bin']
+    else:
+        images = [path]
+    for image in images:
+        try:
+            if image.endswith('.zip'):
+                if (device := _stored_payload(image)) is None:
+                    logging.warning(f"No stored payload.bin in {image}")
+                    continue
+            else:
+                device = blockdev.open_image(image)
+        except (OSError, ValueError):
+            logging.exception('romscan')
+            continue
+        if device.size < 4096:
+            continue
+        if device.pread(0, 4) == b"CrAU":
+            layout['payload'] = True
+            partitions.update(blockdev.payload_partitions(device))
+        elif _is_super(device):
+            layout['super'] = True
+            partitions.update({k: v for k, v in blockdev.lp_partitions(device).items() if v.size})
+        else:
+            partitions[os.path.basename(image).rsplit('.', 1)[0]] = device
+    return partitions, layout
+
+
+def _base_name(name: str) -> str:
+    return name[:-2] if name[-2:] in ('_a', '_b') else name
+
+
+def prop_order(name: str) -> tuple:
+    """
+    Sort key of partitions in the order init loads their props, a later partition overrides an earlier one
+    """
+    base = _base_name(name)
+    # Unknown partitions (my_*, mi_ext, ...) are loaded after the known ones but before product
+    if base == 'product':
+        return len(PARTITION_ORDER) + 1, name
+    return (PARTITION_ORDER.index(base) if base in PARTITION_ORDER else len(PARTITION_ORDER)), name
+
+
+def scan(path: str, workers: int = None) -> dict:
+    """
+    Scan a firmware without unpacking it
+    :param path: directory of images, an image, super.img, payload.bin or an OTA zip
+    :param workers: partitions read in parallel
+    :return: {'summary': {}, 'layout': {}, 'partitions': {name: {'files': {}, 'props': {}}}, 'merged': {}}
+    """
+    partitions, layout = collect_partitions(path)
+
+    def read(name):
+        try:
+            return name, scan_filesystem(partitions[name]), None
+        except ValueError:
+            # Not a filesystem, boot, vbmeta and friends
+            return name, None, None
+        except (Exception, BaseException) as e:
+            logging.exception(f'romscan {name}')
+            return name, None, str(e)
+
+    with ThreadPoolExecutor(max_workers=workers or min(8, os.cpu_count() or 1)) as executor:
+        results = list(executor.map(read, sorted(partitions, key=prop_order)))
+
+    report = {}
+    merged = {}
+    for name, files, error in results:
+        if error:
+            report[name] = {'error': error}
+            continue
+        if files is None:
+            continue
+        props = {}
+        for i in files.values():
+            props.update(i)
+        report[name] = {'files': files, 'props': props}
+        merged.update(props)
+
+    names = {_base_name(i) for i in partitions}
+    layout['dynamic'] = layout['super'] or merged.get('ro.boot.dynamic_partitions') == 'true'
+    layout['ab'] = layout['payload'] or any(i.endswith('_b') for i in partitions) or \
+                   merged.get('ro.build.ab_update') == 'true'
+    layout['virtual_ab'] = merged.get('ro.virtual_ab.enabled') == 'true'
+    layout['partitions'] = sorted(names)
+    summary = {}
+    for key, candidates in SUMMARY_KEYS.items():
+        summary[key] = next((merged[i] for i in candidates if merged.get(i)), '')
+    return {'summary': summary, 'layout': layout, 'partitions': report, 'merged': merged}
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Show the properties of a ROM without unpacking it")
+    parser.add_argument('path', help="directory of images, an image, super.img, payload.bin or an OTA zip")
+    parser.add_argument('-o', '--output', help="output json file, stdout by default")
+    parser.add_argument('-j', '--jobs', type=int, default=None, help="partitions read in parallel")
+    args = parser.parse_args()
+    # Image readers talk on stdout, keep it for the report.
+    with contextlib.redirect_stdout(sys.stderr):
+        report = scan(args.path, args.jobs)
+    if args.output:
+        with open(args.output, 'w', encoding='utf-8', newline='\n') as f:
+            json.dump(report, f, indent=4, ensure_ascii=False)
+    else:
+        json.dump(report, sys.stdout, indent=4, ensure_ascii=False)
+        print()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,294 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+Rebuild precompiled_sepolicy of a project after the *.cil files were edited.
+init only loads the precompiled policy when the sha256 files of system, system_ext and product match the copies
+next to it, otherwise it compiles the split policy at every boot. With secilc the policy is compiled the way init
+does and every hash pair is rewritten, compiled policies are cached by the hash of their inputs.
+The hashes of the cil files of all partitions precompiled_sepolicy was built from are kept in the project, so edits
+of vendor and odm policies, which have no hash file of their own, are found too.
+Without secilc precompiled_sepolicy is invalidated instead and init compiles the policy at boot.
+"""
+import hashlib
+import json
+import logging
+import os
+import shutil
+import struct
+
+from .utils import call, tool_bin
+
+SELINUX_MAGIC = 0xF97CFF8C
+DEFAULT_POLICY_VERSION = 30
+CACHE_ENTRIES = 4
+
+
+def partition_root(work: str, name: str) -> str | None:
+    """
+    The root of a partition in an unpacked project, partitions may live inside system or vendor
+    :param work: project path
+    :param name: system, system_ext, product, vendor or odm
+    :return:
+    """
+    candidates = {
+        'system': ['system/system', 'system'],
+        'system_ext': ['system_ext', 'system/system/system_ext', 'system/system_ext'],
+        'product': ['product', 'system/system/product', 'system/product'],
+        'vendor': ['vendor'],
+        'odm': ['odm', 'vendor/odm'],
+    }[name]
+    for i in candidates:
+        path = os.path.join(work, i)
+        if os.path.isdir(os.path.join(path, 'etc', 'selinux')):
+            return path
+    return None
+
+
+def _selinux(root: str | None, *name: str) -> str | None:
+    if root is None:
+        return None
+    path = os.path.join(root, 'etc', 'selinux', *name)
+    return path if os.path.isfile(path) else None
+
+
+def _sha256(*files: str) -> str:
+    h = hashlib.sha256()
+    for i in files:
+        with open(i, 'rb') as f:
+            while data := f.read(1024 * 1024):
+                h.update(data)
+    return h.hexdigest()
+
+
+def find_secilc(configured: str = '') -> str | None:
+    """
+    :param configured: path set by the user, used first
+    :return: secilc from the setting, bin or PATH
+    """
+    for i in (configured, f'{tool_bin}secilc', f'{tool_bin}secilc.exe'):
+        if i and os.path.isfile(i):
+            return i
+    return shutil.which('secilc')
+
+
+def policy_version(precompiled: str) -> int:
+    """
+    Version of a binary policy, the new one is compiled with the same version
+    """
+    try:
+        with open(precompiled, 'rb') as f:
+            magic, length = struct.unpack('<2I', f.read(8))
+            if magic != SELINUX_MAGIC:
+                return DEFAULT_POLICY_VERSION
+            f.seek(length, os.SEEK_CUR)
+            return struct.unpack('<I', f.read(4))[0]
+    except (OSError, struct.error):
+        return DEFAULT_POLICY_VERSION
+
+
+class SplitPolicy:
+    def __init__(self, work: str):
+        self.work = work
+        self.roots = {i: partition_root(work, i) for i in ('system', 'system_ext', 'product', 'vendor', 'odm')}
+        self.vendor_version = ''
+        if vers := _selinux(self.roots['vendor'], 'plat_sepolicy_vers.txt'):
+            with open(vers, 'r', encoding='utf-8') as f:
+                self.vendor_version = f.read().strip()
+        # odm wins over vendor, like init
+        self.precompiled = _selinux(self.roots['odm'], 'precompiled_sepolicy') or \
+                           os.path.join(self.roots['vendor'] or work, 'etc', 'selinux', 'precompiled_sepolicy')
+        # {cil file relative to the project: sha256} of the inputs precompiled_sepolicy was built from
+        self.record_file = os.path.join(work, 'config', 'sepolicy_inputs.json')
+
+    @property
+    def valid(self) -> bool:
+        return bool(self.vendor_version and _selinux(self.roots['system'], 'plat_sepolicy.cil') and
+                    self.roots['vendor'])
+
+    def _mapping(self, root: str, suffix: str = 'cil') -> str | None:
+        return _selinux(root, 'mapping', f'{self.vendor_version}.{suffix}')
+
+    def hash_pairs(self) -> list[tuple[str, str, list]]:
+        """
+        :return: [(hash file of the partition, hash file next to precompiled_sepolicy, hashed cil files)]
+        """
+        selinux = os.path.dirname(self.precompiled)
+        pairs = []
+        for name, policy, hash_name in (
+                ('system', 'plat_sepolicy.cil', 'plat_sepolicy_and_mapping.sha256'),
+                ('system_ext', 'system_ext_sepolicy.cil', 'system_ext_sepolicy_and_mapping.sha256'),
+                ('product', 'product_sepolicy.cil', 'product_sepolicy_and_mapping.sha256')):
+            root = self.roots[name]
+            if not (cil := _selinux(root, policy)):
+                continue
+            files = [cil] + ([mapping] if (mapping := self._mapping(root)) else [])
+            pairs.append((os.path.join(root, 'etc', 'selinux', hash_name),
+                          os.path.join(selinux, f'precompiled_sepolicy.{hash_name}'), files))
+        # Android 8 - 10 only hashed the platform policy under another name
+        legacy = os.path.join(selinux, 'precompiled_sepolicy.plat_and_mapping.sha256')
+        if os.path.exists(legacy) and pairs:
+            pairs.append((os.path.join(self.roots['system'], 'etc', 'selinux', 'plat_and_mapping_sepolicy.cil.sha256'),
+                          legacy, pairs[0][2]))
+        return pairs
+
+    def inputs(self) -> list[str]:
+        """
+        The cil files of the five partitions in the order init passes them to secilc
+        """
+        system, system_ext, product = self.roots['system'], self.roots['system_ext'], self.roots['product']
+        vendor, odm = self.roots['vendor'], self.roots['odm']
+        files = [
+            _selinux(system, 'plat_sepolicy.cil'),
+            self._mapping(system),
+            self._mapping(system, 'compat.cil'),
+            _selinux(system_ext, 'system_ext_sepolicy.cil'),
+            self._mapping(system_ext),
+            self._mapping(system_ext, 'compat.cil'),
+            _selinux(product, 'product_sepolicy.cil'),
+            self._mapping(product),
+            _selinux(vendor, 'plat_pub_versioned.cil'),
+            _selinux(vendor, 'vendor_sepolicy.cil') or _selinux(vendor, 'nonplat_sepolicy.cil'),
+            _selinux(odm, 'odm_sepolicy.cil'),
+        ]
+        return [i for i in files if i]
+
+    def digests(self) -> dict[str, str]:
+        return {os.path.relpath(i, self.work).replace('\\', '/'): _sha256(i) for i in self.inputs()}
+
+    def key(self, version: int, digests: dict[str, str]) -> str:
+        return hashlib.sha256(json.dumps([version, digests], sort_keys=True).encode()).hexdigest()
+
+    def recorded(self) -> dict[str, str]:
+        try:
+            with open(self.record_file, 'r', encoding='utf-8') as f:
+                return json.load(f)
+        except (OSError, ValueError):
+            return {}
+
+    def record(self, digests: dict[str, str]):
+        os.makedirs(os.path.dirname(self.record_file), exist_ok=True)
+        with open(self.record_file, 'w', encoding='utf-8', newline='\n') as f:
+            json.dump(digests, f, indent=4, sort_keys=True)
+
+    def changed(self, digests: dict[str, str]) -> list[str]:
+        """
+        The cil files that differ from the ones precompiled_sepolicy was built from.
+        Files without a recorded hash are only found through the hash file of their partition.
+        """
+        recorded = self.recorded()
+        changed = [i for i, digest in digests.items() if recorded.get(i, digest) != digest]
+        changed += [i for i in recorded if i not in digests]
+        for partition_file, precompiled_file, files in self.hash_pairs():
+            if not os.path.isfile(partition_file):
+                continue
+            with open(partition_file, 'r', encoding='utf-8') as f:
+                if f.read().strip() != _sha256(*files):
+                    changed.append(os.path.relpath(partition_file, self.work).replace('\\', '/'))
+            # Invalidated before
+            if not os.path.isfile(precompiled_file):
+                changed.append(os.path.relpath(precompiled_file, self.work).replace('\\', '/'))
+        return changed
+
+    def compile(self, secilc: str, output: str, version: int) -> bool:
+        files = self.inputs()
+        cmd = [secilc, files[0], '-m', '-M', 'true', '-G', '-N', '-c', f'{version}', *files[1:], '-o', output,
+               '-f', os.devnull]
+        return call(cmd, extra_path=False) == 0 and os.path.isfile(output)
+
+    def write_hashes(self):
+        """
+        Rewrite both files of every hash pair from the cil files
+        """
+        for partition_file, precompiled_file, files in self.hash_pairs():
+            digest = _sha256(*files) + '\n'
+            for i in partition_file, precompiled_file:
+                with open(i, 'w', encoding='utf-8', newline='\n') as f:
+                    f.write(digest)
+
+    def invalidate(self):
+        """
+        Remove the hash files next to precompiled_sepolicy, init then compiles the split policy at boot
+        """
+        for _, precompiled_file, _ in self.hash_pairs():
+            if os.path.isfile(precompiled_file):
+                os.remove(precompiled_file)
+
+
+def record(work: str):
+    """
+    Keep the hashes of the cil files of a freshly unpacked project, precompiled_sepolicy was built from them.
+    Files that already have a hash keep it.
+    :param work: project path
+    """
+    policy = SplitPolicy(work)
+    if not policy.valid or not os.path.isfile(policy.precompiled):
+        return
+    policy.record({**policy.digests(), **policy.recorded()})
+
+
+def _prune(cache_dir: str):
+    """
+    Keep the most recently used compiled policies
+    """
+    entries = sorted((os.path.join(cache_dir, i) for i in os.listdir(cache_dir)), key=os.path.getmtime)
+    for i in entries[:-CACHE_ENTRIES]:
+        try:
+            os.remove(i)
+        except OSError:
+            logging.exception('sepolicy')
+
+
+def rebuild(work: str, secilc: str = '') -> bool:
+    """
+    Compile the split policy of the project into precompiled_sepolicy and rewrite the hash files if a cil file
+    changed, a policy compiled before from the same inputs is taken from the cache.
+    Without secilc the stale precompiled_sepolicy is invalidated instead.
+    :param work: project path
+    :param secilc: configured path of secilc, bin and PATH are searched if it is not set
+    :return: True if precompiled_sepolicy matches the cil files
+    """
+    policy = SplitPolicy(work)
+    if not policy.valid or not os.path.isfile(policy.precompiled):
+        return False
+    digests = policy.digests()
+    if not (changed := policy.changed(digests)):
+        return True
+    print(f"Changed sepolicy: {', '.join(changed)}")
+    version = policy_version(policy.precompiled)
+    cache_dir = os.path.join(work, 'config', 'sepolicy_cache')
+    cached = os.path.join(cache_dir, policy.key(version, digests))
+    if os.path.isfile(cached):
+        # Touch it, the cache keeps the most recently used entries.
+        os.utime(cached)
+    elif not (secilc := find_secilc(secilc)):
+        policy.invalidate()
+        print("[W] secilc not found, set secilc in the settings or add it to PATH. "
+              "precompiled_sepolicy is invalidated, the device compiles the policy at every boot.")
+        return False
+    else:
+        os.makedirs(cache_dir, exist_ok=True)
+        print(f"Compiling sepolicy (version {version})...")
+        if not policy.compile(secilc, cached + '.tmp', version):
+            if os.path.exists(cached + '.tmp'):
+                os.remove(cached + '.tmp')
+            policy.invalidate()
+            print("[E] secilc failed, precompiled_sepolicy is invalidated, the device compiles the policy at boot.")
+            return False
+        os.replace(cached + '.tmp', cached)
+        _prune(cache_dir)
+    shutil.copyfile(cached, policy.precompiled)
+    policy.write_hashes()
+    policy.record(digests)
+    print(f"Updated {os.path.relpath(policy.precompiled, work)}")
+    return True
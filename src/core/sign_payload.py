@@ -1,7 +1,17 @@
+import base64
+import hashlib
+import os
+import struct
+
 from cryptography.hazmat.primitives import hashes
 from cryptography.hazmat.primitives.asymmetric import padding, utils
 from cryptography.hazmat.primitives.serialization import load_pem_private_key, load_der_private_key, Encoding, PrivateFormat, NoEncryption
 
+from . import update_metadata_pb2 as um
+
+PAYLOAD_HEADER = '>4sQQI'
+BUFFER_SIZE = 16 * 1024 * 1024
+
 
 def payload_sign(inkey, in_, out):
     with open(inkey, 'rb') as fkey, open(in_, 'rb') as fin_, open(out, 'wb') as fout:
@@ -16,3 +26,131 @@ def private_der_to_pem(inkey, outkey, password=None):
     with open(inkey, 'rb') as f, open(outkey, 'wb') as o:
         key = load_der_private_key(f.read(), password=password)
         o.write(key.private_bytes(encoding=Encoding.PEM, format=PrivateFormat.PKCS8, encryption_algorithm=NoEncryption()))
+
+
+def load_private_key(inkey, password=None):
+    with open(inkey, 'rb') as f:
+        data = f.read()
+    if data.lstrip().startswith(b'-----'):
+        return load_pem_private_key(data, password=password)
+    return load_der_private_key(data, password=password)
+
+
+def _sign_blob(key, digest: bytes, old_blob: bytes) -> bytes:
+    """
+    Sign a sha256 digest and return a Signatures blob with the same layout as old_blob.
+    """
+    signature = key.sign(digest, padding.PKCS1v15(), utils.Prehashed(hashes.SHA256()))
+    sigs = um.Signatures.FromString(old_blob)
+    if not sigs.signatures:
+        sigs.signatures.add()
+    for i in sigs.signatures:
+        i.data = signature
+        # Older payloads have no such field, adding it would grow the blob
+        if i.HasField('unpadded_signature_size'):
+            i.unpadded_signature_size = len(signature)
+    blob = sigs.SerializeToString()
+    if len(blob) != len(old_blob):
+        raise ValueError(f"New signature blob is {len(blob)} bytes but the payload has room for {len(old_blob)}, "
+                         f"use a key of the same size as the original one.")
+    return blob
+
+
+def _update_properties(path: str, values: dict):
+    lines = []
+    if os.path.exists(path):
+        with open(path, 'r', encoding='utf-8') as f:
+            lines = f.read().splitlines()
+    keys = set()
+    for index, line in enumerate(lines):
+        name = line.split('=', 1)[0]
+        if name in values:
+            lines[index] = f"{name}={values[name]}"
+            keys.add(name)
+    lines.extend(f"{name}={value}" for name, value in values.items() if name not in keys)
+    with open(path, 'w', encoding='utf-8', newline='\n') as f:
+        f.write('\n'.join(lines) + '\n')
+
+
+def sign_payload_file(payload: str, inkey: str, properties: str = None, password=None) -> dict:
+    """
+    Re-sign payload.bin in place.
+    The metadata hash, payload hash and whole file hash are computed in one streaming pass,
+    then only the two signature blobs are rewritten, the payload data is never copied.
+    :param payload: payload.bin path
+    :param inkey: private key, PEM or DER
+    :param properties: payload_properties.txt to update, default is the one next to payload.bin if it exists
+    :param password: key password
+    :return: the new payload properties
+    """
+    key = load_private_key(inkey, password)
+    if properties is None:
+        properties = os.path.join(os.path.dirname(os.path.abspath(payload)), 'payload_properties.txt')
+        if not os.path.exists(properties):
+            properties = None
+    file_size = os.path.getsize(payload)
+    with open(payload, 'rb+') as f:
+        header = f.read(struct.calcsize(PAYLOAD_HEADER))
+        magic, version, manifest_size, metadata_sig_size = struct.unpack(PAYLOAD_HEADER, header)
+        if magic != b'CrAU' or version != 2:
+            raise ValueError(f"{payload} is not a version 2 payload!")
+        manifest_data = f.read(manifest_size)
+        manifest = um.DeltaArchiveManifest.FromString(manifest_data)
+        if not manifest.HasField('signatures_offset') or not manifest.signatures_size:
+            raise ValueError(f"{payload} has no room reserved for a payload signature!")
+        metadata_size = len(header) + manifest_size
+        data_start = metadata_size + metadata_sig_size
+        sig_offset = data_start + manifest.signatures_offset
+        if sig_offset + manifest.signatures_size > file_size:
+            raise ValueError(f"{payload} is truncated!")
+
+        metadata_hash = hashlib.sha256(header + manifest_data).digest()
+        payload_hasher = hashlib.sha256(header + manifest_data)
+        file_hasher = hashlib.sha256(header + manifest_data)
+        # The metadata signature covers header + manifest only, it can be made before streaming the data.
+        metadata_sig = _sign_blob(key, metadata_hash, f.read(metadata_sig_size))
+        file_hasher.update(metadata_sig)
+
+        # The payload hash skips the metadata signature and stops at the payload signature.
+        pos = data_start
+        f.seek(pos)
+        while pos < sig_offset:
+            data = f.read(min(BUFFER_SIZE, sig_offset - pos))
+            if not data:
+                raise ValueError(f"{payload} is truncated!")
+            payload_hasher.update(data)
+            file_hasher.update(data)
+            pos += len(data)
+        payload_sig = _sign_blob(key, payload_hasher.digest(), f.read(manifest.signatures_size))
+        file_hasher.update(payload_sig)
+        # Anything after the signature blob still belongs to the file hash.
+        f.seek(sig_offset + manifest.signatures_size)
+        while data := f.read(BUFFER_SIZE):
+            file_hasher.update(data)
+
+        f.seek(metadata_size)
+        f.write(metadata_sig)
+        f.seek(sig_offset)
+        f.write(payload_sig)
+    values = {
+        'FILE_HASH': base64.b64encode(file_hasher.digest()).decode(),
+        'FILE_SIZE': str(file_size),
+        'METADATA_HASH': base64.b64encode(metadata_hash).decode(),
+        'METADATA_SIZE': str(metadata_size),
+    }
+    if properties:
+        _update_properties(properties, values)
+    return values
+
+
+if __name__ == '__main__':
+    import argparse
+
+    parser = argparse.ArgumentParser(prog='sign_payload', description='Re-sign payload.bin in place')
+    parser.add_argument('payload', type=str, help='payload.bin')
+    parser.add_argument('-k', '--key', type=str, dest='key', help='private key, PEM or DER', required=True)
+    parser.add_argument('-p', '--properties', type=str, dest='properties', default=None,
+                        help='payload_properties.txt to update')
+    args = parser.parse_args()
+    for k, v in sign_payload_file(args.payload, args.key, args.properties).items():
+        print(f"{k}={v}")
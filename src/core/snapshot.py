@@ -0,0 +1,514 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+Project snapshots.
+The data of all files is one stream cut into frames of FRAME_SIZE bytes that are compressed in parallel,
+the last frame holds the json index and the zstd seek table closes the file (the seekable format of zstd/contrib),
+so `zstd -d` can still read it and a single file is restored by decompressing only the frames it lies in.
+The index keeps modes, owners, times, xattrs (SELinux labels), symlinks, hardlinks and the data extents of files
+with holes, the entries are grouped by the top level name of the project (a partition folder, config, an image).
+Files with the same content are stored once.
+Usage:
+    export_snapshot('MIO/rom', 'rom.snap')
+    import_snapshot('rom.snap', 'MIO/rom', ['system', 'config/system_fs_config'])
+"""
+import base64
+import errno
+import hashlib
+import json
+import os
+import stat
+import struct
+import threading
+from bisect import bisect_right
+from collections import deque
+from concurrent.futures import ThreadPoolExecutor
+
+import zstandard
+
+from . import jobs, progress, trace
+
+FORMAT = 'mio-snapshot'
+VERSION = 1
+FRAME_SIZE = 4 << 20
+SKIPPABLE_MAGIC = 0x184D2A5E
+SEEKABLE_MAGIC = 0x8F92EAB1
+
+
+class SnapshotError(Exception):
+    pass
+
+
+def _xattrs(path: str) -> dict:
+    if not hasattr(os, 'listxattr'):
+        return {}
+    try:
+        return {name: base64.b64encode(os.getxattr(path, name, follow_symlinks=False)).decode()
+                for name in os.listxattr(path, follow_symlinks=False)}
+    except OSError:
+        return {}
+
+
+def _extents(path: str, size: int) -> list:
+    """
+    Data extents of a file, the holes between them are not stored
+    :return: [[offset, length], ...]
+    """
+    if not size:
+        return []
+    if not hasattr(os, 'SEEK_DATA'):
+        return [[0, size]]
+    extents = []
+    fd = os.open(path, os.O_RDONLY)
+    try:
+        pos = 0
+        while pos < size:
+            try:
+                start = os.lseek(fd, pos, os.SEEK_DATA)
+            except OSError as e:
+                if e.errno == errno.ENXIO:
+                    break
+                return [[0, size]]
+            end = min(os.lseek(fd, start, os.SEEK_HOLE), size)
+            extents.append([start, end - start])
+            pos = end
+    finally:
+        os.close(fd)
+    return extents
+
+
+def _read_extents(path: str, extents: list):
+    """
+    Yield the data of the extents in pieces of at most FRAME_SIZE
+    """
+    with open(path, 'rb') as f:
+        for offset, length in extents:
+            f.seek(offset)
+            while length > 0:
+                data = f.read(min(length, FRAME_SIZE))
+                if not data:
+                    raise SnapshotError(f'{path} changed while it was read')
+                length -= len(data)
+                yield data
+
+
+def _hash(path: str, extents: list) -> str:
+    sha = hashlib.sha256()
+    for data in _read_extents(path, extents):
+        sha.update(data)
+    return sha.hexdigest()
+
+
+def scan(folder: str, skip: str = None) -> list[dict]:
+    """
+    Entries of folder, parents first and the top level names sorted
+    :param folder:
+    :param skip: a path that is left out, the snapshot being written
+    :return:
+    """
+    entries = []
+    inodes = {}
+
+    def add(path: str, rel: str, st: os.stat_result):
+        entry = {'path': rel, 'mode': st.st_mode, 'uid': st.st_uid, 'gid': st.st_gid, 'mtime': st.st_mtime_ns}
+        if xattrs := _xattrs(path):
+            entry['xattrs'] = xattrs
+        if stat.S_ISDIR(st.st_mode):
+            entry['type'] = 'dir'
+        elif stat.S_ISLNK(st.st_mode):
+            entry['type'] = 'symlink'
+            entry['target'] = os.readlink(path)
+        elif stat.S_ISREG(st.st_mode):
+            entry['type'] = 'file'
+            entry['size'] = st.st_size
+            if st.st_nlink > 1 and st.st_ino:
+                if (first := inodes.setdefault((st.st_dev, st.st_ino), rel)) != rel:
+                    entry['link'] = first
+            entry['extents'] = _extents(path, st.st_size)
+        else:
+            entry['type'] = 'special'
+            entry['rdev'] = st.st_rdev
+        entries.append(entry)
+
+    def walk(path: str, rel: str):
+        with os.scandir(path) as it:
+            children = sorted(it, key=lambda i: i.name)
+        for i in children:
+            if skip and os.path.abspath(i.path) == skip:
+                continue
+            st = i.stat(follow_symlinks=False)
+            add(i.path, f'{rel}/{i.name}', st)
+            if stat.S_ISDIR(st.st_mode):
+                walk(i.path, f'{rel}/{i.name}')
+
+    skip = os.path.abspath(skip) if skip else None
+    for name in sorted(os.listdir(folder)):
+        path = os.path.join(folder, name)
+        if skip and os.path.abspath(path) == skip:
+            continue
+        st = os.lstat(path)
+        add(path, name, st)
+        if stat.S_ISDIR(st.st_mode):
+            walk(path, name)
+    return entries
+
+
+class FrameWriter:
+    """
+    Compress a stream as independent frames on a pool and write them in order, with the seek table at the end
+    """
+
+    def __init__(self, out, workers: int, level: int):
+        self.out = out
+        self.level = level
+        self.workers = workers
+        self.executor = ThreadPoolExecutor(max_workers=workers)
+        self.local = threading.local()
+        self.buf = bytearray()
+        self.offset = 0
+        self.frames = []
+        self.pending = deque()
+
+    def _compress(self, data: bytes) -> tuple[bytes, int]:
+        if (compressor := getattr(self.local, 'compressor', None)) is None:
+            compressor = self.local.compressor = zstandard.ZstdCompressor(level=self.level, write_checksum=True)
+        return compressor.compress(data), len(data)
+
+    def _drain(self, keep: int):
+        while len(self.pending) > keep:
+            frame, size = self.pending.popleft().result()
+            self.out.write(frame)
+            self.frames.append((len(frame), size))
+
+    def _frame(self, data: bytes):
+        self.pending.append(self.executor.submit(self._compress, data))
+        self._drain(self.workers * 2)
+
+    def write(self, data: bytes):
+        self.buf += data
+        self.offset += len(data)
+        while len(self.buf) >= FRAME_SIZE:
+            self._frame(bytes(self.buf[:FRAME_SIZE]))
+            del self.buf[:FRAME_SIZE]
+
+    def flush(self):
+        if self.buf:
+            self._frame(bytes(self.buf))
+            self.buf.clear()
+        self._drain(0)
+
+    def close(self, index: bytes):
+        """
+        Write the index as the last frame and the seek table
+        """
+        self.flush()
+        self._frame(index)
+        self._drain(0)
+        self.executor.shutdown()
+        table = b''.join(struct.pack('<II', *i) for i in self.frames)
+        table += struct.pack('<IBI', len(self.frames), 0, SEEKABLE_MAGIC)
+        self.out.write(struct.pack('<II', SKIPPABLE_MAGIC, len(table)) + table)
+
+
+def export_snapshot(folder: str, output: str, workers: int = None, level: int = 3) -> dict:
+    """
+    Write a snapshot of folder
+    :param folder: the project
+    :param output: snapshot file
+    :param workers: compression threads
+    :param level: zstd level
+    :return: counts of the snapshot
+    """
+    workers = workers or os.cpu_count() or 2
+    entries = scan(folder, output)
+    files = [i for i in entries if i['type'] == 'file' and 'link' not in i]
+    # Only files whose data has the same length as another one may be duplicates, those are hashed first
+    by_length = {}
+    for entry in files:
+        by_length.setdefault(sum(i[1] for i in entry['extents']), []).append(entry)
+    candidates = [i for group in by_length.values() if len(group) > 1 for i in group]
+    hashes = dict(zip(map(id, candidates), jobs.parallel(
+        lambda i: _hash(os.path.join(folder, i['path']), i['extents']), candidates, workers=workers)))
+    blobs = []
+    keys = {}
+    paths = {}
+    stored = 0
+    total = sum(sum(i[1] for i in entry['extents']) for entry in files)
+    with open(output, 'wb') as out, \
+            progress.Progress(f'snapshot {os.path.basename(output)}', total, len(entries)) as tracker, \
+            trace.span(f'snapshot {os.path.basename(output)}', bytes=total):
+        writer = FrameWriter(out, workers, level)
+        for entry in entries:
+            jobs.check_cancelled()
+            tracker.update(items=1)
+            if entry['type'] != 'file':
+                continue
+            if 'link' in entry:
+                entry['blob'] = paths[entry['link']]
+                continue
+            length = sum(i[1] for i in entry['extents'])
+            key = (length, hashes.get(id(entry)) or entry['path'], tuple(map(tuple, entry['extents'])))
+            if key in keys:
+                entry['blob'] = paths[entry['path']] = keys[key]
+                tracker.update(length)
+                continue
+            entry['blob'] = paths[entry['path']] = keys[key] = len(blobs)
+            blobs.append([writer.offset, length])
+            for data in _read_extents(os.path.join(folder, entry['path']), entry['extents']):
+                writer.write(data)
+                tracker.update(len(data))
+            stored += length
+        partitions = {}
+        for n, entry in enumerate(entries):
+            top = entry['path'].split('/', 1)[0]
+            partitions.setdefault(top, [n, n])[1] = n + 1
+        index = {'format': FORMAT, 'version': VERSION, 'name': os.path.basename(os.path.normpath(folder)),
+                 'frame_size': FRAME_SIZE, 'partitions': partitions, 'blobs': blobs, 'entries': entries}
+        writer.close(json.dumps(index, ensure_ascii=False, separators=(',', ':')).encode('utf-8'))
+    info = {'entries': len(entries), 'files': len(files), 'duplicates': len(files) - len(blobs), 'data': total,
+            'stored': stored, 'size': os.path.getsize(output)}
+    print(f"Snapshot: {info['entries']} entries, {info['duplicates']} duplicate files, "
+          f"{info['stored']} bytes stored in {info['size']}")
+    return info
+
+
+class SnapshotReader:
+    def __init__(self, path: str, workers: int = None):
+        self.workers = workers or os.cpu_count() or 2
+        self.file = open(path, 'rb')
+        self.lock = threading.Lock()
+        self.local = threading.local()
+        self.cache = (None, b'')
+        try:
+            self._read_table()
+            self.index = json.loads(self._frame(len(self.sizes) - 1))
+        except (ValueError, zstandard.ZstdError, struct.error) as e:
+            self.file.close()
+            raise SnapshotError(f'{path} is not a snapshot: {e}')
+        if self.index.get('format') != FORMAT or self.index.get('version', 0) > VERSION:
+            self.file.close()
+            raise SnapshotError(f'{path} is not a supported snapshot')
+        self.executor = ThreadPoolExecutor(max_workers=self.workers)
+
+    def _read_table(self):
+        self.file.seek(-9, os.SEEK_END)
+        count, descriptor, magic = struct.unpack('<IBI', self.file.read(9))
+        if magic != SEEKABLE_MAGIC:
+            raise ValueError('no seek table')
+        entry_size = 12 if descriptor & 0x80 else 8
+        self.file.seek(-(count * entry_size + 17), os.SEEK_END)
+        skippable, size = struct.unpack('<II', self.file.read(8))
+        if skippable != SKIPPABLE_MAGIC or size != count * entry_size + 9:
+            raise ValueError('bad seek table')
+        table = self.file.read(count * entry_size)
+        self.sizes = [struct.unpack_from('<II', table, i * entry_size) for i in range(count)]
+        # Start of every frame in the file and in the data stream
+        self.offsets = [0]
+        self.starts = [0]
+        for compressed, size in self.sizes:
+            self.offsets.append(self.offsets[-1] + compressed)
+            self.starts.append(self.starts[-1] + size)
+
+    def _frame(self, n: int) -> bytes:
+        with self.lock:
+            if self.cache[0] == n:
+                return self.cache[1]
+            self.file.seek(self.offsets[n])
+            data = self.file.read(self.sizes[n][0])
+        if (decompressor := getattr(self.local, 'decompressor', None)) is None:
+            decompressor = self.local.decompressor = zstandard.ZstdDecompressor()
+        frame = decompressor.decompress(data, max_output_size=self.sizes[n][1])
+        if len(frame) != self.sizes[n][1]:
+            raise SnapshotError(f'frame {n} has a wrong size')
+        with self.lock:
+            self.cache = (n, frame)
+        return frame
+
+    def read(self, offset: int, length: int):
+        """
+        Yield the data at offset of the stream, the frames are decompressed in parallel
+        """
+        first = bisect_right(self.starts, offset) - 1
+        last = bisect_right(self.starts, offset + length - 1) - 1 if length else first - 1
+        pending = deque()
+        frames = iter(range(first, last + 1))
+        for n in frames:
+            pending.append((n, self.executor.submit(self._frame, n)))
+            if len(pending) >= self.workers * 2:
+                break
+        while pending:
+            n, future = pending.popleft()
+            frame = memoryview(future.result())
+            if (following := next(frames, None)) is not None:
+                pending.append((following, self.executor.submit(self._frame, following)))
+            start = self.starts[n]
+            lo = max(offset, start)
+            hi = min(offset + length, start + len(frame))
+            yield frame[lo - start:hi - start]
+
+    def select(self, members: list = None) -> list[dict]:
+        """
+        :param members: partitions, folders or files to restore, everything if empty
+        """
+        entries = self.index['entries']
+        if not members:
+            return entries
+        selected = {}
+        for member in members:
+            member = member.replace('\\', '/').strip('/')
+            if (part := self.index['partitions'].get(member.split('/', 1)[0])) is None:
+                raise SnapshotError(f'{member} is not in the snapshot')
+            found = {n: entries[n] for n in range(*part)
+                     if entries[n]['path'] == member or entries[n]['path'].startswith(member + '/')}
+            if not found:
+                raise SnapshotError(f'{member} is not in the snapshot')
+            selected |= found
+        # In the order of the snapshot, parents before their children
+        return [selected[n] for n in sorted(selected)]
+
+    def close(self):
+        if hasattr(self, 'executor'):
+            self.executor.shutdown()
+        self.file.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_val, exc_tb):
+        self.close()
+
+
+def _target(out_dir: str, rel: str, itself: bool = False) -> str:
+    """
+    The path of an entry under out_dir, rejected if it or a link already on disk leads out of out_dir
+    :param itself: also resolve the last part, for folders that are written into
+    """
+    parts = rel.split('/')
+    if not rel or os.path.isabs(rel) or '..' in parts or ':' in parts[0]:
+        raise SnapshotError(f'unsafe path in snapshot: {rel}')
+    path = os.path.join(out_dir, *parts)
+    root = os.path.realpath(out_dir)
+    resolved = os.path.realpath(path if itself else os.path.dirname(path))
+    if resolved != root and not resolved.startswith(root.rstrip(os.sep) + os.sep):
+        raise SnapshotError(f'unsafe path in snapshot: {rel}')
+    return path
+
+
+def _set_meta(path: str, entry: dict):
+    is_link = entry['type'] == 'symlink'
+    for name, value in entry.get('xattrs', {}).items():
+        try:
+            os.setxattr(path, name, base64.b64decode(value), follow_symlinks=False)
+        except (OSError, AttributeError):
+            pass
+    if hasattr(os, 'geteuid') and os.geteuid() == 0:
+        try:
+            os.chown(path, entry['uid'], entry['gid'], follow_symlinks=False)
+        except OSError:
+            pass
+    if not is_link:
+        os.chmod(path, stat.S_IMODE(entry['mode']))
+    if not is_link or os.utime in os.supports_follow_symlinks:
+        os.utime(path, ns=(entry['mtime'], entry['mtime']), follow_symlinks=not is_link)
+
+
+def _remove(path: str):
+    if os.path.lexists(path) and not (os.path.isdir(path) and not os.path.islink(path)):
+        os.remove(path)
+
+
+def import_snapshot(snapshot: str, out_dir: str, members: list = None, workers: int = None) -> int:
+    """
+    Restore a snapshot, existing files are replaced
+    :param snapshot:
+    :param out_dir: the project
+    :param members: partitions, folders or files to restore, everything if empty
+    :param workers: decompression threads
+    :return: entries restored
+    """
+    with SnapshotReader(snapshot, workers) as reader:
+        entries = reader.select(members)
+        blobs = reader.index['blobs']
+        total = sum(blobs[i['blob']][1] for i in entries if i['type'] == 'file')
+        restored = set()
+        dirs = []
+        # Created after everything else, so no entry is written through a link of the snapshot
+        links = []
+        with progress.Progress(f'restore {os.path.basename(snapshot)}', total, len(entries)) as tracker, \
+                trace.span(f'restore {os.path.basename(snapshot)}', bytes=total):
+            for entry in entries:
+                jobs.check_cancelled()
+                tracker.update(items=1)
+                path = _target(out_dir, entry['path'], entry['type'] == 'dir')
+                os.makedirs(os.path.dirname(path), exist_ok=True)
+                match entry['type']:
+                    case 'dir':
+                        os.makedirs(path, exist_ok=True)
+                        dirs.append((path, entry))
+                        continue
+                    case 'symlink':
+                        links.append((path, entry))
+                        continue
+                    case 'file':
+                        _remove(path)
+                        offset, length = blobs[entry['blob']]
+                        if entry.get('link') in restored:
+                            try:
+                                os.link(_target(out_dir, entry['link']), path)
+                                tracker.update(length)
+                                continue
+                            except OSError:
+                                pass
+                        with jobs.partial(path), open(path, 'wb') as f:
+                            for start, size in entry['extents']:
+                                f.seek(start)
+                                for data in reader.read(offset, size):
+                                    f.write(data)
+                                    tracker.update(len(data))
+                                offset += size
+                            f.truncate(entry['size'])
+                        restored.add(entry['path'])
+                    case _:
+                        _remove(path)
+                        try:
+                            os.mknod(path, entry['mode'], entry['rdev'])
+                        except (OSError, AttributeError) as e:
+                            print(f"Cannot create {entry['path']}: {e}")
+                            continue
+                _set_meta(path, entry)
+            for path, entry in links:
+                jobs.check_cancelled()
+                _target(out_dir, entry['path'])
+                _remove(path)
+                try:
+                    os.symlink(entry['target'], path)
+                except OSError as e:
+                    print(f"Cannot create symlink {entry['path']}: {e}")
+                    continue
+                _set_meta(path, entry)
+            # Deepest first, writing into a folder changes its time
+            for path, entry in reversed(dirs):
+                _set_meta(path, entry)
+    print(f"Restored {len(entries)} entries from {snapshot}")
+    return len(entries)
+
+
+def list_snapshot(snapshot: str) -> dict:
+    """
+    :return: {partition: (entries, bytes)}
+    """
+    with SnapshotReader(snapshot) as reader:
+        entries = reader.index['entries']
+        return {name: (end - start, sum(i.get('size', 0) for i in entries[start:end]))
+                for name, (start, end) in reader.index['partitions'].items()}
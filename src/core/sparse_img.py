@@ -12,12 +12,18 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
+import mmap
 import os
 import struct
 import sys
+import threading
 from bisect import bisect_right
+from hashlib import sha1
 
-from . import rangelib
+from . import jobs, rangelib
+
+# Fill chunks are expanded at most this many blocks at a time.
+FILL_PIECE_BLOCKS = 1024
 
 
 class SparseImage:
@@ -29,11 +35,18 @@ class SparseImage:
   of blocks that should be always written to the target regardless of the old
   contents (i.e. copying instead of patching). clobbered_blocks should be in
   the form of a string like "0" or "0 1-5 8".
+
+  With allow_raw a raw image is read as if it were one raw chunk, so it does
+  not have to be converted to sparse first.
   """
 
     def __init__(self, simg_fn, file_map_fn=None, clobbered_blocks=None,
-                 mode="rb", build_map=True):
+                 mode="rb", build_map=True, allow_raw=False):
+        self.simg_fn = simg_fn
         self.simg_f = f = open(simg_fn, mode)
+        self._mm = None
+        self._mm_lock = threading.Lock()
+        self._fill_cache = {}
 
         header_bin = f.read(28)
         header = struct.unpack("<I4H4I", header_bin)
@@ -47,6 +60,15 @@ class SparseImage:
         self.total_blocks = total_blks = header[6]
         self.total_chunks = total_chunks = header[7]
 
+        if magic != 0xED26FF3A and allow_raw:
+            size = os.path.getsize(simg_fn)
+            if size % 4096:
+                raise ValueError(f"Raw image size ({size:d}) is not a multiple of 4096")
+            self.blocksize = blk_sz = 4096
+            self.total_blocks = total_blks = size // blk_sz
+            self.total_chunks = total_chunks = 0
+            magic, major_version, minor_version, file_hdr_sz, chunk_hdr_sz = 0xED26FF3A, 1, 0, 28, 12
+
         if magic != 0xED26FF3A:
             raise ValueError(f"Magic should be 0xED26FF3A but is 0x{magic:08X}")
         if major_version != 1 or minor_version != 0:
@@ -66,6 +88,10 @@ class SparseImage:
         self.offset_map = offset_map = []
         self.clobbered_blocks = rangelib.RangeSet(data=clobbered_blocks)
 
+        if not total_chunks and total_blks:
+            care_data = [0, total_blks]
+            offset_map.append((0, total_blks, 0, None))
+
         for i in range(total_chunks):
             header_bin = f.read(12)
             header = struct.unpack("<2H2I", header_bin)
@@ -132,38 +158,99 @@ class SparseImage:
     particular is not necessarily equal to the number of ranges in
     'ranges'.
 
-    This generator is stateful -- it depends on the open file object
-    contained in this SparseImage, so you should not try to run two
-    instances of this generator on the same object simultaneously."""
-
-        f = self.simg_f
+    The data is copied out of PReadRangeSet, so several instances may
+    run at once, also from different threads."""
+        for piece in self.PReadRangeSet(ranges):
+            yield bytes(piece)
+
+    def _Map(self):
+        """Return a read-only mmap of the sparse file, shared by all readers.
+    It has its own handle, the position of simg_f is never touched."""
+        if self._mm is None:
+            with self._mm_lock:
+                if self._mm is None:
+                    with open(self.simg_fn, "rb") as f:
+                        self._mm = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        return self._mm
+
+    def Close(self):
+        """Close the file and the mmap of PReadRangeSet, the views it yielded
+    must be released first."""
+        with self._mm_lock:
+            if self._mm is not None:
+                self._mm.close()
+                self._mm = None
+        self.simg_f.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_val, exc_tb):
+        self.Close()
+
+    def _Fill(self, fill_data, blocks):
+        """Return a memoryview of 'blocks' blocks of fill_data, the buffer is
+    built once per pattern and sliced afterwards."""
+        buf = self._fill_cache.get(fill_data)
+        if buf is None:
+            buf = self._fill_cache[fill_data] = memoryview(
+                fill_data * (FILL_PIECE_BLOCKS * (self.blocksize >> 2)))
+        return buf[:blocks * self.blocksize]
+
+    def PReadRangeSet(self, ranges):
+        """Stateless positional read: yields memoryviews of the data in
+    'ranges' without a shared file position, so independent ranges can be
+    read from a pool of workers.  Raw chunks are views into the mmap of the
+    file (no copy), fill chunks are yielded in pieces of at most
+    FILL_PIECE_BLOCKS blocks."""
+        mm = memoryview(self._Map())
+        bs = self.blocksize
         for s, e in ranges:
-            to_read = e - s
-            idx = bisect_right(self.offset_index, s) - 1
-            chunk_start, chunk_len, filepos, fill_data = self.offset_map[idx]
-
-            # for the first chunk we may be starting partway through it.
-            remain = chunk_len - (s - chunk_start)
-            this_read = min(remain, to_read)
-            if filepos is not None:
-                p = filepos + ((s - chunk_start) * self.blocksize)
-                f.seek(p, os.SEEK_SET)
-                yield f.read(this_read * self.blocksize)
-            else:
-                yield fill_data * (this_read * (self.blocksize >> 2))
-            to_read -= this_read
-
-            while to_read > 0:
-                # continue with following chunks if this range spans multiple chunks.
-                idx += 1
-                chunk_start, chunk_len, filepos, fill_data = self.offset_map[idx]
-                this_read = min(chunk_len, to_read)
+            while s < e:
+                # Looked up again for every piece, a chunk may be followed by don't care blocks.
+                idx = bisect_right(self.offset_index, s) - 1
+                chunk_start, chunk_len, filepos, fill_data = self.offset_map[idx] if idx >= 0 else (0, 0, None, None)
+                if s >= chunk_start + chunk_len:
+                    # Don't care blocks up to the next chunk or the end of the range, read as zeros.
+                    this_read = min(self.offset_index[idx + 1] if idx + 1 < len(self.offset_index) else e, e) - s
+                    for i in range(0, this_read, FILL_PIECE_BLOCKS):
+                        yield self._Fill(b"\0" * 4, min(FILL_PIECE_BLOCKS, this_read - i))
+                    s += this_read
+                    continue
+                this_read = min(chunk_start + chunk_len, e) - s
                 if filepos is not None:
-                    f.seek(filepos, os.SEEK_SET)
-                    yield f.read(this_read * self.blocksize)
+                    p = filepos + (s - chunk_start) * bs
+                    yield mm[p:p + this_read * bs]
                 else:
-                    yield fill_data * (this_read * (self.blocksize >> 2))
-                to_read -= this_read
+                    for i in range(0, this_read, FILL_PIECE_BLOCKS):
+                        yield self._Fill(fill_data, min(FILL_PIECE_BLOCKS, this_read - i))
+                s += this_read
+
+    def RangeSha1(self, ranges):
+        h = sha1()
+        for piece in self.PReadRangeSet(ranges):
+            h.update(piece)
+        return h.hexdigest()
+
+    def HashRangeSets(self, ranges_list, workers=None):
+        """Return the SHA-1 hex digests of every RangeSet in 'ranges_list'.
+    The hashes are computed on the cpu pool of jobs, hashlib drops the GIL
+    for large buffers, so this scales with the number of cores."""
+        return jobs.parallel(self.RangeSha1, ranges_list, workers=workers)
+
+    def TotalSha1(self, include_clobbered_blocks=False):
+        """Return the SHA-1 hash of all data in the 'care' regions.
+
+    If include_clobbered_blocks is True, it returns the hash including the
+    clobbered_blocks."""
+        ranges = self.care_map
+        if not include_clobbered_blocks:
+            ranges = ranges.subtract(self.clobbered_blocks)
+        return self.RangeSha1(ranges)
+
+    def WriteRangeDataToFd(self, ranges, fd):
+        for data in self.PReadRangeSet(ranges):
+            fd.write(data)
 
     def LoadFileBlockMap(self, fn, clobbered_blocks):
         remaining = self.care_map
@@ -207,15 +294,14 @@ class SparseImage:
         MAX_BLOCKS_PER_GROUP = 1024
         nonzero_groups = []
 
-        f = self.simg_f
+        mm = self._Map()
         for s, e in remaining:
             for b in range(s, e):
                 idx = bisect_right(self.offset_index, b) - 1
                 chunk_start, _, filepos, fill_data = self.offset_map[idx]
                 if filepos is not None:
                     filepos += (b - chunk_start) * self.blocksize
-                    f.seek(filepos, os.SEEK_SET)
-                    data = f.read(self.blocksize)
+                    data = mm[filepos:filepos + self.blocksize]
                 else:
                     if fill_data == reference[:4]:  # fill with all zeros
                         data = reference
@@ -247,3 +333,124 @@ class SparseImage:
                 out[f"__NONZERO-{i:d}"] = rangelib.RangeSet(data=blocks)
         if clobbered_blocks:
             out["__COPY"] = clobbered_blocks
+
+
+class SparseWriter:
+    """Writes an Android sparse image chunk by chunk.
+
+  Adjacent chunks of the same kind are merged, so callers may append in
+  pieces of any number of blocks.  fd must be seekable, the header of a chunk
+  is filled in when the chunk is finished."""
+
+    CHUNK_TYPE_RAW = 0xCAC1
+    CHUNK_TYPE_FILL = 0xCAC2
+    CHUNK_TYPE_DONT_CARE = 0xCAC3
+    # total_sz of a chunk is 32 bits, raw chunks are split well below that.
+    MAX_RAW_CHUNK = 64 * 1024 * 1024
+
+    def __init__(self, fd, blocksize, total_blocks):
+        self.fd = fd
+        self.blocksize = blocksize
+        self.total_blocks = total_blocks
+        self.total_chunks = 0
+        self.blocks = 0
+        self._kind = None
+        self._fill = None
+        self._header_pos = 0
+        self._chunk_blocks = 0
+        self._zero_block = bytes(blocksize)
+        fd.write(b"\0" * 28)
+
+    def _Flush(self):
+        if self._kind is None:
+            return
+        data_sz = {self.CHUNK_TYPE_RAW: self._chunk_blocks * self.blocksize,
+                   self.CHUNK_TYPE_FILL: 4, self.CHUNK_TYPE_DONT_CARE: 0}[self._kind]
+        pos = self.fd.tell()
+        self.fd.seek(self._header_pos)
+        self.fd.write(struct.pack("<2H2I", self._kind, 0, self._chunk_blocks, 12 + data_sz))
+        self.fd.seek(pos)
+        self.total_chunks += 1
+        self._kind = None
+
+    def _Start(self, kind, fill_data=None):
+        if self._kind == kind and self._fill == fill_data:
+            if kind != self.CHUNK_TYPE_RAW or self._chunk_blocks * self.blocksize < self.MAX_RAW_CHUNK:
+                return
+        self._Flush()
+        self._kind = kind
+        self._fill = fill_data
+        self._chunk_blocks = 0
+        self._header_pos = self.fd.tell()
+        self.fd.write(b"\0" * 12)
+        if kind == self.CHUNK_TYPE_FILL:
+            self.fd.write(fill_data)
+
+    def _Add(self, blocks):
+        if self.blocks + blocks > self.total_blocks:
+            raise ValueError(f"Writing past the end of the image ({self.blocks + blocks:d} > {self.total_blocks:d} blocks)")
+        self._chunk_blocks += blocks
+        self.blocks += blocks
+
+    def AppendRaw(self, data):
+        if len(data) % self.blocksize:
+            raise ValueError(f"Raw data of {len(data):d} bytes is not a multiple of the block size")
+        data = memoryview(data)
+        while data:
+            self._Start(self.CHUNK_TYPE_RAW)
+            n = min(len(data), self.MAX_RAW_CHUNK - self._chunk_blocks * self.blocksize)
+            self.fd.write(data[:n])
+            self._Add(n // self.blocksize)
+            data = data[n:]
+
+    def _NextZeroBlock(self, data, pos):
+        """Offset of the first block aligned run of zeros at or after pos, len(data) if none."""
+        zero = self._zero_block
+        i = data.find(zero, pos)
+        while i != -1:
+            aligned = -(-i // self.blocksize) * self.blocksize
+            if data[aligned:aligned + self.blocksize] == zero:
+                return aligned
+            i = data.find(zero, aligned + 1)
+        return len(data)
+
+    def AppendData(self, data):
+        """Append image data, runs of zero blocks become fill chunks.
+
+  The data between zero blocks is found with bytes.find, so it is copied as
+  raw chunks without looking at every block from python."""
+        if len(data) % self.blocksize:
+            raise ValueError(f"Data of {len(data):d} bytes is not a multiple of the block size")
+        if not isinstance(data, (bytes, bytearray)):
+            data = bytes(data)
+        view = memoryview(data)
+        pos = 0
+        while pos < len(data):
+            zero = self._NextZeroBlock(data, pos)
+            if zero > pos:
+                self.AppendRaw(view[pos:zero])
+            end = zero
+            while end < len(data) and view[end:end + self.blocksize] == self._zero_block:
+                end += self.blocksize
+            self.AppendFill(b"\0" * 4, (end - zero) // self.blocksize)
+            pos = end
+
+    def AppendFill(self, fill_data, blocks):
+        if blocks:
+            self._Start(self.CHUNK_TYPE_FILL, fill_data)
+            self._Add(blocks)
+
+    def AppendDontCare(self, blocks):
+        if blocks:
+            self._Start(self.CHUNK_TYPE_DONT_CARE)
+            self._Add(blocks)
+
+    def Close(self):
+        """Finish the last chunk, the rest of the image is don't care."""
+        self.AppendDontCare(self.total_blocks - self.blocks)
+        self._Flush()
+        end = self.fd.tell()
+        self.fd.seek(0)
+        self.fd.write(struct.pack("<I4H4I", 0xED26FF3A, 1, 0, 28, 12, self.blocksize, self.total_blocks,
+                                  self.total_chunks, 0))
+        self.fd.seek(end)
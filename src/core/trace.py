@@ -0,0 +1,195 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+Opt-in tracing of phases, external commands and jobs.
+A span records its thread, wall time, cpu time and the bytes it moved, export() writes them as Chrome trace
+json that opens in Perfetto (ui.perfetto.dev) or chrome://tracing.
+Spans are recorded while tracing is enabled for the whole tool or for the job running them,
+otherwise span() returns a shared no-op object so it can stay in hot paths.
+Usage:
+    with span('extract system', bytes=size) as s:
+        ...
+        s.add_bytes(n)
+"""
+import functools
+import json
+import os
+import threading
+import time
+
+try:
+    import resource
+except ImportError:
+    resource = None
+
+_enabled = False
+_local = threading.local()
+_events = []
+_lock = threading.Lock()
+_origin = time.perf_counter()
+
+
+def enable():
+    global _enabled
+    _enabled = True
+
+
+def disable():
+    global _enabled
+    _enabled = False
+
+
+def trace_thread(on):
+    """
+    Trace the spans of this thread only, used for traced jobs
+    :param on: a bool, or a job whose traced flag is read at every span so tracing can be switched while it runs
+    """
+    _local.on = on
+
+
+def _thread_on() -> bool:
+    on = getattr(_local, 'on', False)
+    return on if isinstance(on, bool) else on.traced
+
+
+def is_enabled() -> bool:
+    return _enabled or _thread_on()
+
+
+def has_events() -> bool:
+    with _lock:
+        return bool(_events)
+
+
+def clear():
+    with _lock:
+        _events.clear()
+
+
+def _now() -> float:
+    """
+    Microseconds since import, the time base of the trace
+    """
+    return (time.perf_counter() - _origin) * 1e6
+
+
+def _children_cpu() -> float:
+    if resource is None:
+        return 0.0
+    usage = resource.getrusage(resource.RUSAGE_CHILDREN)
+    return usage.ru_utime + usage.ru_stime
+
+
+class _NullSpan:
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_val, exc_tb):
+        return False
+
+    def add_bytes(self, n: int):
+        pass
+
+    def set(self, **args):
+        pass
+
+
+_NULL = _NullSpan()
+
+
+class Span:
+    def __init__(self, name: str, cat: str, args: dict):
+        self.name = name
+        self.cat = cat
+        self.args = args
+        self.bytes = args.pop('bytes', 0)
+        self.children = cat == 'exec'
+
+    def add_bytes(self, n: int):
+        self.bytes += n
+
+    def set(self, **args):
+        self.args.update(args)
+
+    def __enter__(self):
+        self.start = _now()
+        self.cpu = time.thread_time()
+        if self.children:
+            self.child_cpu = _children_cpu()
+        return self
+
+    def __exit__(self, exc_type, exc_val, exc_tb):
+        args = self.args
+        args['cpu_ms'] = round((time.thread_time() - self.cpu) * 1000, 3)
+        if self.children:
+            # Process wide, overlapping commands share it
+            args['child_cpu_ms'] = round((_children_cpu() - self.child_cpu) * 1000, 3)
+        if self.bytes:
+            args['bytes'] = self.bytes
+        if exc_type is not None:
+            args['error'] = exc_type.__name__
+        thread = threading.current_thread()
+        event = {'name': self.name, 'cat': self.cat, 'ph': 'X', 'ts': round(self.start, 1),
+                 'dur': round(_now() - self.start, 1), 'pid': os.getpid(), 'tid': thread.ident,
+                 'args': args, '_thread': thread.name}
+        with _lock:
+            _events.append(event)
+        return False
+
+
+def span(name: str, cat: str = 'phase', **args) -> Span | _NullSpan:
+    """
+    :param name: shown on the bar
+    :param cat: phase, exec, job or io
+    :param args: extra values shown with the span, bytes=n sets the bytes moved
+    """
+    if not _enabled and not _thread_on():
+        return _NULL
+    return Span(name, cat, args)
+
+
+def traced(name: str = None, cat: str = 'phase'):
+    """
+    Decorator, every call of the function is a span
+    """
+
+    def decorator(func):
+        @functools.wraps(func)
+        def wrapper(*args, **kwargs):
+            with span(name or func.__qualname__, cat):
+                return func(*args, **kwargs)
+
+        return wrapper
+
+    return decorator
+
+
+def export(path: str) -> int:
+    """
+    Write the recorded spans as Chrome trace json
+    :return: number of spans written
+    """
+    with _lock:
+        events = list(_events)
+    threads = {}
+    out = []
+    for event in events:
+        event = dict(event)
+        threads[(event['pid'], event['tid'])] = event.pop('_thread')
+        out.append(event)
+    for (pid, tid), name in threads.items():
+        out.append({'name': 'thread_name', 'ph': 'M', 'pid': pid, 'tid': tid, 'args': {'name': name}})
+    with open(path, 'w', encoding='utf-8', newline='\n') as f:
+        json.dump({'traceEvents': out, 'displayTimeUnit': 'ms'}, f, ensure_ascii=False)
+    return len(events)
@@ -3,12 +3,21 @@
 # source from https://github.com/ilyakurdyukov/spreadtrum_flash/blob/main/unpac/unpac.c
 # rewritten to python by affggh
 import ctypes
+import sys
+from array import array
+from concurrent.futures import ThreadPoolExecutor
+from functools import cache
 from io import SEEK_SET
 from os import makedirs
 from os.path import exists
 from os.path import join as path_join
 from enum import Enum
 
+# Bytes handled by one step of the sliced crc16, the bytes sliced at once, and the read size of extraction
+CRC_STRIDE = 256
+CRC_WINDOW = 1 << 20
+CHUNK = 4 << 20
+
 class CommonStruct(ctypes.LittleEndianStructure):
     @property
     def _size(self):
@@ -81,11 +90,60 @@ class MODE(Enum):
 
 
 
-def crc16(crc: int, src: bytes):
-    for byte in src:
-        crc ^= byte
+@cache
+def crc16_tables():
+    """
+    tables[k][b] is the crc16 of byte b followed by k zero bytes,
+    step[c] the crc16 of CRC_STRIDE zero bytes starting from crc c
+    """
+    t0 = []
+    for i in range(256):
+        crc = i
         for _ in range(8):
             crc = (crc >> 1) ^ (0xA001 if (crc & 1) else 0)
+        t0.append(crc)
+    tables = [t0]
+    for _ in range(CRC_STRIDE - 1):
+        tables.append([(v >> 8) ^ t0[v & 0xff] for v in tables[-1]])
+    low = [bytes(v & 0xff for v in t) for t in tables]
+    high = [bytes(v >> 8 for v in t) for t in tables]
+    last, second = tables[-1], tables[-2]
+    step = [last[c & 0xff] ^ second[c >> 8] for c in range(0x10000)]
+    return t0, low, high, step
+
+
+def crc16(crc: int, src: bytes):
+    """
+    CRC-16/ARC, the same as the bitwise loop of unpac.c.
+    The crc is linear, so the part of every CRC_STRIDE bytes block that does not depend on the running crc is
+    computed for all blocks at once: the bytes at the same place of every block are sliced out, mapped through
+    the table of that place with bytes.translate and xored together as big integers.
+    Only one table lookup per block is left in the python loop.
+    """
+    t0, low, high, step = crc16_tables()
+    if not isinstance(src, (bytes, bytearray)):
+        src = bytes(src)
+    size = len(src) - len(src) % CRC_STRIDE
+    if size < CRC_STRIDE * 16:
+        size = 0
+    for start in range(0, size, CRC_WINDOW):
+        end = min(start + CRC_WINDOW, size)
+        count = (end - start) // CRC_STRIDE
+        lo = hi = 0
+        for j in range(CRC_STRIDE):
+            part = src[start + j:end:CRC_STRIDE]
+            lo ^= int.from_bytes(part.translate(low[CRC_STRIDE - 1 - j]), 'little')
+            hi ^= int.from_bytes(part.translate(high[CRC_STRIDE - 1 - j]), 'little')
+        words = bytearray(count * 2)
+        words[0::2] = lo.to_bytes(count, 'little')
+        words[1::2] = hi.to_bytes(count, 'little')
+        blocks = array('H', words)
+        if sys.byteorder == 'big':
+            blocks.byteswap()
+        for block in blocks:
+            crc = step[crc] ^ block
+    for byte in src[size:]:
+        crc = (crc >> 8) ^ t0[(crc ^ byte) & 0xff]
     return crc
 
 def check_path(path):
@@ -95,10 +153,112 @@ def check_path(path):
             return False
     return True
 
-def unpac(image_path: str, out_dir:str, mode: MODE = MODE.LIST):
+class DataCrc:
+    """
+    crc16 of the data part, updated on a worker thread while the next chunk is read.
+    The chunks are handled in order and at most two wait, so memory stays bounded.
+    """
+
+    def __init__(self):
+        self.crc = 0
+        self.pending = []
+        self.executor = ThreadPoolExecutor(max_workers=1)
+
+    def _update(self, data: bytes):
+        self.crc = crc16(self.crc, data)
+
+    def update(self, data: bytes):
+        self.pending.append(self.executor.submit(self._update, data))
+        if len(self.pending) > 2:
+            self.pending.pop(0).result()
+
+    def result(self) -> int:
+        try:
+            for i in self.pending:
+                i.result()
+        finally:
+            self.executor.shutdown()
+        return self.crc
+
+
+def print_data_crc(head: SprdHead, data_crc: int) -> bool:
+    print("data_crc: 0x%04x" % head.data_crc)
+    if head.data_crc != data_crc:
+        print("(expected 0x%04x)" % data_crc)
+        return False
+    return True
+
+
+def copy_range(fi, fo, offset: int, size: int, buf: bytearray):
+    """
+    Copy size bytes at offset of fi to fo, reading into buf
+    """
+    view = memoryview(buf)
+    fi.seek(offset, SEEK_SET)
+    while size > 0:
+        n = fi.readinto(view[:min(size, len(buf))])
+        if not n:
+            break
+        fo.write(view[:n])
+        size -= n
+
+
+def stream_pac(fi, crc_start: int, crc_end: int, entries: list) -> int:
+    """
+    Read the pac once from the start of the data, compute the data crc and write the entries on the way
+    :param fi: the pac
+    :param crc_start: the data crc covers [crc_start, crc_end)
+    :param crc_end:
+    :param entries: [(pac_offset, size, path)]
+    :return: the data crc
+    """
+    data_crc = DataCrc()
+    start = min([crc_start] + [i[0] for i in entries])
+    end = max([crc_end] + [i[0] + i[1] for i in entries])
+    files = {}
+    try:
+        fi.seek(start, SEEK_SET)
+        pos = start
+        while pos < end:
+            buf = fi.read(min(CHUNK, end - pos))
+            if not buf:
+                break
+            buf_end = pos + len(buf)
+            lo, hi = max(pos, crc_start), min(buf_end, crc_end)
+            if lo < hi:
+                data_crc.update(buf if (lo, hi) == (pos, buf_end) else buf[lo - pos:hi - pos])
+            view = memoryview(buf)
+            for index, (offset, size, path) in enumerate(entries):
+                lo, hi = max(pos, offset), min(buf_end, offset + size)
+                if lo >= hi:
+                    continue
+                if index not in files:
+                    files[index] = open(path, 'wb')
+                files[index].write(view[lo - pos:hi - pos])
+                if hi == offset + size:
+                    files[index].close()
+            pos = buf_end
+    finally:
+        for fo in files.values():
+            fo.close()
+    # Entries past the end of a truncated pac
+    for index, (_, _, path) in enumerate(entries):
+        if index not in files:
+            open(path, 'wb').close()
+    return data_crc.result()
+
+
+def unpac(image_path: str, out_dir:str, mode: MODE = MODE.LIST, verify: bool = False):
+    """
+    :param image_path:
+    :param out_dir:
+    :param mode:
+    :param verify: with MODE.EXTRACT, check the crcs in the same pass that extracts the files
+    :return: False if a crc that was checked does not match
+    """
+    ok = True
     if not exists(out_dir):
         makedirs(out_dir, exist_ok=True)
-    chunk = 0x1000
     head = SprdHead()
     # file = sprd_file()
 
@@ -116,11 +276,12 @@ def unpac(image_path: str, out_dir:str, mode: MODE = MODE.LIST):
             print("fw_version: %s" % convert_u16_to_string(head.fw_version))
             print("fw_alias: %s" % convert_u16_to_string(head.fw_alias))
 
-        if mode == MODE.LIST or mode == MODE.CHECK:
+        if mode == MODE.LIST or mode == MODE.CHECK or (mode == MODE.EXTRACT and verify):
             head_crc = crc16(0, head.pack()[: len(head) - 4])
             print("head_crc: 0x%04x" % head.head_crc)
             if head.head_crc != head_crc:
                 print("(expected 0x%04x)" % head_crc)
+                ok = False
 
         if head.dir_offset != len(head):
             raise Exception("unexpected directory offset")
@@ -128,7 +289,14 @@ def unpac(image_path: str, out_dir:str, mode: MODE = MODE.LIST):
         if (head.file_count >> 10) != 0:
             raise Exception("too many files")
 
+        # The data crc covers the pac after the head, pac_size is the size of the whole pac
+        crc_start = len(head)
+        crc_end = head.pac_size
+        if (mode == MODE.CHECK or (mode == MODE.EXTRACT and verify)) and head.pac_size < head._size:
+            raise Exception("unexpected pac size")
+
         if mode == MODE.LIST or mode == MODE.EXTRACT:
+            entries = []
             for i in range(head.file_count):
                 file = SprdFile()
                 file.unpack(fi.read(len(file)))
@@ -163,40 +331,33 @@ def unpac(image_path: str, out_dir:str, mode: MODE = MODE.LIST):
                     file_name = convert_u16_to_string(file.name).strip("\0")
                     print(file_name)
 
-                    fi.seek(file.pac_offset, SEEK_SET)
                     if not check_path(file_name):
                         print("!!! unsafe filename detected!")
                         continue
-
-                    with open(path_join(out_dir, file_name), 'wb') as fo:
-                        l = file.size
-                        for n in range(0, l, chunk):
-                            buf  = fi.read(chunk if l - n > chunk else l - n)
-                            fo.write(buf)
-                    
-                    fi.seek(len(head) + (i + 1) * len(file), SEEK_SET)
+                    entries.append((file.pac_offset, file.size, path_join(out_dir, file_name)))
+
+            if mode == MODE.EXTRACT and verify:
+                # A name listed twice keeps the data of the last entry, as when the files are written in order
+                entries = list({i[2]: i for i in entries}.values())
+                ok = print_data_crc(head, stream_pac(fi, crc_start, crc_end, entries)) and ok
+            elif mode == MODE.EXTRACT:
+                buf = bytearray(CHUNK)
+                for offset, size, path in entries:
+                    with open(path, 'wb') as fo:
+                        copy_range(fi, fo, offset, size, buf)
 
         elif mode == MODE.CHECK:
-            l = head.pac_size
-            data_crc = 0
-            n = head._size
-
-            if l < n:
-                raise Exception("unexpected pac size")
-            for n in range(0, l, chunk):
-                buf = fi.read(chunk if l - n > chunk else l - n)
-                data_crc = crc16(data_crc, buf)
-
-            print("data_crc: 0x%04x" %head.data_crc)
-            if head.data_crc != data_crc:
-                print("(ecpected 0x%04x)" %data_crc)
-            
+            ok = print_data_crc(head, stream_pac(fi, crc_start, crc_end, [])) and ok
+    return ok
+
+
 if __name__ == '__main__':
     import argparse
 
     parser = argparse.ArgumentParser(prog="unpac", usage="<list|extract|check> -d out pac_file")
     parser.add_argument("command")
     parser.add_argument("-d,--dir", metavar="outdir", dest="outdir")
+    parser.add_argument("--verify", action="store_true", help="check the crcs while extracting")
     parser.add_argument("pac_file")
 
     args = parser.parse_args()
@@ -222,4 +383,4 @@ if __name__ == '__main__':
     if not exists(outdir):
         makedirs(outdir)
 
-    unpac(pac_file, outdir, mode)
+    sys.exit(0 if unpac(pac_file, outdir, mode, args.verify) else 1)
@@ -12,6 +12,7 @@
 # WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 # See the License for the specific language governing permissions and
 # limitations under the License.
+import errno
 import hashlib
 import json
 import logging
@@ -29,10 +30,15 @@ from os import getcwd
 from os.path import exists
 from random import randint, choice
 from subprocess import Popen
-from threading import Thread
+from concurrent.futures import ThreadPoolExecutor
+from io import BytesIO
+from threading import Thread, Lock
 from lzma import LZMADecompressor
 import tarfile
 from . import blockimgdiff
+from . import jobs
+from . import progress
+from . import trace
 from . import sparse_img
 from . import update_metadata_pb2 as um
 from .lpunpack import SparseImage
@@ -127,20 +133,23 @@ def call(exe, extra_path=True, out: bool = True):
         if os.name == 'posix':
             cmd = cmd.split()
     conf = subprocess.CREATE_NO_WINDOW if os.name != 'posix' else 0
-    try:
-        ret = subprocess.Popen(cmd, stdin=subprocess.PIPE, stdout=subprocess.PIPE,
-                               stderr=subprocess.STDOUT, creationflags=conf)
-        pid = ret.pid
-        states.open_pids.append(pid)
-        output(ret)
-        states.open_pids.remove(pid)
-    except subprocess.CalledProcessError as e:
-        output(e)
-        return 2
-    except FileNotFoundError:
-        logging.exception('Bugs')
-        return 2
-    ret.wait()
+    with trace.span(os.path.basename(cmd[0] if isinstance(cmd, list) else cmd.split()[0]), 'exec',
+                    cmd=cmd if isinstance(cmd, str) else ' '.join(cmd)) as s:
+        try:
+            ret = subprocess.Popen(cmd, stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                                   stderr=subprocess.STDOUT, creationflags=conf)
+            pid = ret.pid
+            states.open_pids.append(pid)
+            output(ret)
+            states.open_pids.remove(pid)
+        except subprocess.CalledProcessError as e:
+            output(e)
+            return 2
+        except FileNotFoundError:
+            logging.exception('Bugs')
+            return 2
+        ret.wait()
+        s.set(returncode=ret.returncode)
     return ret.returncode
 
 
@@ -227,7 +236,7 @@ class Sdat2img:
         block_size = 4096
         version = next(self.list_file)
         self.version = version
-        next(self.list_file)
+        new_blocks = next(self.list_file)
         versions = {
             1: "Lollipop 5.0",
             2: "Lollipop 5.1",
@@ -247,29 +256,30 @@ class Sdat2img:
                 print(e)
                 return
 
-        new_data_file = open(self.new_data_file, 'rb')
         max_file_size = 0
+        # The files are closed and the tracker finished when copying fails too
+        phase = f'sdat {os.path.basename(self.output_image_file)}'
+        with progress.Progress(phase, new_blocks * block_size) as tracker, output_img, \
+                open(self.new_data_file, 'rb') as new_data_file:
+            for cmd, block_list in self.list_file:
+                max_file_size = max(pair[1] for pair in block_list) * block_size
+                for begin, block_all in block_list:
+                    block_count = block_all - begin
+                    print(f'Copying {block_count} blocks into position {begin}...')
+                    tracker.update(block_count * block_size, 1)
+
+                    # Position output file
+                    output_img.seek(begin * block_size)
+
+                    # Copy one block at a time
+                    while block_count > 0:
+                        output_img.write(new_data_file.read(block_size))
+                        block_count -= 1
+
+            # Make file larger if necessary
+            if output_img.tell() < max_file_size:
+                output_img.truncate(max_file_size)
 
-        for cmd, block_list in self.list_file:
-            max_file_size = max(pair[1] for pair in block_list) * block_size
-            for begin, block_all in block_list:
-                block_count = block_all - begin
-                print(f'Copying {block_count} blocks into position {begin}...')
-
-                # Position output file
-                output_img.seek(begin * block_size)
-
-                # Copy one block at a time
-                while block_count > 0:
-                    output_img.write(new_data_file.read(block_size))
-                    block_count -= 1
-
-        # Make file larger if necessary
-        if output_img.tell() < max_file_size:
-            output_img.truncate(max_file_size)
-
-        output_img.close()
-        new_data_file.close()
         print(f'Done! Output image: {os.path.realpath(output_img.name)}')
 
     @staticmethod
@@ -316,22 +326,118 @@ def get_all_file_paths(directory):
             yield os.path.join(root, filename)
 
 
-def zero_start(file: str, c: int, buff_size: int = 8192) -> bool:
+def data_regions(f, start: int, end: int):
+    """
+    Ask the filesystem which parts of [start, end) hold data, holes of sparse files are skipped without reading them
+    :param f: file opened in binary mode
+    :param start:
+    :param end:
+    :return: (start, end) of every data region
+    """
+    if not hasattr(os, 'SEEK_DATA'):
+        yield start, end
+        return
+    fd = f.fileno()
+    pos = start
+    while pos < end:
+        try:
+            data = os.lseek(fd, pos, os.SEEK_DATA)
+        except OSError as e:
+            # ENXIO: no data after pos, anything else: the filesystem does not know
+            if e.errno == errno.ENXIO:
+                return
+            yield pos, end
+            return
+        if data >= end:
+            return
+        hole = min(os.lseek(fd, data, os.SEEK_HOLE), end)
+        yield data, hole
+        pos = hole
+
+
+def zero_start(file: str, c: int, buff_size: int = 1 << 20, offset: int = 0) -> bool:
+    """
+    Check if c bytes of file at offset are all zero, only the allocated parts are read
+    """
+    zeros_ = bytes(buff_size)
     with open(file, 'rb') as f:
-        zeros_ = bytearray(buff_size)
-        while c:
-            buf = f.read(min(c, buff_size))
-            n = len(buf)
-            if n != len(zeros_):
-                # short read?
-                zeros_ = bytearray(n)
-            if buf != zeros_:
-                return False
-            c -= n
+        for start, end in data_regions(f, offset, offset + c):
+            f.seek(start)
+            left = end - start
+            while left:
+                buf = f.read(min(left, buff_size))
+                if not buf:
+                    # The file is shorter than c
+                    return True
+                # bytes compare is a memcmp
+                if buf != zeros_[:len(buf)]:
+                    return False
+                left -= len(buf)
     return True
 
 
-is_empty_img = lambda file: zero_start(file, os.path.getsize(file))
+def is_empty_sparse(file: str) -> bool | None:
+    """
+    Check if an Android sparse image holds only zeros, the chunk headers are read instead of expanding it
+    :return: None if file is not a sparse image
+    """
+    with open(file, 'rb') as f:
+        header = f.read(28)
+        if len(header) < 28:
+            return None
+        magic, major, _, file_hdr_sz, chunk_hdr_sz, blk_sz, _, total_chunks, _ = struct.unpack('<I4H4I', header)
+        if magic != 0xED26FF3A or major != 1:
+            return None
+        offset = file_hdr_sz
+        raw = []
+        for _ in range(total_chunks):
+            f.seek(offset)
+            chunk = f.read(12)
+            if len(chunk) < 12:
+                break
+            chunk_type, _, chunk_sz, total_sz = struct.unpack('<2H2I', chunk)
+            if chunk_type == 0xCAC1:
+                raw.append((offset + chunk_hdr_sz, chunk_sz * blk_sz))
+            elif chunk_type == 0xCAC2 and f.read(4) != b'\0\0\0\0':
+                return False
+            offset += total_sz
+    return all(zero_start(file, size, offset=start) for start, size in raw)
+
+
+def is_empty_img(file: str) -> bool:
+    """
+    Check if an image holds no data, a sparse file or an Android sparse image is checked without reading it all
+    """
+    if (empty := is_empty_sparse(file)) is not None:
+        return empty
+    return zero_start(file, os.path.getsize(file))
+
+
+# Enough bytes to cover every magic in formats, the super geometry at 4096 and the xiaomi logo at 16384.
+PROBE_SIZE = 16392
+
+
+def probe_type(header: bytes) -> str:
+    """
+    Return File Type from the first PROBE_SIZE bytes of a file
+    :param header: file header
+    :return:
+    """
+    if header[4096:4100] == b'\x67\x44\x6c\x61':
+        return 'super'
+    for magic, desc, *offset in formats:
+        start = offset[0] if offset else 0
+        if header[start:start + len(magic)] == magic:
+            return desc
+    if header[:512].strip(b'\x00'):
+        try:
+            if tarfile.is_tarfile(BytesIO(header)):
+                return 'tar'
+        except (tarfile.TarError, EOFError, OSError):
+            ...
+    if header[16384:16392] == b"LOGO!!!!":
+        return 'logo'
+    return "unknown"
 
 
 def gettype(file) -> str:
@@ -344,36 +450,67 @@ def gettype(file) -> str:
         return 'fnf'
     if not os.path.exists(file):
         return "fne"
+    with open(file, 'rb') as f:
+        return probe_type(f.read(PROBE_SIZE))
 
-    def is_super(fil) -> bool:
-        with open(fil, 'rb') as file_:
-            try:
-                file_.seek(4096, 0)
-                return file_.read(4) == b'\x67\x44\x6c\x61'
-            except EOFError:
-                return False
 
-    try:
-        if is_super(file):
-            return 'super'
-    except IndexError:
-        ...
-    for header, desc, *offset in formats:
-        with open(file, 'rb') as f:
-            f.seek(offset[0] if offset else 0)
-            if f.read(len(header)) == header:
-                return desc
+class TypeCache:
+    """
+    Cache of gettype results keyed by (path, size, mtime, inode).
+    Changed or new files are probed concurrently, one header read each.
+    """
 
-    if not zero_start(file, 512) and tarfile.is_tarfile(file):
-        return 'tar'
-    try:
-        if LogoDumper(file, str(None)).check_img(file):
-            return 'logo'
-    except AssertionError:
-        ...
-    except struct.error:
-        ...
-    return "unknown"
+    def __init__(self, workers: int = 8):
+        self.workers = workers
+        self.cache: dict[str, tuple[tuple, str]] = {}
+        self.lock = Lock()
+
+    @staticmethod
+    def _key(path: str):
+        try:
+            st = os.stat(path)
+        except OSError:
+            return None
+        return st.st_size, st.st_mtime_ns, st.st_ino
+
+    def get(self, path: str) -> str:
+        return self.get_many([path])[path]
+
+    def get_many(self, paths) -> dict[str, str]:
+        """
+        Return {path: type} for paths, probing only files changed since the last call
+        :param paths: file paths
+        :return:
+        """
+        result = {}
+        missing = []
+        for path in paths:
+            key = self._key(path)
+            with self.lock:
+                cached = self.cache.get(path)
+            if key is not None and cached and cached[0] == key:
+                result[path] = cached[1]
+            else:
+                missing.append((path, key))
+        if not missing:
+            return result
+
+        def probe(item):
+            path_, key_ = item
+            return path_, key_, gettype(path_)
+
+        with ThreadPoolExecutor(max_workers=min(self.workers, len(missing))) as pool:
+            for path, key, type_ in pool.map(probe, missing):
+                result[path] = type_
+                with self.lock:
+                    if key is None:
+                        self.cache.pop(path, None)
+                    else:
+                        self.cache[path] = (key, type_)
+        return result
+
+
+type_cache = TypeCache()
 
 
 def dynamic_list_reader(path):
@@ -457,26 +594,34 @@ def qc(file_) -> None:
         return
     with open(file_, 'r+', encoding='utf-8', newline='\n') as f:
         data = f.readlines()
-        data = sorted(set(data), key=data.index)
+        data = list(dict.fromkeys(data))
         f.seek(0)
         f.truncate()
         f.writelines(data)
     del data
 
 
-def create_thread(func, *args, join=False, deamon: bool = True):
+def create_thread(func, *args, join=False, deamon: bool = True, pool: str = 'thread',
+                  priority: jobs.Priority = jobs.Priority.NORMAL, traced: bool = False):
     """
     Multithreaded running tasks
     :param deamon:
     :param func: Function
     :param args:Args for the task
     :param join:if wait the task
-    :return:
+    :param pool: cpu, io or thread, see jobs
+    :param priority: order of queued jobs in cpu and io
+    :param traced: record the trace spans of this job even if tracing is off
+    :return: the job
     """
-    t = Thread(target=func, args=args, daemon=deamon)
-    t.start()
+    if func is None:
+        return None
+    # A job waiting on a job of its own pool could wait forever
+    job = jobs.submit(func, *args, pool='thread' if join else pool, priority=priority, daemon=deamon,
+                      traced=traced)
     if join:
-        t.join()
+        job.wait()
+    return job
 
 
 def simg2img(path):
@@ -501,7 +646,15 @@ def simg2img(path):
         print(e)
 
 
-def img2sdat(input_image, out_dir='.', version=None, prefix='system'):
+def img2sdat(input_image, out_dir='.', version=None, prefix='system', new_data_file=None):
+    """
+    :param input_image: sparse or raw image
+    :param out_dir:
+    :param version: transfer list version
+    :param prefix: name of the partition
+    :param new_data_file: file object new.dat is written to instead of {prefix}.new.dat
+    :return:
+    """
     if not os.path.isdir(out_dir):
         os.makedirs(out_dir)
     versions = {
@@ -512,8 +665,11 @@ def img2sdat(input_image, out_dir='.', version=None, prefix='system'):
     if version not in versions.keys():
         version = 4
     print(f"Img2sdat(1.7):{versions[version]}")
-    blockimgdiff.BlockImageDiff(sparse_img.SparseImage(input_image, tempfile.mkstemp()[1], '0'), None, version).Compute(
-        f'{out_dir}/{prefix}')
+    with trace.span(f'img2sdat {prefix}', bytes=os.path.getsize(input_image)), \
+            sparse_img.SparseImage(input_image, tempfile.mkstemp()[1], '0', allow_raw=True) as image:
+        diff = blockimgdiff.BlockImageDiff(image, None, version)
+        diff.new_data_file = new_data_file
+        diff.Compute(f'{out_dir}/{prefix}')
 
 
 def findfile(file, dir_) -> str:
@@ -0,0 +1,201 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+Compress raw or sparse images to zstd, the output decompresses to the raw image with `zstd -d`.
+Sparse images are expanded while they are read, fill and don't care chunks are made in memory,
+so no raw copy is written. The encoder is multi-threaded with long distance matching, its window
+stays at 128M (window log 27) that zstd -d accepts without --long.
+Usage:
+    compress_all(['system.img', 'vendor.img'])
+"""
+import os
+import struct
+
+import zstandard
+
+from . import jobs, progress, trace, utils
+
+CHUNK = 4 << 20
+SPARSE_MAGIC = 0xED26FF3A
+# The default window limit of zstd -d
+WINDOW_LOG = 27
+JOB_SIZE = 32 << 20
+# Estimated memory of an encoder: the window and the long distance match tables, then the buffers of each thread
+ENCODER_MEMORY = 320 << 20
+THREAD_MEMORY = 64 << 20
+
+
+def raw_stream(f):
+    """
+    The raw data of a sparse image in pieces of at most CHUNK bytes
+    :param f: sparse image opened at 0
+    :return: generator of bytes
+    """
+    magic, major, _, file_hdr_sz, chunk_hdr_sz, blk_sz, total_blks, total_chunks, _ = struct.unpack(
+        '<I4H4I', f.read(28))
+    if magic != SPARSE_MAGIC or major != 1:
+        raise ValueError('Not a sparse image')
+    f.seek(file_hdr_sz)
+    zeros = bytes(CHUNK)
+    blocks = 0
+    for _ in range(total_chunks):
+        chunk_type, _, chunk_sz, total_sz = struct.unpack('<2H2I', f.read(12))
+        f.seek(chunk_hdr_sz - 12, os.SEEK_CUR)
+        size = chunk_sz * blk_sz
+        if chunk_type == 0xCAC1:
+            while size:
+                if not (data := f.read(min(size, CHUNK))):
+                    raise ValueError('Sparse image is truncated')
+                size -= len(data)
+                yield data
+        elif chunk_type == 0xCAC2:
+            fill = f.read(4)
+            piece = zeros if fill == b'\0' * 4 else fill * (CHUNK // 4)
+            while size:
+                yield piece[:min(size, CHUNK)]
+                size -= min(size, CHUNK)
+        elif chunk_type == 0xCAC3:
+            while size:
+                yield zeros[:min(size, CHUNK)]
+                size -= min(size, CHUNK)
+        elif chunk_type == 0xCAC4:
+            f.seek(total_sz - chunk_hdr_sz, os.SEEK_CUR)
+            continue
+        else:
+            raise ValueError(f'Unknown chunk type 0x{chunk_type:04X}')
+        blocks += chunk_sz
+    if blocks != total_blks:
+        raise ValueError(f'Sparse image has {blocks} blocks, expected {total_blks}')
+
+
+def _file_stream(f):
+    while data := f.read(CHUNK):
+        yield data
+
+
+def raw_size(path: str) -> int:
+    with open(path, 'rb') as f:
+        header = f.read(28)
+    if len(header) == 28 and struct.unpack('<I', header[:4])[0] == SPARSE_MAGIC:
+        blk_sz, total_blks = struct.unpack('<2I', header[12:20])
+        return blk_sz * total_blks
+    return os.path.getsize(path)
+
+
+def compress(path: str, output: str = None, threads: int = 1, level: int = 5, remove: bool = True) -> str:
+    """
+    Compress a raw or sparse image to zstd
+    :param path: the image
+    :param output: path.zst by default
+    :param threads: encoder threads
+    :param level: like zstd -5
+    :param remove: remove the image when the output is complete, like zstd --rm
+    :return: the output
+    """
+    output = output or f'{path}.zst'
+    size = raw_size(path)
+    params = zstandard.ZstdCompressionParameters.from_level(
+        level, source_size=size, window_log=WINDOW_LOG, enable_ldm=True, threads=max(1, threads),
+        job_size=JOB_SIZE, write_checksum=True, write_content_size=True)
+    with progress.Progress(f'zstd {os.path.basename(path)}', size) as tracker, \
+            trace.span(f'zstd {os.path.basename(path)}', bytes=size, threads=threads), \
+            jobs.partial(output), open(path, 'rb') as f, open(output, 'wb') as out:
+        sparse = f.read(4) == struct.pack('<I', SPARSE_MAGIC)
+        f.seek(0)
+        with zstandard.ZstdCompressor(compression_params=params).stream_writer(out, size=size,
+                                                                                closefd=False) as writer:
+            for data in raw_stream(f) if sparse else _file_stream(f):
+                jobs.check_cancelled()
+                writer.write(data)
+                tracker.update(len(data))
+    if remove:
+        os.remove(path)
+    return output
+
+
+def available_memory() -> int | None:
+    """
+    Memory that can be used without swapping, None if unknown
+    """
+    try:
+        if os.name == 'nt':
+            import ctypes
+
+            class MemoryStatus(ctypes.Structure):
+                _fields_ = [('length', ctypes.c_ulong), ('load', ctypes.c_ulong), ('total', ctypes.c_ulonglong),
+                            ('available', ctypes.c_ulonglong), ('total_page', ctypes.c_ulonglong),
+                            ('available_page', ctypes.c_ulonglong), ('total_virtual', ctypes.c_ulonglong),
+                            ('available_virtual', ctypes.c_ulonglong), ('available_extended', ctypes.c_ulonglong)]
+
+            status = MemoryStatus()
+            status.length = ctypes.sizeof(MemoryStatus)
+            return status.available if ctypes.windll.kernel32.GlobalMemoryStatusEx(ctypes.byref(status)) else None
+        if os.path.exists('/proc/meminfo'):
+            with open('/proc/meminfo', 'r', encoding='utf-8') as f:
+                for line in f:
+                    if line.startswith('MemAvailable:'):
+                        return int(line.split()[1]) * 1024
+        return os.sysconf('SC_AVPHYS_PAGES') * os.sysconf('SC_PAGE_SIZE')
+    except (OSError, ValueError, AttributeError):
+        return None
+
+
+def plan_encoders(count: int, cpu: int, memory: int | None) -> tuple[int, int]:
+    """
+    How many images are compressed at the same time and with how many threads each
+    :param count: images
+    :param cpu: threads of all encoders
+    :param memory: bytes the encoders may use, None if unknown
+    :return: (encoders, threads of each)
+    """
+    running = max(1, min(count, cpu))
+    if memory is not None:
+        # Fewer encoders with more threads each use less memory for the same cpu
+        while running > 1 and running * (ENCODER_MEMORY + THREAD_MEMORY * max(1, cpu // running)) > memory:
+            running -= 1
+    threads = max(1, cpu // running)
+    if memory is not None:
+        threads = max(1, min(threads, (memory // running - ENCODER_MEMORY) // THREAD_MEMORY))
+    return running, threads
+
+
+def compress_all(paths: list, cpu: int = None, level: int = 5, memory: int = None) -> dict:
+    """
+    Compress images at the same time, the cpu budget and half of the available memory are shared between them
+    :param paths: images
+    :param cpu: threads of all encoders, the limit of the cpu pool by default
+    :param level:
+    :param memory: bytes the encoders may use, half of the available memory by default
+    :return: {path: output or None if it failed}
+    """
+    if not paths:
+        return {}
+    if memory is None and (memory := available_memory()) is not None:
+        memory //= 2
+    running, threads = plan_encoders(len(paths), cpu or jobs.pools['cpu'].limit, memory)
+
+    def job(path):
+        print(f"[Compress] {os.path.basename(path)}...")
+        try:
+            return compress(path, threads=threads, level=level)
+        except jobs.JobCancelled:
+            raise
+        except Exception as e:
+            utils.logging.exception('Bugs')
+            print(f"[Fail] Compress {os.path.basename(path)} Fail:{e}")
+            return None
+
+    # The encoders run on the cpu pool as part of the calling job, a cancel stops them and removes their
+    # partial outputs
+    return dict(zip(paths, jobs.parallel(job, paths, workers=running)))
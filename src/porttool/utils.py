@@ -18,6 +18,7 @@ from .configs import (
 from src.core.utils import img2sdat
 from src.core.imgextractor import Extractor
 from src.core.utils import Sdat2img as sdat2img, prog_path
+from src.core.romscan import prop_order
 
 if osname == 'nt':
     from ctypes import windll, wintypes
@@ -26,36 +27,178 @@ tool_author = 'affggh and ColdWindScholar'
 tool_version = '1.1145141919810'
 
 
+class PropFile:
+    """
+    A prop file kept as its lines, set/delete change single lines so comments, order and import lines survive.
+    """
+
+    def __init__(self, path: str):
+        self.path = path
+        with open(path, 'r', encoding='utf-8', errors='surrogateescape', newline='') as f:
+            self.lines = f.read().splitlines(keepends=True)
+        self.newline = '\r\n' if self.lines and self.lines[0].endswith('\r\n') else '\n'
+        self.index = {}  # key: line numbers
+        self._reindex()
+        self.dirty = False
+
+    def _reindex(self):
+        self.index.clear()
+        for n, line in enumerate(self.lines):
+            if (key := self.parse_key(line)) is not None:
+                self.index.setdefault(key, []).append(n)
+
+    @staticmethod
+    def parse_key(line: str) -> str | None:
+        line = line.strip()
+        if not line or line[:1] == '#' or '=' not in line or line.startswith('import '):
+            return None
+        return line.split('=', 1)[0].strip()
+
+    def __contains__(self, key: str) -> bool:
+        return key in self.index
+
+    def get(self, key: str, default: str = None) -> str | None:
+        if key not in self.index:
+            return default
+        # The last assignment wins, like init
+        return self.lines[self.index[key][-1]].split('=', 1)[1].strip()
+
+    def set(self, key: str, value: str):
+        line = f'{key}={value}'
+        if key in self.index:
+            n = self.index[key][-1]
+            if self.lines[n].rstrip('\r\n') == line:
+                return
+            self.lines[n] = line + (self.newline if self.lines[n].endswith('\n') else '')
+        else:
+            if self.lines and not self.lines[-1].endswith('\n'):
+                self.lines[-1] += self.newline
+            self.index[key] = [len(self.lines)]
+            self.lines.append(line + self.newline)
+        self.dirty = True
+
+    def delete(self, key: str):
+        for n in self.index.pop(key, []):
+            self.lines[n] = None
+        self.dirty = True
+
+    def items(self) -> dict:
+        return {key: self.get(key) for key in self.index}
+
+    def save(self) -> bool:
+        if not self.dirty:
+            return False
+        with open(self.path, 'w', encoding='utf-8', errors='surrogateescape', newline='') as f:
+            f.write(''.join(i for i in self.lines if i is not None))
+        self.lines = [i for i in self.lines if i is not None]
+        self._reindex()
+        self.dirty = False
+        return True
+
+
+class PropStore:
+    """
+    Every *.prop file of several partitions, indexed in one scan.
+    Reads follow the init load order, a key of a later partition (product) hides the same key of an earlier one.
+    Inside a partition the build.prop at its root wins over the deeper prop files, like prop_utils on that file did.
+    Usage:
+        with PropStore({'system': 'tmp/rom/system', 'vendor': 'tmp/rom/vendor'}) as props:
+            props.apply([('set', 'ro.sf.lcd_density', '440'), ('delete', 'ro.debuggable')])
+    """
+
+    def __init__(self, partitions: dict | str):
+        if isinstance(partitions, str):
+            partitions = {i.name: str(i) for i in Path(partitions).iterdir() if i.is_dir()}
+        self.partitions = {k: partitions[k] for k in sorted(partitions, key=prop_order)}
+        self.files: dict[str, list[PropFile]] = {}
+        for name, root in self.partitions.items():
+            found = []
+            for dirpath, _, filenames in walk(root):
+                found.extend(op.join(dirpath, i) for i in sorted(filenames) if i.endswith('.prop'))
+            # The root build.prop first, it is read first and it is where new keys go
+            found.sort(key=lambda x: (x.count(op.sep), op.basename(x) != 'build.prop', x))
+            self.files[name] = [PropFile(i) for i in found]
+
+    def _owners(self, key: str, partition: str = None) -> list[PropFile]:
+        names = [partition] if partition else self.partitions
+        return [f for name in names for f in self.files.get(name, []) if key in f]
+
+    def get(self, key: str, partition: str = None, default: str = '') -> str:
+        for name in reversed([partition] if partition else list(self.partitions)):
+            for f in self.files.get(name, []):
+                if key in f:
+                    return f.get(key)
+        return default
+
+    def set(self, key: str, value: str, partition: str = None):
+        """
+        Change key everywhere it is defined, a new key goes into build.prop of partition or of the first partition
+        """
+        if owners := self._owners(key, partition):
+            for f in owners:
+                f.set(key, value)
+            return
+        name = partition or next(iter(self.partitions), None)
+        if not self.files.get(name):
+            raise FileNotFoundError(f"No prop file in {name} to add {key}")
+        self.files[name][0].set(key, value)
+
+    def delete(self, key: str, partition: str = None):
+        for f in self._owners(key, partition):
+            f.delete(key)
+
+    def apply(self, operations: list) -> list:
+        """
+        Run a batch of ('get', key[, partition]), ('set', key, value[, partition]) and ('delete', key[, partition])
+        :return: the results of the gets, in order
+        """
+        results = []
+        for operation, key, *args in operations:
+            match operation:
+                case 'get':
+                    results.append(self.get(key, *args))
+                case 'set':
+                    self.set(key, *args)
+                case 'delete':
+                    self.delete(key, *args)
+                case _:
+                    raise ValueError(f"Unknown operation {operation}")
+        return results
+
+    def save(self) -> list:
+        """
+        Write the changed files, once each
+        :return: paths written
+        """
+        return [f.path for files in self.files.values() for f in files if f.save()]
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_val, exc_tb):
+        if exc_type is None:
+            self.save()
+
+
 class prop_utils:
     def __init__(self, prop_file: str):
         path = Path(prop_file)
-        if path.exists():
-            self.fd = Path(prop_file).open('r+', encoding='utf-8')
-        else:
+        if not path.exists():
             raise FileExistsError(f"File {prop_file} does not exist!")
-        self.prop: dict = {n: v for n, v in self.__loadprop}
+        self.file = PropFile(prop_file)
 
     @property
-    def __loadprop(self) -> list:
-        for __ in self.fd.readlines():
-            if __[:1] == '#':
-                return
-            if '=' not in __:
-                continue
-            yield __.split('=')
+    def prop(self) -> dict:
+        return self.file.items()
 
     def getprop(self, key: str) -> str | None:
-        return self.prop.get(key, '')
+        return self.file.get(key, '')
 
     def setprop(self, key, value) -> None:
-        self.prop[key] = value
+        self.file.set(key, value)
 
     def save(self):
-        self.fd.seek(0, 0)
-        self.fd.truncate()
-        for i in self.prop.keys():
-            self.fd.write(f'{i}={self.prop.get(i, "")}\n')
-        self.fd.close()
+        self.file.save()
 
     def __enter__(self):
         return self
@@ -404,6 +547,9 @@ class portutils:
 
         base_prefix = Path("base/system")
         port_prefix = Path("tmp/rom/system")
+        # Prop changes are collected and written at the end, so every prop file is rewritten once
+        prop_ops = []
+        base_props = None
         for item in self.items['flags']:
             item_flag = self.items[item]
             if not item_flag:
@@ -420,22 +566,19 @@ class portutils:
             match item:
                 case 'single_simcard' | 'dual_simcard':
                     print(f"Modifying config [{'Single SimCard' if item == 'single_simcard' else 'Double SimCard'}]")
-                    with prop_utils(str(port_prefix.joinpath("build.prop"))) as p:
-                        kv = [
-                            ('persist.multisim.config', 'ss' if item == 'single_simcard' else 'dsds'),
-                            ('persist.radio.multisim.config', 'ss' if item == 'single_simcard' else 'dsds'),
-                            ('ro.telephony.sim.count', '1' if item == 'single_simcard' else '2'),
-                            ('persist.dsds.enabled', 'false' if item == 'single_simcard' else 'true'),
-                            ('ro.dual.sim.phone', 'false' if item == 'single_simcard' else 'true'),
-                        ]
-                        for key, value in kv:
-                            p.setprop(key, value)
+                    kv = [
+                        ('persist.multisim.config', 'ss' if item == 'single_simcard' else 'dsds'),
+                        ('persist.radio.multisim.config', 'ss' if item == 'single_simcard' else 'dsds'),
+                        ('ro.telephony.sim.count', '1' if item == 'single_simcard' else '2'),
+                        ('persist.dsds.enabled', 'false' if item == 'single_simcard' else 'true'),
+                        ('ro.dual.sim.phone', 'false' if item == 'single_simcard' else 'true'),
+                    ]
+                    prop_ops.extend(('set', key, value) for key, value in kv)
                 case 'fit_density':
                     print(f"Get dpi from base rom and write to port rom")
-                    with prop_utils(str(port_prefix.joinpath("build.prop"))) as pp, \
-                            prop_utils(str(base_prefix.joinpath("build.prop"))) as bp:
-                        print(f"Modified port rom build.prop dpi:{bp.getprop('ro.sf.lcd_density')}")
-                        pp.setprop('ro.sf.lcd_density', bp.getprop('ro.sf.lcd_density'))
+                    base_props = base_props or PropStore({'system': str(base_prefix)})
+                    print(f"Modified port rom build.prop dpi:{base_props.get('ro.sf.lcd_density')}")
+                    prop_ops.append(('set', 'ro.sf.lcd_density', base_props.get('ro.sf.lcd_density')))
                 case 'change_timezone' | 'change_locale' | 'change_model':
                     change_type = item.split('_')[1]
                     keys = []
@@ -457,12 +600,16 @@ class portutils:
                                 'ro.product.board',
                                 'ro.product.brand',
                             ]
-                    with prop_utils(str(port_prefix.joinpath("build.prop"))) as pp, \
-                            prop_utils(str(base_prefix.joinpath("build.prop"))) as bp:
-                        for key in keys:
-                            value = bp.getprop(key)
-                            print(f"修改移植包build.prop键值 [{key}]:[{value}]")
-                            pp.setprop(key, value)
+                    base_props = base_props or PropStore({'system': str(base_prefix)})
+                    for key in keys:
+                        value = base_props.get(key)
+                        print(f"修改移植包build.prop键值 [{key}]:[{value}]")
+                        prop_ops.append(('set', key, value))
+        if prop_ops:
+            port_props = PropStore({'system': str(port_prefix)})
+            port_props.apply(prop_ops)
+            for i in port_props.save():
+                print(f"Updated {i}")
         return True
 
     def __pack_rom(self):
@@ -22,6 +22,7 @@ from tkinter.ttk import Button
 import pygments.lexers
 from chlorophyll import CodeView
 
+from ..core.mmap_text import MappedText, LARGE_FILE_SIZE
 from ..core.utils import create_thread, lang
 from ..tkui.controls import input_
 
@@ -33,6 +34,8 @@ class PythonEditor(tk.Frame):
         if not os.path.exists(self.path):
             os.makedirs(self.path, exist_ok=True)
         self.parent = parent
+        self.large_file = False
+        self.lexer = lexer
         self.text = CodeView(self, wrap="word", undo=True, lexer=lexer, color_scheme="dracula")
         self.text.pack(side="left", fill="both", expand=True)
         f1 = ttk.Frame(self.parent)
@@ -129,6 +132,8 @@ class PythonEditor(tk.Frame):
         self.load()
 
     def save(self):
+        if self.large_file:
+            return
         self.save_b.configure(text=lang.t55, state='disabled')
         with open(os.path.join(self.path, self.file_name), 'w+', encoding='utf-8', newline='\n') as txt:
             txt.write(self.text.get(1.0, tk.END))
@@ -138,6 +143,14 @@ class PythonEditor(tk.Frame):
 
     def load(self):
         if self.file_name:
+            file_path = os.path.join(self.path, self.file_name)
+            self.large_file = os.path.isfile(file_path) and os.path.getsize(file_path) > LARGE_FILE_SIZE
+            if self.large_file:
+                self.text.delete(0.0, tk.END)
+                self.text.insert(tk.END, f"# {self.file_name} is too large, opened in the large file editor.")
+                large_main(file_path, lexer=self.lexer)
+                self.parent.title(f"{self.file_name} - Editor")
+                return
             try:
                 with open(os.path.join(self.path, self.file_name), 'rb+') as f:
                     self.text.delete(0.0, tk.END)
@@ -151,6 +164,189 @@ class PythonEditor(tk.Frame):
             self.parent.title(f"{self.file_name} - Editor")
 
 
+class LargeFileEditor(tk.Frame):
+    """
+    Shows a window of lines of a MappedText, only these lines live in the CodeView,
+    so loading, highlighting and scrolling cost the same for 1KB and 1GB files.
+    """
+    window_lines = 300
+
+    def __init__(self, parent, file_path, lexer=pygments.lexers.BashLexer):
+        super().__init__(parent)
+        self.parent = parent
+        self.file_path = file_path
+        self.doc = MappedText(file_path)
+        self.start = self.end = 0
+        # A worker thread uses the document, save closes and reopens its mapping
+        self.saving = self.searching = False
+        f0 = ttk.Frame(self)
+        self.search_var = tk.StringVar()
+        entry = ttk.Entry(f0, textvariable=self.search_var)
+        entry.bind("<Return>", lambda *x: self.find())
+        entry.pack(side=tk.LEFT, fill=tk.X, padx=5, pady=5, expand=True)
+        ttk.Button(f0, text='Find', command=self.find).pack(side=tk.LEFT, padx=5, pady=5)
+        self.status = ttk.Label(f0)
+        self.status.pack(side=tk.LEFT, padx=5, pady=5)
+        f0.pack(side=tk.TOP, fill=tk.X)
+        self.scroll = ttk.Scrollbar(self, orient='vertical', command=self.on_scroll)
+        self.scroll.pack(side=tk.RIGHT, fill=tk.Y)
+        self.text = CodeView(self, wrap="none", undo=True, lexer=lexer, color_scheme="dracula")
+        self.text.pack(side="left", fill="both", expand=True)
+        self.text.tag_configure('found', background='#44475a')
+        for event in ("<MouseWheel>", "<Button-4>", "<Button-5>"):
+            self.text.bind(event, self.on_wheel)
+        f1 = ttk.Frame(self.parent)
+        ttk.Button(f1, text=lang.text17, command=self.parent.destroy).pack(side=tk.LEFT, fill=tk.X, padx=5, pady=5,
+                                                                              expand=1)
+        self.save_b = ttk.Button(f1, text=lang.t54, command=self.save, style="Accent.TButton")
+        self.save_b.pack(side=tk.LEFT, fill=tk.X, padx=5, pady=5, expand=1)
+        f1.pack(side=tk.BOTTOM, fill=tk.X, padx=5, pady=5)
+        self.bind("<Destroy>", lambda e: self.doc.close() if e.widget is self and not self.saving else None)
+        self.render(0)
+        self.poll_index()
+
+    def poll_index(self):
+        if not self.winfo_exists():
+            return
+        if not self.doc.indexed.is_set():
+            self.status.configure(text=f"Indexing... {self.doc.line_count} lines")
+            # The window may have been rendered before its lines were indexed.
+            if self.end - self.start < self.window_lines:
+                self.render(self.top_line())
+            self.after(200, self.poll_index)
+        else:
+            self.update_status()
+
+    def top_line(self) -> int:
+        return self.start + int(self.text.index('@0,0').split('.')[0]) - 1
+
+    def update_status(self):
+        total = max(self.doc.line_count, 1)
+        top = self.top_line()
+        self.status.configure(text=f"{top + 1}/{total}")
+        self.scroll.set(top / total, min(top + self.visible_lines(), total) / total)
+
+    def visible_lines(self) -> int:
+        return max(int(self.text.index(f'@0,{self.text.winfo_height()}').split('.')[0]) -
+                   int(self.text.index('@0,0').split('.')[0]), 1)
+
+    def commit(self):
+        """
+        Store the widget content as an edit of the lines it was rendered from.
+        """
+        if self.saving:
+            return
+        if self.text.edit_modified():
+            self.doc.replace(self.start, self.end, self.text.get('1.0', 'end-1c'))
+        self.text.edit_modified(False)
+
+    def render(self, top: int):
+        if self.saving:
+            return
+        self.commit()
+        top = max(min(top, self.doc.line_count - 1), 0)
+        self.start, self.end = self.doc.expand(max(top - self.window_lines // 3, 0),
+                                               min(top + self.window_lines, self.doc.line_count))
+        self.text.delete('1.0', tk.END)
+        self.text.insert('1.0', self.doc.text(self.start, self.end))
+        self.text.edit_reset()
+        self.text.edit_modified(False)
+        self.text.yview(f'{top - self.start + 1}.0')
+        self.update_status()
+
+    def goto(self, line: int):
+        if self.saving:
+            return
+        if self.start <= line and (line + self.visible_lines() <= self.end or self.end >= self.doc.line_count):
+            self.text.yview(f'{line - self.start + 1}.0')
+            self.update_status()
+            return
+        self.render(line)
+
+    def on_wheel(self, event):
+        if event.num == 4 or event.delta > 0:
+            self.goto(max(self.top_line() - 3, 0))
+        else:
+            self.goto(self.top_line() + 3)
+        return "break"
+
+    def on_scroll(self, action, value, unit=None):
+        if action == 'moveto':
+            self.goto(int(float(value) * self.doc.line_count))
+        elif unit == 'pages':
+            self.goto(self.top_line() + int(value) * self.visible_lines())
+        else:
+            self.goto(self.top_line() + int(value))
+
+    def find(self):
+        pattern = self.search_var.get()
+        if not pattern or self.saving or self.searching:
+            return
+        self.commit()
+        self.searching = True
+        self.status.configure(text='Searching...')
+        offset = self.doc.offset_of(self.top_line() + 1)
+
+        def search():
+            line = -1
+            try:
+                line = self.doc.find(pattern, offset)
+                if line == -1:
+                    # Wrap around to the beginning once.
+                    line = self.doc.find(pattern, 0)
+            finally:
+                self.after(0, lambda: self.found(line, pattern))
+
+        create_thread(search)
+
+    def found(self, line: int, pattern: str):
+        self.searching = False
+        if line == -1:
+            self.status.configure(text='Not found')
+            return
+        self.render(line)
+        self.text.tag_remove('found', '1.0', tk.END)
+        index = self.text.search(pattern, f'{line - self.start + 1}.0', tk.END)
+        if index:
+            self.text.tag_add('found', index, f'{index}+{len(pattern)}c')
+
+    def save(self):
+        if self.saving or self.searching:
+            return
+        self.commit()
+        # Scrolling, editing and searching wait for the document to be reopened
+        self.saving = True
+        self.text.configure(state='disabled')
+        self.save_b.configure(text=lang.t55, state='disabled')
+        top = self.top_line()
+
+        def saved():
+            self.saving = False
+            if not self.winfo_exists():
+                self.doc.close()
+                return
+            self.text.configure(state='normal')
+            self.render(top)
+            self.poll_index()
+            self.save_b.configure(text=lang.t54, state='normal')
+
+        def save():
+            try:
+                self.doc.save()
+            finally:
+                # Tk widgets are only touched from the main thread
+                self.after(0, saved)
+
+        create_thread(save)
+
+
+def large_main(file_path, lexer=pygments.lexers.BashLexer):
+    root = tk.Toplevel()
+    root.title(f"{os.path.basename(file_path)} - Editor")
+    editor = LargeFileEditor(root, file_path, lexer=lexer)
+    editor.pack(side="top", fill="both", expand=True)
+
+
 def main(file_=None, file_name=None, lexer=pygments.lexers.BashLexer):
     root = tk.Toplevel()
     root.title("Editor")
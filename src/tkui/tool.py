@@ -14,6 +14,8 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 import argparse
+import atexit
+import errno
 import gzip
 import json
 import platform
@@ -30,6 +32,7 @@ from src.core.Magisk import Magisk_patch
 from src.core.addon_register import loader, Entry
 from src.core.avb_disabler import process_fstab
 from src.core.cpio import extract as cpio_extract, repack as cpio_repack
+from src.core.downloader import Downloader
 from src.core.encryption_disabler import process_fstab_for_encryption
 from src.core.qsb_imger import process_by_xml
 from src.core.romfs_parse import RomfsParse
@@ -88,18 +91,20 @@ from src.core import images
 from src.core import extra
 from . import AI_engine
 from src.core import ext4
+from src.core import convert, fdt, jobs, prepack, progress, sepolicy, snapshot, trace, zstd_image
 from src.core.config_parser import ConfigParser
 from src.core import utils
 from src.core.unpac import MODE as PACMODE, unpac
 
 if os.name == 'nt':
     from .sv_ttk_fixes import *
-from src.core.extra import fspatch, re, contextpatch
+from src.core.extra import re
 from src.core.utils import create_thread, move_center, v_code, gettype, is_empty_img, findfile, findfolder, Sdat2img, \
-    Unxz
+    Unxz, type_cache
 from .controls import ListBox, ScrollFrame, input_
 from src.core.undz import DZFileTools
 from src.core.selinux_audit_allow import main as selinux_audit_allow
+from src.core.sign_payload import sign_payload_file
 import logging
 
 is_pro = False
@@ -488,6 +493,7 @@ class ToolBox(ttk.Frame):
             (lang.merge_file_segments, self.MergeSparseImage),
             (lang.decrypt_xtc_xml, self.DecryptXtcXml),
             (lang.mtk_port_tool, MtkPortTool),
+            (lang.sign_payload, self.SignPayload),
         ]
         width_controls = 3  # Number of buttons per row.
         index_row = 0
@@ -531,6 +537,34 @@ class ToolBox(ttk.Frame):
                         print(f"Decrypting {f}")
                         Xor_file(os.path.join(root, f))
 
+    class SignPayload(Toplevel):
+        def __init__(self):
+            super().__init__()
+            self.title(lang.sign_payload)
+            self.payload = StringVar()
+            self.key = StringVar(value=os.path.join(cwd_path, 'bin', 'keys', 'testkey.key'))
+            self.gui()
+            move_center(self)
+
+        def gui(self):
+            ccontrols.filechose(self, self.payload, 'payload.bin')
+            ccontrols.filechose(self, self.key, 'Key')
+            ttk.Button(self, text=lang.run, command=lambda: create_thread(self.run)).pack(padx=5, pady=5, fill='both')
+
+        def run(self):
+            if not os.path.isfile(self.payload.get()) or not os.path.isfile(self.key.get()):
+                warn_win('Please choose payload.bin and the key.')
+                return
+            self.destroy()
+            print(f"Signing {self.payload.get()}")
+            try:
+                for k, v in sign_payload_file(self.payload.get(), self.key.get()).items():
+                    print(f"{k}={v}")
+            except ValueError as e:
+                print(e)
+                return
+            print(lang.text8)
+
     class MergequalcommimageOld(Toplevel):
         """A Toplevel window for merging Qualcomm sparse images using rawprogram.xml (Legacy version).
 
@@ -945,7 +979,7 @@ class ToolBox(ttk.Frame):
             self.gui()
             self.geometry("400x450")
             self.resizable(False, False)
-            self.dnd = lambda file_list: create_thread(self.__dnd, file_list)
+            self.dnd = lambda file_list: create_thread(self.__dnd, file_list, pool='io', priority=jobs.Priority.BULK)
             move_center(self)
 
         def gui(self):
@@ -1082,7 +1116,7 @@ class ToolBox(ttk.Frame):
             self.partitions_with_fstab = {}
             self.gui()
             move_center(self)
-            create_thread(self.scan_partitions)
+            create_thread(self.scan_partitions, pool='io', priority=jobs.Priority.INTERACTIVE)
 
         def gui(self):
             """Creates the graphical user interface for the window."""
@@ -1152,7 +1186,7 @@ class ToolBox(ttk.Frame):
                 return
 
             self.run_button.config(state='disabled', text=lang.running)
-            create_thread(self._process_in_thread, selected_partitions)
+            create_thread(self._process_in_thread, selected_partitions, pool='io', priority=jobs.Priority.BULK)
 
         def _process_in_thread(self, selected_partitions):
             """Background thread for processing."""
@@ -1184,7 +1218,7 @@ class ToolBox(ttk.Frame):
             self.partitions_with_fstab = {}
             self.gui()
             move_center(self)
-            create_thread(self.scan_partitions)
+            create_thread(self.scan_partitions, pool='io', priority=jobs.Priority.INTERACTIVE)
 
         def gui(self):
             """Creates the graphical user interface for the window."""
@@ -1252,7 +1286,7 @@ class ToolBox(ttk.Frame):
                 return
 
             self.run_button.config(state='disabled', text=lang.running)
-            create_thread(self._process_in_thread, selected_partitions)
+            create_thread(self._process_in_thread, selected_partitions, pool='io', priority=jobs.Priority.BULK)
 
         def _process_in_thread(self, selected_partitions):
             """Internal method for execution in a separate thread."""
@@ -1378,7 +1412,8 @@ class ToolBox(ttk.Frame):
             delete_source_files = self.delete_source.get()
 
             # Offload the main work to a background thread.
-            create_thread(self._process_in_thread, project_path, output_name, delete_source_files)
+            create_thread(self._process_in_thread, project_path, output_name, delete_source_files,
+                          pool='io', priority=jobs.Priority.BULK)
 
         def update_progress(self, percentage: int) -> None:
             """
@@ -1639,12 +1674,23 @@ class Tool(Tk):
             padx=10, pady=10, side=TOP)
         self.gif_label = Label(self.Clear_Load_canvas)
         self.gif_label.pack(padx=10, pady=10, side=TOP)
+        self.progress_label = ttk.Label(self.Clear_Load_canvas, text='', justify='left')
+        self.progress_label.pack(padx=10, pady=5, side=TOP)
+        self.show_progress()
         self.Clear_Load_canvas.pack(side=RIGHT, anchor='ne')
         self.scroll.pack(side=RIGHT, fill=BOTH)
         self.show.pack(side=RIGHT, fill=BOTH, expand=True)
 
         MpkMan().gui()
 
+    def show_progress(self):
+        """Shows the running operations under the loading animation, polled so workers never touch the widget."""
+        try:
+            self.progress_label.configure(text='\n'.join(progress.format_event(i) for i in progress.active()))
+        except TclError:
+            return
+        self.after(500, self.show_progress)
+
     def tab_content(self):
         global kemiaojiang
         kemiaojiang_img = open_img(open(f'{cwd_path}/bin/kemiaojiang.png', 'rb'))
@@ -1765,7 +1811,7 @@ class Tool(Tk):
         slo2.bind('<Button-1>', lambda *x: windll.shell32.ShellExecuteW(None, "open", self.show_local.get(), None, None,
                                                                         1) if os.name == 'nt' else ...)
         slo2.pack(padx=10, pady=10, side='left')
-        ttk.Button(sf6, text=lang.clean, command=lambda: create_thread(clean_cache)).pack(side="left", padx=10, pady=10)
+        ttk.Button(sf6, text=lang.clean, command=lambda: create_thread(clean_cache, pool='io')).pack(side="left", padx=10, pady=10)
         context = StringVar(value=settings.contextpatch)
 
         def enable_contextpatch():
@@ -1802,8 +1848,29 @@ start = dti()
 
 tool_self = os.path.normpath(os.path.abspath(sys.argv[0]))
 temp = os.path.join(cwd_path, "bin", "temp").replace(os.sep, '/')
+# Every running tool shares its jobs here, so `tool jobs` can list and cancel them
+jobs_folder = os.path.join(temp, 'jobs')
 tool_log = f'{temp}/{time.strftime("%Y%m%d_%H-%M-%S", time.localtime())}_{v_code()}.log'
 context_rule_file = os.path.join(cwd_path, 'bin', "context_rules.json")
+progress_sink: progress.JsonlSink | None = None
+
+
+def export_trace():
+    """
+    Write the recorded spans to the trace_file setting, the spans of traced jobs go next to the log if it is unset
+    """
+    if not trace.has_events():
+        return
+    path = settings.trace_file or f'{tool_log[:-4]}_trace.json'
+    try:
+        print(f"Trace: {trace.export(path)} spans written to {path}")
+    except OSError:
+        logging.exception('Trace')
+
+
+atexit.register(export_trace)
+
+
 from src.core.utils import states, call
 
 module_exec = os.path.join(cwd_path, 'bin', "exec.sh").replace(os.sep, '/')
@@ -2349,6 +2416,17 @@ class SetUtils:
             self.set_file = os.path.join(cwd_path, "bin", "setting.ini")
         self.plugin_repo = None
         self.contextpatch = '0'
+        # Workers of the cpu and io job pools, 0 for the default
+        self.cpu_jobs = '0'
+        self.io_jobs = '0'
+        # Progress events are appended to this file as json lines if set
+        self.progress_log = ''
+        # Trace spans are recorded and written to this file on exit if set
+        self.trace_file = ''
+        # secilc used to rebuild precompiled_sepolicy, searched in bin and PATH if unset
+        self.secilc = ''
+        # Partitions extracted from payload and super are written as sparse images
+        self.sparse_extract = '0'
         self.oobe = '0'
         self.path = None
         self.bar_level = '0.9'
@@ -2379,6 +2457,23 @@ class SetUtils:
         self.config.read(self.set_file)
         for i in self.config.items('setting'):
             setattr(self, i[0], i[1])
+        try:
+            jobs.set_limits(cpu=int(self.cpu_jobs), io=int(self.io_jobs))
+        except ValueError:
+            logging.exception('Jobs')
+        global progress_sink
+        if progress_sink and progress_sink.path != self.progress_log:
+            progress_sink.close()
+            progress_sink = None
+        if self.progress_log and not progress_sink:
+            try:
+                progress.subscribe(progress_sink := progress.JsonlSink(self.progress_log))
+            except OSError:
+                logging.exception('Progress log')
+        if self.trace_file:
+            trace.enable()
+        else:
+            trace.disable()
         if os.path.exists(self.path):
             if not self.path:
                 self.path = os.getcwd()
@@ -2467,24 +2562,29 @@ def un_dtbo(bn: str = 'dtbo') -> None:
     re_folder(f"{work}/{bn}/dtbo")
     re_folder(f"{work}/{bn}/dts")
     try:
-        mkdtboimg.dump_dtbo(dtboimg, f"{work}/{bn}/dtbo/dtbo")
+        blobs = mkdtboimg.read_dtbo(dtboimg)
     except Exception as e:
         logging.exception("Bugs")
         print(lang.warn4.format(e))
         return
-    for dtbo in os.listdir(f"{work}/{bn}/dtbo"):
-        if dtbo.startswith("dtbo."):
-            print(lang.text4.format(dtbo))
-            call(
-                exe=['dtc', '-@', '-I', 'dtb', '-O', 'dts', f'{work}/{bn}/dtbo/{dtbo}', '-o',
-                     os.path.join(work, bn, 'dts', 'dts.' + os.path.basename(dtbo).rsplit('.', 1)[1])],
-                out=False)
+    for index, text in enumerate(fdt.decompile_all(blobs)):
+        print(lang.text4.format(f'dtbo.{index}'))
+        dts = os.path.join(work, bn, 'dts', f'dts.{index}')
+        if text is None:
+            # Not a blob fdt can read, leave it to dtc
+            dtbo = os.path.join(work, bn, 'dtbo', f'dtbo.{index}')
+            with open(dtbo, 'wb') as f:
+                f.write(blobs[index])
+            call(exe=['dtc', '-@', '-I', 'dtb', '-O', 'dts', dtbo, '-o', dts], out=False)
+            continue
+        with open(dts, 'w', encoding='utf-8', errors='surrogateescape', newline='\n') as f:
+            f.write(text)
     print(lang.text5)
     try:
         os.remove(dtboimg)
     except (Exception, BaseException):
         logging.exception('Bugs')
-    rmdir(f"{work}/dtbo/dtbo")
+    rmdir(f"{work}/{bn}/dtbo")
 
 
 @animation
@@ -2494,18 +2594,27 @@ def pack_dtbo() -> bool:
         print(lang.warn5)
         return False
     re_folder(f"{work}/dtbo/dtbo")
-    for dts in os.listdir(f"{work}/dtbo/dts"):
-        if dts.startswith("dts."):
-            print(f"{lang.text6}:{dts}")
-            call(
-                exe=['dtc', '-@', '-I', 'dts', '-O', 'dtb', os.path.join(work, 'dtbo', 'dts', dts), '-o',
-                     os.path.join(work, 'dtbo', 'dtbo', 'dtbo.' + os.path.basename(dts).rsplit('.', 1)[1])],
-                out=False)
+    names = sorted((i for i in os.listdir(f"{work}/dtbo/dts") if i.startswith("dts.")),
+                   key=lambda x: int(x.rsplit('.', 1)[1]))
+    texts = []
+    for dts in names:
+        print(f"{lang.text6}:{dts}")
+        with open(os.path.join(work, 'dtbo', 'dts', dts), encoding='utf-8', errors='surrogateescape') as f:
+            texts.append(f.read())
+    blobs = []
+    for dts, blob in zip(names, fdt.compile_all(texts)):
+        if blob is None:
+            # Syntax fdt does not handle, leave it to dtc
+            dtbo = os.path.join(work, 'dtbo', 'dtbo', 'dtbo.' + dts.rsplit('.', 1)[1])
+            call(exe=['dtc', '-@', '-I', 'dts', '-O', 'dtb', os.path.join(work, 'dtbo', 'dts', dts), '-o', dtbo],
+                 out=False)
+            if not os.path.exists(dtbo):
+                continue
+            with open(dtbo, 'rb') as f:
+                blob = f.read()
+        blobs.append(blob)
     print(f"{lang.text7}:dtbo.img")
-    list_ = [os.path.join(work, "dtbo", "dtbo", f) for f in os.listdir(f"{work}/dtbo/dtbo") if
-             f.startswith("dtbo.")]
-    mkdtboimg.create_dtbo(project_manger.current_work_output_path() + "dtbo.img",
-                          sorted(list_, key=lambda x: int(x.rsplit('.')[1])), 4096)
+    mkdtboimg.create_dtbo_from_blobs(project_manger.current_work_output_path() + "dtbo.img", blobs, 4096)
     rmdir(f"{work}/dtbo")
     print(lang.text8)
     return True
@@ -3952,6 +4061,48 @@ def generate_bug_report():
     print(f"\tThe Bug Report Was Saved:{bugreport}")
 
 
+class JobViewer(Toplevel):
+    """Lists the background jobs, refreshed every second, the selected ones can be cancelled or traced."""
+
+    def __init__(self):
+        super().__init__()
+        self.title("Jobs")
+        scroll = ttk.Scrollbar(self, orient='vertical')
+        columns = ['id', 'name', 'pool', 'priority', 'state', 'elapsed', 'traced']
+        self.table = ttk.Treeview(master=self, height=12, columns=columns, show='headings',
+                                  yscrollcommand=scroll.set)
+        for column in columns:
+            self.table.heading(column=column, text=column, anchor=CENTER)
+            self.table.column(column=column, anchor=CENTER, width=260 if column == 'name' else 80)
+        scroll.config(command=self.table.yview)
+        ttk.Button(self, text=lang.cancel, command=self.cancel).pack(side=BOTTOM, padx=5, pady=5, fill=X)
+        ttk.Button(self, text='Trace', command=self.trace).pack(side=BOTTOM, padx=5, pady=5, fill=X)
+        scroll.pack(side=RIGHT, fill=Y)
+        self.table.pack(fill=BOTH, expand=True)
+        self.refresh()
+        move_center(self)
+
+    def refresh(self):
+        if not self.winfo_exists():
+            return
+        selected = [self.table.set(i, 'id') for i in self.table.selection()]
+        self.table.delete(*self.table.get_children())
+        for job in reversed(jobs.list_jobs(finished=True)):
+            item = self.table.insert('', tk.END, values=[job[i] for i in self.table['columns']])
+            if str(job['id']) in selected:
+                self.table.selection_add(item)
+        self.after(1000, self.refresh)
+
+    def cancel(self):
+        for i in self.table.selection():
+            jobs.cancel(int(self.table.set(i, 'id')))
+
+    def trace(self):
+        # Switches tracing of the selected jobs, their spans are written when the tool exits
+        for i in self.table.selection():
+            jobs.set_traced(int(self.table.set(i, 'id')), self.table.set(i, 'traced') != 'True')
+
+
 class Debugger(Toplevel):
     def __init__(self):
         super().__init__()
@@ -3974,6 +4125,7 @@ class Debugger(Toplevel):
             ('Crash it!', self.crash),
             ('Hacker panel', lambda: openurl('https://vdse.bdstatic.com/192d9a98d782d9c74c96f09db9378d93.mp4')),
             ('Generate Bug Report', lambda: create_thread(generate_bug_report)),
+            ('Jobs', JobViewer),
             ('米塔 MiSide', lambda: openurl('https://store.steampowered.com/app/2527500/')),
             ('米塔 MiSide(Demo)', lambda: openurl('steam://install/2527520')),
             ('No More Room in Hell', lambda: openurl('steam://install/224260')),
@@ -4869,11 +5021,14 @@ class PackHybridRom:
             lines = script.readlines()
             lines.insert(45, f'right_device="{right_device}"\n')
             add_line = self.get_line_num(lines, '#Other images')
+            # Images over 200M are compressed together after the flash methods are added
+            large = []
+            outside = []
             for t in os.listdir(f"{dir_}/images"):
                 if t.endswith('.img') and not os.path.isdir(dir_ + t):
                     print(f"Add Flash method {t} to update-binary")
                     if os.path.getsize(os.path.join(f'{dir_}/images', t)) > 209715200:
-                        self.zstd_compress(os.path.join(f'{dir_}/images', t))
+                        large.append(os.path.join(f'{dir_}/images', t))
                         lines.insert(add_line,
                                      f'package_extract_zstd "images/{t}.zst" "/dev/block/by-name/{t[:-4]}"\n')
                     else:
@@ -4883,14 +5038,17 @@ class PackHybridRom:
                 if not t.startswith("preloader_") and not os.path.isdir(dir_ + t) and t.endswith('.img'):
                     print(f"Add Flash method {t} to update-binary")
                     if os.path.getsize(dir_ + t) > 209715200:
-                        self.zstd_compress(dir_ + t)
-                        move(os.path.join(dir_, f"{t}.zst"), os.path.join(f"{dir_}/images", f"{t}.zst"))
+                        outside.append(t)
                         lines.insert(add_line,
                                      f'package_extract_zstd "images/{t}.zst" "/dev/block/by-name/{t[:-4]}"\n')
                     else:
                         lines.insert(add_line,
                                      f'package_extract_file "images/{t}" "/dev/block/by-name/{t[:-4]}"\n')
                         move(os.path.join(dir_, t), os.path.join(f"{dir_}/images", t))
+            self.zstd_compress(large + [dir_ + t for t in outside])
+            for t in outside:
+                if os.path.exists(os.path.join(dir_, f"{t}.zst")):
+                    move(os.path.join(dir_, f"{t}.zst"), os.path.join(f"{dir_}/images", f"{t}.zst"))
             script.seek(0)
             script.truncate()
             script.writelines(lines)
@@ -4902,18 +5060,13 @@ class PackHybridRom:
                 return i
 
     @staticmethod
-    def zstd_compress(path):
-        basename = os.path.basename(path)
-        if os.path.exists(path):
-            if gettype(path) == "sparse":
-                print(f"[INFO] {basename} is (sparse), converting to (raw)")
-                utils.simg2img(path)
-            try:
-                print(f"[Compress] {basename}...")
-                call(['zstd', '-5', '--rm', path, '-o', f'{path}.zst'])
-            except Exception as e:
-                logging.exception('Bugs')
-                print(f"[Fail] Compress {basename} Fail:{e}")
+    def zstd_compress(paths: list):
+        """
+        Compress raw or sparse images to .zst at the same time, sparse images are expanded while compressing
+        :param paths: images, removed when compressed
+        :return:
+        """
+        zstd_image.compress_all([i for i in paths if os.path.exists(i)])
 
 
 # multi group_size must 4194304 less than super
@@ -5138,13 +5291,15 @@ class PackSuper(Toplevel):
         ttk.Button(self, text=lang.cancel, command=self.destroy).pack(side='left', padx=10, pady=10,
                                                                       fill=X,
                                                                       expand=True)
-        ttk.Button(self, text=lang.pack, command=lambda: create_thread(self.start_), style="Accent.TButton").pack(
+        ttk.Button(self, text=lang.pack,
+                   command=lambda: create_thread(self.start_, pool='io', priority=jobs.Priority.BULK),
+                   style="Accent.TButton").pack(
             side='left',
             padx=5,
             pady=5, fill=X,
             expand=True)
         self.read_list()
-        create_thread(self.refresh)
+        create_thread(self.refresh, pool='io', priority=jobs.Priority.INTERACTIVE)
 
     def start_(self):
         try:
@@ -5353,7 +5508,7 @@ class StdoutRedirector:
             logging.error(string)
             return
         self.text_space.insert(tk.END, string)
-        create_thread(logging.debug, string)
+        logging.debug(string)
         if settings.ai_engine == '1':
             AI_engine.suggest(string, language=settings.language, ok=lang.ok)
 
@@ -5378,79 +5533,27 @@ class StdoutRedirector:
             time.sleep(0.5)
 
 
-def download_api(url, path=None, int_=True, size_=0):
+def download_api(url, path=None, int_=True, size_=0, connections: int = 4, hash_: tuple[str, str] = None):
     """
     return percentage, speed, bytes_downloaded, file_size, elapsed
+    The file is fetched by Downloader over several connections when the server supports ranges,
+    an interrupted download resumes from its state file, hash_ is (algorithm, hexdigest) to verify.
     """
-    start_time = time.time()
-    session = requests.Session()  # Create a session once
-
-    try:
-        # HEAD request to get the file size. Verify=True by default.
-        # Add a timeout to prevent hanging
-        response_head = session.head(url, timeout=10)  # 10-second timeout
-        response_head.raise_for_status()  # Check for HTTP errors (4xx, 5xx)
-        file_size = int(response_head.headers.get("Content-Length", 0))
-    except requests.exceptions.RequestException as e_head:
-        logging.error(f"Error making HEAD request to {url}: {e_head}")
-        # In case of a HEAD error, we can either abort or try to download without a known file_size.
-        # Here, we will continue; file_size will remain 0, and if size_ is provided, it will be used.
-        file_size = 0  # or an exception could be raised and handled further up
-
-    # GET request to download the file.
-    # Removed verify=False, so the default True is used.
-    try:
-        # Add a timeout for the GET request as well (for establishing the connection)
-        response_get = session.get(url, stream=True, timeout=10)
-        response_get.raise_for_status()  # Check for HTTP errors
-    except requests.exceptions.RequestException as e_get:
-        logging.error(f"Error making GET request to {url}: {e_get}")
-        # If the GET request fails, the generator needs to be interrupted.
-        # An exception can be raised, or an empty yield can be returned.
-        yield "Error", 0, 0, 0, 0  # Example of returning an error
-        return
-
-    last_time = time.time()
-    if file_size == 0 and size_ > 0:  # Use the provided size_ if not obtained from the header
-        file_size = size_
     file_save_path = os.path.join(path or settings.path, os.path.basename(url))
-    logging.info(f"Starting download: {url} to {file_save_path}, expected size: {file_size}")
-
+    logging.info(f"Starting download: {url} to {file_save_path}")
+    downloader = Downloader(url, file_save_path, connections=connections, hash_=hash_, size=size_)
+    bytes_downloaded = file_size = 0
+    start_time = time.time()
     try:
-        with open(file_save_path, "wb") as f:
-            chunk_size = 2048576  # 2MB
-            chunk_kb = chunk_size / 1024
-            bytes_downloaded = 0
-            for data in response_get.iter_content(chunk_size=chunk_size):
-                if not data:  # Check for empty data if the connection was dropped
-                    break
-                f.write(data)
-                bytes_downloaded += len(data)
-
-                current_time = time.time()
-                elapsed_total = current_time - start_time
-
-                # Speed calculation
-                # To avoid division by zero if the time interval is very small
-                time_since_last_chunk = current_time - last_time
-                speed = 0
-                if time_since_last_chunk > 0.001:  # Avoid division by a very small number
-                    speed = (len(data) / 1024) / time_since_last_chunk  # Speed of the current chunk
-                else:  # If the time interval is very small, use the average speed
-                    if elapsed_total > 0.001:
-                        speed = (bytes_downloaded / 1024) / elapsed_total
-
-                last_time = current_time
-
-                percentage = "Unknown"  # If file_size is unknown
-                if file_size > 0:
-                    percentage_float = (bytes_downloaded / file_size) * 100
-                    percentage = int(percentage_float) if int_ else percentage_float
-
-                yield percentage, speed, bytes_downloaded, file_size, elapsed_total
-    except IOError as e_io:
-        logging.error(f"IOError during download or saving file {file_save_path}: {e_io}")
-        yield "Error", 0, bytes_downloaded, file_size, time.time() - start_time  # Return an error
+        for bytes_downloaded, file_size, speed, elapsed in downloader.run():
+            percentage = "Unknown"  # If file_size is unknown
+            if file_size > 0:
+                percentage_float = (bytes_downloaded / file_size) * 100
+                percentage = int(percentage_float) if int_ else percentage_float
+            yield percentage, speed, bytes_downloaded, file_size, elapsed
+    except (IOError, ValueError) as e:
+        logging.error(f"Error during download of {url} to {file_save_path}: {e}")
+        yield "Error", 0, bytes_downloaded, file_size, time.time() - start_time
     except Exception as e_download:  # Catch other potential errors during download
         logging.exception(f"Unexpected error during download of {url}: {e_download}")
         yield "Error", 0, bytes_downloaded, file_size, time.time() - start_time
@@ -5502,6 +5605,7 @@ def download_file():
 
 
 @animation
+@trace.traced()
 def unpack_boot(name: str = 'boot', boot: str = None, work: str = None):
     if not work:
         work = project_manger.current_work_path()
@@ -5545,6 +5649,7 @@ def unpack_boot(name: str = 'boot', boot: str = None, work: str = None):
 
 
 @animation
+@trace.traced()
 def dboot(name: str = 'boot', source: str = None, boot: str = None):
     work = project_manger.current_work_path()
     flag = ''
@@ -5706,7 +5811,9 @@ class Packxx(Toplevel):
                                                                       pady=2,
                                                                       fill=X,
                                                                       expand=True)
-        ttk.Button(self, text=lang.pack, command=lambda: create_thread(self.start_), style="Accent.TButton").pack(
+        ttk.Button(self, text=lang.pack,
+                   command=lambda: create_thread(self.start_, pool='io', priority=jobs.Priority.BULK),
+                   style="Accent.TButton").pack(
             side='left',
             padx=2, pady=2,
             fill=X,
@@ -5789,12 +5896,33 @@ class Packxx(Toplevel):
         ck.wait_window()
 
     @animation
+    @trace.traced()
     def packrom(self) -> bool:
         if not project_manger.exist():
             win.message_pop(lang.warn1, "red")
             return False
         parts_dict = JsonEdit((work := project_manger.current_work_path()) + "config/parts_info").read()
+        # Policy edits would be hidden by the stale precompiled_sepolicy, rebuild it before the partitions are packed.
+        if {os.path.basename(i) for i in self.lg} & {'system', 'system_ext', 'product', 'vendor', 'odm'}:
+            sepolicy.rebuild(work, settings.secilc)
+        if os.name == 'nt':
+            try:
+                if folder := findfolder(work, "com.google.android.apps.nbu."):
+                    call(['mv', folder,
+                          folder.replace('com.google.android.apps.nbu.', 'com.google.android.apps.nbu')])
+            except Exception:
+                logging.exception('Bugs')
+        # fs_config and file_contexts of all partitions are patched together before the images are built.
+        try:
+            prepack.normalize(work, [os.path.basename(i) for i in self.lg if
+                                     os.access(os.path.join(f"{work}/config", f"{os.path.basename(i)}_fs_config"),
+                                               os.F_OK)],
+                              context_rule_file if settings.contextpatch == "1" else None)
+        except RuntimeError as e:
+            print(lang.text75 % e)
+            return False
         for i in self.lg:
+            jobs.check_cancelled()
             dname = os.path.basename(i)
             if dname not in parts_dict.keys():
                 parts_dict[dname] = 'unknown'
@@ -5805,24 +5933,7 @@ class Packxx(Toplevel):
                         print(lang.text71 % file)
                         utils.Vbpatch(file).disavb()
             if os.access(os.path.join(f"{work}/config", f"{dname}_fs_config"), os.F_OK):
-                if os.name == 'nt':
-                    try:
-                        if folder := findfolder(work, "com.google.android.apps.nbu."):
-                            call(['mv', folder,
-                                  folder.replace('com.google.android.apps.nbu.', 'com.google.android.apps.nbu')])
-                    except Exception:
-                        logging.exception('Bugs')
-                fspatch.main(work + dname, os.path.join(f"{work}/config", f"{dname}_fs_config"))
-                utils.qc(f"{work}/config/{dname}_fs_config")
                 contexts_file = f"{work}/config/{dname}_file_contexts"
-                if os.path.exists(contexts_file):
-                    if settings.contextpatch == "1":
-                        contextpatch.main(work + dname, contexts_file, context_rule_file)
-                        new_rules = contextpatch.scan_context(contexts_file)
-                        rules = JsonEdit(context_rule_file)
-                        rules.write(new_rules | rules.read())
-
-                    utils.qc(contexts_file)
                 if self.fs_conver.get():
                     if parts_dict[dname] == self.origin_fs.get():
                         parts_dict[dname] = self.modify_fs.get()
@@ -5964,6 +6075,7 @@ def script2fs(path):
 
 
 @animation
+@trace.traced()
 def unpackrom(ifile) -> None:
     print(lang.text77 + ifile, f'Type:[{(ftype := gettype(ifile))}]')
     # gzip
@@ -6051,15 +6163,20 @@ def unpackrom(ifile) -> None:
     # pac
     if gettype(ifile) == 'pac':
         current_project_name.set(os.path.splitext(os.path.basename(ifile))[0])
-        unpac(ifile, project_manger.current_work_path(), PACMODE.EXTRACT)
+        if not unpac(ifile, project_manger.current_work_path(), PACMODE.EXTRACT, verify=True):
+            print(f"[W] {os.path.basename(ifile)}: crc mismatch, the extracted files may be corrupted")
+            return
         if settings.auto_unpack == '1':
             unpack([i.split('.')[0] for i in os.listdir(project_manger.current_work_path())])
         return
     # zip
     if gettype(ifile) == 'zip':
         current_project_name.set(os.path.splitext(os.path.basename(ifile))[0])
-        with zipfile.ZipFile(ifile, 'r') as fz:
+        with zipfile.ZipFile(ifile, 'r') as fz, \
+                progress.Progress(f'unzip {os.path.basename(ifile)}', sum(i.file_size for i in fz.infolist()),
+                                  len(fz.infolist())) as tracker:
             for fi in fz.namelist():
+                tracker.update(fz.getinfo(fi).file_size, 1)
                 try:
                     member_name = fi.encode('cp437').decode('gbk')
                 except (Exception, BaseException):
@@ -6165,6 +6282,7 @@ project_manger = ProjectManager()
 
 
 @animation
+@trace.traced()
 def unpack(chose, form: str = '') -> bool:
     if os.name == 'nt':
         if windll.shell32.IsUserAnAdmin():
@@ -6193,6 +6311,7 @@ def unpack(chose, form: str = '') -> bool:
                 ),
                 work,
                 os.cpu_count() or 2,
+                settings.sparse_extract == '1',
             )
         tooks = time.time() - time_start
         print("Done! tooks: %.2f" % tooks)
@@ -6209,7 +6328,7 @@ def unpack(chose, form: str = '') -> bool:
         if gettype(f"{work}/super.img") == 'super':
             # should get info here.
             parts["super_info"] = lpunpack.get_info(os.path.join(work, "super.img"))
-            lpunpack.unpack(os.path.join(work, "super.img"), work, chose)
+            lpunpack.unpack(os.path.join(work, "super.img"), work, chose, settings.sparse_extract == '1')
             for file_name in os.listdir(work):
                 if file_name.endswith('_a.img') and not os.path.exists(work + file_name.replace('_a', '')):
                     os.rename(work + file_name, work + file_name.replace('_a', ''))
@@ -6223,6 +6342,7 @@ def unpack(chose, form: str = '') -> bool:
         splituapp.extract(f"{work}/UPDATE.APP", work, chose)
         return True
     for i in chose:
+        jobs.check_cancelled()
         if os.access(f"{work}/{i}.zst", os.F_OK):
             print(f"{lang.text79} {i}.zst")
             call(['zstd', '--rm', '-d', f"{work}/{i}.zst"])
@@ -6232,7 +6352,9 @@ def unpack(chose, form: str = '') -> bool:
             Unxz(f"{work}/{i}.new.dat.xz")
         if os.access(f"{work}/{i}.new.dat.br", os.F_OK):
             print(lang.text79 + f"{i}.new.dat.br")
-            call(['brotli', '-dj', f"{work}/{i}.new.dat.br"])
+            with progress.Progress(f'brotli {i}.new.dat.br', os.path.getsize(f"{work}/{i}.new.dat.br")) as tracker:
+                call(['brotli', '-dj', f"{work}/{i}.new.dat.br"])
+                tracker.update(tracker.bytes_total)
         if os.access(f"{work}/{i}.new.dat.1", os.F_OK):
             with open(f"{work}/{i}.new.dat", 'ab') as ofd:
                 for n in range(100):
@@ -6357,6 +6479,8 @@ def unpack(chose, form: str = '') -> bool:
         os.makedirs(f"{work}/config")
     json_.write(parts)
     parts.clear()
+    # The policy as unpacked is the one precompiled_sepolicy was built from
+    sepolicy.record(work)
     print(lang.text8)
     return True
 
@@ -6450,7 +6574,8 @@ class GetFolderSize:
     # 1 - return True value of dir size
     # 2 - return Rsize value of dir size
     # 3 - return Rsize value of dir size and modify dynampic_partition_list
-    def __init__(self, dir_: str, num: int = 1, get: int = 2, list_f: str = None):
+    # holes - count only the allocated blocks of sparse files, for packers which keep holes (e2fsdroid)
+    def __init__(self, dir_: str, num: int = 1, get: int = 2, list_f: str = None, holes: bool = False):
         self.rsize_v: int
         self.num = num
         self.get = get
@@ -6465,7 +6590,12 @@ class GetFolderSize:
                         file_path = os.path.join(root, name)
                         if not os.path.isfile(file_path):
                             self.size += len(name)
-                        self.size += os.path.getsize(file_path)
+                        st = os.stat(file_path)
+                        if holes and getattr(st, 'st_blocks', None) is not None and st.st_blocks * 512 < st.st_size:
+                            # Fewer blocks than bytes: holes, or a filesystem that compresses, ask for the data
+                            self.size += self.data_size(file_path, st.st_size)
+                        else:
+                            self.size += st.st_size
                     except (PermissionError, BaseException, Exception):
                         logging.exception(f"Getsize {name}")
                         self.size += 1
@@ -6479,6 +6609,33 @@ class GetFolderSize:
         else:
             self.rsize(self.size, self.num)
 
+    @staticmethod
+    def data_size(path: str, size: int) -> int:
+        """
+        Bytes of a file outside of its holes, st_blocks is smaller on filesystems that compress
+        :param path: a regular file
+        :param size: st_size of it
+        :return: size when holes cannot be found
+        """
+        if not hasattr(os, 'SEEK_DATA'):
+            return size
+        total = pos = 0
+        try:
+            with open(path, 'rb') as f:
+                while pos < size:
+                    try:
+                        start = os.lseek(f.fileno(), pos, os.SEEK_DATA)
+                    except OSError as e:
+                        if e.errno == errno.ENXIO:
+                            # Only a hole is left
+                            break
+                        raise
+                    pos = os.lseek(f.fileno(), start, os.SEEK_HOLE)
+                    total += pos - start
+        except OSError:
+            return size
+        return min(total, size)
+
     def rsize(self, size: int, num: int):
         print(f"{self.dname} Size : {hum_convert(size)}")
         if size <= 2097152:
@@ -6514,6 +6671,7 @@ class GetFolderSize:
 
 
 @animation
+@trace.traced()
 def datbr(work, name, brl: str | int, dat_ver=4):
     """
 
@@ -6539,7 +6697,10 @@ def datbr(work, name, brl: str | int, dat_ver=4):
         print(lang.text87 % name)
     else:
         print(lang.text88 % (name, 'br'))
-        call(['brotli', '-q', str(brl), '-j', '-w', '24', f"{work}/{name}.new.dat", '-o', f"{work}/{name}.new.dat.br"])
+        with progress.Progress(f'brotli {name}.new.dat', os.path.getsize(f"{work}/{name}.new.dat")) as tracker:
+            call(['brotli', '-q', str(brl), '-j', '-w', '24', f"{work}/{name}.new.dat", '-o',
+                  f"{work}/{name}.new.dat.br"])
+            tracker.update(tracker.bytes_total)
         if os.access(f"{work}/{name}.new.dat", os.F_OK):
             try:
                 os.remove(f"{work}/{name}.new.dat")
@@ -6548,6 +6709,7 @@ def datbr(work, name, brl: str | int, dat_ver=4):
         print(lang.text89 % (name, 'br'))
 
 
+@trace.traced()
 def mkerofs(name: str, format_, work, work_output, level, old_kernel: bool = False, UTC: int = None):
     if not UTC:
         UTC = int(time.time())
@@ -6563,6 +6725,7 @@ def mkerofs(name: str, format_, work, work_output, level, old_kernel: bool = Fal
 
 
 @animation
+@trace.traced()
 def make_ext4fs(name: str, work: str, work_output, sparse: bool = False, size: int = 0, UTC: int = None,
                 has_contexts: bool = True):
     if not has_contexts:
@@ -6582,6 +6745,7 @@ def make_ext4fs(name: str, work: str, work_output, sparse: bool = False, size: i
 
 
 @animation
+@trace.traced()
 def make_f2fs(name: str, work: str, work_output: str, UTC: int = None):
     print(lang.text91 % name)
     size = GetFolderSize(work + name, 1, 1).rsize_v
@@ -6620,11 +6784,12 @@ def make_f2fs(name: str, work: str, work_output: str, UTC: int = None):
          f'{work}/config/{name}_file_contexts', '-t', f'/{name}', '-c', f'{work_output}/{name}.img'])
 
 
+@trace.traced()
 def mke2fs(name: str, work: str, sparse: bool, work_output: str, size: int = 0, UTC: int = None):
     if isinstance(size, str): size = int(size)
     print(lang.text91 % name)
     size = GetFolderSize(work + name, 4096, 3,
-                         f"{work}/dynamic_partitions_op_list").rsize_v if not size else size / 4096
+                         f"{work}/dynamic_partitions_op_list", holes=True).rsize_v if not size else size / 4096
     print(f"{name}:[{size}]")
     if not UTC:
         UTC = int(time.time())
@@ -6681,6 +6846,7 @@ def rmdir(path: str, quiet: bool = False):
 
 
 @animation
+@trace.traced()
 def pack_zip(input_dir: str = None, output_zip: str = None, silent: bool = False):
     if input_dir is None:
         input_dir = project_manger.current_work_output_path()
@@ -6728,10 +6894,12 @@ def pack_zip(input_dir: str = None, output_zip: str = None, silent: bool = False
                 return
 
     print(lang.text91 % current_project_name.get())
+    files = {str(i): os.lstat(i).st_size for i in utils.get_all_file_paths(input_dir)}
     with zipfile.ZipFile(output_zip, 'w',
-                         compression=zipfile.ZIP_DEFLATED) as zip_:
-        for file in utils.get_all_file_paths(input_dir):
-            file = str(file)
+                         compression=zipfile.ZIP_DEFLATED) as zip_, \
+            progress.Progress(f'zip {os.path.basename(output_zip)}', sum(files.values()), len(files)) as tracker:
+        for file, size in files.items():
+            tracker.update(size, 1)
             arch_name = file.replace(input_dir, '')
             if not silent:
                 print(f"{lang.text1}:{arch_name}")
@@ -6743,7 +6911,43 @@ def pack_zip(input_dir: str = None, output_zip: str = None, silent: bool = False
         print(lang.text3.format(output_zip))
 
 
-def dndfile(files: list):
+@trace.traced()
+def export_snapshot(name: str = None, output: str = None):
+    """
+    Save a project as a snapshot, the partitions, configs and images with their metadata
+    :param name: project, the current one if None
+    :param output: the snapshot file, {name}.snap next to the projects if None
+    :return:
+    """
+    name = name or current_project_name.get()
+    if not name or not os.path.isdir(project_manger.get_work_path(name)):
+        win.message_pop(lang.warn1)
+        return
+    output = output or os.path.join(settings.path, f"{name}.snap")
+    print(f"Snapshot {name} -> {output}")
+    with jobs.partial(output):
+        snapshot.export_snapshot(project_manger.get_work_path(name), output)
+
+
+@trace.traced()
+def import_snapshot(file: str, name: str = None, members: list = None):
+    """
+    Restore a snapshot as a project, only some partitions or files of it if members are given
+    :param file:
+    :param name: project, the name of the snapshot if None
+    :param members: partitions, folders or files, everything if empty
+    :return:
+    """
+    name = name or os.path.splitext(os.path.basename(file))[0]
+    try:
+        snapshot.import_snapshot(file, project_manger.get_work_path(name), members)
+    except snapshot.SnapshotError as e:
+        print(e)
+        return
+    current_project_name.set(name)
+
+
+def dndfile(files: list, traced: bool = False):
     for fi in files:
         if fi.endswith('}') and fi.startswith('{'):
             fi = fi[1:-1]
@@ -6755,8 +6959,10 @@ def dndfile(files: list):
         if os.path.exists(fi):
             if fi.endswith(".mpk"):
                 InstallMpk(fi)
+            elif fi.endswith(".snap"):
+                create_thread(import_snapshot, fi, pool='io', priority=jobs.Priority.BULK, traced=traced)
             else:
-                create_thread(unpackrom, fi)
+                create_thread(unpackrom, fi, pool='io', priority=jobs.Priority.BULK, traced=traced)
         else:
             print(fi + lang.text84)
 
@@ -6841,7 +7047,7 @@ class Frame3(ttk.LabelFrame):
     def gui(self):
         row = 0
         functions = [
-            (lang.text122, lambda: create_thread(pack_zip)),
+            (lang.text122, lambda: create_thread(pack_zip, pool='io', priority=jobs.Priority.BULK)),
             (lang.text123, lambda: create_thread(PackSuper)),
             (lang.text19, lambda: win.notepad.select(win.tab7)),
             (lang.t13, lambda: create_thread(FormatConversion)),
@@ -6989,22 +7195,20 @@ class UnpackGui(ttk.LabelFrame):
 
         parts_dict = JsonEdit(f"{work}/config/parts_info").read()
 
-        # Find .img files in the working directory to be packed into the payload.
-        for file_name in os.listdir(work):
-            if file_name.endswith('.img'):
-                partition_name = file_name.split('.img')[0]
-                img_path = os.path.join(work, file_name)
-                # Skip empty images.
-                if not os.path.getsize(img_path):
-                    continue
-                f_type = gettype(img_path)
-                if f_type == 'unknown':
-                    f_type = 'img'
+        # Find .img files in the working directory to be packed into the payload, skipping empty images.
+        images_ = [os.path.join(work, i) for i in os.listdir(work) if i.endswith('.img')]
+        images_ = [i for i in images_ if os.path.getsize(i)]
+        types = type_cache.get_many(images_)
+        for img_path in images_:
+            partition_name = os.path.basename(img_path).split('.img')[0]
+            f_type = types[img_path]
+            if f_type == 'unknown':
+                f_type = 'img'
 
-                # Check if a corresponding folder type exists in parts_info.
-                folder_type = parts_dict.get(partition_name, f_type)
+            # Check if a corresponding folder type exists in parts_info.
+            folder_type = parts_dict.get(partition_name, f_type)
 
-                self.lsg.insert(f'{partition_name} [{folder_type}] ({hum_convert(os.path.getsize(img_path))})', partition_name)
+            self.lsg.insert(f'{partition_name} [{folder_type}] ({hum_convert(os.path.getsize(img_path))})', partition_name)
 
         return True
 
@@ -7013,14 +7217,28 @@ class UnpackGui(ttk.LabelFrame):
         Refreshes the list of items available for unpacking based on the selected format.
         """
         if auto:
-            for index, value in enumerate(self.fm.cget("values")):
-                self.fm.current(index)
-                self.__refs()
-                if len(self.lsg.vars):
-                    return True
+            # Pick the first format with something to unpack from a single directory listing.
+            work = project_manger.current_work_path()
+            files = os.listdir(work) if project_manger.exist() else []
             self.fm.current(0)
+            for index, value in enumerate(self.fm.cget("values")):
+                if self.has_items(value, files):
+                    self.fm.current(index)
+                    break
+            self.__refs()
             return True
-        create_thread(self.__refs)
+        create_thread(self.__refs, pool='io', priority=jobs.Priority.INTERACTIVE)
+
+    @staticmethod
+    def has_items(form: str, files: list) -> bool:
+        """Whether __refs would list anything for the format, judged by file names only."""
+        if form == 'payload':
+            return 'payload.bin' in files
+        if form == 'super':
+            return 'super.img' in files
+        if form == 'update.app':
+            return 'UPDATE.APP' in files
+        return any(i.endswith(form) for i in files)
 
     @animation
     def __refs(self):
@@ -7049,13 +7267,14 @@ class UnpackGui(ttk.LabelFrame):
                 for i in splituapp.get_parts(f"{work}/UPDATE.APP"):
                     self.lsg.insert(i, i)
         else:
-            for file_name in os.listdir(work):
-                if file_name.endswith(form):
-                    f_type = gettype(work + file_name)
-                    if f_type == 'unknown':
-                        f_type = form
-                    self.lsg.insert(f'{file_name.split(f".{form}")[0]} [{f_type}]',
-                                    file_name.split(f".{form}")[0])
+            files = [i for i in os.listdir(work) if i.endswith(form)]
+            types = type_cache.get_many([work + i for i in files])
+            for file_name in files:
+                f_type = types[work + file_name]
+                if f_type == 'unknown':
+                    f_type = form
+                self.lsg.insert(f'{file_name.split(f".{form}")[0]} [{f_type}]',
+                                file_name.split(f".{form}")[0])
         return True
 
     def refs2(self):
@@ -7106,11 +7325,13 @@ class FormatConversion(ttk.LabelFrame):
         self.list_b = ListBox(self)
         self.list_b.gui()
         self.list_b.pack(padx=5, pady=5, fill=BOTH)
-        create_thread(self.relist)
+        create_thread(self.relist, pool='io', priority=jobs.Priority.INTERACTIVE)
         t = Frame(self)
         ttk.Button(t, text=lang.cancel, command=self.destroy).pack(side='left', padx=5, pady=5, fill=BOTH,
                                                                    expand=True)
-        ttk.Button(t, text=lang.ok, command=lambda: create_thread(self.conversion), style='Accent.TButton').pack(
+        ttk.Button(t, text=lang.ok,
+                   command=lambda: create_thread(self.conversion, pool='io', priority=jobs.Priority.BULK),
+                   style='Accent.TButton').pack(
             side='left',
             padx=5, pady=5,
             fill=BOTH,
@@ -7129,15 +7350,13 @@ class FormatConversion(ttk.LabelFrame):
         elif self.h.get() == 'dat':
             for i in self.refile(".new.dat"):
                 self.list_b.insert(i, i)
-        elif self.h.get() == 'sparse':
-            for i in os.listdir(work):
-                if os.path.isfile(f'{work}/{i}') and gettype(f'{work}/{i}') == 'sparse':
+        elif self.h.get() in ['sparse', 'raw']:
+            files = [i for i in os.listdir(work) if os.path.isfile(f'{work}/{i}')]
+            types = type_cache.get_many([f'{work}/{i}' for i in files])
+            wanted = ['sparse'] if self.h.get() == 'sparse' else ['ext', 'erofs', 'super', 'f2fs']
+            for i in files:
+                if types[f'{work}/{i}'] in wanted:
                     self.list_b.insert(i, i)
-        elif self.h.get() == 'raw':
-            for i in os.listdir(work):
-                if os.path.isfile(f'{work}/{i}'):
-                    if gettype(f'{work}/{i}') in ['ext', 'erofs', 'super', 'f2fs']:
-                        self.list_b.insert(i, i)
 
     @staticmethod
     def refile(f):
@@ -7154,102 +7373,7 @@ class FormatConversion(ttk.LabelFrame):
         self.destroy()
         if f_get == hget:
             return
-        for i in selection:
-            print(f'[{hget}->{f_get}]{i}')
-            if f_get == 'sparse':
-                basename = os.path.basename(i).split('.')[0]
-                if hget == 'br':
-                    if os.access(f'{work}/{i}', os.F_OK):
-                        print(lang.text79 + i)
-                        call(['brotli', '-dj', f'{work}/{i}'])
-                if hget == 'xz':
-                    if os.access(f'{work}/{i}', os.F_OK):
-                        print(lang.text79 + i)
-                        Unxz(f'{work}/{i}')
-                if hget == 'dat':
-                    if os.access(f'{work}/{i}', os.F_OK):
-                        print(lang.text79 + f'{work}/{i}')
-                        transferfile = os.path.abspath(
-                            os.path.dirname(work)) + f"/{basename}.transfer.list"
-                        if os.access(transferfile, os.F_OK) and os.path.getsize(f'{work}/{i}') != 0:
-                            Sdat2img(transferfile, f'{work}/{i}', f"{work}/{basename}.img")
-                            if os.access(f"{work}/{basename}.img", os.F_OK):
-                                os.remove(f'{work}/{i}')
-                                os.remove(transferfile)
-                                try:
-                                    os.remove(f'{work}/{basename}.patch.dat')
-                                except (IOError, PermissionError, FileNotFoundError):
-                                    logging.exception('Bugs')
-                        else:
-                            print("transferpath" + lang.text84)
-                    if os.path.exists(f'{work}/{basename}.img'):
-                        img2simg(f'{work}/{basename}.img')
-                if hget == 'raw':
-                    if os.path.exists(f'{work}/{basename}.img'):
-                        img2simg(f'{work}/{basename}.img')
-            elif f_get == 'raw':
-                basename = os.path.basename(i).split('.')[0]
-                if hget == 'br':
-                    if os.access(f'{work}/{i}', os.F_OK):
-                        print(lang.text79 + i)
-                        call(['brotli', '-dj', f'{work}/{i}'])
-                if hget == 'xz':
-                    if os.access(f'{work}/{i}', os.F_OK):
-                        print(lang.text79 + i)
-                        Unxz(f'{work}/{i}')
-                if hget in ['dat', 'br', 'xz']:
-                    if os.path.exists(work):
-                        if hget == 'br':
-                            i = i.replace('.br', '')
-                        if hget == 'xz':
-                            i = i.replace('.xz', '')
-                        print(lang.text79 + f'{work}/{i}')
-                        transferfile = os.path.abspath(
-                            os.path.dirname(work)) + f"/{basename}.transfer.list"
-                        if os.access(transferfile, os.F_OK) and os.path.getsize(f'{work}/{i}') != 0:
-                            Sdat2img(transferfile, f'{work}/{i}', f"{work}/{basename}.img")
-                            if os.access(f"{work}/{basename}.img", os.F_OK):
-                                try:
-                                    os.remove(f'{work}/{i}')
-                                    os.remove(transferfile)
-                                    if not os.path.getsize(f'{work}/{basename}.patch.dat'):
-                                        os.remove(f'{work}/{basename}.patch.dat')
-                                except (PermissionError, IOError, FileNotFoundError, IsADirectoryError):
-                                    logging.exception('Bugs')
-                        else:
-                            print("transferfile" + lang.text84)
-                if hget == 'sparse':
-                    utils.simg2img(f'{work}/{i}')
-            elif f_get == 'dat':
-                if hget == 'raw':
-                    img2simg(f'{work}/{i}')
-                if hget in ['raw', 'sparse']:
-                    datbr(work, os.path.basename(i).split('.')[0], "dat")
-                if hget == 'br':
-                    print(lang.text79 + i)
-                    call(['brotli', '-dj', f'{work}/{i}'])
-                if hget == 'xz':
-                    print(lang.text79 + i)
-                    Unxz(f'{work}/{i}')
-
-            elif f_get == 'br':
-                if hget == 'raw':
-                    img2simg(f'{work}/{i}')
-                if hget in ['raw', 'sparse']:
-                    datbr(work, os.path.basename(i).split('.')[0], 0)
-                if hget in ['dat', 'xz']:
-                    if hget == 'xz':
-                        print(lang.text79 + i)
-                        Unxz(f'{work}/{i}')
-                        i = i.rsplit('.xz', 1)[0]
-
-                    print(lang.text88 % (os.path.basename(i).split('.')[0], 'br'))
-                    call(['brotli', '-q', '0', '-j', '-w', '24', f'{work}/{i}', '-o', f'{work}/{i}.br'])
-                    if os.access(f'{work}/{i}.br', os.F_OK):
-                        try:
-                            os.remove(f'{work}/{i}')
-                        except Exception:
-                            logging.exception('Bugs')
+        convert.convert(work, selection, hget, f_get)
         print(lang.text8)
 
 
@@ -7277,8 +7401,10 @@ class ParseCmdline:
         subparser = self.parser.add_subparsers(title='subcommand',
                                                description='Valid subcommands')
         # Unpack Rom
-        unpack_rom_parser = subparser.add_parser('unpack', add_help=False, help="Unpack Suported File")
-        unpack_rom_parser.set_defaults(func=dndfile)
+        unpack_rom_parser = subparser.add_parser('unpack', add_help=False,
+                                                 help='Unpack Suported File, "unpack --trace FILE..." records '
+                                                      'the trace spans of the unpack')
+        unpack_rom_parser.set_defaults(func=self.unpack)
         # Set Config
         set_config_parse = subparser.add_parser('set', help="Set Config")
         set_config_parse.set_defaults(func=self.set)
@@ -7290,7 +7416,23 @@ class ParseCmdline:
         # Lpmake
         lpmake_parser = subparser.add_parser('lpmake', help='To make super image')
         lpmake_parser.set_defaults(func=self.lpmake)
+        # Jobs
+        jobs_parser = subparser.add_parser('jobs', help='List the background jobs of all running tools, '
+                                                        '"jobs cancel [PID:]ID" to cancel one')
+        jobs_parser.set_defaults(func=self.list_jobs)
+        # Trace
+        trace_parser = subparser.add_parser('trace', help='"trace on [FILE]" to trace this and every later run, '
+                                                          'the spans are written to FILE when the tool exits, '
+                                                          '"trace off" to stop')
+        trace_parser.set_defaults(func=self.trace)
+        # Snapshot
+        snapshot_parser = subparser.add_parser('snapshot', help='"snapshot export [PROJECT] [FILE]", '
+                                                                '"snapshot import FILE [PROJECT] [MEMBER...]" or '
+                                                                '"snapshot list FILE"')
+        snapshot_parser.set_defaults(func=self.snapshot)
         # End
+        # Jobs started here run in the background, their progress is printed for as long as the tool runs
+        progress.subscribe(self.print_progress)
         if len(args_list) == 1 and args_list[0] not in ["help", '--help', '-h']:
             dndfile(args_list)
         if len(args_list) == 1 and args_list[0] in ['--help', '-h']:
@@ -7305,6 +7447,10 @@ class ParseCmdline:
         if self.cmd_exit == '1':
             sys.exit(1)
 
+    @staticmethod
+    def print_progress(event: progress.Event):
+        cprint(f'[{event.job}] {progress.format_event(event)}')
+
     # Hidden Methods
     def __parse(self):
         subcmd, subcmd_args = self.parser.parse_known_args(self.args_list)
@@ -7340,6 +7486,55 @@ class ParseCmdline:
         else:
             logging.warning('sys.stdout_origin not defined!')
 
+    @staticmethod
+    def list_jobs(args):
+        # The jobs run in the tool that started them, this process reads what the others share
+        shared = jobs.shared_jobs(jobs_folder)
+        if args[:1] == ['cancel']:
+            for i in args[1:]:
+                pid, _, job_id = i.rpartition(':')
+                owners = [int(pid)] if pid else [
+                    owner for owner, owner_jobs in shared.items()
+                    if any(job['id'] == int(job_id) and job['state'] in ('queued', 'running') for job in owner_jobs)]
+                if len(owners) != 1:
+                    cprint(f'Cancel {i}: ' + ('no such job' if not owners else 'several tools have it, use PID:ID'))
+                    continue
+                cprint(f'Cancel {i}: {jobs.request_cancel(jobs_folder, owners[0], int(job_id))}')
+            return
+        for pid, pid_jobs in {os.getpid(): jobs.list_jobs(finished=True), **shared}.items():
+            for job in pid_jobs:
+                cprint(f"{pid:>7}:{job['id']:<4} {job['state']:<10} {job['pool']:<6} {job['priority']:<12} "
+                       f"{job['elapsed']:>9}s {job['name']}")
+
+    @staticmethod
+    def unpack(args):
+        dndfile([i for i in args if i != '--trace'], traced='--trace' in args)
+
+    @staticmethod
+    def trace(args):
+        # Kept in the trace_file setting, so the runs that follow are traced too
+        if args[:1] == ['on']:
+            settings.set_value('trace_file', os.path.abspath(args[1]) if args[1:] else
+                               settings.trace_file or os.path.join(cwd_path, 'bin', 'trace.json'))
+            trace.enable()
+        elif args == ['off']:
+            settings.set_value('trace_file', '')
+            trace.disable()
+        cprint(f'Tracing: {settings.trace_file or "off"}')
+
+    @staticmethod
+    def snapshot(args):
+        if args[:1] == ['export']:
+            export_snapshot(*args[1:3])
+        elif args[:1] == ['import'] and len(args) > 1:
+            import_snapshot(args[1], args[2] if len(args) > 2 else None, args[3:])
+        elif args[:1] == ['list'] and len(args) == 2:
+            for name, (count, size) in snapshot.list_snapshot(args[1]).items():
+                cprint(f'{name:<32} {count:>8} {size:>16}')
+        else:
+            cprint('snapshot export [PROJECT] [FILE] | snapshot import FILE [PROJECT] [MEMBER...] | '
+                   'snapshot list FILE')
+
     def lpmake(self, arglist):
         parser = argparse.ArgumentParser(add_help=False)
         parser.add_argument('outputdir', nargs='?',
@@ -7397,6 +7592,7 @@ def __init__tk(args: list):
     theme = StringVar()
     language = StringVar()
     settings.load()
+    jobs.share(jobs_folder)
     if settings.updating in ['1', '2']:
         Updater()
     if int(settings.oobe) < 5:
@@ -0,0 +1,112 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+A file served on a free port of localhost for the tests of the http clients.
+"""
+import threading
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+class FileServer:
+    """
+    Serves data at /file while used as a context manager.
+    :param data: the file
+    :param ranges: answer range requests with 206
+    :param etag: sent with every answer when set
+    :param redirect: /file redirects to /signed?n=<count>, a url that changes on every request
+    :param drop: the next drop answers to GET send half of their body and close the connection
+    """
+
+    def __init__(self, data: bytes, ranges: bool = True, etag: str = '"1"', redirect: bool = False, drop: int = 0):
+        self.data = data
+        self.ranges = ranges
+        self.etag = etag
+        self.redirect = redirect
+        self.drop = drop
+        self.sent = 0
+        self.paths = []
+        # (start, end) of every body sent
+        self.served = []
+        self.lock = threading.Lock()
+        self.httpd = ThreadingHTTPServer(('127.0.0.1', 0), self._handler())
+        self.httpd.daemon_threads = True
+        self.thread = threading.Thread(target=self.httpd.serve_forever, daemon=True)
+
+    @property
+    def url(self) -> str:
+        return f'http://127.0.0.1:{self.httpd.server_address[1]}/file'
+
+    def __enter__(self):
+        self.thread.start()
+        return self
+
+    def __exit__(self, exc_type, exc_val, exc_tb):
+        self.httpd.shutdown()
+        self.httpd.server_close()
+
+    def _handler(self):
+        server = self
+
+        class Handler(BaseHTTPRequestHandler):
+            def log_message(self, *args):
+                pass
+
+            def _answer(self, body: bool):
+                with server.lock:
+                    server.paths.append(self.path)
+                    count = len(server.paths)
+                if server.redirect and self.path == '/file':
+                    self.send_response(302)
+                    self.send_header('Location', f'/signed?n={count}')
+                    self.send_header('Content-Length', '0')
+                    self.end_headers()
+                    return
+                if self.path.split('?')[0] not in ('/file', '/signed'):
+                    self.send_error(404)
+                    return
+                start, end = 0, len(server.data)
+                value = self.headers.get('Range')
+                if server.ranges and value and value.startswith('bytes='):
+                    first, _, last = value[6:].partition('-')
+                    start, end = int(first), min(int(last) + 1 if last else end, end)
+                    self.send_response(206)
+                    self.send_header('Content-Range', f'bytes {start}-{end - 1}/{len(server.data)}')
+                else:
+                    self.send_response(200)
+                if server.ranges:
+                    self.send_header('Accept-Ranges', 'bytes')
+                if server.etag:
+                    self.send_header('ETag', server.etag)
+                self.send_header('Content-Length', str(end - start))
+                self.end_headers()
+                if not body:
+                    return
+                with server.lock:
+                    dropped = server.drop > 0
+                    server.drop -= dropped
+                if dropped:
+                    end = start + (end - start) // 2
+                    self.close_connection = True
+                self.wfile.write(server.data[start:end])
+                with server.lock:
+                    server.sent += end - start
+                    server.served.append((start, end))
+
+            def do_HEAD(self):
+                self._answer(False)
+
+            def do_GET(self):
+                self._answer(True)
+
+        return Handler
@@ -0,0 +1,106 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+Downloads from a local http server with and without range requests, behind a redirect and resumed.
+Run from the root of the repository:
+    python -m unittest discover tests
+"""
+import hashlib
+import logging
+import os
+import random
+import tempfile
+import unittest
+from unittest import mock
+
+from src.core import downloader
+from tests.httpd import FileServer
+
+SIZE = 256 * 1024
+
+
+def download(url: str, path: str, **kwargs):
+    for _ in downloader.Downloader(url, path, connections=4, **kwargs).run():
+        pass
+
+
+class DownloaderTest(unittest.TestCase):
+    def setUp(self):
+        self.temp = tempfile.TemporaryDirectory()
+        self.path = os.path.join(self.temp.name, 'file.bin')
+        self.data = random.Random(79).randbytes(SIZE)
+        # Segments of 64K, the file is fetched by 4 connections
+        patcher = mock.patch.object(downloader, 'MIN_SEGMENT', 64 * 1024)
+        patcher.start()
+        self.addCleanup(patcher.stop)
+        logging.disable(logging.CRITICAL)
+        self.addCleanup(logging.disable, logging.NOTSET)
+
+    def tearDown(self):
+        self.temp.cleanup()
+
+    def read(self) -> bytes:
+        with open(self.path, 'rb') as f:
+            return f.read()
+
+    def test_ranges(self):
+        with FileServer(self.data) as server:
+            download(server.url, self.path, hash_=('sha256', hashlib.sha256(self.data).hexdigest()))
+        self.assertEqual(self.read(), self.data)
+        self.assertEqual(len(server.paths), 5)
+        self.assertFalse(os.path.exists(self.path + downloader.STATE_SUFFIX))
+
+    def test_hash_mismatch(self):
+        with FileServer(self.data) as server, self.assertRaises(ValueError):
+            download(server.url, self.path, hash_=('sha256', '0' * 64))
+
+    def test_no_ranges(self):
+        with FileServer(self.data, ranges=False) as server:
+            download(server.url, self.path)
+        self.assertEqual(self.read(), self.data)
+
+    def test_no_ranges_removes_state(self):
+        state = self.path + downloader.STATE_SUFFIX
+        with open(state, 'w', encoding='utf-8') as f:
+            f.write('{}')
+        with FileServer(self.data, ranges=False, drop=2) as server, self.assertRaises(IOError):
+            download(server.url, self.path, retries=1)
+        self.assertFalse(os.path.exists(state))
+
+    def test_resume_after_redirect(self):
+        # Two of the four segments fail, the other two are kept
+        with FileServer(self.data, redirect=True, drop=2) as server:
+            with self.assertRaises(IOError):
+                download(server.url, self.path, retries=1)
+            self.assertTrue(os.path.exists(self.path + downloader.STATE_SUFFIX))
+            # The second run is sent to another signed url, the state still belongs to the same file
+            sent = server.sent
+            download(server.url, self.path)
+        self.assertEqual(self.read(), self.data)
+        self.assertEqual(server.sent - sent, SIZE // 2)
+
+    def test_restart_when_changed(self):
+        with FileServer(self.data, drop=2) as server:
+            with self.assertRaises(IOError):
+                download(server.url, self.path, retries=1)
+            server.data = self.data = bytes(reversed(self.data))
+            server.etag = '"2"'
+            sent = server.sent
+            download(server.url, self.path)
+        self.assertEqual(self.read(), self.data)
+        self.assertEqual(server.sent - sent, SIZE)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,130 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+parallel() on the pools of jobs: order of results, errors, cancelling and nesting in a job of the same pool.
+Tracing of single jobs, switched while they run.
+Run from the root of the repository:
+    python -m unittest discover tests
+"""
+import threading
+import time
+import unittest
+
+from src.core import jobs, trace
+
+
+class ParallelTest(unittest.TestCase):
+    def setUp(self):
+        # Several workers even on a single core machine
+        limit = jobs.pools['cpu'].limit
+        jobs.set_limits(cpu=4)
+        self.addCleanup(jobs.set_limits, cpu=limit)
+
+    def test_results_in_order(self):
+        self.assertEqual(jobs.parallel(lambda i: i * i, range(20)), [i * i for i in range(20)])
+        self.assertEqual(jobs.parallel(str, []), [])
+
+    def test_runs_on_cpu_pool(self):
+        names = set()
+
+        def item(_):
+            names.add(threading.current_thread().name)
+            time.sleep(0.05)
+
+        jobs.parallel(item, range(8), workers=3)
+        self.assertIn(threading.current_thread().name, names)
+        self.assertTrue(any(i.startswith('cpu-') for i in names))
+
+    def test_error(self):
+        def item(i):
+            if i == 3:
+                raise ValueError(i)
+            return i
+
+        with self.assertRaises(ValueError):
+            jobs.parallel(item, range(10))
+
+    def test_nested_in_full_pool(self):
+        # Every worker of the pool waits for items of its own pool
+        outer = [jobs.submit(jobs.parallel, lambda i: jobs.parallel(abs, range(-5, 5)), range(4), pool='cpu')
+                 for _ in range(5)]
+        for job in outer:
+            self.assertTrue(job.wait(10))
+            self.assertEqual(job.state, 'done')
+
+    def test_cancel(self):
+        started = threading.Event()
+        done = []
+
+        def item(i):
+            started.set()
+            for _ in range(100):
+                jobs.check_cancelled()
+                time.sleep(0.01)
+            done.append(i)
+
+        job = jobs.submit(jobs.parallel, item, range(4), pool='io')
+        self.assertTrue(started.wait(5))
+        job.cancel()
+        self.assertTrue(job.wait(5))
+        self.assertEqual(job.state, 'cancelled')
+        self.assertEqual(done, [])
+
+
+class TracedJobTest(unittest.TestCase):
+    def setUp(self):
+        trace.disable()
+        trace.clear()
+        self.addCleanup(trace.clear)
+
+    @staticmethod
+    def names() -> list:
+        with trace._lock:
+            return [i['name'] for i in trace._events]
+
+    def test_traced_job(self):
+        def item(i):
+            # Runs on the workers of the cpu pool as part of the traced job
+            with trace.span(f'item {i}'):
+                pass
+
+        job = jobs.submit(jobs.parallel, item, range(3), pool='io', name='traced', traced=True)
+        self.assertTrue(job.wait(5))
+        self.assertEqual(sorted(self.names()), ['item 0', 'item 1', 'item 2', 'traced'])
+        self.assertTrue(job.info()['traced'])
+
+    def test_switch_while_running(self):
+        go = threading.Event()
+
+        def run():
+            with trace.span('before'):
+                pass
+            go.wait(5)
+            with trace.span('after'):
+                pass
+
+        job = jobs.submit(run, pool='io', name='untraced')
+        self.assertTrue(jobs.set_traced(job.id, True))
+        go.set()
+        self.assertTrue(job.wait(5))
+        self.assertIn('after', self.names())
+        self.assertFalse(jobs.set_traced(job.id, False))
+
+    def test_untraced_job(self):
+        self.assertTrue(jobs.submit(trace.span, 'quiet', pool='io').wait(5))
+        self.assertFalse(trace.has_events())
+
+
+if __name__ == '__main__':
+    unittest.main()
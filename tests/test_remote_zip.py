@@ -0,0 +1,200 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+Reads of a zip served by a local http server through range requests, with dropped and refused connections,
+and extraction of one partition of a payload served bare or in a zip.
+Run from the root of the repository:
+    python -m unittest discover tests
+"""
+import bz2
+import contextlib
+import io
+import lzma
+import os
+import random
+import socket
+import struct
+import tempfile
+import unittest
+import zipfile
+
+import requests
+
+from src.core import payload_extract, remote_zip
+from src.core import update_metadata_pb2 as um
+from tests.httpd import FileServer
+
+
+def sample_zip() -> tuple[bytes, bytes]:
+    """
+    :return: a zip with a stored payload.bin and a deflated file, and the payload
+    """
+    payload = b'CrAU' + random.Random(78).randbytes(300 * 1024)
+    buffer = io.BytesIO()
+    with zipfile.ZipFile(buffer, 'w') as z:
+        z.writestr('META-INF/com/android/metadata', 'ota-type=AB\n', zipfile.ZIP_DEFLATED)
+        z.writestr('payload.bin', payload, zipfile.ZIP_STORED)
+        z.writestr('payload_properties.txt', 'FILE_HASH=\n' * 100, zipfile.ZIP_DEFLATED)
+    return buffer.getvalue(), payload
+
+
+def sample_payload() -> tuple[bytes, dict, dict]:
+    """
+    A full payload of three partitions of 1.5M with raw, xz, bz2 and zero operations, the blobs of every partition
+    follow each other
+    :return: the payload, {name: image}, {name: (first, end) of its blobs in the payload}
+    """
+    rng = random.Random(78)
+    manifest = um.DeltaArchiveManifest(block_size=4096, minor_version=0)
+    blobs = b''
+    images = {}
+    spans = {}
+    for name in ('odm', 'vendor', 'system'):
+        partition = manifest.partitions.add(partition_name=name)
+        pieces = [(um.InstallOperation.REPLACE, rng.randbytes(160 * 4096)),
+                  (um.InstallOperation.REPLACE_XZ, rng.randbytes(100 * 4096)),
+                  (um.InstallOperation.ZERO, bytes(16 * 4096)),
+                  (um.InstallOperation.REPLACE_BZ, rng.randbytes(100 * 4096))]
+        first = len(blobs)
+        block = 0
+        for kind, data in pieces:
+            operation = partition.operations.add(type=kind)
+            operation.dst_extents.add(start_block=block, num_blocks=len(data) // 4096)
+            block += len(data) // 4096
+            if kind == um.InstallOperation.ZERO:
+                continue
+            blob = {um.InstallOperation.REPLACE: bytes, um.InstallOperation.REPLACE_XZ: lzma.compress,
+                    um.InstallOperation.REPLACE_BZ: bz2.compress}[kind](data)
+            operation.data_offset, operation.data_length = len(blobs), len(blob)
+            blobs += blob
+        images[name] = b''.join(data for _, data in pieces)
+        spans[name] = (first, len(blobs))
+    manifest_data = manifest.SerializeToString()
+    signature = bytes(256)
+    header = struct.pack(payload_extract.PayloadHdr._fmtstr, b'CrAU', 2, len(manifest_data), len(signature))
+    base = len(header) + len(manifest_data) + len(signature)
+    spans = {k: (base + first, base + end) for k, (first, end) in spans.items()}
+    return header + manifest_data + signature + blobs, images, spans
+
+
+class RemoteZipTest(unittest.TestCase):
+    def setUp(self):
+        self.zip, self.payload = sample_zip()
+
+    def test_read_stored(self):
+        with FileServer(self.zip) as server, remote_zip.RemoteZip(server.url) as remote:
+            self.assertIn('payload.bin', remote.namelist())
+            f = remote.open_stored(remote.find('payload.bin'))
+            self.assertEqual(f.read(), self.payload)
+            f.seek(-100, io.SEEK_END)
+            self.assertEqual(f.read(10), self.payload[-100:-90])
+            # Only the tail, the local header and the entry, never the whole zip twice
+            self.assertLess(remote.source.fetched, len(self.zip) + remote_zip.TAIL_SIZE)
+
+    def test_open_remote_payload(self):
+        with FileServer(self.zip) as server:
+            self.assertEqual(remote_zip.open_remote_payload(server.url).read(), self.payload)
+        with FileServer(self.payload) as server:
+            self.assertEqual(remote_zip.open_remote_payload(server.url).read(), self.payload)
+
+    def test_compressed_entry(self):
+        with FileServer(self.zip) as server, remote_zip.RemoteZip(server.url) as remote:
+            with self.assertRaises(io.UnsupportedOperation):
+                remote.open_stored('payload_properties.txt')
+
+    def test_no_ranges(self):
+        with FileServer(self.zip, ranges=False) as server, self.assertRaises(io.UnsupportedOperation):
+            remote_zip.HttpRange(server.url)
+
+    def test_retry(self):
+        with FileServer(self.zip, drop=1) as server:
+            source = remote_zip.HttpRange(server.url)
+            self.assertEqual(source.pread(100, 1000), self.zip[100:1100])
+            self.assertEqual(len(server.paths), 3)
+            server.drop = source.retries
+            with self.assertRaises(requests.RequestException):
+                source.pread(0, 1000)
+
+    def test_connection_failure(self):
+        with socket.socket() as s:
+            s.bind(('127.0.0.1', 0))
+            port = s.getsockname()[1]
+        with self.assertRaises(requests.ConnectionError):
+            remote_zip.HttpRange(f'http://127.0.0.1:{port}/file', timeout=5)
+        with FileServer(self.zip) as server:
+            source = remote_zip.HttpRange(server.url, timeout=5)
+        with self.assertRaises(requests.ConnectionError):
+            source.pread(0, 1000)
+
+    def test_plan_ranges(self):
+        far = 10 << 20
+        spans = [(0, 10, 'a'), (5000, 10, 'c'), (20, 10, 'b'), (far, 10, 'd')]
+        self.assertEqual(remote_zip.plan_ranges(spans, max_gap=4096),
+                         [(0, 30, [spans[0], spans[2]]), (5000, 5010, [spans[1]]), (far, far + 10, [spans[3]])])
+
+
+
+class RemotePayloadTest(unittest.TestCase):
+    def setUp(self):
+        self.temp = tempfile.TemporaryDirectory()
+        self.payload, self.images, self.spans = sample_payload()
+        path = os.path.join(self.temp.name, 'payload.bin')
+        with open(path, 'wb') as f:
+            f.write(self.payload)
+        # The local extraction is the reference
+        with open(path, 'rb') as f, contextlib.redirect_stdout(io.StringIO()):
+            payload_extract.extract_partitions_from_payload(f, ['vendor'], os.path.join(self.temp.name, 'local'))
+        with open(os.path.join(self.temp.name, 'local', 'vendor.img'), 'rb') as f:
+            self.expected = f.read()
+        self.assertEqual(self.expected, self.images['vendor'])
+
+    def tearDown(self):
+        self.temp.cleanup()
+
+    def extract(self, data: bytes, base: int):
+        """
+        Extract vendor from data served on localhost
+        :param base: offset of the payload in data
+        """
+        out_dir = os.path.join(self.temp.name, 'remote')
+        with FileServer(data) as server, contextlib.redirect_stdout(io.StringIO()):
+            payload_extract.extract_partitions_from_url(server.url, ['vendor'], out_dir, connections=4)
+        with open(os.path.join(out_dir, 'vendor.img'), 'rb') as f:
+            self.assertEqual(f.read(), self.expected)
+        # The manifest is read with a readahead block and a zip from its tail, the rest are blobs of vendor
+        start_of_rest = base + 1024 * 1024
+        end_of_rest = len(data) - remote_zip.TAIL_SIZE if base else len(data)
+        for name in ('odm', 'system'):
+            first, end = (base + i for i in self.spans[name])
+            first, end = max(first, start_of_rest), min(end, end_of_rest)
+            for start, stop in server.served:
+                self.assertLessEqual(min(stop, end) - max(start, first), 0,
+                                     f'{name} blobs were fetched: {start}-{stop}')
+
+    def test_bare_payload(self):
+        self.extract(self.payload, 0)
+
+    def test_payload_in_zip(self):
+        buffer = io.BytesIO()
+        with zipfile.ZipFile(buffer, 'w') as z:
+            z.writestr('payload.bin', self.payload, zipfile.ZIP_STORED)
+            z.writestr('payload_properties.txt', 'FILE_HASH=\n', zipfile.ZIP_DEFLATED)
+        info = zipfile.ZipFile(buffer).getinfo('payload.bin')
+        data = buffer.getvalue()
+        name_length, extra_length = struct.unpack('<2H', data[info.header_offset + 26:info.header_offset + 30])
+        self.extract(data, info.header_offset + zipfile.sizeFileHeader + name_length + extra_length)
+
+
+if __name__ == '__main__':
+    unittest.main()
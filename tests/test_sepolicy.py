@@ -0,0 +1,131 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+Rebuilding precompiled_sepolicy of a project after cil edits, with a stand-in secilc that concatenates its inputs.
+Run from the root of the repository:
+    python -m unittest discover tests
+"""
+import contextlib
+import hashlib
+import io
+import os
+import pathlib
+import shutil
+import sys
+import tempfile
+import unittest
+from unittest import mock
+
+from src.core import sepolicy
+
+FAKE_SECILC = '''#!{python}
+import sys
+args = sys.argv[1:]
+out = args[args.index('-o') + 1]
+files = [args[0]] + [i for i in args[args.index('-c') + 2:args.index('-o')]]
+with open(out, 'wb') as o:
+    for i in files:
+        with open(i, 'rb') as f:
+            o.write(f.read())
+with open({log!r}, 'a') as log:
+    log.write('compiled\\n')
+'''
+
+
+@unittest.skipIf(os.name == 'nt', 'the stand-in secilc is a script')
+class RebuildTest(unittest.TestCase):
+    def setUp(self):
+        self.work = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, self.work)
+        self.system = self.write('system/system/etc/selinux/plat_sepolicy.cil', '(type init)\n')
+        self.mapping = self.write('system/system/etc/selinux/mapping/30.0.cil', '(typeattribute init_30_0)\n')
+        self.write('vendor/etc/selinux/plat_sepolicy_vers.txt', '30.0\n')
+        self.vendor = self.write('vendor/etc/selinux/vendor_sepolicy.cil', '(type vendor_init)\n')
+        self.odm = self.write('odm/etc/selinux/odm_sepolicy.cil', '(type odm_init)\n')
+        self.precompiled = self.write('vendor/etc/selinux/precompiled_sepolicy', 'old policy')
+        digest = self.sha256(self.system, self.mapping) + '\n'
+        self.partition_hash = self.write('system/system/etc/selinux/plat_sepolicy_and_mapping.sha256', digest)
+        self.precompiled_hash = self.write(
+            'vendor/etc/selinux/precompiled_sepolicy.plat_sepolicy_and_mapping.sha256', digest)
+        self.log = os.path.join(self.work, 'secilc.log')
+        self.secilc = self.write('secilc', FAKE_SECILC.format(python=sys.executable, log=self.log))
+        os.chmod(self.secilc, 0o755)
+        sepolicy.record(self.work)
+
+    def write(self, name: str, text: str) -> str:
+        path = os.path.join(self.work, name)
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        with open(path, 'w', encoding='utf-8', newline='\n') as f:
+            f.write(text)
+        return path
+
+    @staticmethod
+    def read(path: str) -> str:
+        with open(path, 'r', encoding='utf-8') as f:
+            return f.read()
+
+    @staticmethod
+    def sha256(*files: str) -> str:
+        return hashlib.sha256(b''.join(pathlib.Path(i).read_bytes() for i in files)).hexdigest()
+
+    def rebuild(self, secilc: str = None) -> bool:
+        with contextlib.redirect_stdout(io.StringIO()):
+            return sepolicy.rebuild(self.work, self.secilc if secilc is None else secilc)
+
+    def compiles(self) -> int:
+        return len(self.read(self.log).splitlines()) if os.path.exists(self.log) else 0
+
+    def test_unchanged(self):
+        self.assertTrue(self.rebuild())
+        self.assertEqual(self.compiles(), 0)
+        self.assertEqual(self.read(self.precompiled), 'old policy')
+
+    def test_vendor_edit(self):
+        self.write('vendor/etc/selinux/vendor_sepolicy.cil', '(type vendor_init)\n(allow vendor_init self)\n')
+        self.assertTrue(self.rebuild())
+        self.assertEqual(self.compiles(), 1)
+        self.assertIn('(allow vendor_init self)', self.read(self.precompiled))
+        self.assertIn('(type odm_init)', self.read(self.precompiled))
+        self.assertTrue(self.rebuild())
+        self.assertEqual(self.compiles(), 1)
+
+    def test_system_edit_rewrites_hashes(self):
+        self.write('system/system/etc/selinux/plat_sepolicy.cil', '(type init)\n(type su)\n')
+        self.assertTrue(self.rebuild())
+        digest = self.sha256(self.system, self.mapping) + '\n'
+        self.assertEqual(self.read(self.partition_hash), digest)
+        self.assertEqual(self.read(self.precompiled_hash), digest)
+
+    def test_cache(self):
+        for text in '(type odm_a)\n', '(type odm_b)\n', '(type odm_a)\n':
+            self.write('odm/etc/selinux/odm_sepolicy.cil', text)
+            self.assertTrue(self.rebuild())
+            self.assertIn(text, self.read(self.precompiled))
+        self.assertEqual(self.compiles(), 2)
+
+    def test_without_secilc(self):
+        self.write('odm/etc/selinux/odm_sepolicy.cil', '(type odm_init)\n(allow odm_init self)\n')
+        with mock.patch.object(sepolicy.shutil, 'which', return_value=None):
+            self.assertFalse(self.rebuild(secilc=os.path.join(self.work, 'missing')))
+        self.assertFalse(os.path.exists(self.precompiled_hash))
+        self.assertEqual(self.read(self.precompiled), 'old policy')
+        # Still stale on the next pack, now with secilc
+        self.write('odm/etc/selinux/odm_sepolicy.cil', '(type odm_init)\n')
+        self.assertTrue(self.rebuild())
+        self.assertEqual(self.compiles(), 1)
+        self.assertTrue(os.path.exists(self.precompiled_hash))
+
+
+if __name__ == '__main__':
+    unittest.main()
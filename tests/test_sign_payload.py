@@ -0,0 +1,106 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+Re-signing of small payloads whose signature blobs were made with and without unpadded_signature_size.
+Run from the root of the repository:
+    python -m unittest discover tests
+"""
+import base64
+import hashlib
+import os
+import random
+import struct
+import tempfile
+import unittest
+
+from cryptography.hazmat.primitives import hashes, serialization
+from cryptography.hazmat.primitives.asymmetric import padding, rsa, utils
+
+from src.core import sign_payload
+from src.core import update_metadata_pb2 as um
+
+
+def signature_blob(size: int, unpadded: bool) -> bytes:
+    sigs = um.Signatures()
+    sig = sigs.signatures.add()
+    sig.data = bytes(size)
+    if unpadded:
+        sig.unpadded_signature_size = size
+    return sigs.SerializeToString()
+
+
+def build_payload(path: str, data: bytes, unpadded: bool, key_size: int = 256):
+    blob = signature_blob(key_size, unpadded)
+    manifest = um.DeltaArchiveManifest(block_size=4096, signatures_offset=len(data), signatures_size=len(blob))
+    manifest_data = manifest.SerializeToString()
+    with open(path, 'wb') as f:
+        f.write(struct.pack(sign_payload.PAYLOAD_HEADER, b'CrAU', 2, len(manifest_data), len(blob)))
+        f.write(manifest_data + blob + data + blob)
+
+
+class SignPayloadTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.key = rsa.generate_private_key(public_exponent=65537, key_size=2048)
+
+    def setUp(self):
+        self.temp = tempfile.TemporaryDirectory()
+        self.path = os.path.join(self.temp.name, 'payload.bin')
+        self.keyfile = os.path.join(self.temp.name, 'key.pem')
+        with open(self.keyfile, 'wb') as f:
+            f.write(self.key.private_bytes(serialization.Encoding.PEM, serialization.PrivateFormat.PKCS8,
+                                           serialization.NoEncryption()))
+        self.data = random.Random(80).randbytes(100 * 1024)
+
+    def tearDown(self):
+        self.temp.cleanup()
+
+    def verify(self, blob: bytes, digest: bytes, unpadded: bool):
+        sig = um.Signatures.FromString(blob).signatures[0]
+        self.assertEqual(sig.HasField('unpadded_signature_size'), unpadded)
+        self.key.public_key().verify(sig.data, digest, padding.PKCS1v15(), utils.Prehashed(hashes.SHA256()))
+
+    def check(self, unpadded: bool):
+        build_payload(self.path, self.data, unpadded)
+        size = os.path.getsize(self.path)
+        values = sign_payload.sign_payload_file(self.path, self.keyfile)
+        with open(self.path, 'rb') as f:
+            payload = f.read()
+        self.assertEqual(len(payload), size)
+        _, _, manifest_size, sig_size = struct.unpack(sign_payload.PAYLOAD_HEADER, payload[:24])
+        metadata_size = 24 + manifest_size
+        metadata = payload[:metadata_size]
+        data_start = metadata_size + sig_size
+        self.assertEqual(payload[data_start:data_start + len(self.data)], self.data)
+        self.verify(payload[metadata_size:data_start], hashlib.sha256(metadata).digest(), unpadded)
+        self.verify(payload[data_start + len(self.data):],
+                    hashlib.sha256(metadata + self.data).digest(), unpadded)
+        self.assertEqual(values['FILE_HASH'], base64.b64encode(hashlib.sha256(payload).digest()).decode())
+        self.assertEqual(values['METADATA_HASH'], base64.b64encode(hashlib.sha256(metadata).digest()).decode())
+        self.assertEqual(values['METADATA_SIZE'], str(metadata_size))
+
+    def test_with_unpadded_size(self):
+        self.check(True)
+
+    def test_without_unpadded_size(self):
+        self.check(False)
+
+    def test_bigger_key(self):
+        build_payload(self.path, self.data, False, key_size=128)
+        with self.assertRaises(ValueError):
+            sign_payload.sign_payload_file(self.path, self.keyfile)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,99 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+Snapshot round trip and restoring snapshots whose entries lead out of the restore folder.
+Run from the root of the repository:
+    python -m unittest discover tests
+"""
+import json
+import os
+import tempfile
+import unittest
+
+from src.core import snapshot
+
+
+def write_snapshot(path: str, entries: list, data: bytes = b''):
+    """
+    A snapshot with handmade entries, every file entry uses the whole data as its blob
+    """
+    with open(path, 'wb') as out:
+        writer = snapshot.FrameWriter(out, 1, 3)
+        writer.write(data)
+        index = {'format': snapshot.FORMAT, 'version': snapshot.VERSION, 'name': 'crafted',
+                 'frame_size': snapshot.FRAME_SIZE, 'partitions': {'p': [0, len(entries)]},
+                 'blobs': [[0, len(data)]], 'entries': entries}
+        writer.close(json.dumps(index).encode('utf-8'))
+
+
+def entry(path: str, type_: str, **kwargs) -> dict:
+    mode = {'dir': 0o40755, 'symlink': 0o120777, 'file': 0o100644}[type_]
+    return {'path': path, 'type': type_, 'mode': mode, 'uid': 0, 'gid': 0, 'mtime': 0, **kwargs}
+
+
+@unittest.skipUnless(hasattr(os, 'symlink'), 'needs symlinks')
+class SnapshotTest(unittest.TestCase):
+    def setUp(self):
+        self.tmp = tempfile.TemporaryDirectory()
+        self.root = self.tmp.name
+        self.out = os.path.join(self.root, 'out')
+        self.outside = os.path.join(self.root, 'outside')
+        os.makedirs(self.out)
+        os.makedirs(self.outside)
+
+    def tearDown(self):
+        self.tmp.cleanup()
+
+    def test_round_trip(self):
+        project = os.path.join(self.root, 'project')
+        os.makedirs(os.path.join(project, 'system', 'etc'))
+        with open(os.path.join(project, 'system', 'etc', 'a.prop'), 'wb') as f:
+            f.write(b'ro.a=1\n')
+        with open(os.path.join(project, 'system', 'etc', 'b.prop'), 'wb') as f:
+            f.write(b'ro.a=1\n')
+        os.symlink('a.prop', os.path.join(project, 'system', 'etc', 'link'))
+        info = snapshot.export_snapshot(project, os.path.join(self.root, 'p.snap'), 2)
+        self.assertEqual(info['duplicates'], 1)
+        snapshot.import_snapshot(os.path.join(self.root, 'p.snap'), self.out, ['system/etc/link'])
+        self.assertEqual(os.readlink(os.path.join(self.out, 'system', 'etc', 'link')), 'a.prop')
+        snapshot.import_snapshot(os.path.join(self.root, 'p.snap'), self.out)
+        with open(os.path.join(self.out, 'system', 'etc', 'b.prop'), 'rb') as f:
+            self.assertEqual(f.read(), b'ro.a=1\n')
+
+    def test_write_through_snapshot_link(self):
+        path = os.path.join(self.root, 'evil.snap')
+        write_snapshot(path, [entry('p', 'dir'), entry('p/evil', 'symlink', target=self.outside),
+                              entry('p/evil/pwned', 'file', size=5, extents=[[0, 5]], blob=0)], b'pwned')
+        snapshot.import_snapshot(path, self.out)
+        self.assertEqual(os.listdir(self.outside), [])
+        self.assertFalse(os.path.islink(os.path.join(self.out, 'p', 'evil')))
+
+    def test_write_through_existing_link(self):
+        os.symlink(self.outside, os.path.join(self.out, 'p'))
+        path = os.path.join(self.root, 'evil.snap')
+        write_snapshot(path, [entry('p', 'dir'), entry('p/pwned', 'file', size=5, extents=[[0, 5]], blob=0)],
+                       b'pwned')
+        with self.assertRaises(snapshot.SnapshotError):
+            snapshot.import_snapshot(path, self.out)
+        self.assertEqual(os.listdir(self.outside), [])
+
+    def test_parent_path(self):
+        path = os.path.join(self.root, 'evil.snap')
+        write_snapshot(path, [entry('p/../../pwned', 'file', size=5, extents=[[0, 5]], blob=0)], b'pwned')
+        with self.assertRaises(snapshot.SnapshotError):
+            snapshot.import_snapshot(path, self.out)
+
+
+if __name__ == '__main__':
+    unittest.main()
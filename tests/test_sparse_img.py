@@ -0,0 +1,97 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+Positional reads of a sparse image with don't care gaps, compared to the image expanded by simg2img.
+Run from the root of the repository:
+    python -m unittest discover tests
+"""
+import contextlib
+import hashlib
+import io
+import os
+import random
+import shutil
+import struct
+import tempfile
+import unittest
+
+from src.core import utils
+from src.core.rangelib import RangeSet
+from src.core.sparse_img import SparseImage
+
+BLOCK = 4096
+
+
+def build_sparse(path: str, chunks: list):
+    """
+    :param chunks: ('raw', blocks), ('fill', blocks) or ('skip', blocks)
+    """
+    rng = random.Random(82)
+    body = b''
+    total = 0
+    for kind, blocks in chunks:
+        if kind == 'raw':
+            body += struct.pack('<2H2I', 0xCAC1, 0, blocks, 12 + blocks * BLOCK) + rng.randbytes(blocks * BLOCK)
+        elif kind == 'fill':
+            body += struct.pack('<2H2I', 0xCAC2, 0, blocks, 16) + bytes(4)
+        else:
+            body += struct.pack('<2H2I', 0xCAC3, 0, blocks, 12)
+        total += blocks
+    with open(path, 'wb') as f:
+        f.write(struct.pack('<I4H4I', 0xED26FF3A, 1, 0, 28, 12, BLOCK, total, len(chunks), 0) + body)
+
+
+class SparseImageTest(unittest.TestCase):
+    def setUp(self):
+        self.temp = tempfile.TemporaryDirectory()
+        self.path = os.path.join(self.temp.name, 'sparse.img')
+        build_sparse(self.path, [('raw', 100), ('skip', 100), ('raw', 100), ('fill', 100), ('skip', 50)])
+        raw = os.path.join(self.temp.name, 'raw.img')
+        shutil.copy(self.path, raw)
+        with contextlib.redirect_stdout(io.StringIO()):
+            utils.simg2img(raw)
+            self.image = SparseImage(self.path)
+        with open(raw, 'rb') as f:
+            self.raw = f.read()
+        self.assertEqual(len(self.raw), 450 * BLOCK)
+
+    def tearDown(self):
+        self.image.Close()
+        self.temp.cleanup()
+
+    def expect(self, ranges: RangeSet) -> bytes:
+        return b''.join(self.raw[s * BLOCK:e * BLOCK] for s, e in ranges)
+
+    def test_across_gap(self):
+        ranges = RangeSet(data=(98, 202))
+        self.assertEqual(b''.join(self.image.ReadRangeSet(ranges)), self.expect(ranges))
+        ranges = RangeSet(data=(98, 302))
+        self.assertEqual(b''.join(self.image.ReadRangeSet(ranges)), self.expect(ranges))
+
+    def test_trailing_dont_care(self):
+        ranges = RangeSet(data=(390, 450))
+        self.assertEqual(b''.join(self.image.ReadRangeSet(ranges)), self.expect(ranges))
+        ranges = RangeSet(data=(420, 450))
+        self.assertEqual(b''.join(self.image.ReadRangeSet(ranges)), self.expect(ranges))
+
+    def test_hashes(self):
+        ranges = RangeSet(data=(0, 450))
+        self.assertEqual(self.image.RangeSha1(ranges), hashlib.sha1(self.raw).hexdigest())
+        ranges = RangeSet(data=(5, 150, 250, 320, 399, 430))
+        self.assertEqual(self.image.HashRangeSets([ranges], workers=2),
+                         [hashlib.sha1(self.expect(ranges)).hexdigest()])
+
+
+if __name__ == '__main__':
+    unittest.main()
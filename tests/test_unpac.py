@@ -0,0 +1,145 @@
+# Copyright (C) 2022-2025 The MIO-KITCHEN-SOURCE Project
+#
+# Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE, Version 3.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      https://www.gnu.org/licenses/agpl-3.0.en.html#license-text
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""
+crc16 against known values and extraction of a small pac built with the layout of unpac.c.
+Run from the root of the repository:
+    python -m unittest discover tests
+"""
+import contextlib
+import io
+import os
+import random
+import tempfile
+import unittest
+
+from src.core import unpac
+
+
+def bitwise_crc16(crc: int, data: bytes) -> int:
+    """
+    The loop of unpac.c
+    """
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = (crc >> 1) ^ (0xA001 if crc & 1 else 0)
+    return crc
+
+
+def u16(text: str, length: int) -> list:
+    data = text.encode('utf-16-le')
+    return [int.from_bytes(data[i:i + 2], 'little') for i in range(0, len(data), 2)] + [0] * (length - len(text))
+
+
+def build_pac(files: dict) -> bytes:
+    """
+    A pac with the files in the order given, both crcs correct
+    """
+    head = unpac.SprdHead()
+    entry_size = len(unpac.SprdFile())
+    offset = len(head) + entry_size * len(files)
+    directory = b''
+    for name, data in files.items():
+        entry = unpac.SprdFile()
+        entry.struct_size = entry_size
+        entry.id[:] = u16(name.split('.')[0].upper(), 256)
+        entry.name[:] = u16(name, 256)
+        entry.size = len(data)
+        entry.type = unpac.FileTypes.file.value
+        entry.pac_offset = offset
+        directory += entry.pack()
+        offset += len(data)
+    body = directory + b''.join(files.values())
+    head.pac_version[:] = u16('BP_R1.0.0', 24)
+    head.fw_name[:] = u16('test', 256)
+    head.pac_size = len(head) + len(body)
+    head.file_count = len(files)
+    head.dir_offset = len(head)
+    head.pac_magic = 0xFFFAFFFA
+    head.data_crc = unpac.crc16(0, body)
+    head.head_crc = unpac.crc16(0, head.pack()[:len(head) - 4])
+    return head.pack() + body
+
+
+class Crc16Test(unittest.TestCase):
+    def test_check_value(self):
+        # CRC-16/ARC
+        self.assertEqual(unpac.crc16(0, b'123456789'), 0xBB3D)
+
+    def test_matches_bitwise(self):
+        rnd = random.Random(96)
+        for size in 0, 1, 255, 4096, 4096 * 3 + 17, (1 << 20) + 4099:
+            data = rnd.randbytes(size)
+            self.assertEqual(unpac.crc16(0x1234, data), bitwise_crc16(0x1234, data), size)
+
+    def test_chained(self):
+        data = random.Random(1).randbytes(100000)
+        self.assertEqual(unpac.crc16(unpac.crc16(0, data[:33333]), data[33333:]), unpac.crc16(0, data))
+
+
+class UnpacTest(unittest.TestCase):
+    def setUp(self):
+        rnd = random.Random(7)
+        self.files = {'fdl1.bin': rnd.randbytes(5000), 'boot.img': rnd.randbytes(300000),
+                      'super.img': rnd.randbytes(100000)}
+        self.tmp = tempfile.TemporaryDirectory()
+        self.pac = os.path.join(self.tmp.name, 'test.pac')
+        with open(self.pac, 'wb') as f:
+            f.write(build_pac(self.files))
+        self.out = os.path.join(self.tmp.name, 'out')
+
+    def tearDown(self):
+        self.tmp.cleanup()
+
+    def run_unpac(self, mode, verify=False) -> bool:
+        with contextlib.redirect_stdout(io.StringIO()):
+            return unpac.unpac(self.pac, self.out, mode, verify)
+
+    def assert_extracted(self):
+        for name, data in self.files.items():
+            with open(os.path.join(self.out, name), 'rb') as f:
+                self.assertEqual(f.read(), data, name)
+
+    def corrupt(self, offset: int):
+        with open(self.pac, 'r+b') as f:
+            f.seek(offset)
+            byte = f.read(1)
+            f.seek(offset)
+            f.write(bytes([byte[0] ^ 0xFF]))
+
+    def test_check(self):
+        self.assertTrue(self.run_unpac(unpac.MODE.CHECK))
+
+    def test_extract(self):
+        self.assertTrue(self.run_unpac(unpac.MODE.EXTRACT))
+        self.assert_extracted()
+
+    def test_extract_verify(self):
+        self.assertTrue(self.run_unpac(unpac.MODE.EXTRACT, True))
+        self.assert_extracted()
+
+    def test_corrupted_data(self):
+        self.corrupt(os.path.getsize(self.pac) - 1000)
+        self.assertFalse(self.run_unpac(unpac.MODE.CHECK))
+        self.assertFalse(self.run_unpac(unpac.MODE.EXTRACT, True))
+
+    def test_corrupted_head(self):
+        # A byte of fw_name, covered by head_crc only
+        self.corrupt(100)
+        self.assertFalse(self.run_unpac(unpac.MODE.CHECK))
+        self.assertFalse(self.run_unpac(unpac.MODE.EXTRACT, True))
+
+
+if __name__ == '__main__':
+    unittest.main()